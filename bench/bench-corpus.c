@@ -0,0 +1,479 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Generate ring buffer sub-buffers that look like those of a busy
+ * machine: a mix of events, with fixed and dynamic strings, time
+ * extends, discarded events and sub-buffers that follow missed events,
+ * in either endianness.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <event-parse.h>
+#include <kbuffer.h>
+
+#include "bench-corpus.h"
+
+/* The sub-buffer header, with 8 byte longs */
+#define PAGE_HEADER_SIZE	16
+/* Room kept at the end of each page for the count of missed events */
+#define PAGE_MISSED_SIZE	8
+
+#define MISSING_EVENTS		(1ULL << 31)
+#define MISSING_STORED		(1ULL << 30)
+
+/* Longest event whose length fits in the type_len of its header */
+#define MAX_TYPE_LEN_DATA	(28 * 4)
+
+#define COMMON_FIELDS							\
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n" \
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n" \
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n" \
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n\n"
+
+enum {
+	SCHED_SWITCH = 1,
+	IRQ_HANDLER_ENTRY,
+	SYS_ENTER,
+	KMALLOC,
+	LOCK_ACQUIRE,
+	CONSOLE,
+};
+
+static const char * const formats[] = {
+	"name: sched_switch\n"
+	"ID: 1\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:char prev_comm[16];\toffset:8;\tsize:16;\tsigned:1;\n"
+	"\tfield:pid_t prev_pid;\toffset:24;\tsize:4;\tsigned:1;\n"
+	"\tfield:int prev_prio;\toffset:28;\tsize:4;\tsigned:1;\n"
+	"\tfield:long prev_state;\toffset:32;\tsize:8;\tsigned:1;\n"
+	"\tfield:char next_comm[16];\toffset:40;\tsize:16;\tsigned:1;\n"
+	"\tfield:pid_t next_pid;\toffset:56;\tsize:4;\tsigned:1;\n"
+	"\tfield:int next_prio;\toffset:60;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"prev_comm=%s prev_pid=%d prev_prio=%d prev_state=%s ==> "
+	"next_comm=%s next_pid=%d next_prio=%d\", REC->prev_comm, REC->prev_pid, "
+	"REC->prev_prio, REC->prev_state ? __print_flags(REC->prev_state, \"|\", "
+	"{ 0x01, \"S\" }, { 0x02, \"D\" }) : \"R\", REC->next_comm, REC->next_pid, "
+	"REC->next_prio\n",
+
+	"name: irq_handler_entry\n"
+	"ID: 2\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:int irq;\toffset:8;\tsize:4;\tsigned:1;\n"
+	"\tfield:__data_loc char[] name;\toffset:12;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"irq=%d name=%s\", REC->irq, __get_str(name)\n",
+
+	"name: sys_enter\n"
+	"ID: 3\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:long id;\toffset:8;\tsize:8;\tsigned:1;\n"
+	"\tfield:unsigned long args[6];\toffset:16;\tsize:48;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"NR %ld (%lx, %lx, %lx, %lx, %lx, %lx)\", REC->id, "
+	"REC->args[0], REC->args[1], REC->args[2], REC->args[3], REC->args[4], "
+	"REC->args[5]\n",
+
+	"name: kmalloc\n"
+	"ID: 4\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:unsigned long call_site;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\tfield:const void * ptr;\toffset:16;\tsize:8;\tsigned:0;\n"
+	"\tfield:size_t bytes_req;\toffset:24;\tsize:8;\tsigned:0;\n"
+	"\tfield:size_t bytes_alloc;\toffset:32;\tsize:8;\tsigned:0;\n"
+	"\tfield:unsigned int gfp_flags;\toffset:40;\tsize:4;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"call_site=%lx ptr=%p bytes_req=%zu bytes_alloc=%zu "
+	"gfp_flags=%s\", REC->call_site, REC->ptr, REC->bytes_req, "
+	"REC->bytes_alloc, __print_flags(REC->gfp_flags, \"|\", "
+	"{ 0xcc0, \"GFP_KERNEL\" }, { 0x800, \"__GFP_NOWARN\" }, "
+	"{ 0x400, \"__GFP_IO\" })\n",
+
+	"name: lock_acquire\n"
+	"ID: 5\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:unsigned int flags;\toffset:8;\tsize:4;\tsigned:0;\n"
+	"\tfield:__rel_loc char[] name;\toffset:12;\tsize:4;\tsigned:1;\n"
+	"\tfield:void * lockdep_addr;\toffset:16;\tsize:8;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"%p %s%s%s\", REC->lockdep_addr, "
+	"(REC->flags & 1) ? \"try \" : \"\", (REC->flags & 2) ? \"read \" : \"\", "
+	"__get_rel_str(name)\n",
+
+	"name: console\n"
+	"ID: 6\n"
+	"format:\n"
+	COMMON_FIELDS
+	"\tfield:__data_loc char[] msg;\toffset:8;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"%s\", __get_str(msg)\n",
+};
+
+static const char * const comms[] = {
+	"bash", "kworker/0:1", "systemd", "sshd", "trace-cmd",
+	"swapper/1", "Xorg", "firefox", "rcu_sched", "ksoftirqd/2",
+};
+#define NR_COMMS	(sizeof(comms) / sizeof(comms[0]))
+#define COMM_PID(i)	(1000 + (i) * 7)
+
+static const char * const irq_names[] = {
+	"eth0", "ahci[0000:00:17.0]", "i915", "nvme0q1", "xhci_hcd",
+};
+
+static const char * const lock_names[] = {
+	"&rq->__lock", "&mm->mmap_lock", "rcu_node_0", "&pool->lock",
+	"&sb->s_type->i_mutex_key#10",
+};
+
+/* Long enough for some of the events to not fit in a type_len */
+static const char * const messages[] = {
+	"e1000e 0000:00:1f.6 eth0: NIC Link is Up 1000 Mbps Full Duplex, Flow Control: Rx/Tx",
+	"EXT4-fs (nvme0n1p2): mounted filesystem with ordered data mode. Quota mode: none.",
+	"usb 1-4: new high-speed USB device number 7 using xhci_hcd",
+	"audit: type=1400 audit(1700000000.123:456): apparmor=\"STATUS\" operation=\"profile_replace\" profile=\"unconfined\" name=\"/usr/bin/man\" pid=4242 comm=\"apparmor_parser\"",
+	"perf: interrupt took too long (2503 > 2500), lowering kernel.perf_event_max_sample_rate to 79750",
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+struct generator {
+	bool			big_endian;
+	unsigned long long	rand;
+};
+
+/* xorshift64*, the same corpus is generated for the same seed */
+static unsigned int gen_rand(struct generator *gen)
+{
+	gen->rand ^= gen->rand >> 12;
+	gen->rand ^= gen->rand << 25;
+	gen->rand ^= gen->rand >> 27;
+	return (gen->rand * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void put_u16(struct generator *gen, void *ptr, unsigned short val)
+{
+	unsigned char *p = ptr;
+
+	if (gen->big_endian) {
+		p[0] = val >> 8;
+		p[1] = val;
+	} else {
+		p[0] = val;
+		p[1] = val >> 8;
+	}
+}
+
+static void put_u32(struct generator *gen, void *ptr, unsigned int val)
+{
+	unsigned char *p = ptr;
+
+	if (gen->big_endian) {
+		put_u16(gen, p, val >> 16);
+		put_u16(gen, p + 2, val);
+	} else {
+		put_u16(gen, p, val);
+		put_u16(gen, p + 2, val >> 16);
+	}
+}
+
+static void put_u64(struct generator *gen, void *ptr, unsigned long long val)
+{
+	unsigned char *p = ptr;
+
+	if (gen->big_endian) {
+		put_u32(gen, p, val >> 32);
+		put_u32(gen, p + 4, val);
+	} else {
+		put_u32(gen, p, val);
+		put_u32(gen, p + 4, val >> 32);
+	}
+}
+
+/* The header of an event, as the kernel lays it out for each endianness */
+static void put_header(struct generator *gen, void *ptr, unsigned int type_len,
+		       unsigned int delta)
+{
+	delta &= (1 << 27) - 1;
+	if (gen->big_endian)
+		put_u32(gen, ptr, (type_len << 27) | delta);
+	else
+		put_u32(gen, ptr, (delta << 5) | type_len);
+}
+
+static void put_common(struct generator *gen, unsigned char *data, int type)
+{
+	unsigned int i = gen_rand(gen) % NR_COMMS;
+
+	put_u16(gen, data, type);
+	data[2] = gen_rand(gen) & 0x0d;		/* irqs off, hardirq, softirq */
+	data[3] = gen_rand(gen) % 3;
+	put_u32(gen, data + 4, COMM_PID(i));
+}
+
+static unsigned int put_str(unsigned char *data, const char *str)
+{
+	unsigned int len = strlen(str) + 1;
+
+	memcpy(data, str, len);
+	return len;
+}
+
+/* Writes the data of a random event to @data and returns its size */
+static unsigned int make_event(struct generator *gen, unsigned char *data)
+{
+	static const unsigned int sizes[] = { 32, 64, 96, 128, 192, 256, 512, 1024 };
+	static const unsigned int gfp[] = { 0xcc0, 0xcc0 | 0x800, 0x400 };
+	unsigned int r = gen_rand(gen) % 100;
+	unsigned int size;
+	unsigned int prev;
+	unsigned int next;
+	unsigned int len;
+	int i;
+
+	if (r < 30) {
+		put_common(gen, data, SCHED_SWITCH);
+		prev = gen_rand(gen) % NR_COMMS;
+		next = gen_rand(gen) % NR_COMMS;
+		memset(data + 8, 0, 16);
+		strncpy((char *)data + 8, comms[prev], 15);
+		put_u32(gen, data + 24, COMM_PID(prev));
+		put_u32(gen, data + 28, 120);
+		put_u64(gen, data + 32, gen_rand(gen) % 3);
+		memset(data + 40, 0, 16);
+		strncpy((char *)data + 40, comms[next], 15);
+		put_u32(gen, data + 56, COMM_PID(next));
+		put_u32(gen, data + 60, 120);
+		return 64;
+	}
+
+	if (r < 45) {
+		put_common(gen, data, IRQ_HANDLER_ENTRY);
+		i = gen_rand(gen) % ARRAY_SIZE(irq_names);
+		put_u32(gen, data + 8, 16 + i);
+		len = put_str(data + 16, irq_names[i]);
+		put_u32(gen, data + 12, (len << 16) | 16);
+		return 16 + len;
+	}
+
+	if (r < 70) {
+		put_common(gen, data, SYS_ENTER);
+		put_u64(gen, data + 8, gen_rand(gen) % 450);
+		for (i = 0; i < 6; i++)
+			put_u64(gen, data + 16 + i * 8,
+				((unsigned long long)gen_rand(gen) << 32) |
+				gen_rand(gen));
+		return 64;
+	}
+
+	if (r < 95) {
+		put_common(gen, data, KMALLOC);
+		size = sizes[gen_rand(gen) % ARRAY_SIZE(sizes)];
+		put_u64(gen, data + 8, 0xffffffff81000000ULL +
+			gen_rand(gen) % 0x1000000);
+		put_u64(gen, data + 16, 0xffff888100000000ULL +
+			(gen_rand(gen) & ~63U));
+		put_u64(gen, data + 24, size - gen_rand(gen) % 16);
+		put_u64(gen, data + 32, size);
+		put_u32(gen, data + 40, gfp[gen_rand(gen) % ARRAY_SIZE(gfp)]);
+		return 44;
+	}
+
+	if (r < 97) {
+		put_common(gen, data, CONSOLE);
+		i = gen_rand(gen) % ARRAY_SIZE(messages);
+		len = put_str(data + 12, messages[i]);
+		put_u32(gen, data + 8, (len << 16) | 12);
+		return 12 + len;
+	}
+
+	put_common(gen, data, LOCK_ACQUIRE);
+	i = gen_rand(gen) % ARRAY_SIZE(lock_names);
+	put_u32(gen, data + 8, gen_rand(gen) & 3);
+	put_u64(gen, data + 16, 0xffffffff83000000ULL + i * 0x40);
+	len = put_str(data + 24, lock_names[i]);
+	/* Relative to the end of the field */
+	put_u32(gen, data + 12, (len << 16) | 8);
+	return 24 + len;
+}
+
+/* Fills one sub-buffer, and returns the timestamp its last event ended at */
+static unsigned long long fill_page(struct generator *gen, struct corpus *corpus,
+				    unsigned char *page, unsigned long long ts,
+				    unsigned int index)
+{
+	unsigned char data[256];
+	unsigned long long commit;
+	unsigned long long delta;
+	unsigned int offset = 0;
+	unsigned int space;
+	unsigned int need;
+	unsigned int len;
+	unsigned char *ptr = page + PAGE_HEADER_SIZE;
+
+	memset(page, 0, CORPUS_PAGE_SIZE);
+	put_u64(gen, page, ts);
+	space = CORPUS_PAGE_SIZE - PAGE_HEADER_SIZE - PAGE_MISSED_SIZE;
+
+	for (;;) {
+		/* Mostly close together, now and then after a long idle */
+		if (gen_rand(gen) % 50)
+			delta = gen_rand(gen) % 20000;
+		else
+			delta = (1ULL << 27) + gen_rand(gen) % 1000000000;
+
+		len = make_event(gen, data);
+		/* Events are padded to 4 bytes */
+		memset(data + len, 0, 3);
+		len = (len + 3) & ~3;
+		need = 4 + len + (len > MAX_TYPE_LEN_DATA ? 4 : 0);
+		if (delta >= (1 << 27))
+			need += 8;
+		if (offset + need > space)
+			break;
+
+		if (delta >= (1 << 27)) {
+			put_header(gen, ptr + offset, KBUFFER_TYPE_TIME_EXTEND,
+				   delta);
+			put_u32(gen, ptr + offset + 4, delta >> 27);
+			offset += 8;
+			corpus->nr_extends++;
+			ts += delta;
+			delta = 0;
+		} else {
+			ts += delta;
+		}
+
+		/* Discarded events are left in place as padding */
+		if (gen_rand(gen) % 100 == 0) {
+			put_header(gen, ptr + offset, KBUFFER_TYPE_PADDING, delta);
+			put_u32(gen, ptr + offset + 4, len + 4);
+			offset += 8 + len;
+			corpus->nr_discarded++;
+			continue;
+		}
+
+		if (len > MAX_TYPE_LEN_DATA) {
+			put_header(gen, ptr + offset, 0, delta);
+			put_u32(gen, ptr + offset + 4, len + 4);
+			offset += 8;
+		} else {
+			put_header(gen, ptr + offset, len / 4, delta);
+			offset += 4;
+		}
+		memcpy(ptr + offset, data, len);
+		offset += len;
+		corpus->nr_events++;
+	}
+
+	commit = offset;
+	if (index % 50 == 49) {
+		/* The count of missed events is stored after the data */
+		commit |= MISSING_EVENTS | MISSING_STORED;
+		put_u64(gen, ptr + offset, 1 + gen_rand(gen) % 5000);
+		corpus->nr_missed_pages++;
+	} else if (index % 97 == 96) {
+		commit |= MISSING_EVENTS;
+		corpus->nr_missed_pages++;
+	}
+	put_u64(gen, page + 8, commit);
+
+	return ts;
+}
+
+/**
+ * corpus_generate - generate sub-buffers of events
+ * @corpus: where to store the sub-buffers
+ * @big_endian: if the sub-buffers are of a big endian machine
+ * @nr_pages: the number of sub-buffers of CORPUS_PAGE_SIZE to generate
+ * @seed: the seed of the random events
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int corpus_generate(struct corpus *corpus, bool big_endian,
+		    unsigned int nr_pages, unsigned int seed)
+{
+	struct generator gen = {
+		.big_endian	= big_endian,
+		.rand		= seed * 0x9e3779b97f4a7c15ULL + 1,
+	};
+	unsigned long long ts = 1000000000ULL;
+	unsigned int i;
+
+	memset(corpus, 0, sizeof(*corpus));
+	corpus->pages = malloc((size_t)nr_pages * CORPUS_PAGE_SIZE);
+	if (!corpus->pages)
+		return -1;
+	corpus->big_endian = big_endian;
+	corpus->nr_pages = nr_pages;
+
+	for (i = 0; i < nr_pages; i++)
+		ts = fill_page(&gen, corpus, corpus->pages +
+			       (size_t)i * CORPUS_PAGE_SIZE, ts, i);
+
+	return 0;
+}
+
+void corpus_free(struct corpus *corpus)
+{
+	free(corpus->pages);
+	corpus->pages = NULL;
+}
+
+/* Writes the sub-buffers, as they would be read from trace_pipe_raw */
+int corpus_write(struct corpus *corpus, const char *file)
+{
+	size_t size = (size_t)corpus->nr_pages * CORPUS_PAGE_SIZE;
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	while (done < size) {
+		ret = write(fd, corpus->pages + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return close(fd);
+}
+
+/* Sets up @tep to read the events of a corpus */
+int corpus_setup_tep(struct tep_handle *tep, bool big_endian)
+{
+	unsigned int i;
+
+	tep_set_file_bigendian(tep, big_endian ? TEP_BIG_ENDIAN :
+						 TEP_LITTLE_ENDIAN);
+	tep_set_long_size(tep, 8);
+	tep_set_page_size(tep, CORPUS_PAGE_SIZE);
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (tep_parse_event(tep, formats[i], strlen(formats[i]),
+				    "bench"))
+			return -1;
+	}
+
+	for (i = 0; i < NR_COMMS; i++) {
+		if (tep_register_comm(tep, comms[i], COMM_PID(i)))
+			return -1;
+	}
+
+	return 0;
+}
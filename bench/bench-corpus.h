@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: LGPL-2.1 */
+/*
+ * Synthetic ring buffer sub-buffers for the benchmarks.
+ */
+#ifndef _BENCH_CORPUS_H
+#define _BENCH_CORPUS_H
+
+#include <stdbool.h>
+
+struct tep_handle;
+
+#define CORPUS_PAGE_SIZE	4096
+
+struct corpus {
+	bool			big_endian;
+	unsigned int		nr_pages;
+	unsigned char		*pages;
+
+	/* What was generated */
+	unsigned long long	nr_events;
+	unsigned long long	nr_extends;
+	unsigned long long	nr_discarded;
+	unsigned long long	nr_missed_pages;
+};
+
+int corpus_generate(struct corpus *corpus, bool big_endian,
+		    unsigned int nr_pages, unsigned int seed);
+void corpus_free(struct corpus *corpus);
+int corpus_write(struct corpus *corpus, const char *file);
+int corpus_setup_tep(struct tep_handle *tep, bool big_endian);
+
+#endif /* _BENCH_CORPUS_H */
@@ -0,0 +1,450 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Microbenchmarks of the hot paths of the library, over a synthetic
+ * corpus of ring buffer sub-buffers. Each result is printed as a line
+ * of JSON, so that runs can be compared by scripts.
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <event-parse.h>
+#include <kbuffer.h>
+#include <trace-seq.h>
+
+#include "bench-corpus.h"
+
+#define DEFAULT_PAGES		256
+#define DEFAULT_MIN_MS		200
+#define DEFAULT_SEED		1
+
+/* The highest event id of the corpus */
+#define MAX_EVENT_ID		6
+#define MAX_READ_FIELDS		4
+
+static const char * const filters[] = {
+	"bench/sched_switch: prev_pid > 1020 && next_comm != \"bash\"",
+	"bench/irq_handler_entry: name =~ \"^nvme\"",
+	"bench/kmalloc: bytes_alloc >= 256",
+	"bench/lock_acquire: flags & 1",
+};
+
+/* The fields read by the field_read benchmark, for each event */
+static const char * const read_fields[MAX_EVENT_ID + 1][MAX_READ_FIELDS] = {
+	[1] = { "prev_pid", "prev_state", "next_comm", "next_pid" },
+	[2] = { "irq", "name" },
+	[3] = { "id", "args" },
+	[4] = { "call_site", "ptr", "bytes_req", "gfp_flags" },
+	[5] = { "flags", "name", "lockdep_addr" },
+	[6] = { "msg" },
+};
+
+struct bench_ctx {
+	struct corpus		corpus;
+	struct tep_handle	*tep;
+	struct kbuffer		*kbuf;
+	struct tep_record	*records;
+	unsigned long long	nr_records;
+	struct tep_event_filter	*filter;
+	struct tep_format_field	*fields[MAX_EVENT_ID + 1][MAX_READ_FIELDS];
+	struct trace_seq	seq;
+};
+
+struct bench {
+	const char		*name;
+	/* Runs one pass over the corpus and returns the operations done */
+	unsigned long long	(*run)(struct bench_ctx *ctx);
+};
+
+/* Keeps the compiler from dropping the work of a benchmark */
+static volatile unsigned long long sink;
+
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "trace-bench: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (errno)
+		fprintf(stderr, ": %s", strerror(errno));
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *corpus_page(struct bench_ctx *ctx, unsigned int i)
+{
+	return ctx->corpus.pages + (size_t)i * CORPUS_PAGE_SIZE;
+}
+
+static unsigned long long bench_kbuffer_decode(struct bench_ctx *ctx)
+{
+	unsigned long long events = 0;
+	unsigned long long ts;
+	unsigned int i;
+	void *data;
+
+	for (i = 0; i < ctx->corpus.nr_pages; i++) {
+		kbuffer_load_subbuffer(ctx->kbuf, corpus_page(ctx, i));
+		for (data = kbuffer_read_event(ctx->kbuf, &ts); data;
+		     data = kbuffer_next_event(ctx->kbuf, &ts)) {
+			sink += ts + kbuffer_event_size(ctx->kbuf);
+			events++;
+		}
+		sink += kbuffer_missed_events(ctx->kbuf);
+	}
+
+	return events;
+}
+
+static unsigned long long bench_find_event(struct bench_ctx *ctx)
+{
+	struct tep_event *event;
+	unsigned long long i;
+
+	for (i = 0; i < ctx->nr_records; i++) {
+		event = tep_find_event(ctx->tep,
+				       tep_data_type(ctx->tep, &ctx->records[i]));
+		sink += event->id;
+	}
+
+	return ctx->nr_records;
+}
+
+static unsigned long long bench_field_read(struct bench_ctx *ctx)
+{
+	struct tep_format_field *field;
+	struct tep_field_view view;
+	struct tep_record *record;
+	unsigned long long reads = 0;
+	unsigned long long val;
+	unsigned long long i;
+	int type;
+	int f;
+
+	for (i = 0; i < ctx->nr_records; i++) {
+		record = &ctx->records[i];
+		type = tep_data_type(ctx->tep, record);
+		for (f = 0; f < MAX_READ_FIELDS; f++) {
+			field = ctx->fields[type][f];
+			if (!field)
+				break;
+			if (field->flags & (TEP_FIELD_IS_STRING | TEP_FIELD_IS_ARRAY)) {
+				tep_get_field_view(field, record, &view);
+				sink += view.len;
+			} else {
+				tep_read_number_field(field, record->data, &val);
+				sink += val;
+			}
+			reads++;
+		}
+	}
+
+	return reads;
+}
+
+static unsigned long long bench_filter_match(struct bench_ctx *ctx)
+{
+	unsigned long long i;
+
+	for (i = 0; i < ctx->nr_records; i++)
+		sink += tep_filter_match(ctx->filter, &ctx->records[i]);
+
+	return ctx->nr_records;
+}
+
+static unsigned long long bench_print_event(struct bench_ctx *ctx)
+{
+	unsigned long long i;
+
+	for (i = 0; i < ctx->nr_records; i++) {
+		trace_seq_reset(&ctx->seq);
+		tep_print_event(ctx->tep, &ctx->seq, &ctx->records[i],
+				"%s-%d [%03d] %d %s: %s\n",
+				TEP_PRINT_COMM, TEP_PRINT_PID, TEP_PRINT_CPU,
+				TEP_PRINT_TIME, TEP_PRINT_NAME, TEP_PRINT_INFO);
+		sink += ctx->seq.len;
+	}
+
+	return ctx->nr_records;
+}
+
+static const struct bench benches[] = {
+	{ "kbuffer_decode",	bench_kbuffer_decode },
+	{ "find_event",		bench_find_event },
+	{ "field_read",		bench_field_read },
+	{ "filter_match",	bench_filter_match },
+	{ "print_event",	bench_print_event },
+};
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+/* Decodes all the events of the corpus into records, once */
+static void load_records(struct bench_ctx *ctx)
+{
+	struct tep_record *record;
+	unsigned long long alloc = 0;
+	unsigned long long ts;
+	unsigned int i;
+	void *data;
+
+	ctx->nr_records = 0;
+	for (i = 0; i < ctx->corpus.nr_pages; i++) {
+		kbuffer_load_subbuffer(ctx->kbuf, corpus_page(ctx, i));
+		for (data = kbuffer_read_event(ctx->kbuf, &ts); data;
+		     data = kbuffer_next_event(ctx->kbuf, &ts)) {
+			if (ctx->nr_records == alloc) {
+				alloc = alloc ? alloc * 2 : 1024;
+				record = realloc(ctx->records,
+						 sizeof(*record) * alloc);
+				if (!record)
+					die("allocating records");
+				ctx->records = record;
+			}
+			record = &ctx->records[ctx->nr_records++];
+			memset(record, 0, sizeof(*record));
+			record->ts = ts;
+			record->data = data;
+			record->size = kbuffer_event_size(ctx->kbuf);
+			record->record_size = kbuffer_curr_size(ctx->kbuf);
+			record->cpu = i % 4;
+		}
+	}
+
+	if (ctx->nr_records != ctx->corpus.nr_events) {
+		errno = 0;
+		die("decoded %llu events of the %llu generated",
+		    ctx->nr_records, ctx->corpus.nr_events);
+	}
+}
+
+static void setup(struct bench_ctx *ctx, bool big_endian, unsigned int pages,
+		  unsigned int seed)
+{
+	struct tep_event *event;
+	unsigned int i;
+	int f;
+
+	memset(ctx, 0, sizeof(*ctx));
+	if (corpus_generate(&ctx->corpus, big_endian, pages, seed) < 0)
+		die("generating the corpus");
+
+	ctx->tep = tep_alloc();
+	if (!ctx->tep || corpus_setup_tep(ctx->tep, big_endian) < 0)
+		die("setting up the event formats");
+
+	ctx->kbuf = kbuffer_alloc(KBUFFER_LSIZE_8, big_endian ?
+				  KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE);
+	if (!ctx->kbuf)
+		die("allocating the kbuffer");
+
+	ctx->filter = tep_filter_alloc(ctx->tep);
+	if (!ctx->filter)
+		die("allocating the filter");
+	for (i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+		if (tep_filter_add_filter_str(ctx->filter, filters[i])) {
+			errno = 0;
+			die("adding filter '%s'", filters[i]);
+		}
+	}
+
+	for (i = 1; i <= MAX_EVENT_ID; i++) {
+		event = tep_find_event(ctx->tep, i);
+		for (f = 0; event && f < MAX_READ_FIELDS && read_fields[i][f]; f++)
+			ctx->fields[i][f] = tep_find_field(event, read_fields[i][f]);
+	}
+
+	trace_seq_init(&ctx->seq);
+	load_records(ctx);
+}
+
+static void cleanup(struct bench_ctx *ctx)
+{
+	trace_seq_destroy(&ctx->seq);
+	free(ctx->records);
+	tep_filter_free(ctx->filter);
+	kbuffer_free(ctx->kbuf);
+	tep_free(ctx->tep);
+	corpus_free(&ctx->corpus);
+}
+
+static void run_bench(struct bench_ctx *ctx, const struct bench *bench,
+		      const char *endian, unsigned long long min_ns)
+{
+	unsigned long long best_ns = 0;
+	unsigned long long best_ops = 0;
+	unsigned long long total_ns = 0;
+	unsigned long long total_ops = 0;
+	unsigned long long start;
+	unsigned long long ns;
+	unsigned long long ops;
+	unsigned int passes = 0;
+
+	/* Warm up the caches and the lazily built tables */
+	bench->run(ctx);
+
+	do {
+		start = now_ns();
+		ops = bench->run(ctx);
+		ns = now_ns() - start;
+
+		if (!passes || ns * best_ops < best_ns * ops) {
+			best_ns = ns;
+			best_ops = ops;
+		}
+		total_ns += ns;
+		total_ops += ops;
+		passes++;
+	} while (total_ns < min_ns);
+
+	printf("{\"bench\":\"%s\",\"endian\":\"%s\",\"passes\":%u,"
+	       "\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.3f,"
+	       "\"best_ns_per_op\":%.3f,\"ops_per_sec\":%.0f}\n",
+	       bench->name, endian, passes, total_ops, total_ns,
+	       (double)total_ns / total_ops,
+	       (double)best_ns / best_ops,
+	       total_ops * 1e9 / total_ns);
+	fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+	unsigned int i;
+
+	printf("usage: %s [options]\n"
+	       " -h : this message\n"
+	       " -e little|big|both : the endianness of the corpus (default both)\n"
+	       " -p pages : the number of %d byte sub-buffers (default %d)\n"
+	       " -s seed : the seed of the generated events (default %d)\n"
+	       " -t ms : the least time to run each benchmark (default %d)\n"
+	       " -b bench : only run this benchmark\n"
+	       " -o file : write the corpus to file (.le/.be appended for both)\n"
+	       "      and exit\n"
+	       "\n"
+	       "benchmarks:",
+	       argv0, CORPUS_PAGE_SIZE, DEFAULT_PAGES, DEFAULT_SEED,
+	       DEFAULT_MIN_MS);
+	for (i = 0; i < NR_BENCHES; i++)
+		printf(" %s", benches[i].name);
+	printf("\n");
+	exit(-1);
+}
+
+static void write_corpus(const char *file, bool big_endian, bool suffix,
+			 unsigned int pages, unsigned int seed)
+{
+	struct corpus corpus;
+	char *name;
+
+	if (asprintf(&name, "%s%s", file,
+		     suffix ? (big_endian ? ".be" : ".le") : "") < 0)
+		die("allocating the file name");
+
+	if (corpus_generate(&corpus, big_endian, pages, seed) < 0)
+		die("generating the corpus");
+	if (corpus_write(&corpus, name) < 0)
+		die("writing %s", name);
+
+	corpus_free(&corpus);
+	free(name);
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const endians[] = { "little", "big" };
+	const char *only = NULL;
+	const char *output = NULL;
+	unsigned long long min_ns;
+	unsigned int pages = DEFAULT_PAGES;
+	unsigned int seed = DEFAULT_SEED;
+	unsigned int min_ms = DEFAULT_MIN_MS;
+	struct bench_ctx ctx;
+	bool run[2] = { true, true };
+	unsigned int i, e;
+	int c;
+
+	while ((c = getopt(argc, argv, "he:p:s:t:b:o:")) >= 0) {
+		switch (c) {
+		case 'e':
+			run[0] = strcmp(optarg, "big") != 0;
+			run[1] = strcmp(optarg, "little") != 0;
+			if (strcmp(optarg, "big") && strcmp(optarg, "little") &&
+			    strcmp(optarg, "both"))
+				usage(argv[0]);
+			break;
+		case 'p':
+			pages = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 't':
+			min_ms = atoi(optarg);
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!pages)
+		usage(argv[0]);
+
+	if (only) {
+		for (i = 0; i < NR_BENCHES; i++) {
+			if (strcmp(benches[i].name, only) == 0)
+				break;
+		}
+		if (i == NR_BENCHES)
+			usage(argv[0]);
+	}
+
+	if (output) {
+		for (e = 0; e < 2; e++) {
+			if (run[e])
+				write_corpus(output, e, run[0] && run[1],
+					     pages, seed);
+		}
+		return 0;
+	}
+
+	min_ns = min_ms * 1000000ULL;
+
+	for (e = 0; e < 2; e++) {
+		if (!run[e])
+			continue;
+
+		setup(&ctx, e, pages, seed);
+		printf("{\"corpus\":\"%s\",\"pages\":%u,\"seed\":%u,"
+		       "\"events\":%llu,\"extends\":%llu,\"discarded\":%llu,"
+		       "\"missed_pages\":%llu}\n",
+		       endians[e], pages, seed, ctx.corpus.nr_events,
+		       ctx.corpus.nr_extends, ctx.corpus.nr_discarded,
+		       ctx.corpus.nr_missed_pages);
+
+		for (i = 0; i < NR_BENCHES; i++) {
+			if (!only || strcmp(benches[i].name, only) == 0)
+				run_bench(&ctx, &benches[i], endians[e], min_ns);
+		}
+		cleanup(&ctx);
+	}
+
+	return 0;
+}
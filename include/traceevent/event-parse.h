@@ -332,6 +332,8 @@ enum tep_flag {
 	TEP_NSEC_OUTPUT		= 1,	/* output in NSECS */
 	TEP_DISABLE_SYS_PLUGINS	= 1 << 1,
 	TEP_DISABLE_PLUGINS	= 1 << 2,
+	TEP_SHARE_FORMATS	= 1 << 3,
+	TEP_LAZY_PRINT_FMT	= 1 << 4,
 };
 
 #define TEP_ERRORS 							      \
@@ -363,7 +365,9 @@ enum tep_flag {
 	_PE(FILTER_NOT_FOUND,	"no filter found"),			      \
 	_PE(NOT_A_NUMBER,	"must have number field"),		      \
 	_PE(NO_FILTER,		"no filters exists"),			      \
-	_PE(FILTER_MISS,	"record does not match to filter")
+	_PE(FILTER_MISS,	"record does not match to filter"),	      \
+	_PE(HANDLE_FROZEN,	"tep handle is frozen"),			      \
+	_PE(HANDLE_BUSY,	"tep handle is used by a print pipeline")
 
 #undef _PE
 #define _PE(__code, __str) TEP_ERRNO__ ## __code
@@ -449,9 +453,16 @@ int tep_register_comm(struct tep_handle *tep, const char *comm, int pid);
 int tep_override_comm(struct tep_handle *tep, const char *comm, int pid);
 int tep_parse_saved_cmdlines(struct tep_handle *tep, const char *buf);
 int tep_parse_kallsyms(struct tep_handle *tep, const char *kallsyms);
+int tep_parse_kallsyms_buf(struct tep_handle *tep, const char *buf, size_t size);
+int tep_parse_kallsyms_fd(struct tep_handle *tep, int fd);
 int tep_register_function(struct tep_handle *tep, char *name,
 			  unsigned long long addr, char *mod);
+int tep_unregister_functions(struct tep_handle *tep, unsigned long long start,
+			     unsigned long long end);
 int tep_parse_printk_formats(struct tep_handle *tep, const char *buf);
+int tep_parse_printk_formats_buf(struct tep_handle *tep, const char *buf,
+				 size_t size);
+int tep_parse_printk_formats_fd(struct tep_handle *tep, int fd);
 int tep_register_print_string(struct tep_handle *tep, const char *fmt,
 			      unsigned long long addr);
 bool tep_is_pid_registered(struct tep_handle *tep, int pid);
@@ -471,6 +482,36 @@ void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
 		     struct tep_record *record, const char *fmt, ...)
 	__attribute__ ((format (printf, 4, 5)));
 
+struct tep_print_pipeline;
+
+typedef void (*tep_pipeline_print_func)(struct tep_handle *tep,
+					struct trace_seq *s,
+					struct tep_record *record,
+					void *context);
+typedef void (*tep_pipeline_release_func)(struct tep_record *record,
+					  void *context);
+
+struct tep_print_pipeline *
+tep_print_pipeline_alloc(struct tep_handle *tep, int nr_threads, int fd,
+			 tep_pipeline_print_func print,
+			 tep_pipeline_release_func release, void *context);
+int tep_print_pipeline_add(struct tep_print_pipeline *pipe,
+			   struct tep_record *record);
+int tep_print_pipeline_flush(struct tep_print_pipeline *pipe);
+void tep_print_pipeline_free(struct tep_print_pipeline *pipe);
+
+struct tep_record_pool;
+
+struct tep_record_pool *tep_record_pool_alloc(unsigned int data_size,
+					      unsigned int ring_size);
+void tep_record_pool_free(struct tep_record_pool *pool);
+struct tep_record *tep_record_pool_get(struct tep_record_pool *pool);
+int tep_record_pool_get_bulk(struct tep_record_pool *pool,
+			     struct tep_record **records, unsigned int nr);
+void tep_record_pool_ref(struct tep_record *record);
+void tep_record_pool_put(struct tep_record *record);
+struct tep_record *tep_record_pool_next(struct tep_record_pool *pool);
+
 int tep_parse_header_page(struct tep_handle *tep, char *buf, unsigned long size,
 			  int long_size);
 
@@ -485,6 +526,14 @@ void *tep_get_field_raw(struct trace_seq *s, struct tep_event *event,
 			const char *name, struct tep_record *record,
 			int *len, int err);
 
+struct tep_field_view {
+	const void		*data;
+	unsigned int		len;
+};
+
+int tep_get_field_view(struct tep_format_field *field,
+		       struct tep_record *record, struct tep_field_view *view);
+
 int tep_get_field_val(struct trace_seq *s, struct tep_event *event,
 		      const char *name, struct tep_record *record,
 		      unsigned long long *val, int err);
@@ -524,6 +573,7 @@ int tep_unregister_print_function(struct tep_handle *tep,
 struct tep_format_field *tep_find_common_field(struct tep_event *event, const char *name);
 struct tep_format_field *tep_find_field(struct tep_event *event, const char *name);
 struct tep_format_field *tep_find_any_field(struct tep_event *event, const char *name);
+const char *tep_find_interned_string(struct tep_handle *tep, const char *str);
 
 const char *tep_find_function(struct tep_handle *tep, unsigned long long addr);
 unsigned long long
@@ -531,6 +581,25 @@ tep_find_function_address(struct tep_handle *tep, unsigned long long addr);
 int tep_find_function_info(struct tep_handle *tep, unsigned long long addr,
 			   const char **name, unsigned long long *start,
 			   unsigned long *size);
+
+/* Only counted when the library is built with TEP_STATS */
+struct tep_stats {
+	unsigned long long	last_event_hits;	/* tep_find_event() cache */
+	unsigned long long	last_event_misses;
+	unsigned long long	cmdline_searches;	/* comm by pid */
+	unsigned long long	cmdline_probes;
+	unsigned long long	func_cache_hits;	/* function cache */
+	unsigned long long	func_cache_misses;
+	unsigned long long	func_searches;		/* function by address */
+	unsigned long long	func_probes;
+	unsigned long long	printk_searches;	/* printk format by address */
+	unsigned long long	printk_probes;
+	unsigned long long	bprint_parses;		/* bprint formats parsed */
+	unsigned long long	seq_expansions;		/* trace_seq grown when printing */
+};
+
+int tep_get_stats(struct tep_handle *tep, struct tep_stats *stats);
+void tep_reset_stats(struct tep_handle *tep);
 unsigned long long tep_read_number(struct tep_handle *tep, const void *ptr, int size);
 int tep_read_number_field(struct tep_format_field *field, const void *data,
 			  unsigned long long *value);
@@ -544,10 +613,44 @@ tep_find_event_by_name(struct tep_handle *tep, const char *sys, const char *name
 struct tep_event *
 tep_find_event_by_record(struct tep_handle *tep, struct tep_record *record);
 
+struct tep_common_fields {
+	int			type;
+	int			pid;
+	int			preempt_count;
+	int			flags;
+	int			lock_depth;
+	int			migrate_disable;
+};
+
 int tep_data_type(struct tep_handle *tep, struct tep_record *rec);
 int tep_data_pid(struct tep_handle *tep, struct tep_record *rec);
 int tep_data_preempt_count(struct tep_handle *tep, struct tep_record *rec);
 int tep_data_flags(struct tep_handle *tep, struct tep_record *rec);
+int tep_data_common(struct tep_handle *tep, struct tep_record *rec,
+		    struct tep_common_fields *common);
+
+enum tep_column_type {
+	TEP_COLUMN_U8,
+	TEP_COLUMN_U16,
+	TEP_COLUMN_U32,
+	TEP_COLUMN_U64,
+	TEP_COLUMN_S8,
+	TEP_COLUMN_S16,
+	TEP_COLUMN_S32,
+	TEP_COLUMN_S64,
+};
+
+struct tep_column {
+	struct tep_format_field	*field;		/* NULL for the timestamp */
+	enum tep_column_type	type;
+	void			*values;
+	unsigned char		*nulls;		/* optional, a bit per record */
+};
+
+int tep_read_columns(struct tep_event *event, struct tep_record **records,
+		     int nr_records, struct tep_column *columns, int nr_columns);
+int tep_swap_records(struct tep_handle *tep, struct tep_record **records,
+		     int nr_records);
 const char *tep_data_comm_from_pid(struct tep_handle *tep, int pid);
 struct tep_cmdline;
 struct tep_cmdline *tep_data_pid_from_comm(struct tep_handle *tep, const char *comm,
@@ -602,10 +705,29 @@ void tep_set_test_filters(struct tep_handle *tep, int test_filters);
 
 struct tep_handle *tep_alloc(void);
 void tep_free(struct tep_handle *tep);
+int tep_freeze(struct tep_handle *tep);
+bool tep_is_frozen(struct tep_handle *tep);
 void tep_ref(struct tep_handle *tep);
 void tep_unref(struct tep_handle *tep);
 int tep_get_ref(struct tep_handle *tep);
 
+int tep_save_cache(struct tep_handle *tep, const char *file);
+int tep_load_cache(struct tep_handle *tep, const char *file);
+
+/* The inputs that the digest of a handle and its cache file cover */
+enum tep_cache_input {
+	TEP_CACHE_HEADER_PAGE,
+	TEP_CACHE_FORMAT,
+	TEP_CACHE_KALLSYMS,
+	TEP_CACHE_PRINTK,
+};
+
+unsigned long long tep_digest_input(unsigned long long digest,
+				    enum tep_cache_input type,
+				    const char *buf, size_t size);
+unsigned long long tep_get_input_digest(struct tep_handle *tep);
+int tep_get_cache_digest(const char *file, unsigned long long *digest);
+
 struct kbuffer *tep_kbuffer(struct tep_handle *tep);
 
 /* for debugging */
@@ -776,6 +898,10 @@ int tep_filter_copy(struct tep_event_filter *dest, struct tep_event_filter *sour
 
 int tep_filter_compare(struct tep_event_filter *filter1, struct tep_event_filter *filter2);
 
+int tep_filter_get_stats(struct tep_event_filter *filter, int event_id,
+			 unsigned long long *tests, unsigned long long *matches);
+void tep_filter_reset_stats(struct tep_event_filter *filter);
+
 /* Control library logs */
 enum tep_loglevel {
 	TEP_LOG_NONE = 0,
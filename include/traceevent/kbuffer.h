@@ -58,6 +58,18 @@ void *kbuffer_subbuffer(struct kbuffer *kbuf);
 void kbuffer_set_old_format(struct kbuffer *kbuf);
 int kbuffer_start_of_data(struct kbuffer *kbuf);
 
+/* Only counted when the library is built with TEP_STATS */
+struct kbuffer_stats {
+	unsigned long long	subbuffers;	/* sub-buffers loaded */
+	unsigned long long	events;		/* events decoded */
+	unsigned long long	skipped;	/* padding and time stamps skipped */
+	unsigned int		subbuf_events;	/* events of the current sub-buffer */
+	unsigned int		subbuf_skipped;	/* skipped in the current sub-buffer */
+};
+
+int kbuffer_get_stats(struct kbuffer *kbuf, struct kbuffer_stats *stats);
+void kbuffer_reset_stats(struct kbuffer *kbuf);
+
 /* Debugging */
 
 struct kbuffer_raw_info {
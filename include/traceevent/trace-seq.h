@@ -24,6 +24,7 @@ enum trace_seq_fail {
 	TRACE_SEQ__GOOD,
 	TRACE_SEQ__BUFFER_POISONED,
 	TRACE_SEQ__MEM_ALLOC_FAILED,
+	TRACE_SEQ__WRITE_FAILED,
 };
 
 /*
@@ -40,6 +41,9 @@ struct trace_seq {
 };
 
 void trace_seq_init(struct trace_seq *s);
+void trace_seq_init_buf(struct trace_seq *s, char *buf, unsigned int size);
+void trace_seq_init_fd(struct trace_seq *s, int fd, unsigned int size);
+int trace_seq_flush(struct trace_seq *s);
 void trace_seq_reset(struct trace_seq *s);
 void trace_seq_destroy(struct trace_seq *s);
 
@@ -51,6 +55,23 @@ extern int trace_seq_vprintf(struct trace_seq *s, const char *fmt, va_list args)
 extern int trace_seq_puts(struct trace_seq *s, const char *str);
 extern int trace_seq_putc(struct trace_seq *s, unsigned char c);
 
+enum trace_seq_num_flags {
+	TRACE_SEQ_NUM_SIGNED	= (1 << 0),
+	TRACE_SEQ_NUM_HEX	= (1 << 1),
+	TRACE_SEQ_NUM_UPPER	= (1 << 2),
+	TRACE_SEQ_NUM_ZERO	= (1 << 3),
+	TRACE_SEQ_NUM_LEFT	= (1 << 4),
+};
+
+extern int trace_seq_put_num(struct trace_seq *s, unsigned long long val,
+			     int width, unsigned int flags);
+extern int trace_seq_put_u64(struct trace_seq *s, unsigned long long val);
+extern int trace_seq_put_s64(struct trace_seq *s, long long val);
+extern int trace_seq_put_hex(struct trace_seq *s, unsigned long long val);
+extern int trace_seq_put_timestamp(struct trace_seq *s, unsigned long long ts,
+				   unsigned int div, unsigned int prec);
+extern int trace_seq_put_str_pad(struct trace_seq *s, const char *str, int width);
+
 extern void trace_seq_terminate(struct trace_seq *s);
 
 extern int trace_seq_do_fprintf(struct trace_seq *s, FILE *fp);
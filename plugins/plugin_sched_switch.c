@@ -40,6 +40,15 @@ static const char *convert_sym(struct tep_print_flag_sym *sym)
 	return save_states;
 }
 
+/* Arguments of a shared print format refer to fields of their own */
+static bool is_field(struct tep_print_arg_field *field,
+		     struct tep_format_field *prev_state_field)
+{
+	return field && field->field &&
+		(field->field == prev_state_field ||
+		 strcmp(field->field->name, prev_state_field->name) == 0);
+}
+
 static struct tep_print_arg_field *
 find_arg_field(struct tep_format_field *prev_state_field, struct tep_print_arg *arg)
 {
@@ -53,10 +62,10 @@ find_arg_field(struct tep_format_field *prev_state_field, struct tep_print_arg *
 
 	if (arg->type == TEP_PRINT_OP) {
 		field = find_arg_field(prev_state_field, arg->op.left);
-		if (field && field->field == prev_state_field)
+		if (is_field(field, prev_state_field))
 			return field;
 		field = find_arg_field(prev_state_field, arg->op.right);
-		if (field && field->field == prev_state_field)
+		if (is_field(field, prev_state_field))
 			return field;
 	}
 	return NULL;
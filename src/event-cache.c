@@ -0,0 +1,1471 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Save the parsed events and the lookup tables of a handle into a file
+ * that can be mapped back in, instead of parsing everything again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "event-parse.h"
+#include "event-parse-local.h"
+#include "event-utils.h"
+
+/*
+ * The file holds a copy of the events as they are laid out in memory,
+ * with every pointer replaced by the offset of what it points to in
+ * the file. The offsets of those pointers are listed in the relocation
+ * section, so loading the file only needs to map it and add the address
+ * of the mapping to each of them. The print functions that arguments
+ * call are registered by plugins, their slots hold the offset of the
+ * function name instead, and are listed in the function fixup section.
+ *
+ * The header keeps a checksum of the file, so that a damaged file is
+ * refused before anything in it is used. The size of what each pointer
+ * points to is also kept next to the relocation section, and checked
+ * once the pointers are relocated: a pointer to char is a string, which
+ * must end inside the file, anything else must fit in it. This does not
+ * make a crafted file safe to load, as the types of the objects that
+ * the pointers point to are not checked. The file is as trusted as the
+ * code of the program, which is why it is only readable by its user.
+ *
+ * As the copy uses the in memory layout of the structures, a file can
+ * only be loaded by a build of the library with the same layout, which
+ * the abi hash of the header is checked for. Whether it was made from
+ * the same kernel is up to the caller, with the digest of the inputs
+ * that the header keeps (see tep_digest_input()).
+ */
+#define CACHE_MAGIC		"TEPCACHE"
+#define CACHE_VERSION		2
+#define CACHE_ALIGN		8
+/* The function addresses are searched a cache line at a time */
+#define CACHE_LINE		64
+#define CACHE_PTRS_INIT_SIZE	1024
+#define CACHE_LIST_INIT_SIZE	256
+/* The size of the target of a relocation that is a string */
+#define CACHE_STRING		sizeof(char)
+
+enum {
+	CACHE_RELOCS,
+	CACHE_RELOC_SIZES,
+	CACHE_FUNC_FIXUPS,
+	CACHE_EVENTS,
+	CACHE_CMDLINES,
+	CACHE_PRINTK,
+	CACHE_FUNC_ADDRS,
+	CACHE_FUNC_NAMES,
+	CACHE_FUNC_MODS,
+	CACHE_FUNC_STRS,
+	CACHE_FUNC_INDEX,
+	CACHE_FUNC_INDEX_BLK,
+	CACHE_NR_SECTIONS
+};
+
+struct cache_section {
+	uint64_t		offset;
+	uint64_t		size;
+};
+
+struct cache_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		abi;
+	uint64_t		size;
+	int32_t			header_page_ts_offset;
+	int32_t			header_page_ts_size;
+	int32_t			header_page_size_offset;
+	int32_t			header_page_size_size;
+	int32_t			header_page_data_offset;
+	int32_t			header_page_data_size;
+	int32_t			header_page_overwrite;
+	int32_t			file_bigendian;
+	int32_t			old_format;
+	int32_t			cpus;
+	int32_t			long_size;
+	int32_t			page_size;
+	uint32_t		func_blocks;
+	uint32_t		reserved;
+	uint64_t		digest;
+	/* See cache_checksum() */
+	uint64_t		checksum;
+	struct cache_section	sections[CACHE_NR_SECTIONS];
+};
+
+/* Where the copy of an object went */
+struct cache_ptr {
+	const void		*ptr;
+	uint64_t		offset;
+};
+
+struct cache_list {
+	uint64_t		*offsets;
+	size_t			nr;
+	size_t			size;
+};
+
+struct cache_writer {
+	char			*data;
+	size_t			len;
+	size_t			size;
+	struct cache_ptr	*ptrs;
+	size_t			ptrs_size;
+	size_t			nr_ptrs;
+	struct cache_list	relocs;
+	struct cache_list	reloc_sizes;
+	struct cache_list	fixups;
+	bool			failed;
+};
+
+/* A hash of the layout of the structures that are saved */
+static uint32_t cache_abi(void)
+{
+	const size_t layout[] = {
+		sizeof(void *),
+		sizeof(long),
+		tep_is_bigendian(),
+		sizeof(struct tep_event),
+		offsetof(struct tep_event, format),
+		offsetof(struct tep_event, print_fmt),
+		offsetof(struct tep_event, system),
+		sizeof(struct tep_format_field),
+		offsetof(struct tep_format_field, offset),
+		offsetof(struct tep_format_field, flags),
+		sizeof(struct tep_print_arg),
+		offsetof(struct tep_print_arg, atom),
+		sizeof(struct tep_print_flag_sym),
+		sizeof(struct tep_print_parse),
+		offsetof(struct tep_print_parse, arg),
+		sizeof(struct tep_cmdline),
+		sizeof(struct printk_map),
+		TEP_PRINT_CPUMASK,
+	};
+	const unsigned char *p = (const unsigned char *)layout;
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < sizeof(layout); i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+static uint64_t checksum_add(uint64_t sum, const char *data, size_t len)
+{
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		sum = (sum ^ word) * 0x100000001b3ULL;
+	}
+	for (; i < len; i++)
+		sum = (sum ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+	return sum;
+}
+
+/* FNV-1a a word at a time, over all of the file but the checksum itself */
+static uint64_t cache_checksum(const char *data, size_t len)
+{
+	size_t off = offsetof(struct cache_header, checksum);
+	uint64_t sum = 0xcbf29ce484222325ULL;
+
+	sum = checksum_add(sum, data, off);
+	off += sizeof(((struct cache_header *)0)->checksum);
+	return checksum_add(sum, data + off, len - off);
+}
+
+/* Reserve @size zeroed bytes, returns their offset or zero on error */
+static uint64_t cache_reserve(struct cache_writer *cw, size_t size, size_t align)
+{
+	size_t off = (cw->len + align - 1) & ~(align - 1);
+	size_t new_size;
+	char *data;
+
+	if (off + size > cw->size) {
+		new_size = cw->size ? cw->size : 4096;
+		while (new_size < off + size)
+			new_size *= 2;
+		data = realloc(cw->data, new_size);
+		if (!data) {
+			cw->failed = true;
+			return 0;
+		}
+		memset(data + cw->size, 0, new_size - cw->size);
+		cw->data = data;
+		cw->size = new_size;
+	}
+
+	cw->len = off + size;
+	return off;
+}
+
+static uint64_t cache_copy(struct cache_writer *cw, const void *ptr,
+			   size_t size, size_t align)
+{
+	uint64_t off;
+
+	off = cache_reserve(cw, size, align);
+	if (off && size)
+		memcpy(cw->data + off, ptr, size);
+	return off;
+}
+
+static void cache_list_add(struct cache_writer *cw, struct cache_list *list,
+			   uint64_t offset)
+{
+	uint64_t *offsets;
+	size_t size;
+
+	if (list->nr == list->size) {
+		size = list->size ? list->size * 2 : CACHE_LIST_INIT_SIZE;
+		offsets = realloc(list->offsets, sizeof(*offsets) * size);
+		if (!offsets) {
+			cw->failed = true;
+			return;
+		}
+		list->offsets = offsets;
+		list->size = size;
+	}
+	list->offsets[list->nr++] = offset;
+}
+
+static size_t cache_ptr_hash(const void *ptr, size_t size)
+{
+	return (((uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL) >> 32) &
+		(size - 1);
+}
+
+static uint64_t cache_lookup(struct cache_writer *cw, const void *ptr)
+{
+	size_t mask = cw->ptrs_size - 1;
+	size_t i;
+
+	if (!cw->ptrs)
+		return 0;
+
+	for (i = cache_ptr_hash(ptr, cw->ptrs_size); cw->ptrs[i].ptr;
+	     i = (i + 1) & mask) {
+		if (cw->ptrs[i].ptr == ptr)
+			return cw->ptrs[i].offset;
+	}
+	return 0;
+}
+
+static void cache_remember(struct cache_writer *cw, const void *ptr,
+			   uint64_t offset)
+{
+	struct cache_ptr *ptrs;
+	size_t size;
+	size_t i, j;
+
+	if ((cw->nr_ptrs + 1) * 2 > cw->ptrs_size) {
+		size = cw->ptrs_size ? cw->ptrs_size * 2 : CACHE_PTRS_INIT_SIZE;
+		ptrs = calloc(size, sizeof(*ptrs));
+		if (!ptrs) {
+			cw->failed = true;
+			return;
+		}
+		for (i = 0; i < cw->ptrs_size; i++) {
+			if (!cw->ptrs[i].ptr)
+				continue;
+			for (j = cache_ptr_hash(cw->ptrs[i].ptr, size); ptrs[j].ptr;
+			     j = (j + 1) & (size - 1))
+				;
+			ptrs[j] = cw->ptrs[i];
+		}
+		free(cw->ptrs);
+		cw->ptrs = ptrs;
+		cw->ptrs_size = size;
+	}
+
+	for (i = cache_ptr_hash(ptr, cw->ptrs_size); cw->ptrs[i].ptr;
+	     i = (i + 1) & (cw->ptrs_size - 1))
+		;
+	cw->ptrs[i].ptr = ptr;
+	cw->ptrs[i].offset = offset;
+	cw->nr_ptrs++;
+}
+
+/*
+ * Reserve the copy of the object at @ptr. Returns its offset, or zero
+ * if @ptr is NULL or on error. @saved is set if the object was already
+ * copied, as objects may be reached through more than one pointer.
+ */
+static uint64_t cache_object(struct cache_writer *cw, const void *ptr,
+			     size_t size, bool *saved)
+{
+	uint64_t off;
+
+	*saved = true;
+	if (!ptr)
+		return 0;
+
+	off = cache_lookup(cw, ptr);
+	if (off)
+		return off;
+
+	*saved = false;
+	off = cache_reserve(cw, size, CACHE_ALIGN);
+	if (off)
+		cache_remember(cw, ptr, off);
+	return off;
+}
+
+/* Point the pointer at @slot to the object of @size at offset @target */
+static void cache_set_ptr(struct cache_writer *cw, uint64_t slot,
+			  uint64_t target, size_t size)
+{
+	uintptr_t val = target;
+
+	if (!target)
+		return;
+
+	memcpy(cw->data + slot, &val, sizeof(val));
+	cache_list_add(cw, &cw->relocs, slot);
+	cache_list_add(cw, &cw->reloc_sizes, size);
+}
+
+#define set_ptr(cw, off, type, member, target)				\
+	cache_set_ptr(cw, (off) + offsetof(type, member), target,	\
+		      sizeof(*((type *)0)->member))
+
+static uint64_t save_string(struct cache_writer *cw, const char *str)
+{
+	uint64_t off;
+	size_t len;
+
+	if (!str)
+		return 0;
+
+	off = cache_lookup(cw, str);
+	if (off)
+		return off;
+
+	len = strlen(str) + 1;
+	off = cache_copy(cw, str, len, 1);
+	if (off)
+		cache_remember(cw, str, off);
+	return off;
+}
+
+/* The slot keeps the offset of the name to find the function by */
+static void cache_set_func(struct cache_writer *cw, uint64_t slot,
+			   struct tep_function_handler *func)
+{
+	uintptr_t val;
+
+	if (!func)
+		return;
+
+	val = save_string(cw, func_handler_name(func));
+	if (!val)
+		return;
+
+	memcpy(cw->data + slot, &val, sizeof(val));
+	cache_list_add(cw, &cw->fixups, slot);
+}
+
+static uint64_t save_event(struct cache_writer *cw, struct tep_event *event);
+static uint64_t save_arg(struct cache_writer *cw, struct tep_print_arg *arg);
+
+static uint64_t save_field(struct cache_writer *cw,
+			   struct tep_format_field *field)
+{
+	struct tep_format_field *copy;
+	uint64_t off;
+	bool saved;
+
+	off = cache_object(cw, field, sizeof(*field), &saved);
+	if (!off || saved)
+		return off;
+
+	copy = (struct tep_format_field *)(cw->data + off);
+	copy->offset = field->offset;
+	copy->size = field->size;
+	copy->arraylen = field->arraylen;
+	copy->elementsize = field->elementsize;
+	copy->flags = field->flags;
+
+	set_ptr(cw, off, struct tep_format_field, type,
+		save_string(cw, field->type));
+	set_ptr(cw, off, struct tep_format_field, name,
+		save_string(cw, field->name));
+	set_ptr(cw, off, struct tep_format_field, alias,
+		save_string(cw, field->alias));
+	set_ptr(cw, off, struct tep_format_field, event,
+		save_event(cw, field->event));
+	set_ptr(cw, off, struct tep_format_field, next,
+		save_field(cw, field->next));
+
+	return off;
+}
+
+static uint64_t save_flag_sym(struct cache_writer *cw,
+			      struct tep_print_flag_sym *fsym)
+{
+	uint64_t off;
+	bool saved;
+
+	off = cache_object(cw, fsym, sizeof(*fsym), &saved);
+	if (!off || saved)
+		return off;
+
+	set_ptr(cw, off, struct tep_print_flag_sym, value,
+		save_string(cw, fsym->value));
+	set_ptr(cw, off, struct tep_print_flag_sym, str,
+		save_string(cw, fsym->str));
+	set_ptr(cw, off, struct tep_print_flag_sym, next,
+		save_flag_sym(cw, fsym->next));
+
+	return off;
+}
+
+static uint64_t save_arg(struct cache_writer *cw, struct tep_print_arg *arg)
+{
+	struct tep_print_arg *copy;
+	uint64_t off;
+	bool saved;
+
+	off = cache_object(cw, arg, sizeof(*arg), &saved);
+	if (!off || saved)
+		return off;
+
+	copy = (struct tep_print_arg *)(cw->data + off);
+	copy->type = arg->type;
+
+	switch (arg->type) {
+	case TEP_PRINT_ATOM:
+		set_ptr(cw, off, struct tep_print_arg, atom.atom,
+			save_string(cw, arg->atom.atom));
+		break;
+	case TEP_PRINT_FIELD:
+		set_ptr(cw, off, struct tep_print_arg, field.name,
+			save_string(cw, arg->field.name));
+		set_ptr(cw, off, struct tep_print_arg, field.field,
+			save_field(cw, arg->field.field));
+		break;
+	case TEP_PRINT_FLAGS:
+		set_ptr(cw, off, struct tep_print_arg, flags.field,
+			save_arg(cw, arg->flags.field));
+		set_ptr(cw, off, struct tep_print_arg, flags.delim,
+			save_string(cw, arg->flags.delim));
+		set_ptr(cw, off, struct tep_print_arg, flags.flags,
+			save_flag_sym(cw, arg->flags.flags));
+		break;
+	case TEP_PRINT_SYMBOL:
+		set_ptr(cw, off, struct tep_print_arg, symbol.field,
+			save_arg(cw, arg->symbol.field));
+		set_ptr(cw, off, struct tep_print_arg, symbol.symbols,
+			save_flag_sym(cw, arg->symbol.symbols));
+		break;
+	case TEP_PRINT_HEX:
+	case TEP_PRINT_HEX_STR:
+		set_ptr(cw, off, struct tep_print_arg, hex.field,
+			save_arg(cw, arg->hex.field));
+		set_ptr(cw, off, struct tep_print_arg, hex.size,
+			save_arg(cw, arg->hex.size));
+		break;
+	case TEP_PRINT_INT_ARRAY:
+		set_ptr(cw, off, struct tep_print_arg, int_array.field,
+			save_arg(cw, arg->int_array.field));
+		set_ptr(cw, off, struct tep_print_arg, int_array.count,
+			save_arg(cw, arg->int_array.count));
+		set_ptr(cw, off, struct tep_print_arg, int_array.el_size,
+			save_arg(cw, arg->int_array.el_size));
+		break;
+	case TEP_PRINT_TYPE:
+		set_ptr(cw, off, struct tep_print_arg, typecast.type,
+			save_string(cw, arg->typecast.type));
+		set_ptr(cw, off, struct tep_print_arg, typecast.item,
+			save_arg(cw, arg->typecast.item));
+		break;
+	case TEP_PRINT_STRING:
+	case TEP_PRINT_BSTRING:
+		copy->string.offset = arg->string.offset;
+		set_ptr(cw, off, struct tep_print_arg, string.string,
+			save_string(cw, arg->string.string));
+		set_ptr(cw, off, struct tep_print_arg, string.field,
+			save_field(cw, arg->string.field));
+		break;
+	case TEP_PRINT_BITMASK:
+	case TEP_PRINT_CPUMASK:
+		copy->bitmask.offset = arg->bitmask.offset;
+		set_ptr(cw, off, struct tep_print_arg, bitmask.bitmask,
+			save_string(cw, arg->bitmask.bitmask));
+		set_ptr(cw, off, struct tep_print_arg, bitmask.field,
+			save_field(cw, arg->bitmask.field));
+		break;
+	case TEP_PRINT_DYNAMIC_ARRAY:
+	case TEP_PRINT_DYNAMIC_ARRAY_LEN:
+		set_ptr(cw, off, struct tep_print_arg, dynarray.field,
+			save_field(cw, arg->dynarray.field));
+		set_ptr(cw, off, struct tep_print_arg, dynarray.index,
+			save_arg(cw, arg->dynarray.index));
+		break;
+	case TEP_PRINT_OP:
+		copy->op.prio = arg->op.prio;
+		set_ptr(cw, off, struct tep_print_arg, op.op,
+			save_string(cw, arg->op.op));
+		set_ptr(cw, off, struct tep_print_arg, op.left,
+			save_arg(cw, arg->op.left));
+		set_ptr(cw, off, struct tep_print_arg, op.right,
+			save_arg(cw, arg->op.right));
+		break;
+	case TEP_PRINT_FUNC:
+		cache_set_func(cw, off + offsetof(struct tep_print_arg, func.func),
+			       arg->func.func);
+		set_ptr(cw, off, struct tep_print_arg, func.args,
+			save_arg(cw, arg->func.args));
+		break;
+	case TEP_PRINT_NULL:
+	default:
+		break;
+	}
+
+	set_ptr(cw, off, struct tep_print_arg, next, save_arg(cw, arg->next));
+
+	return off;
+}
+
+static uint64_t save_print_parse(struct cache_writer *cw,
+				 struct tep_print_parse *parse)
+{
+	struct tep_print_parse *copy;
+	uint64_t off;
+	bool saved;
+
+	off = cache_object(cw, parse, sizeof(*parse), &saved);
+	if (!off || saved)
+		return off;
+
+	copy = (struct tep_print_parse *)(cw->data + off);
+	copy->ls = parse->ls;
+	copy->type = parse->type;
+
+	set_ptr(cw, off, struct tep_print_parse, format,
+		save_string(cw, parse->format));
+	set_ptr(cw, off, struct tep_print_parse, arg,
+		save_arg(cw, parse->arg));
+	set_ptr(cw, off, struct tep_print_parse, len_as_arg,
+		save_arg(cw, parse->len_as_arg));
+	set_ptr(cw, off, struct tep_print_parse, next,
+		save_print_parse(cw, parse->next));
+
+	return off;
+}
+
+/* The handler, context and handle are set up when loading */
+static uint64_t save_event(struct cache_writer *cw, struct tep_event *event)
+{
+	struct tep_event *copy;
+	uint64_t off;
+	bool saved;
+
+	/* The file keeps print formats parsed */
+	if (event)
+		parse_event_print(event);
+
+	off = cache_object(cw, event, sizeof(*event), &saved);
+	if (!off || saved)
+		return off;
+
+	copy = (struct tep_event *)(cw->data + off);
+	copy->id = event->id;
+	copy->flags = event->flags;
+	copy->format.nr_common = event->format.nr_common;
+	copy->format.nr_fields = event->format.nr_fields;
+
+	set_ptr(cw, off, struct tep_event, name,
+		save_string(cw, event->name));
+	set_ptr(cw, off, struct tep_event, system,
+		save_string(cw, event->system));
+	set_ptr(cw, off, struct tep_event, format.common_fields,
+		save_field(cw, event->format.common_fields));
+	set_ptr(cw, off, struct tep_event, format.fields,
+		save_field(cw, event->format.fields));
+	set_ptr(cw, off, struct tep_event, print_fmt.format,
+		save_string(cw, event->print_fmt.format));
+	set_ptr(cw, off, struct tep_event, print_fmt.args,
+		save_arg(cw, event->print_fmt.args));
+	set_ptr(cw, off, struct tep_event, print_fmt.print_cache,
+		save_print_parse(cw, event->print_fmt.print_cache));
+
+	return off;
+}
+
+static void set_section(struct cache_writer *cw, int id,
+			uint64_t offset, uint64_t size)
+{
+	struct cache_header *header = (struct cache_header *)cw->data;
+
+	header->sections[id].offset = offset;
+	header->sections[id].size = size;
+}
+
+/* An array of pointers to the events, sorted by ID */
+static void save_events(struct cache_writer *cw, struct tep_handle *tep)
+{
+	uint64_t size = sizeof(void *) * tep->nr_events;
+	uint64_t off;
+	int i;
+
+	off = cache_reserve(cw, size, CACHE_ALIGN);
+	if (!off)
+		return;
+
+	for (i = 0; i < tep->nr_events; i++)
+		cache_set_ptr(cw, off + sizeof(void *) * i,
+			      save_event(cw, tep->events[i]),
+			      sizeof(struct tep_event));
+
+	set_section(cw, CACHE_EVENTS, off, size);
+}
+
+static void save_cmdlines(struct cache_writer *cw, struct tep_handle *tep)
+{
+	uint64_t size = sizeof(struct tep_cmdline) * tep->cmdline_count;
+	struct tep_cmdline *cmdline;
+	uint64_t off;
+	int i;
+
+	off = cache_reserve(cw, size, CACHE_ALIGN);
+	if (!off)
+		return;
+
+	for (i = 0; i < tep->cmdline_count; i++) {
+		cmdline = (struct tep_cmdline *)(cw->data + off) + i;
+		cmdline->pid = tep->cmdlines[i].pid;
+		set_ptr(cw, off + sizeof(*cmdline) * i, struct tep_cmdline,
+			comm, save_string(cw, tep->cmdlines[i].comm));
+	}
+
+	set_section(cw, CACHE_CMDLINES, off, size);
+}
+
+static void save_printk(struct cache_writer *cw, struct tep_handle *tep)
+{
+	uint64_t size = sizeof(struct printk_map) * tep->printk_nr;
+	struct printk_map *printk;
+	uint64_t off;
+	unsigned int i;
+
+	off = cache_reserve(cw, size, CACHE_ALIGN);
+	if (!off)
+		return;
+
+	for (i = 0; i < tep->printk_nr; i++) {
+		printk = (struct printk_map *)(cw->data + off) + i;
+		printk->addr = tep->printk_map[i].addr;
+		set_ptr(cw, off + sizeof(*printk) * i, struct printk_map,
+			printk, save_string(cw, tep->printk_map[i].printk));
+	}
+
+	set_section(cw, CACHE_PRINTK, off, size);
+}
+
+static void save_array(struct cache_writer *cw, int id, const void *ptr,
+		       size_t size, size_t align)
+{
+	uint64_t off;
+
+	off = cache_copy(cw, ptr, size, align);
+	if (off)
+		set_section(cw, id, off, size);
+}
+
+/* The function table is saved as is, it has no pointers */
+static void save_funcs(struct cache_writer *cw, struct tep_handle *tep)
+{
+	struct func_table *table = tep->func_table;
+	size_t strs_size = 1;
+	size_t end;
+	unsigned int i;
+
+	if (!table || !table->nr)
+		return;
+
+	for (i = 0; i < table->nr; i++) {
+		end = table->name_offs[i] +
+			strlen(table->strs + table->name_offs[i]) + 1;
+		if (end > strs_size)
+			strs_size = end;
+		end = table->mod_offs[i] +
+			strlen(table->strs + table->mod_offs[i]) + 1;
+		if (end > strs_size)
+			strs_size = end;
+	}
+
+	save_array(cw, CACHE_FUNC_ADDRS, table->addrs,
+		   sizeof(*table->addrs) * table->nr, CACHE_LINE);
+	save_array(cw, CACHE_FUNC_NAMES, table->name_offs,
+		   sizeof(*table->name_offs) * table->nr, CACHE_ALIGN);
+	save_array(cw, CACHE_FUNC_MODS, table->mod_offs,
+		   sizeof(*table->mod_offs) * table->nr, CACHE_ALIGN);
+	save_array(cw, CACHE_FUNC_STRS, table->strs, strs_size, CACHE_ALIGN);
+	save_array(cw, CACHE_FUNC_INDEX, table->index,
+		   sizeof(*table->index) * (table->nr_blocks + 1), CACHE_ALIGN);
+	save_array(cw, CACHE_FUNC_INDEX_BLK, table->index_blk,
+		   sizeof(*table->index_blk) * (table->nr_blocks + 1),
+		   CACHE_ALIGN);
+
+	((struct cache_header *)cw->data)->func_blocks = table->nr_blocks;
+}
+
+static void save_header(struct cache_writer *cw, struct tep_handle *tep)
+{
+	struct cache_header *header = (struct cache_header *)cw->data;
+
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_VERSION;
+	header->abi = cache_abi();
+	header->size = cw->len;
+	header->header_page_ts_offset = tep->header_page_ts_offset;
+	header->header_page_ts_size = tep->header_page_ts_size;
+	header->header_page_size_offset = tep->header_page_size_offset;
+	header->header_page_size_size = tep->header_page_size_size;
+	header->header_page_data_offset = tep->header_page_data_offset;
+	header->header_page_data_size = tep->header_page_data_size;
+	header->header_page_overwrite = tep->header_page_overwrite;
+	header->file_bigendian = tep->file_bigendian;
+	header->old_format = tep->old_format;
+	header->cpus = tep->cpus;
+	header->long_size = tep->long_size;
+	header->page_size = tep->page_size;
+
+	pthread_mutex_lock(&tep->lock);
+	header->digest = tep->input_digest;
+	pthread_mutex_unlock(&tep->lock);
+
+	header->checksum = cache_checksum(cw->data, cw->len);
+}
+
+/*
+ * Write to a new file that replaces @file at once, as the old one may
+ * be mapped by others.
+ */
+static int cache_write(const char *file, const char *data, size_t len)
+{
+	char *tmp;
+	ssize_t r;
+	int err;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return -1;
+
+	/* The file may hold kernel addresses, it is only for the user */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+
+	while (len) {
+		r = write(fd, data, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		data += r;
+		len -= r;
+	}
+
+	err = close(fd);
+	fd = -1;
+	if (err < 0 || rename(tmp, file) < 0)
+		goto fail;
+
+	free(tmp);
+	return 0;
+ fail:
+	err = errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+/**
+ * tep_save_cache - save the parsed events and tables of a handle
+ * @tep: a handle to the trace event parser context
+ * @file: the file to write
+ *
+ * Writes the events, the header page information, and the comm,
+ * function and printk tables of @tep to @file, which tep_load_cache()
+ * can load into a new handle much faster than parsing the event
+ * formats, kallsyms and printk formats again. The file replaces @file
+ * at once, and is only readable by the user.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tep_save_cache(struct tep_handle *tep, const char *file)
+{
+	struct cache_writer cw;
+	int ret = -1;
+
+	if (!tep || !file) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__atomic_load_n(&tep->nr_pipelines, __ATOMIC_ACQUIRE)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (init_lookup_tables(tep))
+		return -1;
+
+	memset(&cw, 0, sizeof(cw));
+
+	/* No object is at offset zero, it stays free for NULL pointers */
+	cache_reserve(&cw, sizeof(struct cache_header), CACHE_ALIGN);
+	if (cw.failed)
+		goto out;
+
+	save_events(&cw, tep);
+	save_cmdlines(&cw, tep);
+	save_printk(&cw, tep);
+	save_funcs(&cw, tep);
+	/* The tables of the loader go last, no pointer is in them */
+	save_array(&cw, CACHE_FUNC_FIXUPS, cw.fixups.offsets,
+		   sizeof(*cw.fixups.offsets) * cw.fixups.nr, CACHE_ALIGN);
+	save_array(&cw, CACHE_RELOCS, cw.relocs.offsets,
+		   sizeof(*cw.relocs.offsets) * cw.relocs.nr, CACHE_ALIGN);
+	save_array(&cw, CACHE_RELOC_SIZES, cw.reloc_sizes.offsets,
+		   sizeof(*cw.reloc_sizes.offsets) * cw.reloc_sizes.nr,
+		   CACHE_ALIGN);
+	if (cw.failed)
+		goto out;
+
+	save_header(&cw, tep);
+	ret = cache_write(file, cw.data, cw.len);
+ out:
+	if (cw.failed)
+		errno = ENOMEM;
+	free(cw.relocs.offsets);
+	free(cw.reloc_sizes.offsets);
+	free(cw.fixups.offsets);
+	free(cw.ptrs);
+	free(cw.data);
+	return ret;
+}
+
+/* Whether the header was written by this build of the library */
+static bool cache_header_ok(const struct cache_header *header)
+{
+	return !memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) &&
+		header->version == CACHE_VERSION && header->abi == cache_abi();
+}
+
+static int cache_check(const char *map, size_t size)
+{
+	const struct cache_header *header = (const struct cache_header *)map;
+	const struct cache_section *sect;
+	uint64_t tables;
+	int i;
+
+	if (size < sizeof(*header) || !cache_header_ok(header) ||
+	    header->size != size || header->checksum != cache_checksum(map, size))
+		return -1;
+
+	for (i = 0; i < CACHE_NR_SECTIONS; i++) {
+		sect = &header->sections[i];
+		if (sect->offset > size || sect->size > size - sect->offset ||
+		    sect->offset % CACHE_ALIGN)
+			return -1;
+	}
+
+	/* The pointers are all before the tables, see cache_slot_ok() */
+	tables = header->sections[CACHE_FUNC_FIXUPS].offset;
+	if (tables < sizeof(*header) ||
+	    header->sections[CACHE_RELOCS].offset < tables ||
+	    header->sections[CACHE_RELOC_SIZES].offset < tables ||
+	    header->sections[CACHE_RELOCS].size !=
+	    header->sections[CACHE_RELOC_SIZES].size)
+		return -1;
+
+	return 0;
+}
+
+static const void *cache_section(const char *map, int id, size_t *size)
+{
+	const struct cache_header *header = (const struct cache_header *)map;
+
+	*size = header->sections[id].size;
+	return map + header->sections[id].offset;
+}
+
+/*
+ * A pointer must be past the header and before the tables of the
+ * loader, so that relocating it cannot change them.
+ */
+static bool cache_slot_ok(const char *map, uint64_t slot)
+{
+	const struct cache_header *header = (const struct cache_header *)map;
+	uint64_t tables = header->sections[CACHE_FUNC_FIXUPS].offset;
+
+	return !(slot % sizeof(void *)) && slot >= sizeof(*header) &&
+		slot <= tables - sizeof(void *);
+}
+
+/*
+ * What a pointer points to must be past the header and inside the file.
+ * A string must end inside the file, anything else must fit in it.
+ */
+static bool cache_target_ok(const char *map, size_t size, uint64_t off,
+			    uint64_t obj_size)
+{
+	if (off < sizeof(struct cache_header) || off >= size)
+		return false;
+	if (obj_size == CACHE_STRING)
+		return memchr(map + off, '\0', size - off) != NULL;
+	return !(off % CACHE_ALIGN) && obj_size <= size - off;
+}
+
+/* Like cache_target_ok() for a pointer that is relocated already */
+static bool cache_ptr_ok(const char *map, size_t size, const void *ptr,
+			 uint64_t obj_size)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+
+	return addr >= (uintptr_t)map &&
+		cache_target_ok(map, size, addr - (uintptr_t)map, obj_size);
+}
+
+/* Turn the offsets of the pointers into addresses in the mapping */
+static int cache_relocate(char *map, size_t size)
+{
+	const uint64_t *relocs;
+	const uint64_t *sizes;
+	uintptr_t val;
+	size_t nr;
+	size_t i;
+
+	/* Both have the same size, see cache_check() */
+	sizes = cache_section(map, CACHE_RELOC_SIZES, &nr);
+	relocs = cache_section(map, CACHE_RELOCS, &nr);
+	nr /= sizeof(*relocs);
+
+	for (i = 0; i < nr; i++) {
+		if (!cache_slot_ok(map, relocs[i]))
+			return -1;
+		memcpy(&val, map + relocs[i], sizeof(val));
+		val += (uintptr_t)map;
+		memcpy(map + relocs[i], &val, sizeof(val));
+	}
+
+	/*
+	 * The targets are checked once all pointers are written, as in a
+	 * damaged file a pointer may overwrite the end of a string.
+	 */
+	for (i = 0; i < nr; i++) {
+		memcpy(&val, map + relocs[i], sizeof(val));
+		if (!cache_ptr_ok(map, size, (const void *)val, sizes[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Look up the print functions that the arguments call by name */
+static int cache_fixup_funcs(struct tep_handle *tep, char *map, size_t size)
+{
+	struct tep_function_handler *func;
+	const uint64_t *fixups;
+	const char *name;
+	uintptr_t val;
+	size_t nr;
+	size_t i;
+
+	fixups = cache_section(map, CACHE_FUNC_FIXUPS, &nr);
+	nr /= sizeof(*fixups);
+
+	for (i = 0; i < nr; i++) {
+		if (!cache_slot_ok(map, fixups[i])) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(&val, map + fixups[i], sizeof(val));
+		if (!cache_target_ok(map, size, val, CACHE_STRING)) {
+			errno = EINVAL;
+			return -1;
+		}
+		name = map + val;
+
+		func = find_func_handler(tep, name);
+		if (!func) {
+			tep_warning("print function %s is not registered", name);
+			errno = ENOENT;
+			return -1;
+		}
+		memcpy(map + fixups[i], &func, sizeof(func));
+	}
+
+	return 0;
+}
+
+static int intern_fields(struct tep_handle *tep, struct tep_format_field *field)
+{
+	const char *name;
+	const char *type;
+
+	for (; field; field = field->next) {
+		name = strtab_intern(&tep->strings, field->name);
+		type = strtab_intern(&tep->strings, field->type);
+		if (!name || !type)
+			return -1;
+		if (field->alias == field->name)
+			field->alias = (char *)name;
+		field->name = (char *)name;
+		field->type = (char *)type;
+	}
+	return 0;
+}
+
+/* Share the strings of the events like tep_parse_event() does */
+static int intern_events(struct tep_handle *tep, struct tep_event **events,
+			 int nr_events)
+{
+	struct tep_event *event;
+	const char *system;
+	int ret = -1;
+	int i;
+
+	pthread_mutex_lock(&tep->lock);
+	for (i = 0; i < nr_events; i++) {
+		event = events[i];
+		if (event->system) {
+			system = strtab_intern(&tep->strings, event->system);
+			if (!system)
+				goto out;
+			event->system = (char *)system;
+		}
+		if (intern_fields(tep, event->format.common_fields) ||
+		    intern_fields(tep, event->format.fields))
+			goto out;
+	}
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&tep->lock);
+	return ret;
+}
+
+static struct tep_cmdline *load_cmdlines(const char *map, size_t map_size,
+					  int *count)
+{
+	const struct tep_cmdline *cached;
+	struct tep_cmdline *cmdlines;
+	size_t size;
+	int nr;
+	int i;
+
+	cached = cache_section(map, CACHE_CMDLINES, &size);
+	nr = size / sizeof(*cached);
+
+	cmdlines = calloc(nr ? nr : 1, sizeof(*cmdlines));
+	if (!cmdlines)
+		return NULL;
+
+	/* The comms can be overridden, they are not kept in the mapping */
+	for (i = 0; i < nr; i++) {
+		if (!cache_ptr_ok(map, map_size, cached[i].comm, CACHE_STRING)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		cmdlines[i].pid = cached[i].pid;
+		cmdlines[i].comm = strdup(cached[i].comm);
+		if (!cmdlines[i].comm)
+			goto fail;
+	}
+
+	*count = nr;
+	return cmdlines;
+ fail:
+	while (i--)
+		free(cmdlines[i].comm);
+	free(cmdlines);
+	return NULL;
+}
+
+static struct func_table *load_funcs(const char *map)
+{
+	const struct cache_header *header = (const struct cache_header *)map;
+	struct func_table *table;
+	size_t strs_size;
+	size_t size;
+	size_t nr;
+	size_t i;
+
+	table = calloc(1, sizeof(*table));
+	if (!table)
+		return NULL;
+
+	table->addrs = (unsigned long long *)cache_section(map, CACHE_FUNC_ADDRS, &size);
+	nr = size / sizeof(*table->addrs);
+	table->name_offs = (unsigned int *)cache_section(map, CACHE_FUNC_NAMES, &size);
+	if (size != nr * sizeof(*table->name_offs))
+		goto fail;
+	table->mod_offs = (unsigned int *)cache_section(map, CACHE_FUNC_MODS, &size);
+	if (size != nr * sizeof(*table->mod_offs))
+		goto fail;
+	table->strs = (char *)cache_section(map, CACHE_FUNC_STRS, &strs_size);
+	if (!strs_size || table->strs[strs_size - 1])
+		goto fail;
+	table->index = (unsigned long long *)cache_section(map, CACHE_FUNC_INDEX, &size);
+	if (header->func_blocks != (nr + FUNC_BLOCK - 1) / FUNC_BLOCK ||
+	    size != (header->func_blocks + 1ULL) * sizeof(*table->index))
+		goto fail;
+	table->index_blk = (unsigned int *)cache_section(map, CACHE_FUNC_INDEX_BLK, &size);
+	if (size != (header->func_blocks + 1ULL) * sizeof(*table->index_blk))
+		goto fail;
+
+	/* The names end inside the string blob, as it ends with '\0' */
+	for (i = 0; i < nr; i++) {
+		if (table->name_offs[i] >= strs_size ||
+		    table->mod_offs[i] >= strs_size)
+			goto fail;
+	}
+	for (i = 1; i <= header->func_blocks; i++) {
+		if (table->index_blk[i] >= header->func_blocks)
+			goto fail;
+	}
+
+	table->nr = nr;
+	table->nr_blocks = header->func_blocks;
+	table->mapped = true;
+
+	return table;
+ fail:
+	free(table);
+	errno = EINVAL;
+	return NULL;
+}
+
+/**
+ * tep_load_cache - load the events and tables saved by tep_save_cache()
+ * @tep: a handle to the trace event parser context
+ * @file: the file written by tep_save_cache()
+ *
+ * Maps @file and uses the events and tables in it for @tep, which must
+ * not have any events, functions, printk formats or comms yet. The
+ * events stay in the private mapping of the file until @tep is freed.
+ * The print functions that the events call are looked up by name, so
+ * the plugins that register them must be loaded before the file is.
+ *
+ * The file is only loaded by a build of the library with the same
+ * layout of the event structures as the one that wrote it, and if it is
+ * not damaged. Otherwise this fails, and the event formats should be
+ * parsed again. A file crafted to pass these checks is not detected, it
+ * must come from a trusted source. It does not tell whether the file was made
+ * for the running kernel, tep_get_cache_digest() is for that.
+ *
+ * Returns 0 on success, or -1 on error with errno set. EINVAL means the
+ * file was not written by this build of the library or is damaged, and
+ * ENOENT that a print function that an event calls is not registered.
+ */
+int tep_load_cache(struct tep_handle *tep, const char *file)
+{
+	const struct cache_header *header;
+	struct tep_cmdline *cmdlines = NULL;
+	struct printk_map *printk_map = NULL;
+	struct func_table *table = NULL;
+	struct tep_event **events = NULL;
+	int nr_cmdlines = 0;
+	int nr_events;
+	unsigned int nr_printk;
+	const void *sect;
+	struct stat st;
+	size_t map_size;
+	size_t size;
+	char *map;
+	int err;
+	int fd;
+	int i;
+
+	if (!tep || !file) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tep->frozen_id) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (tep->nr_events || tep->cache_map || tep->cmdlines || tep->cmdlist ||
+	    tep->func_table || tep->funclist || tep->printk_map ||
+	    tep->printklist) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	map_size = st.st_size;
+	if (map_size < sizeof(*header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Private and writable, the pointers are relocated in place */
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	header = (const struct cache_header *)map;
+
+	err = EINVAL;
+	if (cache_check(map, map_size))
+		goto fail;
+
+	/* Before relocating, which checks the pointers that it leaves */
+	if (cache_fixup_funcs(tep, map, map_size)) {
+		err = errno;
+		goto fail;
+	}
+
+	err = EINVAL;
+	if (cache_relocate(map, map_size))
+		goto fail;
+
+	err = ENOMEM;
+	sect = cache_section(map, CACHE_EVENTS, &size);
+	nr_events = size / sizeof(*events);
+	if (nr_events) {
+		events = malloc(size);
+		if (!events)
+			goto fail;
+		memcpy(events, sect, size);
+	}
+
+	for (i = 0; i < nr_events; i++) {
+		if (!cache_ptr_ok(map, map_size, events[i], sizeof(**events))) {
+			err = EINVAL;
+			goto fail;
+		}
+	}
+
+	if (intern_events(tep, events, nr_events))
+		goto fail;
+
+	cmdlines = load_cmdlines(map, map_size, &nr_cmdlines);
+	if (!cmdlines) {
+		err = errno;
+		goto fail;
+	}
+
+	sect = cache_section(map, CACHE_PRINTK, &size);
+	nr_printk = size / sizeof(*printk_map);
+	printk_map = malloc(size ? size : 1);
+	if (!printk_map)
+		goto fail;
+	memcpy(printk_map, sect, size);
+
+	for (i = 0; i < (int)nr_printk; i++) {
+		if (!cache_ptr_ok(map, map_size, printk_map[i].printk,
+				  CACHE_STRING)) {
+			err = EINVAL;
+			goto fail;
+		}
+	}
+
+	cache_section(map, CACHE_FUNC_ADDRS, &size);
+	if (size) {
+		table = load_funcs(map);
+		if (!table) {
+			err = errno;
+			goto fail;
+		}
+	}
+
+	tep->header_page_ts_offset = header->header_page_ts_offset;
+	tep->header_page_ts_size = header->header_page_ts_size;
+	tep->header_page_size_offset = header->header_page_size_offset;
+	tep->header_page_size_size = header->header_page_size_size;
+	tep->header_page_data_offset = header->header_page_data_offset;
+	tep->header_page_data_size = header->header_page_data_size;
+	tep->header_page_overwrite = header->header_page_overwrite;
+	tep->file_bigendian = header->file_bigendian;
+	tep->old_format = header->old_format;
+	tep->cpus = header->cpus;
+	tep->long_size = header->long_size;
+	tep->page_size = header->page_size;
+
+	tep->cmdlines = cmdlines;
+	tep->cmdline_count = nr_cmdlines;
+
+	tep->printk_map = printk_map;
+	tep->printk_nr = nr_printk;
+	tep->printk_count = nr_printk;
+
+	tep->func_table = table;
+	tep->func_count = table ? table->nr : 0;
+
+	tep->input_digest = header->digest;
+
+	tep->cache_map = map;
+	tep->cache_size = map_size;
+
+	tep->events = events;
+	tep->nr_events = nr_events;
+	for (i = 0; i < nr_events; i++) {
+		events[i]->tep = tep;
+		find_event_handle(tep, events[i]);
+	}
+
+	return 0;
+ fail:
+	if (cmdlines) {
+		for (i = 0; i < nr_cmdlines; i++)
+			free(cmdlines[i].comm);
+		free(cmdlines);
+	}
+	free(printk_map);
+	free(table);
+	free(events);
+	munmap(map, map_size);
+	errno = err;
+	return -1;
+}
+
+/* The finalizer of MurmurHash3, to spread the bits of @x */
+static uint64_t digest_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/**
+ * tep_digest_input - add an input of a handle to a digest
+ * @digest: the digest of the other inputs, or zero
+ * @type: what @buf holds
+ * @buf: the content of the input
+ * @size: the size of @buf
+ *
+ * The digest of a handle covers the header page, the event formats, and
+ * the kallsyms and printk formats that were parsed into it, and is kept
+ * in the file that tep_save_cache() writes. To tell if that file is
+ * still good for the running kernel, add the same buffers that would be
+ * given to tep_parse_header_page(), tep_parse_event() (or
+ * tep_parse_format()), tep_parse_kallsyms_buf() and
+ * tep_parse_printk_formats_buf() to a digest starting at zero, and
+ * compare it to what tep_get_cache_digest() returns. The order that
+ * they are added in does not matter.
+ *
+ * Returns @digest with @buf added to it.
+ */
+unsigned long long tep_digest_input(unsigned long long digest,
+				    enum tep_cache_input type,
+				    const char *buf, size_t size)
+{
+	uint64_t hash = digest_mix(size ^ ((uint64_t)type << 56));
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, buf + i, sizeof(word));
+		hash = digest_mix(hash ^ word);
+	}
+	if (i < size) {
+		word = 0;
+		memcpy(&word, buf + i, size - i);
+		hash = digest_mix(hash ^ word);
+	}
+
+	/* A sum, so that the order of the inputs does not matter */
+	return digest + hash;
+}
+
+/**
+ * tep_get_input_digest - get the digest of the inputs of a handle
+ * @tep: a handle to the trace event parser context
+ *
+ * Returns the digest of the header page, event formats, kallsyms and
+ * printk formats parsed into @tep, as described by tep_digest_input().
+ * For a handle that loaded a file with tep_load_cache(), the inputs of
+ * the file are included.
+ */
+unsigned long long tep_get_input_digest(struct tep_handle *tep)
+{
+	unsigned long long digest;
+
+	if (!tep)
+		return 0;
+
+	pthread_mutex_lock(&tep->lock);
+	digest = tep->input_digest;
+	pthread_mutex_unlock(&tep->lock);
+
+	return digest;
+}
+
+/**
+ * tep_get_cache_digest - get the digest of the inputs of a cache file
+ * @file: the file written by tep_save_cache()
+ * @digest: returns the digest of the inputs it was made from
+ *
+ * Reads the digest that tep_get_input_digest() returned for the handle
+ * that @file was saved from, without loading the file.
+ *
+ * Returns 0 on success, or -1 on error with errno set. EINVAL means
+ * that @file was not written by this build of the library.
+ */
+int tep_get_cache_digest(const char *file, unsigned long long *digest)
+{
+	struct cache_header header;
+	ssize_t r;
+	int err;
+	int fd;
+
+	if (!file || !digest) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	do {
+		r = pread(fd, &header, sizeof(header), 0);
+	} while (r < 0 && errno == EINTR);
+	err = errno;
+	close(fd);
+
+	if (r < 0) {
+		errno = err;
+		return -1;
+	}
+	if (r != sizeof(header) || !cache_header_ok(&header)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*digest = header.digest;
+	return 0;
+}
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Read fields of many records into arrays, one array per field, and
+ * convert many records to the byte order of the host.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "event-parse.h"
+#include "event-parse-local.h"
+
+/*
+ * The records are read in chunks. Every step over a chunk is a simple
+ * loop over an array that stays in the L1 cache, so that the compiler
+ * can vectorize the byte swapping and the conversions.
+ */
+#define COLUMN_CHUNK	256
+
+struct column_chunk {
+	/* The data of the records of the chunk, NULL if it is not the event */
+	const unsigned char	*data[COLUMN_CHUNK];
+	int			size[COLUMN_CHUNK];
+	union {
+		uint8_t		u8[COLUMN_CHUNK];
+		uint16_t	u16[COLUMN_CHUNK];
+		uint32_t	u32[COLUMN_CHUNK];
+		uint64_t	u64[COLUMN_CHUNK];
+	} raw;
+	uint64_t		val[COLUMN_CHUNK];
+	unsigned char		null[COLUMN_CHUNK];
+};
+
+static int column_size(enum tep_column_type type)
+{
+	switch (type) {
+	case TEP_COLUMN_U8:
+	case TEP_COLUMN_S8:
+		return 1;
+	case TEP_COLUMN_U16:
+	case TEP_COLUMN_S16:
+		return 2;
+	case TEP_COLUMN_U32:
+	case TEP_COLUMN_S32:
+		return 4;
+	case TEP_COLUMN_U64:
+	case TEP_COLUMN_S64:
+		return 8;
+	}
+	return 0;
+}
+
+static bool column_valid(struct tep_column *column)
+{
+	struct tep_format_field *field = column->field;
+
+	if (!column->values || !column_size(column->type))
+		return false;
+
+	/* The timestamp of the records */
+	if (!field)
+		return true;
+
+	if (field->flags & (TEP_FIELD_IS_ARRAY | TEP_FIELD_IS_DYNAMIC))
+		return false;
+
+	switch (field->size) {
+	case 1: case 2: case 4: case 8:
+		return true;
+	}
+	return false;
+}
+
+#define GATHER(bits)							\
+	do {								\
+		for (i = 0; i < n; i++) {				\
+			c->null[i] = !c->data[i] || end > c->size[i];	\
+			if (c->null[i])					\
+				c->raw.u##bits[i] = 0;			\
+			else						\
+				memcpy(&c->raw.u##bits[i],		\
+				       c->data[i] + offset, bits / 8);	\
+		}							\
+	} while (0)
+
+#define SWAP(bits)							\
+	do {								\
+		for (i = 0; i < n; i++)					\
+			c->raw.u##bits[i] =				\
+				__builtin_bswap##bits(c->raw.u##bits[i]);\
+	} while (0)
+
+#define WIDEN(bits)							\
+	do {								\
+		if (is_signed) {					\
+			for (i = 0; i < n; i++)				\
+				c->val[i] = (int64_t)(int##bits##_t)	\
+					c->raw.u##bits[i];		\
+		} else {						\
+			for (i = 0; i < n; i++)				\
+				c->val[i] = c->raw.u##bits[i];		\
+		}							\
+	} while (0)
+
+/* Read the field of the records of @c into c->val, and mark the nulls */
+static void read_chunk(struct tep_handle *tep, struct tep_format_field *field,
+		       struct column_chunk *c, int n)
+{
+	bool swap = tep->file_bigendian != tep->host_bigendian;
+	bool is_signed = field->flags & TEP_FIELD_IS_SIGNED;
+	int offset = field->offset;
+	int end = field->offset + field->size;
+	int i;
+
+	switch (field->size) {
+	case 1:
+		GATHER(8);
+		WIDEN(8);
+		break;
+	case 2:
+		GATHER(16);
+		if (swap)
+			SWAP(16);
+		WIDEN(16);
+		break;
+	case 4:
+		GATHER(32);
+		if (swap)
+			SWAP(32);
+		WIDEN(32);
+		break;
+	case 8:
+		GATHER(64);
+		if (swap)
+			SWAP(64);
+		WIDEN(64);
+		break;
+	}
+}
+
+#define STORE(type)							\
+	do {								\
+		type *values = (type *)column->values + base;		\
+		for (i = 0; i < n; i++)					\
+			values[i] = (type)c->val[i];			\
+	} while (0)
+
+static void store_chunk(struct tep_column *column, struct column_chunk *c,
+			int base, int n)
+{
+	int i;
+
+	switch (column->type) {
+	case TEP_COLUMN_U8:
+		STORE(uint8_t);
+		break;
+	case TEP_COLUMN_U16:
+		STORE(uint16_t);
+		break;
+	case TEP_COLUMN_U32:
+		STORE(uint32_t);
+		break;
+	case TEP_COLUMN_U64:
+		STORE(uint64_t);
+		break;
+	case TEP_COLUMN_S8:
+		STORE(int8_t);
+		break;
+	case TEP_COLUMN_S16:
+		STORE(int16_t);
+		break;
+	case TEP_COLUMN_S32:
+		STORE(int32_t);
+		break;
+	case TEP_COLUMN_S64:
+		STORE(int64_t);
+		break;
+	}
+
+	if (!column->nulls)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (c->null[i])
+			column->nulls[(base + i) / 8] |= 1 << ((base + i) % 8);
+		else
+			column->nulls[(base + i) / 8] &= ~(1 << ((base + i) % 8));
+	}
+}
+
+/**
+ * tep_read_columns - read fields of many records into arrays
+ * @event: the event of the records
+ * @records: the records to read
+ * @nr_records: the number of @records
+ * @columns: the fields to read, and where to store them
+ * @nr_columns: the number of @columns
+ *
+ * For each of @columns, stores the value of its field in every one of
+ * @records into its @values array, converted to its type, and sets
+ * the bit of the record in its @nulls mask, if there is one, when the
+ * record does not have the field: it is too short, or it is not a
+ * record of @event. A column without a field gets the timestamps of
+ * the records.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if one of
+ * @columns can not be read.
+ */
+int tep_read_columns(struct tep_event *event, struct tep_record **records,
+		     int nr_records, struct tep_column *columns, int nr_columns)
+{
+	struct column_chunk chunk;
+	struct tep_column *column;
+	int base, n;
+	int i, j;
+
+	if (!event || !event->tep || nr_records < 0 || nr_columns < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (j = 0; j < nr_columns; j++) {
+		if (!column_valid(&columns[j])) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (base = 0; base < nr_records; base += n) {
+		n = nr_records - base;
+		if (n > COLUMN_CHUNK)
+			n = COLUMN_CHUNK;
+
+		for (i = 0; i < n; i++) {
+			struct tep_record *record = records[base + i];
+
+			if (tep_data_type(event->tep, record) == event->id) {
+				chunk.data[i] = record->data;
+				chunk.size[i] = record->size;
+			} else {
+				chunk.data[i] = NULL;
+			}
+		}
+
+		for (j = 0; j < nr_columns; j++) {
+			column = &columns[j];
+			if (column->field) {
+				read_chunk(event->tep, column->field, &chunk, n);
+			} else {
+				for (i = 0; i < n; i++) {
+					chunk.val[i] = records[base + i]->ts;
+					chunk.null[i] = 0;
+				}
+			}
+			store_chunk(column, &chunk, base, n);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The numbers of the fixed part of the records of an event, as runs of
+ * numbers of the same size that follow each other.
+ */
+struct swap_run {
+	unsigned int		offset;
+	unsigned int		size;
+	unsigned int		count;
+};
+
+struct swap_plan {
+	struct tep_event	*event;
+	struct swap_run		*runs;
+	int			nr_runs;
+};
+
+/* Events whose plans are kept by one call */
+#define SWAP_PLANS	64
+
+static int add_swap_run(struct swap_plan *plan, unsigned int offset,
+			unsigned int size, unsigned int count)
+{
+	struct swap_run *run;
+
+	if (size < 2 || !count)
+		return 0;
+
+	if (plan->nr_runs) {
+		run = &plan->runs[plan->nr_runs - 1];
+		if (run->size == size &&
+		    run->offset + run->size * run->count == offset) {
+			run->count += count;
+			return 0;
+		}
+	}
+
+	run = realloc(plan->runs, sizeof(*run) * (plan->nr_runs + 1));
+	if (!run)
+		return -1;
+	plan->runs = run;
+	run += plan->nr_runs++;
+	run->offset = offset;
+	run->size = size;
+	run->count = count;
+	return 0;
+}
+
+static int add_swap_fields(struct swap_plan *plan,
+			   struct tep_format_field *field)
+{
+	unsigned int size;
+	unsigned int count;
+
+	for (; field; field = field->next) {
+		/* The location of the data, not the data */
+		if (field->flags & TEP_FIELD_IS_DYNAMIC) {
+			size = 4;
+			count = 1;
+		} else if (field->flags & TEP_FIELD_IS_STRING) {
+			continue;
+		} else if (field->flags & TEP_FIELD_IS_ARRAY) {
+			size = field->elementsize;
+			count = field->arraylen;
+		} else {
+			size = field->size;
+			count = 1;
+		}
+
+		switch (size) {
+		case 2: case 4: case 8:
+			break;
+		default:
+			continue;
+		}
+		if (add_swap_run(plan, field->offset, size, count) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static struct swap_plan *get_swap_plan(struct swap_plan *plans,
+				       struct swap_plan *tmp,
+				       struct tep_event *event)
+{
+	struct swap_plan *plan = NULL;
+	int i;
+
+	for (i = 0; i < SWAP_PLANS; i++) {
+		plan = &plans[(event->id + i) % SWAP_PLANS];
+		if (plan->event == event)
+			return plan;
+		if (!plan->event)
+			break;
+	}
+
+	/* Too many events, build a plan for this record only */
+	if (plan->event) {
+		free(tmp->runs);
+		plan = tmp;
+	}
+
+	memset(plan, 0, sizeof(*plan));
+	if (add_swap_fields(plan, event->format.common_fields) < 0 ||
+	    add_swap_fields(plan, event->format.fields) < 0) {
+		free(plan->runs);
+		plan->runs = NULL;
+		return NULL;
+	}
+	plan->event = event;
+	return plan;
+}
+
+#define SWAP_RUN(bits)							\
+	do {								\
+		uint##bits##_t v;					\
+									\
+		for (i = 0; i < count; i++, p += bits / 8) {		\
+			memcpy(&v, p, bits / 8);			\
+			v = __builtin_bswap##bits(v);			\
+			memcpy(p, &v, bits / 8);			\
+		}							\
+	} while (0)
+
+static void swap_record(struct swap_plan *plan, struct tep_record *record)
+{
+	struct swap_run *run;
+	unsigned int count;
+	unsigned char *p;
+	unsigned int i;
+	int r;
+
+	for (r = 0; r < plan->nr_runs; r++) {
+		run = &plan->runs[r];
+		count = run->count;
+		/* Leave what is not in the record as it is */
+		if (run->offset + run->size * count > record->size) {
+			if (run->offset >= record->size)
+				break;
+			count = (record->size - run->offset) / run->size;
+		}
+
+		p = (unsigned char *)record->data + run->offset;
+		switch (run->size) {
+		case 2:
+			SWAP_RUN(16);
+			break;
+		case 4:
+			SWAP_RUN(32);
+			break;
+		case 8:
+			SWAP_RUN(64);
+			break;
+		}
+	}
+}
+
+/**
+ * tep_swap_records - convert records to the byte order of the host
+ * @tep: a handle to the trace event parser context
+ * @records: the records to convert
+ * @nr_records: the number of @records
+ *
+ * Byte swaps the numbers of the fixed part of each of @records, which
+ * is in the byte order of the trace data of @tep, according to the
+ * fields of its event. The locations of dynamic fields are converted,
+ * but the data they point to is not. Records of events that @tep does
+ * not know are left as they are.
+ *
+ * The records are then in the byte order of the host, and have to be
+ * read with a handle whose file endianness is set to the one of the
+ * host with tep_set_file_bigendian().
+ *
+ * Returns the number of records converted, which are all of them if
+ * the trace data is already in the byte order of the host, or -1 on
+ * error.
+ */
+int tep_swap_records(struct tep_handle *tep, struct tep_record **records,
+		     int nr_records)
+{
+	struct swap_plan plans[SWAP_PLANS] = { { 0 } };
+	struct swap_plan tmp = { 0 };
+	struct swap_plan *plan;
+	struct tep_event *event;
+	int converted = 0;
+	int ret = -1;
+	int i;
+
+	if (!tep || nr_records < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tep->file_bigendian == tep->host_bigendian)
+		return nr_records;
+
+	for (i = 0; i < nr_records; i++) {
+		event = tep_find_event(tep, tep_data_type(tep, records[i]));
+		if (!event)
+			continue;
+		plan = get_swap_plan(plans, &tmp, event);
+		if (!plan)
+			goto out;
+		swap_record(plan, records[i]);
+		converted++;
+	}
+	ret = converted;
+ out:
+	for (i = 0; i < SWAP_PLANS; i++)
+		free(plans[i].runs);
+	free(tmp.runs);
+	return ret;
+}
@@ -4,6 +4,9 @@
  *
  */
 
+#include <string.h>
+#include <errno.h>
+
 #include "event-parse.h"
 #include "event-parse-local.h"
 #include "event-utils.h"
@@ -24,6 +27,17 @@ struct tep_event *tep_get_event(struct tep_handle *tep, int index)
 	return NULL;
 }
 
+/**
+ * tep_is_frozen - test if a tep handle was made read only
+ * @tep: a handle to the tep_handle
+ *
+ * Returns true if tep_freeze() was called on @tep, false otherwise.
+ */
+bool tep_is_frozen(struct tep_handle *tep)
+{
+	return tep && tep->frozen_id;
+}
+
 /**
  * tep_get_first_event - returns the first event in the events array
  * @tep: a handle to the tep_handle
@@ -64,6 +78,57 @@ int tep_get_function_count(struct tep_handle *tep)
 	return 0;
 }
 
+/* The counters of struct tep_stats, that are all unsigned long long */
+#define NR_TEP_STATS	(sizeof(struct tep_stats) / sizeof(unsigned long long))
+
+/**
+ * tep_get_stats - get the counters of what a handle did
+ * @tep: a handle to the tep_handle
+ * @stats: where to store the counters
+ *
+ * Takes a snapshot of the counters of @tep since it was allocated, or
+ * since tep_reset_stats() was called. They are only counted when the
+ * library is built with TEP_STATS, otherwise @stats is zeroed.
+ *
+ * Returns 0 on success, or -1 with errno set to ENOTSUP if the library
+ * does not count.
+ */
+int tep_get_stats(struct tep_handle *tep, struct tep_stats *stats)
+{
+#ifdef TEP_STATS
+	unsigned long long *counters = (unsigned long long *)&tep->stats;
+	unsigned long long *snapshot = (unsigned long long *)stats;
+	unsigned int i;
+
+	/* Other threads may be counting while this is read */
+	for (i = 0; i < NR_TEP_STATS; i++)
+		snapshot[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * tep_reset_stats - reset the counters of what a handle did
+ * @tep: a handle to the tep_handle
+ *
+ * Sets all the counters returned by tep_get_stats() back to zero.
+ */
+void tep_reset_stats(struct tep_handle *tep)
+{
+#ifdef TEP_STATS
+	unsigned long long *counters = (unsigned long long *)&tep->stats;
+	unsigned int i;
+
+	for (i = 0; i < NR_TEP_STATS; i++)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#endif
+}
+
 /**
  * tep_set_flag - set event parser flag
  * @tep: a handle to the tep_handle
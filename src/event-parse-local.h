@@ -7,16 +7,85 @@
 #ifndef _PARSE_EVENTS_INT_H
 #define _PARSE_EVENTS_INT_H
 
+#include <pthread.h>
+
 struct tep_cmdline;
 struct cmdline_list;
-struct func_map;
+struct func_table;
 struct func_list;
 struct event_handler;
 struct func_resolver;
+struct func_cache_entry;
 struct tep_plugins_dir;
+struct event_layout;
+struct trace_seq;
 
 #define __hidden __attribute__((visibility ("hidden")))
 
+/*
+ * A bump allocator for objects that are all freed together, like the
+ * fields, print arguments and strings that make up a parsed event.
+ */
+struct tep_arena_chunk;
+
+struct tep_arena {
+	struct tep_arena_chunk	*chunks;
+};
+
+void *arena_alloc(struct tep_arena *arena, size_t size);
+void *arena_realloc(struct tep_arena *arena, void *ptr, size_t size);
+bool arena_owns(struct tep_arena *arena, const void *ptr);
+bool arena_release(struct tep_arena *arena, void *ptr);
+void arena_free(struct tep_arena *arena);
+
+/* A table of unique strings, shared by all the events of a handle */
+struct strtab_entry;
+
+struct tep_strtab {
+	struct tep_arena	arena;
+	struct strtab_entry	**buckets;
+	unsigned int		size;
+	unsigned int		count;
+};
+
+const char *strtab_intern(struct tep_strtab *tab, const char *str);
+const char *strtab_lookup(struct tep_strtab *tab, const char *str);
+void strtab_free(struct tep_strtab *tab);
+
+/* The common fields of a record, as decoded by tep_data_common() */
+enum {
+	COMMON_TYPE,
+	COMMON_PID,
+	COMMON_PREEMPT_COUNT,
+	COMMON_FLAGS,
+	COMMON_LOCK_DEPTH,
+	COMMON_MIGRATE_DISABLE,
+	NR_COMMON_FIELDS
+};
+
+/* A size of zero means that the events do not have the field */
+struct common_field {
+	int offset;
+	int size;
+};
+
+/*
+ * Counters for tep_get_stats() and friends. Unless the library is built
+ * with TEP_STATS, they are not counted and cost nothing.
+ */
+#ifdef TEP_STATS
+#define tep_stat_add(counter, n)	\
+	__atomic_add_fetch(&(counter), n, __ATOMIC_RELAXED)
+#else
+#define tep_stat_add(counter, n)	do { } while (0)
+#endif
+#define tep_stat_inc(counter)		tep_stat_add(counter, 1)
+
+#ifdef TEP_STATS
+/* Number of trace_seq buffers grown by this thread */
+extern __thread unsigned long long trace_seq_expansions;
+#endif
+
 struct tep_handle {
 	int ref_count;
 
@@ -41,12 +110,23 @@ struct tep_handle {
 	struct cmdline_list *cmdlist;
 	int cmdline_count;
 
-	struct func_map *func_map;
+	struct func_table *func_table;
 	struct func_resolver *func_resolver;
 	struct func_list *funclist;
 	unsigned int func_count;
+	/* Strings dropped by the function table, see func_retire() */
+	char **func_retired;
+	unsigned int func_retired_nr;
+	unsigned int func_retired_alloc;
+
+	struct func_cache_entry *func_cache;
+	unsigned int func_cache_gen;
+
+	struct tep_stats stats;
 
 	struct printk_map *printk_map;
+	char *printk_strs;
+	unsigned int printk_nr;
 	struct printk_list *printklist;
 	unsigned int printk_count;
 
@@ -55,20 +135,9 @@ struct tep_handle {
 	struct tep_event **sort_events;
 	enum tep_event_sort_type last_type;
 
-	int type_offset;
-	int type_size;
-
-	int pid_offset;
-	int pid_size;
-
-	int pc_offset;
-	int pc_size;
-
-	int flags_offset;
-	int flags_size;
-
-	int ld_offset;
-	int ld_size;
+	/* Where the common fields of the records are, see tep_data_common() */
+	struct common_field common[NR_COMMON_FIELDS];
+	int common_resolved;
 
 	int test_filters;
 
@@ -84,11 +153,36 @@ struct tep_handle {
 	/* cache */
 	struct tep_event *last_event;
 
-	struct tep_plugins_dir *plugins_dir;
+	/*
+	 * Taken around the lazy lookup tables while a print pipeline
+	 * is formatting records on worker threads, and when parsed
+	 * events are added.
+	 */
+	pthread_mutex_t lock;
+	int nr_pipelines;
+
+	/* Serializes the parsing of print formats on first use */
+	pthread_mutex_t print_fmt_lock;
 
-	const char *input_buf;
-	unsigned long long input_buf_ptr;
-	unsigned long long input_buf_siz;
+	/* Non zero once tep_freeze() made the handle read only */
+	unsigned int frozen_id;
+
+	/* Field names and types and system names, protected by @lock */
+	struct tep_strtab strings;
+
+	/* Hash of the formats that events can share, protected by @lock */
+	struct event_layout **layouts;
+	unsigned int layouts_size;
+	unsigned int nr_layouts;
+
+	/* The file mapped by tep_load_cache() that the events live in */
+	void *cache_map;
+	size_t cache_size;
+
+	/* See tep_get_input_digest(), protected by @lock */
+	unsigned long long input_digest;
+
+	struct tep_plugins_dir *plugins_dir;
 };
 
 enum tep_print_parse_type {
@@ -108,10 +202,87 @@ struct tep_print_parse {
 	struct tep_print_arg		*len_as_arg;
 };
 
+struct tep_cmdline {
+	char *comm;
+	int pid;
+};
+
+struct func_map {
+	unsigned long long		addr;
+	char				*func;
+	char				*mod;
+};
+
+/*
+ * The sorted function table keeps the addresses in their own array
+ * so that a search only touches addresses. The names and modules are
+ * offsets into a single string blob (offset zero is the empty string,
+ * meaning "no module").
+ *
+ * The addresses are split into blocks of FUNC_BLOCK entries, which is
+ * one cache line worth. The first address of every block is copied
+ * into @index in Eytzinger (BFS) order, which keeps the first levels
+ * of the search within a few cache lines and lets the next levels be
+ * prefetched. The final step is a short scan within a single block.
+ */
+#define FUNC_BLOCK		8
+#define FUNC_INDEX_PREFETCH	8
+
+/*
+ * Functions registered after the table was created go into a small
+ * sorted @delta array, and unregistered functions of the table are
+ * covered by the sorted @removed address ranges. Lookups consult all
+ * three. When either of them grows past its limit, everything is
+ * merged into a new table.
+ */
+#define FUNC_DELTA_MAX		1024
+#define FUNC_REMOVED_MAX	64
+
+struct func_range {
+	unsigned long long	start;
+	unsigned long long	end;
+};
+
+struct func_table {
+	unsigned long long	*addrs;
+	unsigned int		*name_offs;
+	unsigned int		*mod_offs;
+	char			*strs;
+	unsigned int		nr;
+	unsigned int		nr_blocks;
+	unsigned long long	*index;
+	unsigned int		*index_blk;
+	struct func_map		*delta;
+	unsigned int		delta_nr;
+	unsigned int		delta_alloc;
+	struct func_range	*removed;
+	unsigned int		removed_nr;
+	unsigned int		removed_alloc;
+	/* The arrays up to @index_blk are in a mapped cache file */
+	bool			mapped;
+};
+
+struct printk_map {
+	unsigned long long		addr;
+	char				*printk;
+};
+
+/* The print format of the event is not parsed yet, see TEP_LAZY_PRINT_FMT */
+#define TEP_EVENT_FL_PRINT_PENDING	0x40000000
+
+void trace_seq_print_begin(struct trace_seq *s);
+void trace_seq_print_end(struct trace_seq *s);
+
 void free_tep_event(struct tep_event *event);
-void free_tep_format_field(struct tep_format_field *field);
+void parse_event_print(struct tep_event *event);
 void free_tep_plugin_paths(struct tep_handle *tep);
 
+int init_lookup_tables(struct tep_handle *tep);
+int find_event_handle(struct tep_handle *tep, struct tep_event *event);
+struct tep_function_handler *
+find_func_handler(struct tep_handle *tep, const char *func_name);
+const char *func_handler_name(struct tep_function_handler *func);
+
 unsigned short data2host2(struct tep_handle *tep, unsigned short data);
 unsigned int data2host4(struct tep_handle *tep, unsigned int data);
 unsigned long long data2host8(struct tep_handle *tep, unsigned long long data);
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <limits.h>
 #include <linux/time64.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 #include "event-parse.h"
@@ -28,20 +30,37 @@
 #include "event-utils.h"
 #include "trace-seq.h"
 
-static int is_flag_field;
-static int is_symbolic_field;
+/*
+ * The tokenizer state. It is kept per thread and not in the tep handle,
+ * so that several threads can parse formats into one handle at once.
+ */
+struct tep_parser {
+	const char		*input_buf;
+	unsigned long long	input_buf_ptr;
+	unsigned long long	input_buf_siz;
+	int			is_flag_field;
+	int			is_symbolic_field;
+	/* Where the parts of the event being parsed are allocated from */
+	struct tep_arena	*arena;
+	/* Parsing a schema that other handles may use */
+	bool			shared;
+	/* The print format calls functions registered with the handle */
+	bool			func_args;
+	/* The event has a handler, its format may not be parsed right */
+	bool			quiet;
+};
 
-static int show_warning = 1;
+static __thread struct tep_parser parser;
 
 #define do_warning(fmt, ...)				\
 	do {						\
-		if (show_warning)			\
+		if (!parser.quiet)			\
 			tep_warning(fmt, ##__VA_ARGS__);\
 	} while (0)
 
 #define do_warning_event(event, fmt, ...)				\
 	do {								\
-		if (!show_warning)					\
+		if (parser.quiet)					\
 			continue;					\
 									\
 		if (event)						\
@@ -61,19 +80,19 @@ static int show_warning = 1;
 __hidden void init_input_buf(struct tep_handle *tep, const char *buf,
 		unsigned long long size)
 {
-	tep->input_buf = buf;
-	tep->input_buf_siz = size;
-	tep->input_buf_ptr = 0;
+	parser.input_buf = buf;
+	parser.input_buf_siz = size;
+	parser.input_buf_ptr = 0;
 }
 
 __hidden const char *get_input_buf(struct tep_handle *tep)
 {
-	return tep->input_buf;
+	return parser.input_buf;
 }
 
 __hidden unsigned long long get_input_buf_ptr(struct tep_handle *tep)
 {
-	return tep->input_buf_ptr;
+	return parser.input_buf_ptr;
 }
 
 struct event_handler {
@@ -97,6 +116,11 @@ struct tep_function_handler {
 	tep_func_handler		func;
 	struct func_params		*params;
 	int				nr_args;
+	int				nr_str_args;
+	/* Scratch space reused by process_defined_func() */
+	unsigned long long		*args;
+	struct trace_seq		*str_args;
+	int				busy;
 };
 
 static unsigned long long
@@ -127,21 +151,91 @@ static const char *get_event_type(enum tep_event_type type)
 	return "(UNKNOWN)";
 }
 
+/*
+ * While an event format is parsed, everything that the event keeps is
+ * allocated from the arena of the event, and is freed all at once with
+ * it. Outside of that, as for the bprint arguments made at print time,
+ * these are plain calloc() and free().
+ */
+static void *parse_alloc(size_t size)
+{
+	if (parser.arena)
+		return arena_alloc(parser.arena, size);
+	return calloc(1, size);
+}
+
+static void *parse_realloc(void *ptr, size_t size)
+{
+	if (parser.arena && (!ptr || arena_owns(parser.arena, ptr)))
+		return arena_realloc(parser.arena, ptr, size);
+	return realloc(ptr, size);
+}
+
+static void parse_free(void *ptr)
+{
+	if (parser.arena && arena_release(parser.arena, ptr))
+		return;
+	free(ptr);
+}
+
+static char *parse_strndup(const char *str, size_t len)
+{
+	char *new;
+
+	new = parse_alloc(len + 1);
+	if (new)
+		memcpy(new, str, len);
+	return new;
+}
+
+static char *parse_strdup(const char *str)
+{
+	return parse_strndup(str, strlen(str));
+}
+
+static int parse_asprintf(char **strp, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -1;
+
+	*strp = parse_alloc(len + 1);
+	if (!*strp)
+		return -1;
+
+	va_start(ap, fmt);
+	vsnprintf(*strp, len + 1, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
+
 static struct tep_print_arg *alloc_arg(void)
 {
-	return calloc(1, sizeof(struct tep_print_arg));
+	return parse_alloc(sizeof(struct tep_print_arg));
 }
 
-struct tep_cmdline {
-	char *comm;
-	int pid;
-};
+#ifdef TEP_STATS
+/* Comparisons made by the current search of this thread */
+static __thread unsigned int search_probes;
+#define search_probe()		(search_probes++)
+#define search_probes_reset()	(search_probes = 0)
+#else
+#define search_probe()		do { } while (0)
+#define search_probes_reset()	do { } while (0)
+#endif
 
 static int cmdline_cmp(const void *a, const void *b)
 {
 	const struct tep_cmdline *ca = a;
 	const struct tep_cmdline *cb = b;
 
+	search_probe();
 	if (ca->pid < cb->pid)
 		return -1;
 	if (ca->pid > cb->pid)
@@ -169,6 +263,51 @@ static int cmdline_slot_cmp(const void *a, const void *b)
 	return 0;
 }
 
+/*
+ * The comm, function and printk tables are built lazily and the
+ * function cache is updated on lookup. That only matters while a
+ * print pipeline formats records on several threads, so the handle
+ * lock is only taken when one is running.
+ */
+static bool handle_lock(struct tep_handle *tep)
+{
+	/* A frozen handle has nothing left to build */
+	if (tep->frozen_id ||
+	    !__atomic_load_n(&tep->nr_pipelines, __ATOMIC_ACQUIRE))
+		return false;
+	pthread_mutex_lock(&tep->lock);
+	return true;
+}
+
+static void handle_unlock(struct tep_handle *tep, bool locked)
+{
+	if (locked)
+		pthread_mutex_unlock(&tep->lock);
+}
+
+/* Fails the calls that would modify a frozen handle */
+static bool handle_frozen(struct tep_handle *tep)
+{
+	if (!tep->frozen_id)
+		return false;
+	errno = EBUSY;
+	return true;
+}
+
+/* Fails the calls that would modify what the print pipeline workers use */
+static bool handle_in_pipeline(struct tep_handle *tep)
+{
+	if (!__atomic_load_n(&tep->nr_pipelines, __ATOMIC_ACQUIRE))
+		return false;
+	errno = EBUSY;
+	return true;
+}
+
+static bool handle_busy(struct tep_handle *tep)
+{
+	return handle_frozen(tep) || handle_in_pipeline(tep);
+}
+
 struct cmdline_list {
 	struct cmdline_list	*next;
 	char			*comm;
@@ -208,21 +347,30 @@ static const char *find_cmdline(struct tep_handle *tep, int pid)
 {
 	const struct tep_cmdline *comm;
 	struct tep_cmdline key;
+	const char *str;
+	bool locked;
 
 	if (!pid)
 		return "<idle>";
 
-	if (!tep->cmdlines && cmdline_init(tep))
+	locked = handle_lock(tep);
+	if (!tep->cmdlines && cmdline_init(tep)) {
+		handle_unlock(tep, locked);
 		return "<not enough memory for cmdlines!>";
+	}
 
 	key.pid = pid;
 
+	search_probes_reset();
 	comm = bsearch(&key, tep->cmdlines, tep->cmdline_count,
 		       sizeof(*tep->cmdlines), cmdline_cmp);
+	tep_stat_inc(tep->stats.cmdline_searches);
+	tep_stat_add(tep->stats.cmdline_probes, search_probes);
+	/* The array may move once unlocked, the string does not */
+	str = comm ? comm->comm : "<...>";
+	handle_unlock(tep, locked);
 
-	if (comm)
-		return comm->comm;
-	return "<...>";
+	return str;
 }
 
 /**
@@ -237,17 +385,22 @@ bool tep_is_pid_registered(struct tep_handle *tep, int pid)
 {
 	const struct tep_cmdline *comm;
 	struct tep_cmdline key;
+	bool locked;
 
 	if (!pid)
 		return true;
 
-	if (!tep->cmdlines && cmdline_init(tep))
+	locked = handle_lock(tep);
+	if (!tep->cmdlines && cmdline_init(tep)) {
+		handle_unlock(tep, locked);
 		return false;
+	}
 
 	key.pid = pid;
 
 	comm = bsearch(&key, tep->cmdlines, tep->cmdline_count,
 		       sizeof(*tep->cmdlines), cmdline_cmp);
+	handle_unlock(tep, locked);
 
 	if (comm)
 		return true;
@@ -343,6 +496,9 @@ static int _tep_register_comm(struct tep_handle *tep,
 {
 	struct cmdline_list *item;
 
+	if (override ? handle_busy(tep) : handle_frozen(tep))
+		return -1;
+
 	if (tep->cmdlines)
 		return add_new_comm(tep, comm, pid, override);
 
@@ -379,7 +535,13 @@ static int _tep_register_comm(struct tep_handle *tep,
  */
 int tep_register_comm(struct tep_handle *tep, const char *comm, int pid)
 {
-	return _tep_register_comm(tep, comm, pid, false);
+	bool locked = handle_lock(tep);
+	int ret;
+
+	ret = _tep_register_comm(tep, comm, pid, false);
+	handle_unlock(tep, locked);
+
+	return ret;
 }
 
 /**
@@ -394,11 +556,18 @@ int tep_register_comm(struct tep_handle *tep, const char *comm, int pid)
  */
 int tep_override_comm(struct tep_handle *tep, const char *comm, int pid)
 {
+	bool locked = handle_lock(tep);
+	int ret;
+
 	if (!tep->cmdlines && cmdline_init(tep)) {
+		handle_unlock(tep, locked);
 		errno = ENOMEM;
 		return -1;
 	}
-	return _tep_register_comm(tep, comm, pid, true);
+	ret = _tep_register_comm(tep, comm, pid, true);
+	handle_unlock(tep, locked);
+
+	return ret;
 }
 
 /**
@@ -443,254 +612,1237 @@ int tep_parse_saved_cmdlines(struct tep_handle *tep, const char *buf)
 	return ret;
 }
 
-struct func_map {
-	unsigned long long		addr;
-	char				*func;
-	char				*mod;
+/*
+ * The kallsyms and printk_formats loaders collect their entries here.
+ * The strings are offsets into a single arena, so that a whole file is
+ * loaded with a handful of allocations, and the entries are then sorted
+ * by address with a radix sort.
+ */
+struct sym_entry {
+	unsigned long long	addr;
+	unsigned int		name;
+	unsigned int		mod;
 };
 
-struct func_list {
-	struct func_list	*next;
-	unsigned long long	addr;
-	char			*func;
-	char			*mod;
+struct sym_loader {
+	struct sym_entry	*entries;
+	unsigned int		nr;
+	unsigned int		alloc;
+	char			*strs;
+	size_t			strs_len;
+	unsigned int		last_mod;
+	unsigned int		last_mod_len;
 };
 
-static int func_cmp(const void *a, const void *b)
+static int sym_loader_init(struct sym_loader *ld, size_t size)
 {
-	const struct func_map *fa = a;
-	const struct func_map *fb = b;
+	memset(ld, 0, sizeof(*ld));
 
-	if (fa->addr < fb->addr)
+	/* The strings are never bigger than the file they come from */
+	if (size >= UINT_MAX - 2) {
+		errno = EFBIG;
 		return -1;
-	if (fa->addr > fb->addr)
-		return 1;
+	}
+
+	ld->strs = malloc(size + 2);
+	if (!ld->strs)
+		return -1;
+
+	/* Offset zero is the empty string */
+	ld->strs[0] = '\0';
+	ld->strs_len = 1;
 
 	return 0;
 }
 
-/*
- * We are searching for a record in between, not an exact
- * match.
- */
-static int func_bcmp(const void *a, const void *b)
+static void sym_loader_free(struct sym_loader *ld)
 {
-	const struct func_map *fa = a;
-	const struct func_map *fb = b;
-
-	if ((fa->addr == fb->addr) ||
+	free(ld->entries);
+	free(ld->strs);
+	memset(ld, 0, sizeof(*ld));
+}
 
-	    (fa->addr > fb->addr &&
-	     fa->addr < (fb+1)->addr))
-		return 0;
+static unsigned int sym_loader_add_str(struct sym_loader *ld,
+				       const char *str, size_t len)
+{
+	unsigned int off = ld->strs_len;
 
-	if (fa->addr < fb->addr)
-		return -1;
+	memcpy(ld->strs + off, str, len);
+	ld->strs[off + len] = '\0';
+	ld->strs_len += len + 1;
 
-	return 1;
+	return off;
 }
 
-static int func_map_init(struct tep_handle *tep)
+static struct sym_entry *sym_loader_add(struct sym_loader *ld,
+					unsigned long long addr,
+					const char *name, size_t len)
 {
-	struct func_list *funclist;
-	struct func_list *item;
-	struct func_map *func_map;
-	int i;
-
-	func_map = malloc(sizeof(*func_map) * (tep->func_count + 1));
-	if (!func_map)
-		return -1;
+	struct sym_entry *entry;
 
-	funclist = tep->funclist;
+	if (ld->nr == ld->alloc) {
+		unsigned int alloc = ld->alloc ? ld->alloc * 2 : 1024;
 
-	i = 0;
-	while (funclist) {
-		func_map[i].func = funclist->func;
-		func_map[i].addr = funclist->addr;
-		func_map[i].mod = funclist->mod;
-		i++;
-		item = funclist;
-		funclist = funclist->next;
-		free(item);
+		entry = realloc(ld->entries, sizeof(*entry) * alloc);
+		if (!entry)
+			return NULL;
+		ld->entries = entry;
+		ld->alloc = alloc;
 	}
 
-	qsort(func_map, tep->func_count, sizeof(*func_map), func_cmp);
-
-	/*
-	 * Add a special record at the end.
-	 */
-	func_map[tep->func_count].func = NULL;
-	func_map[tep->func_count].addr = 0;
-	func_map[tep->func_count].mod = NULL;
+	entry = &ld->entries[ld->nr++];
+	entry->addr = addr;
+	entry->name = sym_loader_add_str(ld, name, len);
+	entry->mod = 0;
 
-	tep->func_map = func_map;
-	tep->funclist = NULL;
+	return entry;
+}
 
-	return 0;
+static void sym_loader_add_mod(struct sym_loader *ld, struct sym_entry *entry,
+			       const char *mod, size_t len)
+{
+	/* The symbols of a module are next to each other */
+	if (!ld->last_mod || ld->last_mod_len != len ||
+	    memcmp(ld->strs + ld->last_mod, mod, len) != 0) {
+		ld->last_mod = sym_loader_add_str(ld, mod, len);
+		ld->last_mod_len = len;
+	}
+	entry->mod = ld->last_mod;
 }
 
-static struct func_map *
-__find_func(struct tep_handle *tep, unsigned long long addr)
+/* LSD radix sort of the entries by address, one byte per pass */
+static int sym_loader_sort(struct sym_loader *ld)
 {
-	struct func_map *func;
-	struct func_map key;
+	struct sym_entry *src = ld->entries;
+	struct sym_entry *dst;
+	unsigned long long diff = 0;
+	unsigned int count[256];
+	unsigned int shift;
+	unsigned int sum;
+	unsigned int i;
+	bool sorted = true;
 
-	if (!tep->func_map)
-		func_map_init(tep);
+	for (i = 1; i < ld->nr; i++) {
+		diff |= src[i].addr ^ src[0].addr;
+		if (src[i].addr < src[i - 1].addr)
+			sorted = false;
+	}
+	if (sorted)
+		return 0;
 
-	key.addr = addr;
+	dst = malloc(sizeof(*dst) * ld->nr);
+	if (!dst)
+		return -1;
 
-	func = bsearch(&key, tep->func_map, tep->func_count,
-		       sizeof(*tep->func_map), func_bcmp);
+	for (shift = 0; shift < 64; shift += 8) {
+		struct sym_entry *tmp;
 
-	return func;
-}
+		/* Skip the bytes that are the same for all addresses */
+		if (!((diff >> shift) & 0xff))
+			continue;
 
-struct func_resolver {
-	tep_func_resolver_t	*func;
-	void			*priv;
-	struct func_map		map;
-};
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < ld->nr; i++)
+			count[(src[i].addr >> shift) & 0xff]++;
 
-/**
- * tep_set_function_resolver - set an alternative function resolver
- * @tep: a handle to the trace event parser context
- * @resolver: function to be used
- * @priv: resolver function private state.
- *
- * Some tools may have already a way to resolve kernel functions, allow them to
- * keep using it instead of duplicating all the entries inside tep->funclist.
- */
-int tep_set_function_resolver(struct tep_handle *tep,
-			      tep_func_resolver_t *func, void *priv)
-{
-	struct func_resolver *resolver = malloc(sizeof(*resolver));
+		for (sum = 0, i = 0; i < 256; i++) {
+			unsigned int c = count[i];
 
-	if (resolver == NULL)
-		return -1;
+			count[i] = sum;
+			sum += c;
+		}
 
-	resolver->func = func;
-	resolver->priv = priv;
+		for (i = 0; i < ld->nr; i++)
+			dst[count[(src[i].addr >> shift) & 0xff]++] = src[i];
 
-	free(tep->func_resolver);
-	tep->func_resolver = resolver;
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* src holds the sorted entries, the other one is scratch */
+	free(dst);
+	ld->entries = src;
 
 	return 0;
 }
 
-/**
- * tep_reset_function_resolver - reset alternative function resolver
- * @tep: a handle to the trace event parser context
- *
- * Stop using whatever alternative resolver was set, use the default
- * one instead.
- */
-void tep_reset_function_resolver(struct tep_handle *tep)
+/* Give back the unused part of the string arena */
+static char *sym_loader_take_strs(struct sym_loader *ld)
 {
-	free(tep->func_resolver);
-	tep->func_resolver = NULL;
-}
+	char *strs;
 
-static struct func_map *
-find_func(struct tep_handle *tep, unsigned long long addr)
-{
-	struct func_map *map;
+	strs = realloc(ld->strs, ld->strs_len);
+	if (!strs)
+		strs = ld->strs;
+	ld->strs = NULL;
 
-	if (!tep->func_resolver)
-		return __find_func(tep, addr);
+	return strs;
+}
 
-	map = &tep->func_resolver->map;
-	map->mod  = NULL;
-	map->addr = addr;
-	map->func = tep->func_resolver->func(tep->func_resolver->priv,
-					     &map->addr, &map->mod);
-	if (map->func == NULL)
-		return NULL;
+static inline bool sym_isspace(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r';
+}
 
-	return map;
+static const char *sym_skip_space(const char *p, const char *end)
+{
+	while (p < end && sym_isspace(*p))
+		p++;
+	return p;
 }
 
-/**
- * tep_find_function_info - find a function by a given address
- * @tep: a handle to the trace event parser context
- * @addr: the address to find the function with
- * @name: Return the name of the function (if found)
- * @start: Return the start of the function (if found)
- * @size: Return the size of the function (if found)
- *
- * Returns 1 if found, and 0 if it is not.
- *  If found then @name will point to the name of the function.
- *                @start: will contain the starting address of the function.
- *                @size: will contain the size of the function.
- */
-int tep_find_function_info(struct tep_handle *tep, unsigned long long addr,
-			   const char **name, unsigned long long *start,
-			   unsigned long *size)
+/* Returns the end of the hex number, or NULL if there was none */
+static const char *sym_parse_hex(const char *p, const char *end,
+				 unsigned long long *val)
 {
-	struct func_map *map;
+	const char *start = p;
+	unsigned long long v = 0;
+	int digit;
 
-	map = find_func(tep, addr);
-	if (!map)
-		return 0;
+	for (; p < end; p++) {
+		char ch = *p;
 
-	if (name)
-		*name = map->func;
-	if (start)
-		*start = map->addr;
-	if (size) {
-		if (!tep->func_resolver)
-			*size = map[1].addr - map->addr;
+		if (ch >= '0' && ch <= '9')
+			digit = ch - '0';
+		else if (ch >= 'a' && ch <= 'f')
+			digit = ch - 'a' + 10;
+		else if (ch >= 'A' && ch <= 'F')
+			digit = ch - 'A' + 10;
 		else
-			*size = 0;
+			break;
+		/* Sixteen digits fill an unsigned long long */
+		if (p - start == 16)
+			return NULL;
+		v = (v << 4) | digit;
 	}
 
-	return 1;
+	if (p == start)
+		return NULL;
+
+	*val = v;
+	return p;
 }
 
-/**
- * tep_find_function - find a function by a given address
- * @tep: a handle to the trace event parser context
- * @addr: the address to find the function with
- *
- * Returns a pointer to the function stored that has the given
- * address. Note, the address does not have to be exact, it
- * will select the function that would contain the address.
- */
-const char *tep_find_function(struct tep_handle *tep, unsigned long long addr)
+struct func_list {
+	struct func_list	*next;
+	unsigned long long	addr;
+	char			*func;
+	char			*mod;
+};
+
+static int func_cmp(const void *a, const void *b)
 {
-	struct func_map *map;
+	const struct func_map *fa = a;
+	const struct func_map *fb = b;
 
-	map = find_func(tep, addr);
-	if (!map)
-		return NULL;
+	if (fa->addr < fb->addr)
+		return -1;
+	if (fa->addr > fb->addr)
+		return 1;
 
-	return map->func;
+	return 0;
 }
 
-/**
- * tep_find_function_address - find a function address by a given address
- * @tep: a handle to the trace event parser context
- * @addr: the address to find the function with
- *
- * Returns the address the function starts at. This can be used in
- * conjunction with tep_find_function to print both the function
- * name and the function offset.
- */
-unsigned long long
-tep_find_function_address(struct tep_handle *tep, unsigned long long addr)
+static void free_func_table(struct func_table *table)
 {
-	struct func_map *map;
+	unsigned int i;
 
-	map = find_func(tep, addr);
-	if (!map)
-		return 0;
+	if (!table)
+		return;
 
-	return map->addr;
+	if (!table->mapped) {
+		free(table->addrs);
+		free(table->name_offs);
+		free(table->mod_offs);
+		free(table->strs);
+		free(table->index);
+		free(table->index_blk);
+	}
+	for (i = 0; i < table->delta_nr; i++) {
+		free(table->delta[i].func);
+		free(table->delta[i].mod);
+	}
+	free(table->delta);
+	free(table->removed);
+	free(table);
 }
 
-/**
- * tep_register_function - register a function with a given address
- * @tep: a handle to the trace event parser context
+/*
+ * The names returned by tep_find_function() and friends live as long as
+ * the handle, but the function table may be rebuilt at any time. The
+ * strings that the table drops are kept here until tep_free().
+ */
+static int func_retire_reserve(struct tep_handle *tep, unsigned int nr)
+{
+	unsigned int alloc = tep->func_retired_alloc;
+	char **retired;
+
+	if (tep->func_retired_nr + nr <= alloc)
+		return 0;
+
+	if (!alloc)
+		alloc = 16;
+	while (alloc < tep->func_retired_nr + nr)
+		alloc *= 2;
+
+	retired = realloc(tep->func_retired, sizeof(*retired) * alloc);
+	if (!retired)
+		return -1;
+	tep->func_retired = retired;
+	tep->func_retired_alloc = alloc;
+
+	return 0;
+}
+
+/* The room for @str must have been reserved by func_retire_reserve() */
+static void func_retire(struct tep_handle *tep, char *str)
+{
+	if (str)
+		tep->func_retired[tep->func_retired_nr++] = str;
+}
+
+/* The number of strings that retire_func_table() will retire */
+static unsigned int func_table_strs_nr(struct func_table *table)
+{
+	if (!table)
+		return 0;
+
+	return (table->mapped ? 0 : 1) + table->delta_nr * 2;
+}
+
+/* Frees @table, but keeps the strings it handed out */
+static void retire_func_table(struct tep_handle *tep, struct func_table *table)
+{
+	unsigned int i;
+
+	if (!table)
+		return;
+
+	if (!table->mapped) {
+		func_retire(tep, table->strs);
+		table->strs = NULL;
+	}
+	for (i = 0; i < table->delta_nr; i++) {
+		func_retire(tep, table->delta[i].func);
+		func_retire(tep, table->delta[i].mod);
+	}
+	table->delta_nr = 0;
+	free_func_table(table);
+}
+
+static void free_func_retired(struct tep_handle *tep)
+{
+	unsigned int i;
+
+	for (i = 0; i < tep->func_retired_nr; i++)
+		free(tep->func_retired[i]);
+	free(tep->func_retired);
+}
+
+static inline char *func_table_name(struct func_table *table, unsigned int i)
+{
+	return table->strs + table->name_offs[i];
+}
+
+static inline char *func_table_mod(struct func_table *table, unsigned int i)
+{
+	return table->mod_offs[i] ? table->strs + table->mod_offs[i] : NULL;
+}
+
+static unsigned int func_index_fill(struct func_table *table,
+				    unsigned int blk, unsigned int k)
+{
+	if (k <= table->nr_blocks) {
+		blk = func_index_fill(table, blk, 2 * k);
+		table->index[k] = table->addrs[blk * FUNC_BLOCK];
+		table->index_blk[k] = blk++;
+		blk = func_index_fill(table, blk, 2 * k + 1);
+	}
+	return blk;
+}
+
+static struct func_table *func_table_alloc(unsigned int nr)
+{
+	struct func_table *table;
+
+	table = calloc(1, sizeof(*table));
+	if (!table)
+		return NULL;
+
+	table->nr = nr;
+	table->nr_blocks = (nr + FUNC_BLOCK - 1) / FUNC_BLOCK;
+
+	/* Keep the blocks lined up with cache lines */
+	if (posix_memalign((void **)&table->addrs, 64,
+			   sizeof(*table->addrs) * (nr ? nr : 1))) {
+		table->addrs = NULL;
+		goto fail;
+	}
+	table->name_offs = malloc(sizeof(*table->name_offs) * (nr ? nr : 1));
+	table->mod_offs = malloc(sizeof(*table->mod_offs) * (nr ? nr : 1));
+	table->index = malloc(sizeof(*table->index) * (table->nr_blocks + 1));
+	table->index_blk = malloc(sizeof(*table->index_blk) * (table->nr_blocks + 1));
+	if (!table->name_offs || !table->mod_offs ||
+	    !table->index || !table->index_blk)
+		goto fail;
+
+	return table;
+ fail:
+	free_func_table(table);
+	return NULL;
+}
+
+/*
+ * Create the function table from @funcs, which must already be sorted
+ * by address. The strings are copied, the caller still owns @funcs.
+ */
+static struct func_table *func_table_create(struct func_map *funcs,
+					    unsigned int nr)
+{
+	struct func_table *table;
+	const char *last_mod = NULL;
+	unsigned int last_mod_off = 0;
+	size_t strs_size = 1;
+	size_t off;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		strs_size += strlen(funcs[i].func) + 1;
+		if (funcs[i].mod)
+			strs_size += strlen(funcs[i].mod) + 1;
+	}
+	if (strs_size > UINT_MAX)
+		return NULL;
+
+	table = func_table_alloc(nr);
+	if (!table)
+		return NULL;
+
+	table->strs = malloc(strs_size);
+	if (!table->strs) {
+		free_func_table(table);
+		return NULL;
+	}
+
+	table->strs[0] = '\0';
+	off = 1;
+
+	for (i = 0; i < nr; i++) {
+		size_t len;
+
+		table->addrs[i] = funcs[i].addr;
+
+		len = strlen(funcs[i].func) + 1;
+		memcpy(table->strs + off, funcs[i].func, len);
+		table->name_offs[i] = off;
+		off += len;
+
+		if (!funcs[i].mod) {
+			table->mod_offs[i] = 0;
+			continue;
+		}
+
+		/* Symbols of a module are usually next to each other */
+		if (!last_mod || strcmp(last_mod, funcs[i].mod) != 0) {
+			len = strlen(funcs[i].mod) + 1;
+			memcpy(table->strs + off, funcs[i].mod, len);
+			last_mod = funcs[i].mod;
+			last_mod_off = off;
+			off += len;
+		}
+		table->mod_offs[i] = last_mod_off;
+	}
+
+	func_index_fill(table, 0, 1);
+
+	return table;
+}
+
+/*
+ * Create the function table from the sorted entries of @ld. The string
+ * arena of @ld is handed over to the table.
+ */
+static struct func_table *func_table_from_syms(struct sym_loader *ld)
+{
+	struct func_table *table;
+	unsigned int i;
+
+	table = func_table_alloc(ld->nr);
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < ld->nr; i++) {
+		table->addrs[i] = ld->entries[i].addr;
+		table->name_offs[i] = ld->entries[i].name;
+		table->mod_offs[i] = ld->entries[i].mod;
+	}
+
+	table->strs = sym_loader_take_strs(ld);
+
+	func_index_fill(table, 0, 1);
+
+	return table;
+}
+
+/*
+ * Returns the index of the last function that starts at or before @addr,
+ * or -1 if @addr is before all functions.
+ */
+static int func_table_search(struct func_table *table, unsigned long long addr)
+{
+	unsigned int k = 1;
+	unsigned int blk;
+	unsigned int end;
+	unsigned int i;
+
+	while (k <= table->nr_blocks) {
+		__builtin_prefetch(table->index + FUNC_INDEX_PREFETCH * k);
+		k = 2 * k + (table->index[k] <= addr);
+		search_probe();
+	}
+	/* k is now the slot of the first block that starts after @addr */
+	k >>= __builtin_ffs(~k);
+
+	blk = k ? table->index_blk[k] : table->nr_blocks;
+	if (!blk)
+		return -1;
+	blk--;
+
+	i = blk * FUNC_BLOCK;
+	end = i + FUNC_BLOCK;
+	if (end > table->nr)
+		end = table->nr;
+
+	while (i + 1 < end && table->addrs[i + 1] <= addr) {
+		search_probe();
+		i++;
+	}
+
+	return i;
+}
+
+/* Returns the number of functions in the delta that start at or before @addr */
+static unsigned int func_delta_upper(struct func_table *table,
+				     unsigned long long addr)
+{
+	unsigned int lo = 0;
+	unsigned int hi = table->delta_nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		search_probe();
+		if (table->delta[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the number of functions in the delta that start before @addr */
+static unsigned int func_delta_lower(struct func_table *table,
+				     unsigned long long addr)
+{
+	return addr ? func_delta_upper(table, addr - 1) : 0;
+}
+
+static struct func_range *func_removed_find(struct func_table *table,
+					    unsigned long long addr)
+{
+	unsigned int lo = 0;
+	unsigned int hi = table->removed_nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (table->removed[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo && addr < table->removed[lo - 1].end)
+		return &table->removed[lo - 1];
+
+	return NULL;
+}
+
+/*
+ * @i is the result of func_table_search() for @addr. Returns the index
+ * of the last function at or before @addr that was not removed, or -1.
+ */
+static int func_table_live_le(struct func_table *table,
+			      unsigned long long addr, int i)
+{
+	struct func_range *range;
+
+	while (i >= 0) {
+		range = func_removed_find(table, table->addrs[i]);
+		if (!range)
+			break;
+		if (!range->start)
+			return -1;
+		addr = range->start - 1;
+		i = func_table_search(table, addr);
+	}
+	return i;
+}
+
+/*
+ * @i is the index of the first function after some address. Returns the
+ * index of the first function from there that was not removed, which is
+ * table->nr if there is none.
+ */
+static unsigned int func_table_live_next(struct func_table *table,
+					 unsigned int i)
+{
+	struct func_range *range;
+
+	while (i < table->nr) {
+		range = func_removed_find(table, table->addrs[i]);
+		if (!range)
+			break;
+		i = func_table_search(table, range->end - 1) + 1;
+	}
+	return i;
+}
+
+/* Returns the index of the first function of the table at or after @addr */
+static unsigned int func_table_lower(struct func_table *table,
+				     unsigned long long addr)
+{
+	int i = func_table_search(table, addr);
+
+	if (i < 0)
+		return 0;
+	if (table->addrs[i] < addr)
+		i++;
+	return i;
+}
+
+static bool func_table_dirty(struct tep_handle *tep)
+{
+	struct func_table *table = tep->func_table;
+
+	return !table || tep->funclist || table->delta_nr || table->removed_nr;
+}
+
+static void func_cache_invalidate(struct tep_handle *tep);
+
+static void free_funclist(struct func_list *funclist)
+{
+	struct func_list *item;
+
+	while (funclist) {
+		item = funclist;
+		funclist = funclist->next;
+		free(item->func);
+		free(item->mod);
+		free(item);
+	}
+}
+
+/*
+ * Build the function table from the registered functions, and the
+ * functions loaded in @ld if it is not NULL.
+ */
+static int func_map_init(struct tep_handle *tep, struct sym_loader *ld)
+{
+	struct func_table *table = tep->func_table;
+	struct func_list *funclist;
+	struct func_map *func_map;
+	unsigned int nr = 0;
+	unsigned int i;
+
+	if (func_retire_reserve(tep, func_table_strs_nr(table)))
+		return -1;
+
+	/* Nothing to merge with, use the loaded functions as is */
+	if (ld && !table && !tep->funclist) {
+		table = func_table_from_syms(ld);
+		if (!table)
+			return -1;
+		goto out;
+	}
+
+	func_map = malloc(sizeof(*func_map) *
+			  (tep->func_count + (ld ? ld->nr : 0) + 1));
+	if (!func_map)
+		return -1;
+
+	if (table) {
+		struct func_range *range = table->removed;
+		struct func_range *last = range + table->removed_nr;
+
+		for (i = 0; i < table->nr; i++) {
+			unsigned long long addr = table->addrs[i];
+
+			while (range < last && range->end <= addr)
+				range++;
+			if (range < last && range->start <= addr)
+				continue;
+
+			func_map[nr].addr = addr;
+			func_map[nr].func = func_table_name(table, i);
+			func_map[nr].mod = func_table_mod(table, i);
+			nr++;
+		}
+
+		for (i = 0; i < table->delta_nr; i++)
+			func_map[nr++] = table->delta[i];
+	}
+
+	for (funclist = tep->funclist; funclist; funclist = funclist->next) {
+		func_map[nr].func = funclist->func;
+		func_map[nr].addr = funclist->addr;
+		func_map[nr].mod = funclist->mod;
+		nr++;
+	}
+
+	for (i = 0; ld && i < ld->nr; i++) {
+		func_map[nr].addr = ld->entries[i].addr;
+		func_map[nr].func = ld->strs + ld->entries[i].name;
+		func_map[nr].mod = ld->entries[i].mod ?
+			ld->strs + ld->entries[i].mod : NULL;
+		nr++;
+	}
+
+	qsort(func_map, nr, sizeof(*func_map), func_cmp);
+
+	table = func_table_create(func_map, nr);
+	free(func_map);
+	if (!table)
+		return -1;
+ out:
+	free_funclist(tep->funclist);
+	retire_func_table(tep, tep->func_table);
+	tep->func_table = table;
+	tep->funclist = NULL;
+	tep->func_count = table->nr;
+	func_cache_invalidate(tep);
+
+	return 0;
+}
+
+static bool
+__find_func(struct tep_handle *tep, unsigned long long addr,
+	    struct func_map *map, unsigned long *size)
+{
+	struct func_table *table;
+	unsigned long long next = 0;
+	bool has_next = false;
+	bool found;
+	unsigned int n;
+	unsigned int d;
+	int i;
+
+	if ((!tep->func_table || tep->funclist) && func_map_init(tep, NULL))
+		return false;
+
+	table = tep->func_table;
+
+	search_probes_reset();
+	i = func_table_search(table, addr);
+	n = i + 1;
+	if (table->removed_nr) {
+		i = func_table_live_le(table, addr, i);
+		n = func_table_live_next(table, n);
+	}
+
+	found = i >= 0;
+	if (found) {
+		map->addr = table->addrs[i];
+		map->func = func_table_name(table, i);
+		map->mod = func_table_mod(table, i);
+	}
+	if (n < table->nr) {
+		next = table->addrs[n];
+		has_next = true;
+	}
+
+	if (table->delta_nr) {
+		d = func_delta_upper(table, addr);
+		/* The delta is newer and wins over the table */
+		if (d && (!found || table->delta[d - 1].addr >= map->addr)) {
+			*map = table->delta[d - 1];
+			found = true;
+		}
+		if (d < table->delta_nr &&
+		    (!has_next || table->delta[d].addr < next)) {
+			next = table->delta[d].addr;
+			has_next = true;
+		}
+	}
+	tep_stat_inc(tep->stats.func_searches);
+	tep_stat_add(tep->stats.func_probes, search_probes);
+
+	if (!found)
+		return false;
+
+	/*
+	 * We are searching for a record in between, not an exact
+	 * match. The last function only matches exactly.
+	 */
+	if (map->addr != addr && (!has_next || addr >= next))
+		return false;
+
+	if (size)
+		*size = has_next ? next - map->addr : 0;
+
+	return true;
+}
+
+struct func_resolver {
+	tep_func_resolver_t	*func;
+	void			*priv;
+	struct func_map		map;
+};
+
+/*
+ * Function tracing and stack traces tend to look up the same small set
+ * of addresses over and over. A direct mapped cache of the results
+ * sits in front of both the function map and any registered resolver.
+ */
+#define FUNC_CACHE_BITS		10
+#define FUNC_CACHE_SIZE		(1 << FUNC_CACHE_BITS)
+
+struct func_cache_entry {
+	unsigned long long	key;
+	unsigned long		size;
+	unsigned int		gen;
+	struct func_map		map;
+};
+
+static inline unsigned int func_cache_hash(unsigned long long addr)
+{
+	return (addr * 0x9e3779b97f4a7c15ULL) >> (64 - FUNC_CACHE_BITS);
+}
+
+/*
+ * Entries are only valid for the generation they were added in, which
+ * makes invalidating the cache cheap enough to do on every change of
+ * the function map.
+ */
+static void func_cache_invalidate(struct tep_handle *tep)
+{
+	if (++tep->func_cache_gen)
+		return;
+
+	if (tep->func_cache)
+		memset(tep->func_cache, 0,
+		       sizeof(*tep->func_cache) * FUNC_CACHE_SIZE);
+	tep->func_cache_gen = 1;
+}
+
+/**
+ * tep_set_function_resolver - set an alternative function resolver
+ * @tep: a handle to the trace event parser context
+ * @resolver: function to be used
+ * @priv: resolver function private state.
+ *
+ * Some tools may have already a way to resolve kernel functions, allow them to
+ * keep using it instead of duplicating all the entries inside tep->funclist.
+ */
+int tep_set_function_resolver(struct tep_handle *tep,
+			      tep_func_resolver_t *func, void *priv)
+{
+	struct func_resolver *resolver;
+
+	if (handle_busy(tep))
+		return -1;
+
+	resolver = malloc(sizeof(*resolver));
+	if (resolver == NULL)
+		return -1;
+
+	resolver->func = func;
+	resolver->priv = priv;
+
+	free(tep->func_resolver);
+	tep->func_resolver = resolver;
+	func_cache_invalidate(tep);
+
+	return 0;
+}
+
+/**
+ * tep_reset_function_resolver - reset alternative function resolver
+ * @tep: a handle to the trace event parser context
+ *
+ * Stop using whatever alternative resolver was set, use the default
+ * one instead.
+ */
+void tep_reset_function_resolver(struct tep_handle *tep)
+{
+	if (handle_busy(tep))
+		return;
+
+	free(tep->func_resolver);
+	tep->func_resolver = NULL;
+	func_cache_invalidate(tep);
+}
+
+static bool
+find_func_uncached(struct tep_handle *tep, unsigned long long addr,
+		   struct func_map *map, unsigned long *size)
+{
+	if (!tep->func_resolver)
+		return __find_func(tep, addr, map, size);
+
+	map->mod  = NULL;
+	map->addr = addr;
+	map->func = tep->func_resolver->func(tep->func_resolver->priv,
+					     &map->addr, &map->mod);
+	if (map->func == NULL)
+		return false;
+
+	if (size)
+		*size = 0;
+
+	return true;
+}
+
+/*
+ * Once the handle is frozen, each thread keeps its own small cache so
+ * that lookups do not write to the handle. The entries are tagged with
+ * the freeze id of the handle they belong to.
+ */
+#define FUNC_TLS_CACHE_BITS	6
+#define FUNC_TLS_CACHE_SIZE	(1 << FUNC_TLS_CACHE_BITS)
+
+static __thread struct func_cache_entry func_tls_cache[FUNC_TLS_CACHE_SIZE];
+
+static bool
+find_func_frozen(struct tep_handle *tep, unsigned long long addr,
+		 struct func_map *map, unsigned long *size)
+{
+	struct func_cache_entry *entry;
+
+	entry = &func_tls_cache[(addr * 0x9e3779b97f4a7c15ULL) >>
+				(64 - FUNC_TLS_CACHE_BITS)];
+	if (entry->gen != tep->frozen_id || entry->key != addr) {
+		tep_stat_inc(tep->stats.func_cache_misses);
+		entry->key = addr;
+		entry->size = 0;
+		if (!find_func_uncached(tep, addr, &entry->map, &entry->size))
+			entry->map.func = NULL;
+		entry->gen = tep->frozen_id;
+	} else {
+		tep_stat_inc(tep->stats.func_cache_hits);
+	}
+
+	if (!entry->map.func)
+		return false;
+	*map = entry->map;
+	if (size)
+		*size = entry->size;
+	return true;
+}
+
+static bool
+find_func(struct tep_handle *tep, unsigned long long addr,
+	  struct func_map *map, unsigned long *size)
+{
+	struct func_cache_entry *entry;
+	bool found = false;
+	bool locked;
+
+	if (tep->frozen_id)
+		return find_func_frozen(tep, addr, map, size);
+
+	locked = handle_lock(tep);
+	if (!tep->func_cache) {
+		tep->func_cache = calloc(FUNC_CACHE_SIZE, sizeof(*tep->func_cache));
+		if (!tep->func_cache) {
+			found = find_func_uncached(tep, addr, map, size);
+			handle_unlock(tep, locked);
+			return found;
+		}
+		if (!tep->func_cache_gen)
+			tep->func_cache_gen = 1;
+	}
+
+	entry = &tep->func_cache[func_cache_hash(addr)];
+	if (entry->gen == tep->func_cache_gen && entry->key == addr) {
+		tep_stat_inc(tep->stats.func_cache_hits);
+		goto out;
+	}
+	tep_stat_inc(tep->stats.func_cache_misses);
+
+	entry->key = addr;
+	entry->size = 0;
+	if (!find_func_uncached(tep, addr, &entry->map, &entry->size))
+		entry->map.func = NULL;
+	entry->gen = tep->func_cache_gen;
+ out:
+	/* Misses are cached too, as NULL function names */
+	if (entry->map.func) {
+		*map = entry->map;
+		if (size)
+			*size = entry->size;
+		found = true;
+	}
+	handle_unlock(tep, locked);
+
+	return found;
+}
+
+/**
+ * tep_find_function_info - find a function by a given address
+ * @tep: a handle to the trace event parser context
+ * @addr: the address to find the function with
+ * @name: Return the name of the function (if found)
+ * @start: Return the start of the function (if found)
+ * @size: Return the size of the function (if found)
+ *
+ * Returns 1 if found, and 0 if it is not.
+ *  If found then @name will point to the name of the function.
+ *                @start: will contain the starting address of the function.
+ *                @size: will contain the size of the function.
+ */
+int tep_find_function_info(struct tep_handle *tep, unsigned long long addr,
+			   const char **name, unsigned long long *start,
+			   unsigned long *size)
+{
+	struct func_map map;
+
+	if (!find_func(tep, addr, &map, size))
+		return 0;
+
+	if (name)
+		*name = map.func;
+	if (start)
+		*start = map.addr;
+
+	return 1;
+}
+
+/**
+ * tep_find_function - find a function by a given address
+ * @tep: a handle to the trace event parser context
+ * @addr: the address to find the function with
+ *
+ * Returns a pointer to the function stored that has the given
+ * address. Note, the address does not have to be exact, it
+ * will select the function that would contain the address.
+ */
+const char *tep_find_function(struct tep_handle *tep, unsigned long long addr)
+{
+	struct func_map map;
+
+	if (!find_func(tep, addr, &map, NULL))
+		return NULL;
+
+	return map.func;
+}
+
+/**
+ * tep_find_function_address - find a function address by a given address
+ * @tep: a handle to the trace event parser context
+ * @addr: the address to find the function with
+ *
+ * Returns the address the function starts at. This can be used in
+ * conjunction with tep_find_function to print both the function
+ * name and the function offset.
+ */
+unsigned long long
+tep_find_function_address(struct tep_handle *tep, unsigned long long addr)
+{
+	struct func_map map;
+
+	if (!find_func(tep, addr, &map, NULL))
+		return 0;
+
+	return map.addr;
+}
+
+static int func_delta_insert(struct tep_handle *tep, const char *func,
+			     unsigned long long addr, const char *mod)
+{
+	struct func_table *table = tep->func_table;
+	struct func_map *delta;
+	char *func_copy;
+	char *mod_copy = NULL;
+	unsigned int i;
+
+	if (table->delta_nr == table->delta_alloc) {
+		unsigned int alloc = table->delta_alloc ? table->delta_alloc * 2 : 16;
+
+		delta = realloc(table->delta, sizeof(*delta) * alloc);
+		if (!delta)
+			return -1;
+		table->delta = delta;
+		table->delta_alloc = alloc;
+	}
+
+	func_copy = strdup(func);
+	if (!func_copy)
+		goto out_free;
+	if (mod) {
+		mod_copy = strdup(mod);
+		if (!mod_copy)
+			goto out_free;
+	}
+
+	/* Keep the order of registration for the same address */
+	i = func_delta_upper(table, addr);
+	delta = table->delta;
+	memmove(&delta[i + 1], &delta[i], sizeof(*delta) * (table->delta_nr - i));
+	delta[i].addr = addr;
+	delta[i].func = func_copy;
+	delta[i].mod = mod_copy;
+	table->delta_nr++;
+	tep->func_count++;
+
+	func_cache_invalidate(tep);
+
+	/* If the merge fails, the function is still found in the delta */
+	if (table->delta_nr >= FUNC_DELTA_MAX)
+		func_map_init(tep, NULL);
+
+	return 0;
+
+out_free:
+	free(func_copy);
+	errno = ENOMEM;
+	return -1;
+}
+
+/* Returns the number of functions of the table in the range that were already removed */
+static unsigned int func_table_count_removed(struct func_table *table,
+					     unsigned long long start,
+					     unsigned long long end)
+{
+	struct func_range *range;
+	unsigned int count = 0;
+	unsigned int i;
+
+	for (i = 0; i < table->removed_nr; i++) {
+		range = &table->removed[i];
+		if (range->end <= start || range->start >= end)
+			continue;
+		count += func_table_lower(table, range->end < end ? range->end : end) -
+			 func_table_lower(table, range->start > start ? range->start : start);
+	}
+	return count;
+}
+
+static int func_table_remove(struct func_table *table,
+			     unsigned long long start, unsigned long long end)
+{
+	struct func_range *removed;
+	unsigned int i, j;
+
+	/* Fold in the ranges that overlap or touch the new one */
+	for (i = 0; i < table->removed_nr && table->removed[i].end < start; i++)
+		;
+	for (j = i; j < table->removed_nr && table->removed[j].start <= end; j++) {
+		if (table->removed[j].start < start)
+			start = table->removed[j].start;
+		if (table->removed[j].end > end)
+			end = table->removed[j].end;
+	}
+
+	if (i == j) {
+		if (table->removed_nr == table->removed_alloc) {
+			unsigned int alloc = table->removed_alloc ?
+				table->removed_alloc * 2 : 8;
+
+			removed = realloc(table->removed, sizeof(*removed) * alloc);
+			if (!removed)
+				return -1;
+			table->removed = removed;
+			table->removed_alloc = alloc;
+		}
+		j = i + 1;
+		memmove(&table->removed[j], &table->removed[i],
+			sizeof(*removed) * (table->removed_nr - i));
+		table->removed_nr++;
+	} else if (j > i + 1) {
+		memmove(&table->removed[i + 1], &table->removed[j],
+			sizeof(*removed) * (table->removed_nr - j));
+		table->removed_nr -= j - i - 1;
+	}
+
+	table->removed[i].start = start;
+	table->removed[i].end = end;
+
+	return 0;
+}
+
+/**
+ * tep_unregister_functions - remove the functions of an address range
+ * @tep: a handle to the trace event parser context
+ * @start: the first address of the range
+ * @end: the address right after the range
+ *
+ * This removes all the functions that start in the range from @start
+ * up to, but not including, @end. This is for functions that go away
+ * during a session, like those of an unloaded module or BPF program.
+ * Addresses in the range are then resolved as if the removed functions
+ * had never been registered.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int tep_unregister_functions(struct tep_handle *tep, unsigned long long start,
+			     unsigned long long end)
+{
+	struct func_table *table;
+	unsigned int i, j;
+
+	if (handle_busy(tep))
+		return -1;
+
+	if (start >= end)
+		return 0;
+
+	if ((!tep->func_table || tep->funclist) && func_map_init(tep, NULL))
+		return -1;
+
+	table = tep->func_table;
+
+	i = func_delta_lower(table, start);
+	j = func_delta_lower(table, end);
+	if (func_retire_reserve(tep, (j - i) * 2))
+		return -1;
+	tep->func_count -= j - i;
+	if (i < j) {
+		unsigned int k;
+
+		/* Their names may still be held by the callers of lookups */
+		for (k = i; k < j; k++) {
+			func_retire(tep, table->delta[k].func);
+			func_retire(tep, table->delta[k].mod);
+		}
+		memmove(&table->delta[i], &table->delta[j],
+			sizeof(*table->delta) * (table->delta_nr - j));
+		table->delta_nr -= j - i;
+	}
+
+	/* Only ranges that hold functions of the table need to be kept */
+	i = func_table_lower(table, start);
+	j = func_table_lower(table, end);
+	if (i < j) {
+		unsigned int removed = func_table_count_removed(table, start, end);
+
+		if (func_table_remove(table, start, end))
+			return -1;
+		tep->func_count -= j - i - removed;
+	}
+
+	func_cache_invalidate(tep);
+
+	if (table->removed_nr >= FUNC_REMOVED_MAX)
+		func_map_init(tep, NULL);
+
+	return 0;
+}
+
+/**
+ * tep_register_function - register a function with a given address
+ * @tep: a handle to the trace event parser context
  * @function: the function name to register
  * @addr: the address the function starts at
  * @mod: the kernel module the function may be in (NULL for none)
@@ -701,8 +1853,15 @@ tep_find_function_address(struct tep_handle *tep, unsigned long long addr)
 int tep_register_function(struct tep_handle *tep, char *func,
 			  unsigned long long addr, char *mod)
 {
-	struct func_list *item = malloc(sizeof(*item));
+	struct func_list *item;
 
+	if (handle_busy(tep))
+		return -1;
+
+	if (tep->func_table)
+		return func_delta_insert(tep, func, addr, mod);
+
+	item = malloc(sizeof(*item));
 	if (!item)
 		return -1;
 
@@ -721,6 +1880,7 @@ int tep_register_function(struct tep_handle *tep, char *func,
 
 	tep->funclist = item;
 	tep->func_count++;
+	func_cache_invalidate(tep);
 
 	return 0;
 
@@ -733,76 +1893,211 @@ out_free:
 	return -1;
 }
 
+/*
+ * Parses one line of /proc/kallsyms:
+ *
+ *   <addr> <type> <name>[\t[<module>]]
+ */
+static int parse_kallsyms_line(struct sym_loader *ld,
+			       const char *p, const char *end)
+{
+	unsigned long long addr;
+	struct sym_entry *entry;
+	const char *func;
+	const char *mod;
+	char ch;
+
+	p = sym_parse_hex(p, end, &addr);
+	if (!p || p == end || !sym_isspace(*p))
+		return -EINVAL;
+
+	p = sym_skip_space(p, end);
+	if (p == end)
+		return -EINVAL;
+	ch = *p++;
+
+	p = sym_skip_space(p, end);
+	func = p;
+	while (p < end && !sym_isspace(*p))
+		p++;
+	if (p == func)
+		return -EINVAL;
+
+	/*
+	 * Hacks for
+	 *  - arm arch that adds a lot of bogus '$a' functions
+	 *  - x86-64 that reports per-cpu variable offsets as absolute
+	 */
+	if (func[0] == '$' || ch == 'A' || ch == 'a')
+		return 0;
+
+	entry = sym_loader_add(ld, addr, func, p - func);
+	if (!entry)
+		return -ENOMEM;
+
+	if (end - p < 2 || p[0] != '\t' || p[1] != '[')
+		return 0;
+
+	p += 2;
+	mod = p;
+	while (p < end && !sym_isspace(*p))
+		p++;
+	/* truncate the extra ']' */
+	if (p - mod > 1)
+		sym_loader_add_mod(ld, entry, mod, p - mod - 1);
+
+	return 0;
+}
+
+/* Add an input of the handle to the digest that its cache file keeps */
+static void digest_input(struct tep_handle *tep, enum tep_cache_input type,
+			 const char *buf, size_t size)
+{
+	unsigned long long digest = tep_digest_input(0, type, buf, size);
+
+	pthread_mutex_lock(&tep->lock);
+	tep->input_digest += digest;
+	pthread_mutex_unlock(&tep->lock);
+}
+
 /**
- * tep_parse_kallsyms - load functions from a read of /proc/kallsyms
+ * tep_parse_kallsyms_buf - load functions from a buffer of /proc/kallsyms
  * @tep: a handle to the trace event parser
- * @kallsyms: A string buffer that holds the content of /proc/kallsyms and ends with '\0'
+ * @buf: A buffer that holds the content of /proc/kallsyms
+ * @size: The size of @buf, which does not need to end with '\0'
  *
- * This is a helper function to parse the Linux kernel /proc/kallsyms
- * format (stored in a string buffer) and load the functions into
- * the @tep handler such that function IP addresses can be mapped to
- * their name when parsing events with %pS in the print format field.
+ * Like tep_parse_kallsyms() but @buf does not need to be a string,
+ * which allows it to be a memory mapped file.
  *
  * Returns 0 on success, and -1 on error.
  */
-int tep_parse_kallsyms(struct tep_handle *tep, const char *kallsyms)
+int tep_parse_kallsyms_buf(struct tep_handle *tep, const char *buf, size_t size)
 {
-	unsigned long long addr;
-	char *copy;
-	char *func;
-	char *line;
-	char *next = NULL;
-	char *mod;
-	char ch;
+	const char *end = buf + size;
+	const char *line = buf;
+	struct sym_loader ld;
+	const char *eol;
 	int ret = -1;
+	int r;
 
-	copy = strdup(kallsyms);
-	if (!copy)
+	if (handle_busy(tep))
 		return -1;
 
-	line = strtok_r(copy, "\n", &next);
-	while (line) {
-		int func_start, func_end = 0;
-		int mod_start, mod_end = 0;
-		int n;
+	if (sym_loader_init(&ld, size))
+		return -1;
 
-		mod = NULL;
-		errno = 0;
-		n = sscanf(line, "%16llx %c %n%*s%n%*1[\t][%n%*s%n",
-			   &addr, &ch, &func_start, &func_end, &mod_start, &mod_end);
-		if (errno)
-			goto out;
+	for (; line < end; line = eol + 1) {
+		const char *p;
 
-		if (n != 2 || !func_end) {
-			tep_warning("Failed to parse kallsyms n=%d func_end=%d",
-				    n, func_end);
-			goto out;
-		}
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
 
-		func = line + func_start;
-		/*
-		 * Hacks for
-		 *  - arm arch that adds a lot of bogus '$a' functions
-		 *  - x86-64 that reports per-cpu variable offsets as absolute
-		 */
-		if (func[0] != '$' && ch != 'A' && ch != 'a') {
-			line[func_end] = 0;
-			if (mod_end) {
-				mod = line + mod_start;
-				/* truncate the extra ']' */
-				line[mod_end - 1] = 0;
-			}
-			tep_register_function(tep, func, addr, mod);
-		}
+		p = sym_skip_space(line, eol);
+		/* A string buffer may have its '\0' counted in @size */
+		if (p == eol || *p == '\0')
+			continue;
 
-		line = strtok_r(NULL, "\n", &next);
+		r = parse_kallsyms_line(&ld, p, eol);
+		if (r < 0) {
+			if (r == -ENOMEM)
+				goto out;
+			tep_warning("Failed to parse kallsyms line: %.*s",
+				    (int)(eol - line), line);
+			goto out_load;
+		}
 	}
-	free(line);
 	ret = 0;
+ out_load:
+	/* Keep what was parsed before an error, like a register per line would */
+	if (ld.nr && (sym_loader_sort(&ld) || func_map_init(tep, &ld)))
+		ret = -1;
+	func_cache_invalidate(tep);
+	if (!ret)
+		digest_input(tep, TEP_CACHE_KALLSYMS, buf, size);
  out:
-	free(copy);
+	sym_loader_free(&ld);
+	return ret;
+}
+
+static int parse_fd(struct tep_handle *tep, int fd,
+		    int (*parse)(struct tep_handle *, const char *, size_t))
+{
+	struct stat st;
+	size_t alloc = 0;
+	size_t size = 0;
+	ssize_t r;
+	char *buf = NULL;
+	char *tmp;
+	int ret;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			ret = parse(tep, buf, st.st_size);
+			munmap(buf, st.st_size);
+			return ret;
+		}
+		buf = NULL;
+	}
+
+	/* Files in /proc have no size and can not be mapped */
+	do {
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 1 << 16;
+			tmp = realloc(buf, alloc);
+			if (!tmp) {
+				free(buf);
+				return -1;
+			}
+			buf = tmp;
+		}
+		r = read(fd, buf + size, alloc - size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			free(buf);
+			return -1;
+		}
+		size += r;
+	} while (r);
+
+	ret = parse(tep, buf, size);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * tep_parse_kallsyms_fd - load functions from a /proc/kallsyms file
+ * @tep: a handle to the trace event parser
+ * @fd: A file descriptor of a file with the /proc/kallsyms format
+ *
+ * Like tep_parse_kallsyms() but reads the content from @fd. A regular
+ * file is memory mapped instead of being read.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int tep_parse_kallsyms_fd(struct tep_handle *tep, int fd)
+{
+	return parse_fd(tep, fd, tep_parse_kallsyms_buf);
+}
 
-	return ret;
+/**
+ * tep_parse_kallsyms - load functions from a read of /proc/kallsyms
+ * @tep: a handle to the trace event parser
+ * @kallsyms: A string buffer that holds the content of /proc/kallsyms and ends with '\0'
+ *
+ * This is a helper function to parse the Linux kernel /proc/kallsyms
+ * format (stored in a string buffer) and load the functions into
+ * the @tep handler such that function IP addresses can be mapped to
+ * their name when parsing events with %pS in the print format field.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int tep_parse_kallsyms(struct tep_handle *tep, const char *kallsyms)
+{
+	return tep_parse_kallsyms_buf(tep, kallsyms, strlen(kallsyms));
 }
 
 /**
@@ -813,27 +2108,25 @@ int tep_parse_kallsyms(struct tep_handle *tep, const char *kallsyms)
  */
 void tep_print_funcs(struct tep_handle *tep)
 {
-	int i;
+	struct func_table *table;
+	unsigned int i;
+
+	if (func_table_dirty(tep) && func_map_init(tep, NULL))
+		return;
 
-	if (!tep->func_map)
-		func_map_init(tep);
+	table = tep->func_table;
 
-	for (i = 0; i < (int)tep->func_count; i++) {
+	for (i = 0; i < table->nr; i++) {
 		printf("%016llx %s",
-		       tep->func_map[i].addr,
-		       tep->func_map[i].func);
-		if (tep->func_map[i].mod)
-			printf(" [%s]\n", tep->func_map[i].mod);
+		       table->addrs[i],
+		       func_table_name(table, i));
+		if (table->mod_offs[i])
+			printf(" [%s]\n", func_table_mod(table, i));
 		else
 			printf("\n");
 	}
 }
 
-struct printk_map {
-	unsigned long long		addr;
-	char				*printk;
-};
-
 struct printk_list {
 	struct printk_list	*next;
 	unsigned long long	addr;
@@ -845,6 +2138,7 @@ static int printk_cmp(const void *a, const void *b)
 	const struct printk_map *pa = a;
 	const struct printk_map *pb = b;
 
+	search_probe();
 	if (pa->addr < pb->addr)
 		return -1;
 	if (pa->addr > pb->addr)
@@ -853,33 +2147,87 @@ static int printk_cmp(const void *a, const void *b)
 	return 0;
 }
 
-static int printk_map_init(struct tep_handle *tep)
+/*
+ * Build the printk map from the registered strings, and the strings
+ * loaded in @ld if it is not NULL. All the strings of the map are kept
+ * in the single tep->printk_strs buffer.
+ */
+static int printk_map_init(struct tep_handle *tep, struct sym_loader *ld)
 {
 	struct printk_list *printklist;
 	struct printk_list *item;
 	struct printk_map *printk_map;
-	int i;
+	unsigned int map_nr = tep->printk_map ? tep->printk_nr : 0;
+	unsigned int nr = 0;
+	size_t size = 0;
+	char *strs;
+	unsigned int i;
 
-	printk_map = malloc(sizeof(*printk_map) * (tep->printk_count + 1));
+	printk_map = malloc(sizeof(*printk_map) *
+			    (tep->printk_count + (ld ? ld->nr : 0) + 1));
 	if (!printk_map)
 		return -1;
 
-	printklist = tep->printklist;
+	/* Nothing to merge with, use the loaded strings as is */
+	if (ld && !map_nr && !tep->printklist) {
+		strs = sym_loader_take_strs(ld);
+		for (i = 0; i < ld->nr; i++) {
+			printk_map[i].addr = ld->entries[i].addr;
+			printk_map[i].printk = strs + ld->entries[i].name;
+		}
+		nr = ld->nr;
+		goto out;
+	}
 
-	i = 0;
+	for (i = 0; i < map_nr; i++)
+		printk_map[nr++] = tep->printk_map[i];
+
+	for (printklist = tep->printklist; printklist; printklist = printklist->next) {
+		printk_map[nr].printk = printklist->printk;
+		printk_map[nr].addr = printklist->addr;
+		nr++;
+	}
+
+	for (i = 0; ld && i < ld->nr; i++) {
+		printk_map[nr].addr = ld->entries[i].addr;
+		printk_map[nr].printk = ld->strs + ld->entries[i].name;
+		nr++;
+	}
+
+	qsort(printk_map, nr, sizeof(*printk_map), printk_cmp);
+
+	for (i = 0; i < nr; i++)
+		size += strlen(printk_map[i].printk) + 1;
+
+	strs = malloc(size ? size : 1);
+	if (!strs) {
+		free(printk_map);
+		return -1;
+	}
+
+	for (size = 0, i = 0; i < nr; i++) {
+		size_t len = strlen(printk_map[i].printk) + 1;
+
+		memcpy(strs + size, printk_map[i].printk, len);
+		printk_map[i].printk = strs + size;
+		size += len;
+	}
+ out:
+	printklist = tep->printklist;
 	while (printklist) {
-		printk_map[i].printk = printklist->printk;
-		printk_map[i].addr = printklist->addr;
-		i++;
 		item = printklist;
 		printklist = printklist->next;
+		free(item->printk);
 		free(item);
 	}
 
-	qsort(printk_map, tep->printk_count, sizeof(*printk_map), printk_cmp);
-
+	free(tep->printk_map);
+	free(tep->printk_strs);
 	tep->printk_map = printk_map;
+	tep->printk_strs = strs;
 	tep->printklist = NULL;
+	tep->printk_count = nr;
+	tep->printk_nr = nr;
 
 	return 0;
 }
@@ -889,18 +2237,49 @@ find_printk(struct tep_handle *tep, unsigned long long addr)
 {
 	struct printk_map *printk;
 	struct printk_map key;
+	bool locked;
 
-	if (!tep->printk_map && printk_map_init(tep))
+	locked = handle_lock(tep);
+	if ((!tep->printk_map || tep->printklist) && printk_map_init(tep, NULL)) {
+		handle_unlock(tep, locked);
 		return NULL;
+	}
 
 	key.addr = addr;
 
-	printk = bsearch(&key, tep->printk_map, tep->printk_count,
+	search_probes_reset();
+	printk = bsearch(&key, tep->printk_map, tep->printk_nr,
 			 sizeof(*tep->printk_map), printk_cmp);
+	tep_stat_inc(tep->stats.printk_searches);
+	tep_stat_add(tep->stats.printk_probes, search_probes);
+	handle_unlock(tep, locked);
 
 	return printk;
 }
 
+/*
+ * Strip off quotes and '\n' from the end. Returns the start of the
+ * string and updates @len.
+ */
+static const char *printk_trim(const char *fmt, size_t *len)
+{
+	size_t l = *len;
+
+	if (l && fmt[0] == '"') {
+		fmt++;
+		l--;
+	}
+
+	if (l && fmt[l - 1] == '"') {
+		l--;
+		if (l >= 2 && fmt[l - 2] == '\\' && fmt[l - 1] == 'n')
+			l -= 2;
+	}
+
+	*len = l;
+	return fmt;
+}
+
 /**
  * tep_register_print_string - register a string by its address
  * @tep: a handle to the trace event parser context
@@ -913,30 +2292,24 @@ find_printk(struct tep_handle *tep, unsigned long long addr)
 int tep_register_print_string(struct tep_handle *tep, const char *fmt,
 			      unsigned long long addr)
 {
-	struct printk_list *item = malloc(sizeof(*item));
-	char *p;
+	struct printk_list *item;
+	size_t len = strlen(fmt);
 
+	if (handle_busy(tep))
+		return -1;
+
+	item = malloc(sizeof(*item));
 	if (!item)
 		return -1;
 
 	item->next = tep->printklist;
 	item->addr = addr;
 
-	/* Strip off quotes and '\n' from the end */
-	if (fmt[0] == '"')
-		fmt++;
-	item->printk = strdup(fmt);
+	fmt = printk_trim(fmt, &len);
+	item->printk = strndup(fmt, len);
 	if (!item->printk)
 		goto out_free;
 
-	p = item->printk + strlen(item->printk) - 1;
-	if (*p == '"')
-		*p = 0;
-
-	p -= 2;
-	if (strcmp(p, "\\n") == 0)
-		*p = 0;
-
 	tep->printklist = item;
 	tep->printk_count++;
 
@@ -956,18 +2329,129 @@ out_free:
  */
 void tep_print_printk(struct tep_handle *tep)
 {
-	int i;
+	unsigned int i;
 
-	if (!tep->printk_map)
-		printk_map_init(tep);
+	if ((!tep->printk_map || tep->printklist) && printk_map_init(tep, NULL))
+		return;
 
-	for (i = 0; i < (int)tep->printk_count; i++) {
+	for (i = 0; i < tep->printk_nr; i++) {
 		printf("%016llx %s\n",
 		       tep->printk_map[i].addr,
 		       tep->printk_map[i].printk);
 	}
 }
 
+/*
+ * Parses one line of printk_formats:
+ *
+ *   0x<addr> : "<format>"
+ *
+ * Returns 0 on success, 1 for a line without ':', and a negative errno
+ * on error.
+ */
+static int parse_printk_line(struct sym_loader *ld,
+			     const char *p, const char *end)
+{
+	unsigned long long addr = 0;
+	const char *fmt;
+	size_t len;
+
+	fmt = memchr(p, ':', end - p);
+	if (!fmt)
+		return 1;
+
+	p = sym_skip_space(p, fmt);
+	if (fmt - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+		p += 2;
+	sym_parse_hex(p, fmt, &addr);
+
+	/* fmt still has a space, skip it */
+	fmt++;
+	if (fmt < end && *fmt == ' ')
+		fmt++;
+
+	len = end - fmt;
+	/* A string buffer may have its '\0' counted in the size */
+	if (len && fmt[len - 1] == '\0')
+		len--;
+	if (len && fmt[len - 1] == '\r')
+		len--;
+	fmt = printk_trim(fmt, &len);
+
+	if (!sym_loader_add(ld, addr, fmt, len))
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * tep_parse_printk_formats_buf - Parse the address to strings from a buffer
+ * @tep: a handle to the trace event parser
+ * @buf: A buffer that holds the content of printk_formats
+ * @size: The size of @buf, which does not need to end with '\0'
+ *
+ * Like tep_parse_printk_formats() but @buf does not need to be a string,
+ * which allows it to be a memory mapped file.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int tep_parse_printk_formats_buf(struct tep_handle *tep, const char *buf,
+				 size_t size)
+{
+	const char *end = buf + size;
+	const char *line = buf;
+	struct sym_loader ld;
+	const char *eol;
+	int ret = -1;
+	int r;
+
+	if (handle_busy(tep))
+		return -1;
+
+	if (sym_loader_init(&ld, size))
+		return -1;
+
+	for (; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+
+		if (line == eol || *line == '\0')
+			continue;
+
+		r = parse_printk_line(&ld, line, eol);
+		if (r < 0)
+			goto out;
+		if (r > 0) {
+			tep_warning("printk format with empty entry");
+			break;
+		}
+	}
+
+	if (ld.nr && (sym_loader_sort(&ld) || printk_map_init(tep, &ld)))
+		goto out;
+	digest_input(tep, TEP_CACHE_PRINTK, buf, size);
+	ret = 0;
+ out:
+	sym_loader_free(&ld);
+	return ret;
+}
+
+/**
+ * tep_parse_printk_formats_fd - Parse the address to strings from a file
+ * @tep: a handle to the trace event parser
+ * @fd: A file descriptor of a file with the printk_formats format
+ *
+ * Like tep_parse_printk_formats() but reads the content from @fd.
+ * A regular file is memory mapped instead of being read.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int tep_parse_printk_formats_fd(struct tep_handle *tep, int fd)
+{
+	return parse_fd(tep, fd, tep_parse_printk_formats_buf);
+}
+
 /**
  * tep_parse_printk_formats - Parse the address to strings
  * @tep: a handle to the trace event parser
@@ -984,44 +2468,301 @@ void tep_print_printk(struct tep_handle *tep)
  */
 int tep_parse_printk_formats(struct tep_handle *tep, const char *buf)
 {
-	unsigned long long addr;
-	char *addr_str;
-	char *printk;
-	char *copy;
-	char *line;
-	char *next;
-	char *fmt;
-	int ret = -1;
+	return tep_parse_printk_formats_buf(tep, buf, strlen(buf));
+}
 
-	copy = strdup(buf);
-	if (!copy)
-		return -1;
+/*
+ * The fields and print format of an event. The events of one class in
+ * the kernel have the same format text, apart from their name and ID,
+ * and share a single schema that is only parsed once. The first event
+ * parsed with a schema uses its fields, the others get copies of them
+ * that refer to themselves.
+ *
+ * The handles that set TEP_SHARE_FORMATS also share their schemas with
+ * each other, through a process wide store. Such a schema does not refer
+ * to any handle: its fields are only used by its print arguments, and
+ * have no event. The print functions of a handle can not be shared, so
+ * the schemas with print formats that call them are not put in the store.
+ */
+struct event_schema {
+	struct event_schema	*next;
+	unsigned int		hash;
+	int			ref;
+	bool			hashed;
+	int			long_size;
+	int			flags;
+	unsigned long		len;
+	char			*text;
+	struct tep_format	format;
+	struct tep_print_fmt	print_fmt;
+	/* The print format, when it is parsed on first use */
+	char			*print_text;
+	unsigned long		print_len;
+	bool			print_parsed;
+	struct tep_arena	arena;
+};
 
-	line = strtok_r(copy, "\n", &next);
-	while (line) {
-		addr_str = strtok_r(line, ":", &fmt);
-		if (!addr_str) {
-			tep_warning("printk format with empty entry");
-			break;
+/* A schema as used by the events of one handle */
+struct event_layout {
+	struct event_layout	*next;
+	int			ref;
+	bool			hashed;
+	struct event_schema	*schema;
+};
+
+#define LAYOUT_HASH_INIT_SIZE	256
+
+/* The schemas shared by handles, protected by @schema_lock */
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct event_schema **schemas;
+static unsigned int schemas_size;
+static unsigned int nr_schemas;
+
+/*
+ * An event, the layout it uses and the arena that the rest of the
+ * event, like its name, is allocated from.
+ */
+struct event_alloc {
+	struct tep_event	event;
+	struct event_layout	*layout;
+	struct tep_arena	arena;
+};
+
+static struct tep_event *alloc_event(void)
+{
+	struct event_alloc *ealloc;
+
+	ealloc = calloc(1, sizeof(*ealloc));
+	if (!ealloc)
+		return NULL;
+	return &ealloc->event;
+}
+
+static struct event_alloc *to_event_alloc(struct tep_event *event)
+{
+	return (struct event_alloc *)event;
+}
+
+/* FNV-1a */
+static unsigned int layout_hash(const char *text, unsigned long len)
+{
+	unsigned int hash = 2166136261u;
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+	return hash;
+}
+
+static bool schema_matches(struct event_schema *schema, unsigned int hash,
+			   const char *text, unsigned long len, int long_size)
+{
+	return schema->hash == hash && schema->len == len &&
+		schema->long_size == long_size &&
+		memcmp(schema->text, text, len) == 0;
+}
+
+/* Called with tep->lock held */
+static struct event_layout *find_layout(struct tep_handle *tep,
+					unsigned int hash, const char *text,
+					unsigned long len)
+{
+	struct event_layout *layout;
+
+	if (!tep->layouts)
+		return NULL;
+
+	for (layout = tep->layouts[hash & (tep->layouts_size - 1)];
+	     layout; layout = layout->next) {
+		if (schema_matches(layout->schema, hash, text, len,
+				   tep->long_size))
+			return layout;
+	}
+	return NULL;
+}
+
+/* Called with tep->lock held */
+static void add_layout(struct tep_handle *tep, struct event_layout *layout)
+{
+	struct event_layout **layouts;
+	struct event_layout *l;
+	unsigned int size;
+	unsigned int i;
+
+	if (tep->nr_layouts >= tep->layouts_size) {
+		size = tep->layouts_size ? tep->layouts_size * 2 :
+					   LAYOUT_HASH_INIT_SIZE;
+		layouts = calloc(size, sizeof(*layouts));
+		/* The layout is just not shared */
+		if (!layouts)
+			return;
+
+		for (i = 0; i < tep->layouts_size; i++) {
+			while ((l = tep->layouts[i])) {
+				tep->layouts[i] = l->next;
+				l->next = layouts[l->schema->hash & (size - 1)];
+				layouts[l->schema->hash & (size - 1)] = l;
+			}
+		}
+		free(tep->layouts);
+		tep->layouts = layouts;
+		tep->layouts_size = size;
+	}
+
+	i = layout->schema->hash & (tep->layouts_size - 1);
+	layout->next = tep->layouts[i];
+	tep->layouts[i] = layout;
+	layout->hashed = true;
+	tep->nr_layouts++;
+}
+
+/* Returns a reference to the schema of the store for @text, if any */
+static struct event_schema *find_schema(unsigned int hash, const char *text,
+					unsigned long len, int long_size)
+{
+	struct event_schema *schema = NULL;
+
+	pthread_mutex_lock(&schema_lock);
+	if (schemas) {
+		for (schema = schemas[hash & (schemas_size - 1)];
+		     schema; schema = schema->next) {
+			if (schema_matches(schema, hash, text, len, long_size)) {
+				schema->ref++;
+				break;
+			}
 		}
-		addr = strtoull(addr_str, NULL, 16);
-		/* fmt still has a space, skip it */
-		printk = strdup(fmt+1);
-		if (!printk)
+	}
+	pthread_mutex_unlock(&schema_lock);
+
+	return schema;
+}
+
+static void add_schema(struct event_schema *schema)
+{
+	struct event_schema **table;
+	struct event_schema *s;
+	unsigned int size;
+	unsigned int i;
+
+	pthread_mutex_lock(&schema_lock);
+	if (nr_schemas >= schemas_size) {
+		size = schemas_size ? schemas_size * 2 : LAYOUT_HASH_INIT_SIZE;
+		table = calloc(size, sizeof(*table));
+		/* The schema is just not shared */
+		if (!table)
 			goto out;
-		line = strtok_r(NULL, "\n", &next);
-		tep_register_print_string(tep, printk, addr);
-		free(printk);
+
+		for (i = 0; i < schemas_size; i++) {
+			while ((s = schemas[i])) {
+				schemas[i] = s->next;
+				s->next = table[s->hash & (size - 1)];
+				table[s->hash & (size - 1)] = s;
+			}
+		}
+		free(schemas);
+		schemas = table;
+		schemas_size = size;
 	}
-	ret = 0;
+
+	i = schema->hash & (schemas_size - 1);
+	schema->next = schemas[i];
+	schemas[i] = schema;
+	schema->hashed = true;
+	nr_schemas++;
  out:
-	free(copy);
-	return ret;
+	pthread_mutex_unlock(&schema_lock);
 }
 
-static struct tep_event *alloc_event(void)
+static void put_schema(struct event_schema *schema)
+{
+	struct event_schema **next;
+	int ref;
+
+	if (!schema)
+		return;
+
+	/* Only the schemas of the store have more than one user */
+	if (schema->hashed) {
+		pthread_mutex_lock(&schema_lock);
+		ref = --schema->ref;
+		if (!ref) {
+			next = &schemas[schema->hash & (schemas_size - 1)];
+			while (*next != schema)
+				next = &(*next)->next;
+			*next = schema->next;
+			if (!--nr_schemas) {
+				free(schemas);
+				schemas = NULL;
+				schemas_size = 0;
+			}
+		}
+		pthread_mutex_unlock(&schema_lock);
+		if (ref)
+			return;
+	}
+
+	arena_free(&schema->arena);
+	free(schema);
+}
+
+static void put_layout(struct event_layout *layout)
+{
+	if (!layout || __atomic_sub_fetch(&layout->ref, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	put_schema(layout->schema);
+	free(layout);
+}
+
+static struct tep_format_field *
+copy_fields(struct tep_handle *tep, struct tep_arena *arena,
+	    struct tep_event *event, struct tep_format_field *field)
+{
+	struct tep_format_field *fields = NULL;
+	struct tep_format_field **next = &fields;
+	struct tep_format_field *copy;
+
+	for (; field; field = field->next) {
+		copy = arena_alloc(arena, sizeof(*copy));
+		if (!copy)
+			return NULL;
+		*copy = *field;
+		copy->event = event;
+		copy->name = copy->alias =
+			(char *)strtab_intern(&tep->strings, field->name);
+		copy->type = (char *)strtab_intern(&tep->strings, field->type);
+		if (!copy->name || !copy->type)
+			return NULL;
+		copy->next = NULL;
+		*next = copy;
+		next = &copy->next;
+	}
+	/* Not NULL if there are fields, so that a failure can be told */
+	return fields;
+}
+
+/* Give @event its own copy of the fields of its schema */
+static int event_copy_fields(struct tep_handle *tep, struct tep_event *event)
 {
-	return calloc(1, sizeof(struct tep_event));
+	struct event_alloc *ealloc = to_event_alloc(event);
+	struct tep_format *format = &ealloc->layout->schema->format;
+	int ret = -1;
+
+	event->format = *format;
+
+	pthread_mutex_lock(&tep->lock);
+	event->format.common_fields = copy_fields(tep, &ealloc->arena, event,
+						  format->common_fields);
+	if (format->common_fields && !event->format.common_fields)
+		goto out;
+	event->format.fields = copy_fields(tep, &ealloc->arena, event,
+					   format->fields);
+	if (format->fields && !event->format.fields)
+		goto out;
+	ret = 0;
+ out:
+	pthread_mutex_unlock(&tep->lock);
+	return ret;
 }
 
 static int add_event(struct tep_handle *tep, struct tep_event *event)
@@ -1068,9 +2809,9 @@ static void free_flag_sym(struct tep_print_flag_sym *fsym)
 
 	while (fsym) {
 		next = fsym->next;
-		free(fsym->value);
-		free(fsym->str);
-		free(fsym);
+		parse_free(fsym->value);
+		parse_free(fsym->str);
+		parse_free(fsym);
 		fsym = next;
 	}
 }
@@ -1084,14 +2825,14 @@ static void free_arg(struct tep_print_arg *arg)
 
 	switch (arg->type) {
 	case TEP_PRINT_ATOM:
-		free(arg->atom.atom);
+		parse_free(arg->atom.atom);
 		break;
 	case TEP_PRINT_FIELD:
-		free(arg->field.name);
+		parse_free(arg->field.name);
 		break;
 	case TEP_PRINT_FLAGS:
 		free_arg(arg->flags.field);
-		free(arg->flags.delim);
+		parse_free(arg->flags.delim);
 		free_flag_sym(arg->flags.flags);
 		break;
 	case TEP_PRINT_SYMBOL:
@@ -1109,23 +2850,23 @@ static void free_arg(struct tep_print_arg *arg)
 		free_arg(arg->int_array.el_size);
 		break;
 	case TEP_PRINT_TYPE:
-		free(arg->typecast.type);
+		parse_free(arg->typecast.type);
 		free_arg(arg->typecast.item);
 		break;
 	case TEP_PRINT_STRING:
 	case TEP_PRINT_BSTRING:
-		free(arg->string.string);
+		parse_free(arg->string.string);
 		break;
 	case TEP_PRINT_BITMASK:
 	case TEP_PRINT_CPUMASK:
-		free(arg->bitmask.bitmask);
+		parse_free(arg->bitmask.bitmask);
 		break;
 	case TEP_PRINT_DYNAMIC_ARRAY:
 	case TEP_PRINT_DYNAMIC_ARRAY_LEN:
-		free(arg->dynarray.index);
+		parse_free(arg->dynarray.index);
 		break;
 	case TEP_PRINT_OP:
-		free(arg->op.op);
+		parse_free(arg->op.op);
 		free_arg(arg->op.left);
 		free_arg(arg->op.right);
 		break;
@@ -1142,7 +2883,7 @@ static void free_arg(struct tep_print_arg *arg)
 		break;
 	}
 
-	free(arg);
+	parse_free(arg);
 }
 
 static enum tep_event_type get_type(int ch)
@@ -1162,62 +2903,117 @@ static enum tep_event_type get_type(int ch)
 	if (ch == '(' || ch == ')' || ch == ',')
 		return TEP_EVENT_DELIM;
 
-	return TEP_EVENT_OP;
+	return TEP_EVENT_OP;
+}
+
+static int __read_char(struct tep_handle *tep)
+{
+	if (parser.input_buf_ptr >= parser.input_buf_siz)
+		return -1;
+
+	return parser.input_buf[parser.input_buf_ptr++];
+}
+
+/**
+ * peek_char - peek at the next character that will be read
+ *
+ * Returns the next character read, or -1 if end of buffer.
+ */
+__hidden int peek_char(struct tep_handle *tep)
+{
+	if (parser.input_buf_ptr >= parser.input_buf_siz)
+		return -1;
+
+	return parser.input_buf[parser.input_buf_ptr];
+}
+
+/*
+ * A token as a slice of the input buffer, so that tokens which are only
+ * checked and thrown away never need to be copied. A string made of
+ * several quoted parts ("a" "b") can not be a slice of the input, it is
+ * joined into @buf, which the owner of the slice must free.
+ */
+struct token_slice {
+	const char	*str;
+	unsigned int	len;
+	char		*buf;
+};
+
+static void slice_free(struct token_slice *tok)
+{
+	free(tok->buf);
+	tok->buf = NULL;
 }
 
-static int __read_char(struct tep_handle *tep)
+static bool slice_eq(struct token_slice *tok, const char *str)
 {
-	if (tep->input_buf_ptr >= tep->input_buf_siz)
-		return -1;
+	return strlen(str) == tok->len && memcmp(tok->str, str, tok->len) == 0;
+}
 
-	return tep->input_buf[tep->input_buf_ptr++];
+/* Returns the token as an allocated string */
+static char *slice_dup(struct token_slice *tok)
+{
+	char *str;
+
+	if (tok->buf && !parser.arena) {
+		str = tok->buf;
+		tok->buf = NULL;
+		return str;
+	}
+	str = parse_strndup(tok->str, tok->len);
+	slice_free(tok);
+	return str;
 }
 
-/**
- * peek_char - peek at the next character that will be read
- *
- * Returns the next character read, or -1 if end of buffer.
- */
-__hidden int peek_char(struct tep_handle *tep)
+static unsigned long slice_strtoul(struct token_slice *tok)
 {
-	if (tep->input_buf_ptr >= tep->input_buf_siz)
-		return -1;
+	char buf[32];
+	unsigned int len = tok->len;
+
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	memcpy(buf, tok->str, len);
+	buf[len] = '\0';
 
-	return tep->input_buf[tep->input_buf_ptr];
+	return strtoul(buf, NULL, 0);
 }
 
-static int extend_token(char **tok, char *buf, int size)
+/* Add the quoted part from @start of length @len to the joined string */
+static int slice_join(struct token_slice *tok, const char *start,
+		      unsigned int len)
 {
-	char *newtok = realloc(*tok, size);
+	char *buf;
 
-	if (!newtok) {
-		free(*tok);
-		*tok = NULL;
+	buf = realloc(tok->buf, tok->len + len + 1);
+	if (!buf) {
+		slice_free(tok);
+		tok->str = NULL;
+		tok->len = 0;
 		return -1;
 	}
-
-	if (!*tok)
-		strcpy(newtok, buf);
-	else
-		strcat(newtok, buf);
-	*tok = newtok;
+	memcpy(buf + tok->len, start, len);
+	tok->len += len;
+	buf[tok->len] = '\0';
+	tok->buf = buf;
+	tok->str = buf;
 
 	return 0;
 }
 
 static enum tep_event_type force_token(struct tep_handle *tep, const char *str,
-		char **tok);
+				       struct token_slice *tok);
 
-static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
+static enum tep_event_type __read_slice(struct tep_handle *tep,
+					struct token_slice *tok)
 {
-	char buf[BUFSIZ];
 	int ch, last_ch, quote_ch, next_ch;
-	int i = 0;
-	int tok_size = 0;
 	enum tep_event_type type;
+	const char *start;
+	unsigned int len;
 
-	*tok = NULL;
-
+	tok->str = NULL;
+	tok->len = 0;
+	tok->buf = NULL;
 
 	ch = __read_char(tep);
 	if (ch < 0)
@@ -1227,24 +3023,19 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 	if (type == TEP_EVENT_NONE)
 		return type;
 
-	buf[i++] = ch;
+	start = parser.input_buf + parser.input_buf_ptr - 1;
 
 	switch (type) {
 	case TEP_EVENT_NEWLINE:
 	case TEP_EVENT_DELIM:
-		*tok = malloc(2);
-		if (!*tok)
-			return TEP_EVENT_ERROR;
-		(*tok)[0] = ch;
-		(*tok)[1] = '\0';
-		return type;
+		goto out;
 
 	case TEP_EVENT_OP:
 		switch (ch) {
 		case '-':
 			next_ch = peek_char(tep);
 			if (next_ch == '>') {
-				buf[i++] = __read_char(tep);
+				__read_char(tep);
 				break;
 			}
 			/* fall through */
@@ -1257,7 +3048,7 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 			ch = peek_char(tep);
 			if (ch != last_ch)
 				goto test_equal;
-			buf[i++] = __read_char(tep);
+			__read_char(tep);
 			switch (last_ch) {
 			case '>':
 			case '<':
@@ -1272,35 +3063,24 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 		default: /* what should we do instead? */
 			break;
 		}
-		buf[i] = 0;
-		*tok = strdup(buf);
-		return type;
+		goto out;
 
  test_equal:
 		ch = peek_char(tep);
 		if (ch == '=')
-			buf[i++] = __read_char(tep);
+			__read_char(tep);
 		goto out;
 
 	case TEP_EVENT_DQUOTE:
 	case TEP_EVENT_SQUOTE:
 		/* don't keep quotes */
-		i--;
 		quote_ch = ch;
 		last_ch = 0;
  concat:
+		start = parser.input_buf + parser.input_buf_ptr;
 		do {
-			if (i == (BUFSIZ - 1)) {
-				buf[i] = 0;
-				tok_size += BUFSIZ;
-
-				if (extend_token(tok, buf, tok_size) < 0)
-					return TEP_EVENT_NONE;
-				i = 0;
-			}
 			last_ch = ch;
 			ch = __read_char(tep);
-			buf[i++] = ch;
 			/* the '\' '\' will cancel itself */
 			if (ch == '\\' && last_ch == '\\')
 				last_ch = 0;
@@ -1308,8 +3088,11 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 			if (ch <= 0)
 				break;
 		} while ((ch != quote_ch && isprint(ch)) || last_ch == '\\' || ch == '\n');
-		/* remove the last quote */
-		i--;
+
+		/* remove the last quote, or whatever ended the string */
+		len = parser.input_buf + parser.input_buf_ptr - start;
+		if (ch >= 0)
+			len--;
 
 		if (ch <= 0)
 			type = TEP_EVENT_NONE;
@@ -1319,17 +3102,27 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 		 * If it is another string, concatinate the two.
 		 */
 		if (type == TEP_EVENT_DQUOTE) {
-			unsigned long long save_input_buf_ptr = tep->input_buf_ptr;
+			unsigned long long save_input_buf_ptr = parser.input_buf_ptr;
 
 			do {
 				ch = __read_char(tep);
 			} while (isspace(ch));
-			if (ch == '"')
+			if (ch == '"') {
+				if (slice_join(tok, start, len) < 0)
+					return TEP_EVENT_NONE;
 				goto concat;
-			tep->input_buf_ptr = save_input_buf_ptr;
+			}
+			parser.input_buf_ptr = save_input_buf_ptr;
 		}
 
-		goto out;
+		if (tok->buf) {
+			if (slice_join(tok, start, len) < 0)
+				return TEP_EVENT_NONE;
+			return type;
+		}
+		tok->str = start;
+		tok->len = len;
+		return type;
 
 	case TEP_EVENT_ERROR ... TEP_EVENT_SPACE:
 	case TEP_EVENT_ITEM:
@@ -1337,23 +3130,12 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 		break;
 	}
 
-	while (get_type(peek_char(tep)) == type) {
-		if (i == (BUFSIZ - 1)) {
-			buf[i] = 0;
-			tok_size += BUFSIZ;
-
-			if (extend_token(tok, buf, tok_size) < 0)
-				return TEP_EVENT_NONE;
-			i = 0;
-		}
-		ch = __read_char(tep);
-		buf[i++] = ch;
-	}
+	while (get_type(peek_char(tep)) == type)
+		__read_char(tep);
 
  out:
-	buf[i] = 0;
-	if (extend_token(tok, buf, tok_size + i + 1) < 0)
-		return TEP_EVENT_NONE;
+	tok->str = start;
+	tok->len = parser.input_buf + parser.input_buf_ptr - start;
 
 	if (type == TEP_EVENT_ITEM) {
 		/*
@@ -1364,49 +3146,78 @@ static enum tep_event_type __read_token(struct tep_handle *tep, char **tok)
 		 * See Linux kernel commit:
 		 *  811cb50baf63461ce0bdb234927046131fc7fa8b
 		 */
-		if (strcmp(*tok, "LOCAL_PR_FMT") == 0) {
-			free(*tok);
-			*tok = NULL;
+		if (slice_eq(tok, "LOCAL_PR_FMT"))
 			return force_token(tep, "\"%s\" ", tok);
-		} else if (strcmp(*tok, "STA_PR_FMT") == 0) {
-			free(*tok);
-			*tok = NULL;
+		else if (slice_eq(tok, "STA_PR_FMT"))
 			return force_token(tep, "\" sta:%pM\" ", tok);
-		} else if (strcmp(*tok, "VIF_PR_FMT") == 0) {
-			free(*tok);
-			*tok = NULL;
+		else if (slice_eq(tok, "VIF_PR_FMT"))
 			return force_token(tep, "\" vif:%p(%d)\" ", tok);
-		}
 	}
 
 	return type;
 }
 
 static enum tep_event_type force_token(struct tep_handle *tep, const char *str,
-		char **tok)
+				       struct token_slice *tok)
 {
-	const char *save_input_buf;
-	unsigned long long save_input_buf_ptr;
-	unsigned long long save_input_buf_siz;
+	struct tep_parser save;
 	enum tep_event_type type;
-	
+
 	/* save off the current input pointers */
-	save_input_buf = tep->input_buf;
-	save_input_buf_ptr = tep->input_buf_ptr;
-	save_input_buf_siz = tep->input_buf_siz;
+	save = parser;
 
 	init_input_buf(tep, str, strlen(str));
 
-	type = __read_token(tep, tok);
+	type = __read_slice(tep, tok);
 
 	/* reset back to original token */
-	tep->input_buf = save_input_buf;
-	tep->input_buf_ptr = save_input_buf_ptr;
-	tep->input_buf_siz = save_input_buf_siz;
+	parser = save;
+
+	return type;
+}
+
+/* Hand out a copy of @slice in @tok for the callers that keep the token */
+static enum tep_event_type slice_token(enum tep_event_type type,
+				       struct token_slice *slice, char **tok)
+{
+	*tok = NULL;
+
+	if (!slice->str)
+		return type;
+
+	*tok = slice_dup(slice);
+	if (!*tok)
+		return TEP_EVENT_NONE;
 
 	return type;
 }
 
+/* Read the next token that is not white space, without copying it */
+static enum tep_event_type read_slice(struct tep_handle *tep,
+				      struct token_slice *tok)
+{
+	enum tep_event_type type;
+
+	for (;;) {
+		type = __read_slice(tep, tok);
+		if (type != TEP_EVENT_SPACE)
+			return type;
+	}
+}
+
+/* no newline */
+static enum tep_event_type read_slice_item(struct tep_handle *tep,
+					   struct token_slice *tok)
+{
+	enum tep_event_type type;
+
+	for (;;) {
+		type = __read_slice(tep, tok);
+		if (type != TEP_EVENT_SPACE && type != TEP_EVENT_NEWLINE)
+			return type;
+	}
+}
+
 /**
  * free_token - free a token returned by tep_read_token
  * @token: the token to free
@@ -1414,7 +3225,7 @@ static enum tep_event_type force_token(struct tep_handle *tep, const char *str,
 __hidden void free_token(char *tok)
 {
 	if (tok)
-		free(tok);
+		parse_free(tok);
 }
 
 /**
@@ -1428,37 +3239,21 @@ __hidden void free_token(char *tok)
  */
 __hidden enum tep_event_type read_token(struct tep_handle *tep, char **tok)
 {
+	struct token_slice slice;
 	enum tep_event_type type;
 
-	for (;;) {
-		type = __read_token(tep, tok);
-		if (type != TEP_EVENT_SPACE)
-			return type;
-
-		free_token(*tok);
-	}
-
-	/* not reached */
-	*tok = NULL;
-	return TEP_EVENT_NONE;
+	type = read_slice(tep, &slice);
+	return slice_token(type, &slice, tok);
 }
 
 /* no newline */
 static enum tep_event_type read_token_item(struct tep_handle *tep, char **tok)
 {
+	struct token_slice slice;
 	enum tep_event_type type;
 
-	for (;;) {
-		type = __read_token(tep, tok);
-		if (type != TEP_EVENT_SPACE && type != TEP_EVENT_NEWLINE)
-			return type;
-		free_token(*tok);
-		*tok = NULL;
-	}
-
-	/* not reached */
-	*tok = NULL;
-	return TEP_EVENT_NONE;
+	type = read_slice_item(tep, &slice);
+	return slice_token(type, &slice, tok);
 }
 
 static int test_type(enum tep_event_type type, enum tep_event_type expect)
@@ -1490,6 +3285,20 @@ static int test_type_token(enum tep_event_type type, const char *token,
 	return 0;
 }
 
+static int test_type_slice(enum tep_event_type type, struct token_slice *tok,
+			   enum tep_event_type expect, const char *expect_tok)
+{
+	if (test_type(type, expect))
+		return -1;
+
+	if (!slice_eq(tok, expect_tok)) {
+		do_warning("Error: expected '%s' but read '%.*s'",
+			   expect_tok, tok->len, tok->str);
+		return -1;
+	}
+	return 0;
+}
+
 static int __read_expect_type(struct tep_handle *tep, enum tep_event_type expect,
 		char **tok, int newline_ok)
 {
@@ -1511,18 +3320,18 @@ static int read_expect_type(struct tep_handle *tep, enum tep_event_type expect,
 static int __read_expected(struct tep_handle *tep, enum tep_event_type expect,
 		const char *str, int newline_ok)
 {
+	struct token_slice tok;
 	enum tep_event_type type;
-	char *token;
 	int ret;
 
 	if (newline_ok)
-		type = read_token(tep, &token);
+		type = read_slice(tep, &tok);
 	else
-		type = read_token_item(tep, &token);
+		type = read_slice_item(tep, &tok);
 
-	ret = test_type_token(type, token, expect, str);
+	ret = test_type_slice(type, &tok, expect, str);
 
-	free_token(token);
+	slice_free(&tok);
 
 	return ret;
 }
@@ -1539,6 +3348,22 @@ static int read_expected_item(struct tep_handle *tep, enum tep_event_type expect
 	return __read_expected(tep, expect, str, 0);
 }
 
+/* Read a number item, like the value of "offset:" or "size:" */
+static int read_expect_number(struct tep_handle *tep, unsigned long *val)
+{
+	struct token_slice tok;
+	enum tep_event_type type;
+
+	type = read_slice(tep, &tok);
+	if (test_type(type, TEP_EVENT_ITEM) < 0) {
+		slice_free(&tok);
+		return -1;
+	}
+
+	*val = slice_strtoul(&tok);
+	return 0;
+}
+
 static char *event_read_name(struct tep_handle *tep)
 {
 	char *token;
@@ -1561,8 +3386,7 @@ static char *event_read_name(struct tep_handle *tep)
 
 static int event_read_id(struct tep_handle *tep)
 {
-	char *token;
-	int id;
+	unsigned long id;
 
 	if (read_expected_item(tep, TEP_EVENT_ITEM, "ID") < 0)
 		return -1;
@@ -1570,16 +3394,10 @@ static int event_read_id(struct tep_handle *tep)
 	if (read_expected(tep, TEP_EVENT_OP, ":") < 0)
 		return -1;
 
-	if (read_expect_type(tep, TEP_EVENT_ITEM, &token) < 0)
-		goto fail;
+	if (read_expect_number(tep, &id) < 0)
+		return -1;
 
-	id = strtoul(token, NULL, 0);
-	free_token(token);
 	return id;
-
- fail:
-	free_token(token);
-	return -1;
 }
 
 static int field_is_string(struct tep_format_field *field)
@@ -1649,7 +3467,7 @@ static int append(char **buf, const char *delim, const char *str)
 {
 	char *new_buf;
 
-	new_buf = realloc(*buf, strlen(*buf) + strlen(delim) + strlen(str) + 1);
+	new_buf = parse_realloc(*buf, strlen(*buf) + strlen(delim) + strlen(str) + 1);
 	if (!new_buf)
 		return -1;
 	strcat(new_buf, delim);
@@ -1658,11 +3476,44 @@ static int append(char **buf, const char *delim, const char *str)
 	return 0;
 }
 
+/*
+ * Replace the name and type of a parsed field with the copies in the
+ * string table of the handle, shared by all the events.
+ */
+static int intern_field(struct tep_handle *tep, struct tep_format_field *field)
+{
+	const char *name;
+	const char *type;
+
+	pthread_mutex_lock(&tep->lock);
+	name = strtab_intern(&tep->strings, field->name);
+	type = strtab_intern(&tep->strings, field->type);
+	pthread_mutex_unlock(&tep->lock);
+	if (!name || !type)
+		return -1;
+
+	/* Give back the later allocation first, so that both can be reused */
+	if (field->name > field->type) {
+		parse_free(field->name);
+		parse_free(field->type);
+	} else {
+		parse_free(field->type);
+		parse_free(field->name);
+	}
+
+	field->name = field->alias = (char *)name;
+	field->type = (char *)type;
+
+	return 0;
+}
+
 static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 		struct tep_format_field **fields)
 {
 	struct tep_format_field *field = NULL;
+	struct token_slice tok;
 	enum tep_event_type type;
+	unsigned long val;
 	char *token;
 	char *last_token;
 	char *delim = " ";
@@ -1672,39 +3523,37 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 	do {
 		unsigned int size_dynamic = 0;
 
-		type = read_token(tep, &token);
-		if (type == TEP_EVENT_NEWLINE) {
-			free_token(token);
+		type = read_slice(tep, &tok);
+		if (type == TEP_EVENT_NEWLINE)
 			return count;
-		}
 
 		count++;
 
-		if (test_type_token(type, token, TEP_EVENT_ITEM, "field"))
-			goto fail;
-		free_token(token);
+		ret = test_type_slice(type, &tok, TEP_EVENT_ITEM, "field");
+		slice_free(&tok);
+		if (ret < 0)
+			goto fail_expect;
 
-		type = read_token(tep, &token);
+		type = read_slice(tep, &tok);
 		/*
 		 * The ftrace fields may still use the "special" name.
 		 * Just ignore it.
 		 */
 		if (event->flags & TEP_EVENT_FL_ISFTRACE &&
-		    type == TEP_EVENT_ITEM && strcmp(token, "special") == 0) {
-			free_token(token);
-			type = read_token(tep, &token);
-		}
+		    type == TEP_EVENT_ITEM && slice_eq(&tok, "special"))
+			type = read_slice(tep, &tok);
 
-		if (test_type_token(type, token, TEP_EVENT_OP, ":") < 0)
-			goto fail;
+		ret = test_type_slice(type, &tok, TEP_EVENT_OP, ":");
+		slice_free(&tok);
+		if (ret < 0)
+			goto fail_expect;
 
-		free_token(token);
 		if (read_expect_type(tep, TEP_EVENT_ITEM, &token) < 0)
 			goto fail;
 
 		last_token = token;
 
-		field = calloc(1, sizeof(*field));
+		field = parse_alloc(sizeof(*field));
 		if (!field)
 			goto fail;
 
@@ -1727,7 +3576,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 
 				if (field->type) {
 					ret = append(&field->type, delim, last_token);
-					free(last_token);
+					parse_free(last_token);
 					if (ret < 0)
 						goto fail;
 				} else
@@ -1766,7 +3615,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 					}
 					if (ret < 0)
 						goto fail;
-					free(last_token);
+					parse_free(last_token);
 					last_token = token;
 				}
 				continue;
@@ -1809,7 +3658,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 
 				ret = append(&brackets, delim, token);
 				if (ret < 0) {
-					free(brackets);
+					parse_free(brackets);
 					goto fail;
 				}
 				/* We only care about the last token */
@@ -1817,7 +3666,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 				free_token(token);
 				type = read_token(tep, &token);
 				if (type == TEP_EVENT_NONE) {
-					free(brackets);
+					parse_free(brackets);
 					do_warning_event(event, "failed to find token");
 					goto fail;
 				}
@@ -1827,7 +3676,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 
 			ret = append(&brackets, "", "]");
 			if (ret < 0) {
-				free(brackets);
+				parse_free(brackets);
 				goto fail_expect;
 			}
 
@@ -1841,7 +3690,7 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 			if (type == TEP_EVENT_ITEM) {
 				ret = append(&field->type, " ", field->name);
 				if (ret < 0) {
-					free(brackets);
+					parse_free(brackets);
 					goto fail;
 				}
 				ret = append(&field->type, "", brackets);
@@ -1853,11 +3702,11 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 			} else {
 				ret = append(&field->type, "", brackets);
 				if (ret < 0) {
-					free(brackets);
+					parse_free(brackets);
 					goto fail;
 				}
 			}
-			free(brackets);
+			parse_free(brackets);
 		}
 
 		if (field_is_string(field))
@@ -1879,10 +3728,9 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 		if (read_expected(tep, TEP_EVENT_OP, ":") < 0)
 			goto fail_expect;
 
-		if (read_expect_type(tep, TEP_EVENT_ITEM, &token))
-			goto fail;
-		field->offset = strtoul(token, NULL, 0);
-		free_token(token);
+		if (read_expect_number(tep, &val) < 0)
+			goto fail_expect;
+		field->offset = val;
 
 		if (read_expected(tep, TEP_EVENT_OP, ";") < 0)
 			goto fail_expect;
@@ -1893,10 +3741,9 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 		if (read_expected(tep, TEP_EVENT_OP, ":") < 0)
 			goto fail_expect;
 
-		if (read_expect_type(tep, TEP_EVENT_ITEM, &token))
-			goto fail;
-		field->size = strtoul(token, NULL, 0);
-		free_token(token);
+		if (read_expect_number(tep, &val) < 0)
+			goto fail_expect;
+		field->size = val;
 
 		/*
 		 * The old data format before dynamic arrays had dynamic
@@ -1922,13 +3769,12 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 			if (read_expected(tep, TEP_EVENT_OP, ":") < 0)
 				goto fail_expect;
 
-			if (read_expect_type(tep, TEP_EVENT_ITEM, &token))
-				goto fail;
+			if (read_expect_number(tep, &val) < 0)
+				goto fail_expect;
 
-			if (strtoul(token, NULL, 0))
+			if (val)
 				field->flags |= TEP_FIELD_IS_SIGNED;
 
-			free_token(token);
 			if (read_expected(tep, TEP_EVENT_OP, ";") < 0)
 				goto fail_expect;
 
@@ -1952,6 +3798,9 @@ static int event_read_fields(struct tep_handle *tep, struct tep_event *event,
 		} else
 			field->elementsize = field->size;
 
+		if (tep && !parser.shared && intern_field(tep, field) < 0)
+			goto fail_expect;
+
 		*fields = field;
 		fields = &field->next;
 		field = NULL;
@@ -1964,9 +3813,9 @@ fail:
 	free_token(token);
 fail_expect:
 	if (field) {
-		free(field->type);
-		free(field->name);
-		free(field);
+		parse_free(field->type);
+		parse_free(field->name);
+		parse_free(field);
 	}
 	return -1;
 }
@@ -2310,8 +4159,8 @@ static int consolidate_op_arg(enum tep_event_type type, struct tep_print_arg *ar
 	free_arg(arg->op.right);
 
 	arg->type = TEP_PRINT_ATOM;
-	free(arg->op.op);
-	return asprintf(&arg->atom.atom, "%lld", val) < 0 ? -1 : 0;
+	parse_free(arg->op.op);
+	return parse_asprintf(&arg->atom.atom, "%lld", val) < 0 ? -1 : 0;
 }
 
 /* Note, *tok does not get freed, but will most likely be saved */
@@ -2433,9 +4282,9 @@ process_op(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 			if (ret < 0)
 				goto out_warn_free;
 
-			free(arg->op.op);
+			parse_free(arg->op.op);
 			*arg = *left;
-			free(left);
+			parse_free(left);
 
 			return type;
 		}
@@ -2548,12 +4397,12 @@ process_entry(struct tep_event *event __maybe_unused, struct tep_print_arg *arg,
 
 	arg->field.field = tep_find_any_field(event, arg->field.name);
 
-	if (is_flag_field) {
+	if (parser.is_flag_field) {
 		arg->field.field->flags |= TEP_FIELD_IS_FLAG;
-		is_flag_field = 0;
-	} else if (is_symbolic_field) {
+		parser.is_flag_field = 0;
+	} else if (parser.is_symbolic_field) {
 		arg->field.field->flags |= TEP_FIELD_IS_SYMBOLIC;
-		is_symbolic_field = 0;
+		parser.is_symbolic_field = 0;
 	}
 
 	type = read_token(event->tep, &token);
@@ -2892,7 +4741,7 @@ static int arg_num_eval(struct tep_print_arg *arg, long long *val)
 static char *arg_eval (struct tep_print_arg *arg)
 {
 	long long val;
-	static char buf[24];
+	static __thread char buf[24];
 
 	switch (arg->type) {
 	case TEP_PRINT_ATOM:
@@ -2950,14 +4799,14 @@ process_fields(struct tep_event *event, struct tep_print_flag_sym **list, char *
 		if (test_type_token(type, token, TEP_EVENT_DELIM, ","))
 			goto out_free;
 
-		field = calloc(1, sizeof(*field));
+		field = parse_alloc(sizeof(*field));
 		if (!field)
 			goto out_free;
 
 		value = arg_eval(arg);
 		if (value == NULL)
 			goto out_free_field;
-		field->value = strdup(value);
+		field->value = parse_strdup(value);
 		if (field->value == NULL)
 			goto out_free_field;
 
@@ -2974,7 +4823,7 @@ process_fields(struct tep_event *event, struct tep_print_flag_sym **list, char *
 		value = arg_eval(arg);
 		if (value == NULL)
 			goto out_free_field;
-		field->str = strdup(value);
+		field->str = parse_strdup(value);
 		if (field->str == NULL)
 			goto out_free_field;
 		free_arg(arg);
@@ -3342,8 +5191,8 @@ process_str(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 
 	arg->type = TEP_PRINT_STRING;
 	arg->string.string = token;
-	arg->string.offset = -1;
-	arg->string.field = NULL;
+	arg->string.field = tep_find_any_field(event, token);
+	arg->string.offset = arg->string.field ? arg->string.field->offset : -1;
 
 	if (read_expected(event->tep, TEP_EVENT_DELIM, ")") < 0)
 		goto out_err;
@@ -3371,8 +5220,8 @@ process_bitmask(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 
 	arg->type = TEP_PRINT_BITMASK;
 	arg->bitmask.bitmask = token;
-	arg->bitmask.offset = -1;
-	arg->bitmask.field = NULL;
+	arg->bitmask.field = tep_find_any_field(event, token);
+	arg->bitmask.offset = arg->bitmask.field ? arg->bitmask.field->offset : -1;
 
 	if (read_expected(event->tep, TEP_EVENT_DELIM, ")") < 0)
 		goto out_err;
@@ -3400,8 +5249,8 @@ process_cpumask(struct tep_event *event __maybe_unused, struct tep_print_arg *ar
 	return type;
 }
 
-static struct tep_function_handler *
-find_func_handler(struct tep_handle *tep, char *func_name)
+__hidden struct tep_function_handler *
+find_func_handler(struct tep_handle *tep, const char *func_name)
 {
 	struct tep_function_handler *func;
 
@@ -3416,6 +5265,11 @@ find_func_handler(struct tep_handle *tep, char *func_name)
 	return func;
 }
 
+__hidden const char *func_handler_name(struct tep_function_handler *func)
+{
+	return func->name;
+}
+
 static void remove_func_handler(struct tep_handle *tep, char *func_name)
 {
 	struct tep_function_handler *func;
@@ -3444,6 +5298,7 @@ process_func_handler(struct tep_event *event, struct tep_function_handler *func,
 
 	arg->type = TEP_PRINT_FUNC;
 	arg->func.func = func;
+	parser.func_args = true;
 
 	*tok = NULL;
 
@@ -3548,21 +5403,21 @@ process_sizeof(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 	}
 
 	if (token_has_paren || strcmp(token, "int") == 0) {
-		arg->atom.atom = strdup("4");
+		arg->atom.atom = parse_strdup("4");
 
 	} else if (strcmp(token, "long") == 0) {
 		free_token(token);
 		type = read_token_item(event->tep, &token);
 
 		if (token && strcmp(token, "long") == 0) {
-			arg->atom.atom = strdup("8");
+			arg->atom.atom = parse_strdup("8");
 		} else {
 			switch (event->tep->long_size) {
 			case 4:
-				arg->atom.atom = strdup("4");
+				arg->atom.atom = parse_strdup("4");
 				break;
 			case 8:
-				arg->atom.atom = strdup("8");
+				arg->atom.atom = parse_strdup("8");
 				break;
 			default:
 				/* long size not defined yet, fail to parse it */
@@ -3574,19 +5429,19 @@ process_sizeof(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 
 	} else if (strcmp(token, "__u64") == 0 || strcmp(token, "u64") == 0 ||
 		   strcmp(token, "__s64") == 0 || strcmp(token, "s64") == 0) {
-		arg->atom.atom = strdup("8");
+		arg->atom.atom = parse_strdup("8");
 
 	} else if (strcmp(token, "__u32") == 0 || strcmp(token, "u32") == 0 ||
 		   strcmp(token, "__s32") == 0 || strcmp(token, "s32") == 0) {
-		arg->atom.atom = strdup("4");
+		arg->atom.atom = parse_strdup("4");
 
 	} else if (strcmp(token, "__u16") == 0 || strcmp(token, "u16") == 0 ||
 		   strcmp(token, "__s16") == 0 || strcmp(token, "s16") == 0) {
-		arg->atom.atom = strdup("2");
+		arg->atom.atom = parse_strdup("2");
 
 	} else if (strcmp(token, "__u8") == 0 || strcmp(token, "u8") == 0 ||
 		   strcmp(token, "__8") == 0 || strcmp(token, "s8") == 0) {
-		arg->atom.atom = strdup("1");
+		arg->atom.atom = parse_strdup("1");
 
 	} else if (strcmp(token, "REC") == 0) {
 
@@ -3605,7 +5460,7 @@ process_sizeof(struct tep_event *event, struct tep_print_arg *arg, char **tok)
 		if (!field || field->flags & TEP_FIELD_IS_ARRAY)
 			goto error;
 
-		ret = asprintf(&arg->atom.atom, "%d", field->size);
+		ret = parse_asprintf(&arg->atom.atom, "%d", field->size);
 		if (ret < 0)
 			goto error;
 
@@ -3637,12 +5492,12 @@ process_function(struct tep_event *event, struct tep_print_arg *arg,
 
 	if (strcmp(token, "__print_flags") == 0) {
 		free_token(token);
-		is_flag_field = 1;
+		parser.is_flag_field = 1;
 		return process_flags(event, arg, tok);
 	}
 	if (strcmp(token, "__print_symbolic") == 0) {
 		free_token(token);
-		is_symbolic_field = 1;
+		parser.is_symbolic_field = 1;
 		return process_symbols(event, arg, tok);
 	}
 	if (strcmp(token, "__print_hex") == 0) {
@@ -3741,7 +5596,7 @@ process_arg_token(struct tep_event *event, struct tep_print_arg *arg,
 
 			ret = append(&atom, " ", token);
 			if (ret < 0) {
-				free(atom);
+				parse_free(atom);
 				*tok = NULL;
 				free_token(token);
 				return TEP_EVENT_ERROR;
@@ -3757,7 +5612,7 @@ process_arg_token(struct tep_event *event, struct tep_print_arg *arg,
 	case TEP_EVENT_SQUOTE:
 		arg->type = TEP_PRINT_ATOM;
 		/* Make characters into numbers */
-		if (asprintf(&arg->atom.atom, "%d", token[0]) < 0) {
+		if (parse_asprintf(&arg->atom.atom, "%d", token[0]) < 0) {
 			free_token(token);
 			*tok = NULL;
 			arg->atom.atom = NULL;
@@ -3895,7 +5750,7 @@ static int event_read_print(struct tep_event *event)
 	if (type == TEP_EVENT_DQUOTE) {
 		char *cat;
 
-		if (asprintf(&cat, "%s%s", event->print_fmt.format, token) < 0)
+		if (parse_asprintf(&cat, "%s%s", event->print_fmt.format, token) < 0)
 			goto fail;
 		free_token(token);
 		free_token(event->print_fmt.format);
@@ -3927,6 +5782,8 @@ static int event_read_print(struct tep_event *event)
  *
  * Returns a common field from the event by the given @name.
  * This only searches the common fields and not all field.
+ * If @name was returned by tep_find_interned_string(), the fields
+ * are matched by comparing pointers.
  */
 struct tep_format_field *
 tep_find_common_field(struct tep_event *event, const char *name)
@@ -3935,7 +5792,7 @@ tep_find_common_field(struct tep_event *event, const char *name)
 
 	for (format = event->format.common_fields;
 	     format; format = format->next) {
-		if (strcmp(format->name, name) == 0)
+		if (format->name == name || strcmp(format->name, name) == 0)
 			break;
 	}
 
@@ -3949,6 +5806,8 @@ tep_find_common_field(struct tep_event *event, const char *name)
  *
  * Returns a non-common field by the given @name.
  * This does not search common fields.
+ * If @name was returned by tep_find_interned_string(), the fields
+ * are matched by comparing pointers.
  */
 struct tep_format_field *
 tep_find_field(struct tep_event *event, const char *name)
@@ -3957,13 +5816,43 @@ tep_find_field(struct tep_event *event, const char *name)
 
 	for (format = event->format.fields;
 	     format; format = format->next) {
-		if (strcmp(format->name, name) == 0)
+		if (format->name == name || strcmp(format->name, name) == 0)
 			break;
 	}
 
 	return format;
 }
 
+/**
+ * tep_find_interned_string - find the copy of a string shared by events
+ * @tep: a handle to the trace event parser context
+ * @str: a field name, field type or system name
+ *
+ * The names and types of the fields of all the events of @tep, and
+ * their system names, are kept once in @tep. Two fields have the same
+ * name if their name pointers are equal to the returned string.
+ *
+ * Returns the copy of @str kept by @tep, or NULL if no event uses it.
+ */
+const char *tep_find_interned_string(struct tep_handle *tep, const char *str)
+{
+	const char *ret;
+	bool locked;
+
+	if (!tep || !str)
+		return NULL;
+
+	/* A frozen handle can not change, the table is read only */
+	locked = !tep->frozen_id;
+	if (locked)
+		pthread_mutex_lock(&tep->lock);
+	ret = strtab_lookup(&tep->strings, str);
+	if (locked)
+		pthread_mutex_unlock(&tep->lock);
+
+	return ret;
+}
+
 /**
  * tep_find_any_field - find any field by name
  * @event: handle for the event
@@ -4043,117 +5932,181 @@ int tep_read_number_field(struct tep_format_field *field, const void *data,
 	}
 }
 
-static int get_common_info(struct tep_handle *tep,
-			   const char *type, int *offset, int *size)
+/* Find where all the common fields are, once for the handle */
+static int resolve_common_fields(struct tep_handle *tep)
 {
-	struct tep_event *event;
+	static const char * const names[NR_COMMON_FIELDS] = {
+		[COMMON_TYPE]			= "common_type",
+		[COMMON_PID]			= "common_pid",
+		[COMMON_PREEMPT_COUNT]		= "common_preempt_count",
+		[COMMON_FLAGS]			= "common_flags",
+		[COMMON_LOCK_DEPTH]		= "common_lock_depth",
+		[COMMON_MIGRATE_DISABLE]	= "common_migrate_disable",
+	};
 	struct tep_format_field *field;
+	int ret = 0;
+	int i;
 
-	/*
-	 * All events should have the same common elements.
-	 * Pick any event to find where the type is;
-	 */
-	if (!tep->events) {
-		do_warning("no event_list!");
-		return -1;
-	}
+	if (__atomic_load_n(&tep->common_resolved, __ATOMIC_ACQUIRE))
+		return 0;
 
-	event = tep->events[0];
-	field = tep_find_common_field(event, type);
-	if (!field)
-		return -1;
+	pthread_mutex_lock(&tep->lock);
+	if (tep->common_resolved)
+		goto out;
 
-	*offset = field->offset;
-	*size = field->size;
+	/* All events have the same common fields */
+	if (!tep->nr_events) {
+		ret = -1;
+		goto out;
+	}
 
-	return 0;
+	for (i = 0; i < NR_COMMON_FIELDS; i++) {
+		field = tep_find_common_field(tep->events[0], names[i]);
+		tep->common[i].offset = field ? field->offset : 0;
+		tep->common[i].size = field ? field->size : 0;
+	}
+	__atomic_store_n(&tep->common_resolved, 1, __ATOMIC_RELEASE);
+ out:
+	pthread_mutex_unlock(&tep->lock);
+	return ret;
 }
 
-static int __parse_common(struct tep_handle *tep, void *data,
-			  int *size, int *offset, const char *name)
+static inline int read_common_field(struct tep_handle *tep, void *data, int i)
 {
-	int ret;
+	struct common_field *common = &tep->common[i];
 
-	if (!*size) {
-		ret = get_common_info(tep, name, offset, size);
-		if (ret < 0)
-			return ret;
+	if (!common->size)
+		return -1;
+	return tep_read_number(tep, data + common->offset, common->size);
+}
+
+static int parse_common(struct tep_handle *tep, void *data, int i)
+{
+	if (resolve_common_fields(tep) < 0) {
+		do_warning("no event_list!");
+		return -1;
 	}
-	return tep_read_number(tep, data + *offset, *size);
+	return read_common_field(tep, data, i);
 }
 
 static int trace_parse_common_type(struct tep_handle *tep, void *data)
 {
-	return __parse_common(tep, data,
-			      &tep->type_size, &tep->type_offset,
-			      "common_type");
+	return parse_common(tep, data, COMMON_TYPE);
 }
 
 static int parse_common_pid(struct tep_handle *tep, void *data)
 {
-	return __parse_common(tep, data,
-			      &tep->pid_size, &tep->pid_offset,
-			      "common_pid");
+	return parse_common(tep, data, COMMON_PID);
 }
 
 static int parse_common_pc(struct tep_handle *tep, void *data)
 {
-	return __parse_common(tep, data,
-			      &tep->pc_size, &tep->pc_offset,
-			      "common_preempt_count");
+	return parse_common(tep, data, COMMON_PREEMPT_COUNT);
 }
 
 static int parse_common_flags(struct tep_handle *tep, void *data)
 {
-	return __parse_common(tep, data,
-			      &tep->flags_size, &tep->flags_offset,
-			      "common_flags");
+	return parse_common(tep, data, COMMON_FLAGS);
 }
 
-static int parse_common_lock_depth(struct tep_handle *tep, void *data)
+static int events_id_cmp(const void *a, const void *b);
+
+/* The last event looked up by this thread in a frozen handle */
+static __thread unsigned int last_event_frozen_id;
+static __thread struct tep_event *last_event_frozen;
+
+static struct tep_event *get_last_event(struct tep_handle *tep)
 {
-	return __parse_common(tep, data,
-			      &tep->ld_size, &tep->ld_offset,
-			      "common_lock_depth");
+	if (tep->frozen_id)
+		return last_event_frozen_id == tep->frozen_id ?
+			last_event_frozen : NULL;
+	return __atomic_load_n(&tep->last_event, __ATOMIC_RELAXED);
 }
 
-static int parse_common_migrate_disable(struct tep_handle *tep, void *data)
+static void set_last_event(struct tep_handle *tep, struct tep_event *event)
 {
-	return __parse_common(tep, data,
-			      &tep->ld_size, &tep->ld_offset,
-			      "common_migrate_disable");
+	if (tep->frozen_id) {
+		last_event_frozen_id = tep->frozen_id;
+		last_event_frozen = event;
+		return;
+	}
+	__atomic_store_n(&tep->last_event, event, __ATOMIC_RELAXED);
 }
 
-static int events_id_cmp(const void *a, const void *b);
+static inline void event_print_fmt(struct tep_event *event);
+
+static struct tep_event *find_event(struct tep_handle *tep, int id)
+{
+	struct tep_event **eventptr;
+	struct tep_event *event;
+	struct tep_event key;
+	struct tep_event *pkey = &key;
+
+	/* Check cache first */
+	event = get_last_event(tep);
+	if (event && event->id == id) {
+		tep_stat_inc(tep->stats.last_event_hits);
+		return event;
+	}
+	tep_stat_inc(tep->stats.last_event_misses);
+
+	key.id = id;
+
+	eventptr = bsearch(&pkey, tep->events, tep->nr_events,
+			   sizeof(*tep->events), events_id_cmp);
+
+	if (eventptr) {
+		set_last_event(tep, *eventptr);
+		return *eventptr;
+	}
+
+	return NULL;
+}
 
 /**
  * tep_find_event - find an event by given id
  * @tep: a handle to the trace event parser context
  * @id: the id of the event
  *
+ * If the print format of the event was not parsed yet (see
+ * TEP_LAZY_PRINT_FMT), it is parsed before the event is returned.
+ *
  * Returns an event that has a given @id.
  */
 struct tep_event *tep_find_event(struct tep_handle *tep, int id)
 {
-	struct tep_event **eventptr;
-	struct tep_event key;
-	struct tep_event *pkey = &key;
+	struct tep_event *event = find_event(tep, id);
 
-	/* Check cache first */
-	if (tep->last_event && tep->last_event->id == id)
-		return tep->last_event;
+	if (event)
+		event_print_fmt(event);
+	return event;
+}
 
-	key.id = id;
+static struct tep_event *
+find_event_by_name(struct tep_handle *tep, const char *sys, const char *name)
+{
+	struct tep_event *event;
+	int i;
 
-	eventptr = bsearch(&pkey, tep->events, tep->nr_events,
-			   sizeof(*tep->events), events_id_cmp);
+	event = get_last_event(tep);
+	if (event && strcmp(event->name, name) == 0 &&
+	    (!sys || strcmp(event->system, sys) == 0))
+		return event;
 
-	if (eventptr) {
-		tep->last_event = *eventptr;
-		return *eventptr;
+	for (i = 0; i < tep->nr_events; i++) {
+		event = tep->events[i];
+		if (strcmp(event->name, name) == 0) {
+			if (!sys)
+				break;
+			if (strcmp(event->system, sys) == 0)
+				break;
+		}
 	}
+	if (i == tep->nr_events)
+		event = NULL;
 
-	return NULL;
+	set_last_event(tep, event);
+	return event;
 }
 
 /**
@@ -4164,32 +6117,16 @@ struct tep_event *tep_find_event(struct tep_handle *tep, int id)
  *
  * This returns an event with a given @name and under the system
  * @sys. If @sys is NULL the first event with @name is returned.
+ * Like tep_find_event(), its print format is parsed if it was not yet.
  */
 struct tep_event *
 tep_find_event_by_name(struct tep_handle *tep,
 		       const char *sys, const char *name)
 {
-	struct tep_event *event = NULL;
-	int i;
-
-	if (tep->last_event &&
-	    strcmp(tep->last_event->name, name) == 0 &&
-	    (!sys || strcmp(tep->last_event->system, sys) == 0))
-		return tep->last_event;
-
-	for (i = 0; i < tep->nr_events; i++) {
-		event = tep->events[i];
-		if (strcmp(event->name, name) == 0) {
-			if (!sys)
-				break;
-			if (strcmp(event->system, sys) == 0)
-				break;
-		}
-	}
-	if (i == tep->nr_events)
-		event = NULL;
+	struct tep_event *event = find_event_by_name(tep, sys, name);
 
-	tep->last_event = event;
+	if (event)
+		event_print_fmt(event);
 	return event;
 }
 
@@ -4197,21 +6134,29 @@ static unsigned long long test_for_symbol(struct tep_handle *tep,
 					  struct tep_print_arg *arg)
 {
 	unsigned long long val = 0;
-	struct func_list *item = tep->funclist;
+	struct func_table *table;
+	struct func_list *item;
 	char *func;
 	int i;
 
 	if (isdigit(arg->atom.atom[0]))
 		return 0;
 
+	/* Search a single table with no delta or removed functions */
+	if (func_table_dirty(tep))
+		func_map_init(tep, NULL);
+
+	table = tep->func_table;
+	item = tep->funclist;
+
 	/* Linear search but only happens once (see after the loop) */
 	for (i = 0; i < (int)tep->func_count; i++) {
 		unsigned long long addr;
 		const char *name;
 
-		if (tep->func_map) {
-			addr = tep->func_map[i].addr;
-			name = tep->func_map[i].func;
+		if (table && i < (int)table->nr) {
+			addr = table->addrs[i];
+			name = func_table_name(table, i);
 		} else if (item) {
 			addr = item->addr;
 			name = item->func;
@@ -4287,6 +6232,45 @@ static inline void dynamic_offset_field(struct tep_handle *tep,
 		*offset += field->offset + field->size;
 }
 
+/*
+ * Find the data of @field in @data of @size bytes: the field itself, or
+ * the array a dynamic field points to. Returns false if it is not all
+ * within @data.
+ */
+static bool field_data(struct tep_handle *tep, struct tep_format_field *field,
+		       void *data, int size, void **ptr, unsigned int *len)
+{
+	unsigned long long val;
+	unsigned int offset;
+	unsigned int l;
+
+	if (size < 0 || field->offset + field->size > size)
+		return false;
+
+	if (!(field->flags & TEP_FIELD_IS_DYNAMIC)) {
+		*ptr = data + field->offset;
+		*len = field->size;
+		return true;
+	}
+
+	val = tep_read_number(tep, data + field->offset, field->size);
+	offset = val & TEP_OFFSET_LEN_MASK;
+	/* Old kernels did not have a length, the array is the rest */
+	if (field->size == 2)
+		l = offset > size ? 0 : size - offset;
+	else
+		l = (val >> TEP_LEN_SHIFT) & TEP_OFFSET_LEN_MASK;
+	if (field->flags & TEP_FIELD_IS_RELATIVE)
+		offset += field->offset + field->size;
+
+	if (offset > size || l > size - offset)
+		return false;
+
+	*ptr = data + offset;
+	*len = l;
+	return true;
+}
+
 static bool check_data_offset_size(struct tep_event *event, const char *field_name,
 				    int data_size, int field_offset, int field_size)
 {
@@ -4299,6 +6283,25 @@ static bool check_data_offset_size(struct tep_event *event, const char *field_na
 	return true;
 }
 
+/*
+ * Fields are resolved when the event is parsed, the ones that are not
+ * are looked up again when printing. All threads find the same field,
+ * so a relaxed store keeps this safe on a shared or frozen handle.
+ */
+static struct tep_format_field *
+print_arg_field(struct tep_event *event, struct tep_print_arg_field *arg)
+{
+	struct tep_format_field *field;
+
+	field = __atomic_load_n(&arg->field, __ATOMIC_RELAXED);
+	if (!field) {
+		field = tep_find_any_field(event, arg->name);
+		if (field)
+			__atomic_store_n(&arg->field, field, __ATOMIC_RELAXED);
+	}
+	return field;
+}
+
 static unsigned long long
 eval_num_arg(void *data, int size, struct tep_event *event, struct tep_print_arg *arg)
 {
@@ -4306,6 +6309,7 @@ eval_num_arg(void *data, int size, struct tep_event *event, struct tep_print_arg
 	unsigned long long val = 0;
 	unsigned long long left, right;
 	struct tep_print_arg *typearg = NULL;
+	struct tep_format_field *field;
 	struct tep_print_arg *larg;
 	unsigned int offset;
 	unsigned int field_size;
@@ -4320,20 +6324,16 @@ eval_num_arg(void *data, int size, struct tep_event *event, struct tep_print_arg
 			val = test_for_symbol(tep, arg);
 		return val;
 	case TEP_PRINT_FIELD:
-		if (!arg->field.field) {
-			arg->field.field = tep_find_any_field(event, arg->field.name);
-			if (!arg->field.field)
-				goto out_warning_field;
-		}
+		field = print_arg_field(event, &arg->field);
+		if (!field)
+			goto out_warning_field;
 		if (check_data_offset_size(event, arg->field.name, size,
-					   arg->field.field->offset,
-					   arg->field.field->size)) {
+					   field->offset, field->size)) {
 			val = 0;
 			break;
 		}
 		/* must be a number */
-		val = tep_read_number(tep, data + arg->field.field->offset,
-				      arg->field.field->size);
+		val = tep_read_number(tep, data + field->offset, field->size);
 		break;
 	case TEP_PRINT_FLAGS:
 	case TEP_PRINT_SYMBOL:
@@ -4351,7 +6351,9 @@ eval_num_arg(void *data, int size, struct tep_event *event, struct tep_print_arg
 		return 0;
 	case TEP_PRINT_FUNC: {
 		struct trace_seq s;
-		trace_seq_init(&s);
+		char buf[128];
+
+		trace_seq_init_buf(&s, buf, sizeof(buf));
 		val = process_defined_func(&s, data, size, event, arg);
 		trace_seq_destroy(&s);
 		return val;
@@ -4806,6 +6808,7 @@ static void print_str_arg(struct trace_seq *s, void *data, int size,
 	unsigned long long addr;
 	char *str;
 	unsigned char *hex;
+	void *ptr;
 	int print;
 	int i;
 
@@ -4817,14 +6820,10 @@ static void print_str_arg(struct trace_seq *s, void *data, int size,
 		print_str_to_seq(s, format, len_arg, arg->atom.atom);
 		return;
 	case TEP_PRINT_FIELD:
-		field = arg->field.field;
+		field = print_arg_field(event, &arg->field);
 		if (!field) {
-			field = tep_find_any_field(event, arg->field.name);
-			if (!field) {
-				str = arg->field.name;
-				goto out_warning_field;
-			}
-			arg->field.field = field;
+			str = arg->field.name;
+			goto out_warning_field;
 		}
 		/* Zero sized fields, mean the rest of the data */
 		len = field->size ? : size - field->offset;
@@ -4915,13 +6914,10 @@ static void print_str_arg(struct trace_seq *s, void *data, int size,
 				             size, &offset, NULL);
 			hex = data + offset;
 		} else {
-			field = arg->hex.field->field.field;
+			field = print_arg_field(event, &arg->hex.field->field);
 			if (!field) {
 				str = arg->hex.field->field.name;
-				field = tep_find_any_field(event, str);
-				if (!field)
-					goto out_warning_field;
-				arg->hex.field->field.field = field;
+				goto out_warning_field;
 			}
 			hex = data + field->offset;
 		}
@@ -4942,13 +6938,10 @@ static void print_str_arg(struct trace_seq *s, void *data, int size,
 					     size, &offset, NULL);
 			num = data + offset;
 		} else {
-			field = arg->int_array.field->field.field;
+			field = print_arg_field(event, &arg->int_array.field->field);
 			if (!field) {
 				str = arg->int_array.field->field.name;
-				field = tep_find_any_field(event, str);
-				if (!field)
-					goto out_warning_field;
-				arg->int_array.field->field.field = field;
+				goto out_warning_field;
 			}
 			num = data + field->offset;
 		}
@@ -4988,11 +6981,21 @@ static void print_str_arg(struct trace_seq *s, void *data, int size,
 				break;
 			arg->string.offset = arg->string.field->offset;
 		}
-		dynamic_offset_field(tep, arg->string.field, data, size, &offset, &len);
+		if (!field_data(tep, arg->string.field, data, size, &ptr, &len))
+			break;
 		/* Do not attempt to save zero length dynamic strings */
 		if (!len)
 			break;
-		print_str_to_seq(s, format, len_arg, ((char *)data) + offset);
+		/* Only a string that fills its array needs to be copied */
+		if (memchr(ptr, 0, len)) {
+			print_str_to_seq(s, format, len_arg, ptr);
+		} else {
+			str = strndup(ptr, len);
+			if (!str)
+				break;
+			print_str_to_seq(s, format, len_arg, str);
+			free(str);
+		}
 		break;
 	}
 	case TEP_PRINT_BSTRING:
@@ -5052,33 +7055,19 @@ out_warning_field:
 }
 
 static unsigned long long
-process_defined_func(struct trace_seq *s, void *data, int size,
-		     struct tep_event *event, struct tep_print_arg *arg)
+eval_defined_func(struct trace_seq *s, void *data, int size,
+		  struct tep_event *event, struct tep_print_arg *arg,
+		  unsigned long long *args, struct trace_seq *str_args)
 {
 	struct tep_function_handler *func_handle = arg->func.func;
 	struct func_params *param;
-	unsigned long long *args;
-	unsigned long long ret;
 	struct tep_print_arg *farg;
-	struct trace_seq str;
-	struct save_str {
-		struct save_str *next;
-		char *str;
-	} *strings = NULL, *string;
+	struct trace_seq *str;
 	int i;
 
-	if (!func_handle->nr_args) {
-		ret = (*func_handle->func)(s, NULL);
-		goto out;
-	}
-
 	farg = arg->func.args;
 	param = func_handle->params;
-
-	ret = ULLONG_MAX;
-	args = malloc(sizeof(*args) * func_handle->nr_args);
-	if (!args)
-		goto out;
+	str = str_args;
 
 	for (i = 0; i < func_handle->nr_args; i++) {
 		switch (param->type) {
@@ -5088,26 +7077,19 @@ process_defined_func(struct trace_seq *s, void *data, int size,
 			args[i] = eval_num_arg(data, size, event, farg);
 			break;
 		case TEP_FUNC_ARG_STRING:
-			trace_seq_init(&str);
-			print_str_arg(&str, data, size, event, "%s", -1, farg);
-			trace_seq_terminate(&str);
-			string = malloc(sizeof(*string));
-			if (!string) {
-				do_warning_event(event, "%s(%d): malloc str",
-						 __func__, __LINE__);
-				goto out_free;
-			}
-			string->next = strings;
-			string->str = strdup(str.buffer);
-			if (!string->str) {
-				free(string);
+			if (str->buffer)
+				trace_seq_reset(str);
+			else
+				trace_seq_init(str);
+			print_str_arg(str, data, size, event, "%s", -1, farg);
+			trace_seq_terminate(str);
+			if (str->state != TRACE_SEQ__GOOD) {
 				do_warning_event(event, "%s(%d): malloc str",
 						 __func__, __LINE__);
-				goto out_free;
+				return ULLONG_MAX;
 			}
-			args[i] = (uintptr_t)string->str;
-			strings = string;
-			trace_seq_destroy(&str);
+			args[i] = (uintptr_t)str->buffer;
+			str++;
 			break;
 		default:
 			/*
@@ -5115,22 +7097,63 @@ process_defined_func(struct trace_seq *s, void *data, int size,
 			 * an input error, something in this code broke.
 			 */
 			do_warning_event(event, "Unexpected end of arguments\n");
-			goto out_free;
+			return ULLONG_MAX;
 		}
 		farg = farg->next;
 		param = param->next;
 	}
 
-	ret = (*func_handle->func)(s, args);
-out_free:
-	free(args);
-	while (strings) {
-		string = strings;
-		strings = string->next;
-		free(string->str);
-		free(string);
+	return (*func_handle->func)(s, args);
+}
+
+static unsigned long long
+process_defined_func(struct trace_seq *s, void *data, int size,
+		     struct tep_event *event, struct tep_print_arg *arg)
+{
+	struct tep_function_handler *func_handle = arg->func.func;
+	struct trace_seq *str_args = NULL;
+	unsigned long long *args;
+	unsigned long long ret;
+	int i;
+
+	if (!func_handle->nr_args) {
+		ret = (*func_handle->func)(s, NULL);
+		goto out;
+	}
+
+	/*
+	 * The handler keeps its own argument array and string buffers
+	 * so that the common case does not allocate anything. Only if
+	 * the helper is nested within its own arguments do we need
+	 * separate storage.
+	 */
+	if (!__atomic_exchange_n(&func_handle->busy, 1, __ATOMIC_ACQUIRE)) {
+		ret = eval_defined_func(s, data, size, event, arg,
+					func_handle->args, func_handle->str_args);
+		__atomic_store_n(&func_handle->busy, 0, __ATOMIC_RELEASE);
+		goto out;
+	}
+
+	ret = ULLONG_MAX;
+	args = malloc(sizeof(*args) * func_handle->nr_args);
+	if (!args)
+		goto out;
+
+	if (func_handle->nr_str_args) {
+		str_args = calloc(func_handle->nr_str_args, sizeof(*str_args));
+		if (!str_args)
+			goto out_free;
 	}
 
+	ret = eval_defined_func(s, data, size, event, arg, args, str_args);
+
+	for (i = 0; i < func_handle->nr_str_args; i++) {
+		if (str_args[i].buffer)
+			trace_seq_destroy(&str_args[i]);
+	}
+	free(str_args);
+out_free:
+	free(args);
  out:
 	/* TBD : handle return type here */
 	return ret;
@@ -5158,8 +7181,9 @@ static struct tep_print_arg *make_bprint_args(char *fmt, void *data, int size, s
 	void *bptr;
 	int vsize = 0;
 
-	field = tep->bprint_buf_field;
-	ip_field = tep->bprint_ip_field;
+	/* The ip field is published before the buf field that guards it */
+	field = __atomic_load_n(&tep->bprint_buf_field, __ATOMIC_ACQUIRE);
+	ip_field = __atomic_load_n(&tep->bprint_ip_field, __ATOMIC_RELAXED);
 
 	if (!field) {
 		field = tep_find_field(event, "buf");
@@ -5172,8 +7196,8 @@ static struct tep_print_arg *make_bprint_args(char *fmt, void *data, int size, s
 			do_warning_event(event, "can't find ip field for binary printk");
 			return NULL;
 		}
-		tep->bprint_buf_field = field;
-		tep->bprint_ip_field = ip_field;
+		__atomic_store_n(&tep->bprint_ip_field, ip_field, __ATOMIC_RELAXED);
+		__atomic_store_n(&tep->bprint_buf_field, field, __ATOMIC_RELEASE);
 	}
 
 	ip = tep_read_number(tep, data + ip_field->offset, ip_field->size);
@@ -5193,7 +7217,7 @@ static struct tep_print_arg *make_bprint_args(char *fmt, void *data, int size, s
 
 	arg->type = TEP_PRINT_ATOM;
 		
-	if (asprintf(&arg->atom.atom, "%lld", ip) < 0)
+	if (parse_asprintf(&arg->atom.atom, "%lld", ip) < 0)
 		goto out_free;
 
 	/* skip the first "%ps: " */
@@ -5294,8 +7318,8 @@ static struct tep_print_arg *make_bprint_args(char *fmt, void *data, int size, s
 				}
 				arg->next = NULL;
 				arg->type = TEP_PRINT_ATOM;
-				if (asprintf(&arg->atom.atom, "%lld", val) < 0) {
-					free(arg);
+				if (parse_asprintf(&arg->atom.atom, "%lld", val) < 0) {
+					parse_free(arg);
 					goto out_free;
 				}
 				*next = arg;
@@ -5318,9 +7342,9 @@ static struct tep_print_arg *make_bprint_args(char *fmt, void *data, int size, s
 				}
 				arg->next = NULL;
 				arg->type = TEP_PRINT_BSTRING;
-				arg->string.string = strdup(bptr);
+				arg->string.string = parse_strdup(bptr);
 				if (!arg->string.string) {
-					free(arg);
+					parse_free(arg);
 					goto out_free;
 				}
 				bptr += strlen(bptr) + 1;
@@ -5349,7 +7373,7 @@ get_bprint_format(void *data, int size __maybe_unused,
 	struct printk_map *printk;
 	char *format;
 
-	field = tep->bprint_fmt_field;
+	field = __atomic_load_n(&tep->bprint_fmt_field, __ATOMIC_RELAXED);
 
 	if (!field) {
 		field = tep_find_field(event, "fmt");
@@ -5357,7 +7381,7 @@ get_bprint_format(void *data, int size __maybe_unused,
 			do_warning_event(event, "can't find format field for binary printk");
 			return NULL;
 		}
-		tep->bprint_fmt_field = field;
+		__atomic_store_n(&tep->bprint_fmt_field, field, __ATOMIC_RELAXED);
 	}
 
 	addr = tep_read_number(tep, data + field->offset, field->size);
@@ -6022,6 +8046,16 @@ static void print_field_raw(struct trace_seq *s, void *data, int size,
 static int print_parse_data(struct tep_print_parse *parse, struct trace_seq *s,
 			    void *data, int size, struct tep_event *event, bool raw);
 
+static void parse_pending_print(struct tep_event *event);
+
+/* Make sure the print format of @event is parsed before it is used */
+static inline void event_print_fmt(struct tep_event *event)
+{
+	if (__atomic_load_n(&event->flags, __ATOMIC_ACQUIRE) &
+	    TEP_EVENT_FL_PRINT_PENDING)
+		parse_pending_print(event);
+}
+
 static inline void print_field(struct trace_seq *s, void *data, int size,
 				    struct tep_format_field *field,
 				    struct tep_print_parse **parse_ptr, bool raw)
@@ -6032,6 +8066,8 @@ static inline void print_field(struct trace_seq *s, void *data, int size,
 	struct tep_print_arg *arg;
 	bool has_0x = false;
 
+	if (!parse_ptr)
+		event_print_fmt(event);
 	parse = parse_ptr ? *parse_ptr : event->print_fmt.print_cache;
 
 	if (!parse || event->flags & TEP_EVENT_FL_FAILED)
@@ -6059,8 +8095,10 @@ static inline void print_field(struct trace_seq *s, void *data, int size,
 		while (arg && arg->type == TEP_PRINT_TYPE)
 			arg = arg->typecast.item;
 
-		if (!arg || arg->type != TEP_PRINT_FIELD ||
-		    arg->field.field != field) {
+		/* The arguments of a shared schema have fields of their own */
+		if (!arg || arg->type != TEP_PRINT_FIELD || !arg->field.field ||
+		    (arg->field.field != field &&
+		     strcmp(arg->field.field->name, field->name) != 0)) {
 			has_0x = false;
 			goto next;
 		}
@@ -6116,10 +8154,13 @@ print_selected_fields(struct trace_seq *s, void *data, int size,
 		      struct tep_event *event,
 		      unsigned long long ignore_mask, bool raw)
 {
-	struct tep_print_parse *parse = event->print_fmt.print_cache;
+	struct tep_print_parse *parse;
 	struct tep_format_field *field;
 	unsigned long long field_mask = 1;
 
+	event_print_fmt(event);
+	parse = event->print_fmt.print_cache;
+
 	field = event->format.fields;
 	for(; field; field = field->next, field_mask <<= 1) {
 		if (field_mask & ignore_mask)
@@ -6172,18 +8213,19 @@ static int print_function(struct trace_seq *s, const char *format,
 			  void *data, int size, struct tep_event *event,
 			  struct tep_print_arg *arg, bool raw)
 {
-	struct func_map *func;
+	struct func_map func;
 	unsigned long long val;
+	bool found;
 
 	val = eval_num_arg(data, size, event, arg);
-	func = find_func(event->tep, val);
-	if (func) {
-		trace_seq_puts(s, func->func);
+	found = find_func(event->tep, val, &func, NULL);
+	if (found) {
+		trace_seq_puts(s, func.func);
 		if (*format == 'F' || *format == 'S')
-			trace_seq_printf(s, "+0x%llx", val - func->addr);
+			trace_seq_printf(s, "+0x%llx", val - func.addr);
 	}
 
-	if (!func || raw) {
+	if (!found || raw) {
 		if (raw)
 			trace_seq_puts(s, " (");
 		if (event->tep->long_size == 4)
@@ -6249,6 +8291,81 @@ static int print_arg_pointer(struct trace_seq *s, const char *format, int plen,
 
 }
 
+/*
+ * Prints @val for the simple integer formats ("%d", "%08llx", "%-5u", ...)
+ * without going through vsnprintf(). @ls is the size of the argument as
+ * counted by parse_arg_format(). Returns false for any other format.
+ */
+static bool print_int_fast(struct trace_seq *s, const char *format, int ls,
+			   unsigned long long val)
+{
+	const char *p = format + 1;
+	unsigned int flags = 0;
+	bool sign;
+	int width = 0;
+
+	if (*format != '%')
+		return false;
+
+	if (*p == '-') {
+		flags |= TRACE_SEQ_NUM_LEFT;
+		p++;
+	} else if (*p == '0') {
+		flags |= TRACE_SEQ_NUM_ZERO;
+		p++;
+	}
+	for (; isdigit(*p); p++) {
+		width = width * 10 + *p - '0';
+		if (width > 1024)
+			return false;
+	}
+	while (*p == 'h' || *p == 'l' || *p == 'L' || *p == 'z' || *p == 'Z')
+		p++;
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+		flags |= TRACE_SEQ_NUM_SIGNED;
+		break;
+	case 'u':
+		break;
+	case 'X':
+		flags |= TRACE_SEQ_NUM_UPPER;
+		/* fall through */
+	case 'x':
+		flags |= TRACE_SEQ_NUM_HEX;
+		break;
+	default:
+		return false;
+	}
+	if (p[1])
+		return false;
+
+	/* Convert like printf() does for the argument size */
+	sign = flags & TRACE_SEQ_NUM_SIGNED;
+	switch (ls) {
+	case -2:
+		val = sign ? (long long)(signed char)val : (unsigned char)val;
+		break;
+	case -1:
+		val = sign ? (long long)(short)val : (unsigned short)val;
+		break;
+	case 0:
+		val = sign ? (long long)(int)val : (unsigned int)val;
+		break;
+	case 1:
+		val = sign ? (long long)(long)val : (unsigned long)val;
+		break;
+	case 2:
+		break;
+	default:
+		return false;
+	}
+
+	trace_seq_put_num(s, val, width, flags);
+	return true;
+}
+
 static int print_arg_number(struct trace_seq *s, const char *format, int plen,
 			    void *data, int size, int ls,
 			    struct tep_event *event, struct tep_print_arg *arg)
@@ -6257,6 +8374,9 @@ static int print_arg_number(struct trace_seq *s, const char *format, int plen,
 
 	val = eval_num_arg(data, size, event, arg);
 
+	if (plen < 0 && print_int_fast(s, format, ls, val))
+		return 0;
+
 	switch (ls) {
 	case -2:
 		if (plen >= 0)
@@ -6301,9 +8421,10 @@ static void print_arg_string(struct trace_seq *s, const char *format, int plen,
 			     struct tep_event *event, struct tep_print_arg *arg)
 {
 	struct trace_seq p;
+	char buf[256];
 
 	/* Use helper trace_seq */
-	trace_seq_init(&p);
+	trace_seq_init_buf(&p, buf, sizeof(buf));
 	print_str_arg(&p, data, size, event,
 		      format, plen, arg);
 	trace_seq_terminate(&p);
@@ -6416,8 +8537,8 @@ static void free_parse_args(struct tep_print_parse *arg)
 	while (arg) {
 		del = arg;
 		arg = del->next;
-		free(del->format);
-		free(del);
+		parse_free(del->format);
+		parse_free(del);
 	}
 }
 
@@ -6429,10 +8550,10 @@ static int parse_arg_add(struct tep_print_parse **parse, char *format,
 {
 	struct tep_print_parse *parg = NULL;
 
-	parg = calloc(1, sizeof(*parg));
+	parg = parse_alloc(sizeof(*parg));
 	if (!parg)
 		goto error;
-	parg->format = strdup(format);
+	parg->format = parse_strdup(format);
 	if (!parg->format)
 		goto error;
 	parg->type = type;
@@ -6443,8 +8564,8 @@ static int parse_arg_add(struct tep_print_parse **parse, char *format,
 	return 0;
 error:
 	if (parg) {
-		free(parg->format);
-		free(parg);
+		parse_free(parg->format);
+		parse_free(parg);
 	}
 	return -1;
 }
@@ -6744,6 +8865,7 @@ static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_e
 		bprint_fmt = get_bprint_format(data, size, event);
 		args = make_bprint_args(bprint_fmt, data, size, event);
 		parse = parse_args(event, bprint_fmt, args);
+		tep_stat_inc(event->tep->stats.bprint_parses);
 	}
 
 	print_event_cache(parse, s, data, size, event);
@@ -6763,88 +8885,62 @@ static void pretty_print(struct trace_seq *s, void *data, int size, struct tep_e
 static void data_latency_format(struct tep_handle *tep, struct trace_seq *s,
 				char *format, struct tep_record *record)
 {
-	static int check_lock_depth = 1;
-	static int check_migrate_disable = 1;
-	static int lock_depth_exists;
-	static int migrate_disable_exists;
+	struct tep_common_fields common;
+	bool migrate_disable_exists;
+	bool lock_depth_exists;
 	unsigned int lat_flags;
-	struct trace_seq sq;
 	unsigned int pc;
-	int lock_depth = 0;
-	int migrate_disable = 0;
+	int lock_depth;
+	int migrate_disable;
 	int hardirq;
 	int softirq;
-	void *data = record->data;
-
-	trace_seq_init(&sq);
-	lat_flags = parse_common_flags(tep, data);
-	pc = parse_common_pc(tep, data);
-	/* lock_depth may not always exist */
-	if (lock_depth_exists)
-		lock_depth = parse_common_lock_depth(tep, data);
-	else if (check_lock_depth) {
-		lock_depth = parse_common_lock_depth(tep, data);
-		if (lock_depth < 0)
-			check_lock_depth = 0;
-		else
-			lock_depth_exists = 1;
-	}
 
-	/* migrate_disable may not always exist */
-	if (migrate_disable_exists)
-		migrate_disable = parse_common_migrate_disable(tep, data);
-	else if (check_migrate_disable) {
-		migrate_disable = parse_common_migrate_disable(tep, data);
-		if (migrate_disable < 0)
-			check_migrate_disable = 0;
-		else
-			migrate_disable_exists = 1;
+	/* lock_depth and migrate_disable may not always exist */
+	if (tep_data_common(tep, record, &common) == 0) {
+		lock_depth_exists = tep->common[COMMON_LOCK_DEPTH].size;
+		migrate_disable_exists = tep->common[COMMON_MIGRATE_DISABLE].size;
+	} else {
+		lock_depth_exists = false;
+		migrate_disable_exists = false;
 	}
+	lat_flags = common.flags;
+	pc = common.preempt_count;
+	lock_depth = common.lock_depth;
+	migrate_disable = common.migrate_disable;
 
 	hardirq = lat_flags & TRACE_FLAG_HARDIRQ;
 	softirq = lat_flags & TRACE_FLAG_SOFTIRQ;
 
-	trace_seq_printf(&sq, "%c%c%c",
-	       (lat_flags & TRACE_FLAG_IRQS_OFF) ? 'd' :
-	       (lat_flags & TRACE_FLAG_IRQS_NOSUPPORT) ?
-	       'X' : '.',
-	       (lat_flags & TRACE_FLAG_NEED_RESCHED) ?
-	       'N' : '.',
-	       (hardirq && softirq) ? 'H' :
-	       hardirq ? 'h' : softirq ? 's' : '.');
+	trace_seq_putc(s, (lat_flags & TRACE_FLAG_IRQS_OFF) ? 'd' :
+		       (lat_flags & TRACE_FLAG_IRQS_NOSUPPORT) ? 'X' : '.');
+	trace_seq_putc(s, (lat_flags & TRACE_FLAG_NEED_RESCHED) ? 'N' : '.');
+	trace_seq_putc(s, (hardirq && softirq) ? 'H' :
+		       hardirq ? 'h' : softirq ? 's' : '.');
 
 	if (pc & 0xf)
-		trace_seq_printf(&sq, "%x", pc & 0xf);
+		trace_seq_put_hex(s, pc & 0xf);
 	else
-		trace_seq_printf(&sq, ".");
+		trace_seq_putc(s, '.');
 
 	if (pc & 0xf0)
-		trace_seq_printf(&sq, "%x", pc >> 4);
+		trace_seq_put_hex(s, pc >> 4);
 	else
-		trace_seq_printf(&sq, ".");
+		trace_seq_putc(s, '.');
 
 	if (migrate_disable_exists) {
 		if (migrate_disable < 0)
-			trace_seq_printf(&sq, ".");
+			trace_seq_putc(s, '.');
 		else
-			trace_seq_printf(&sq, "%d", migrate_disable);
+			trace_seq_put_s64(s, migrate_disable);
 	}
 
 	if (lock_depth_exists) {
 		if (lock_depth < 0)
-			trace_seq_printf(&sq, ".");
+			trace_seq_putc(s, '.');
 		else
-			trace_seq_printf(&sq, "%d", lock_depth);
-	}
-
-	if (sq.state == TRACE_SEQ__MEM_ALLOC_FAILED) {
-		s->state = TRACE_SEQ__MEM_ALLOC_FAILED;
-		return;
+			trace_seq_put_s64(s, lock_depth);
 	}
 
-	trace_seq_terminate(&sq);
-	trace_seq_puts(s, sq.buffer);
-	trace_seq_destroy(&sq);
 	trace_seq_terminate(s);
 }
 
@@ -6898,6 +8994,39 @@ int tep_data_flags(struct tep_handle *tep, struct tep_record *rec)
 	return parse_common_flags(tep, rec->data);
 }
 
+/**
+ * tep_data_common - parse all the common fields from the record
+ * @tep: a handle to the trace event parser context
+ * @rec: the record to parse
+ * @common: where to store the fields
+ *
+ * Reads the type, PID, preempt count, latency flags, lock depth and
+ * migrate disable count of @rec into @common, with one lookup of where
+ * they are. The fields that the events do not have are set to -1.
+ *
+ * Returns 0 on success, or -1 if the handle has no events to find the
+ * common fields with, in which case all of @common is set to -1.
+ */
+int tep_data_common(struct tep_handle *tep, struct tep_record *rec,
+		    struct tep_common_fields *common)
+{
+	void *data = rec->data;
+
+	if (resolve_common_fields(tep) < 0) {
+		memset(common, -1, sizeof(*common));
+		return -1;
+	}
+
+	common->type = read_common_field(tep, data, COMMON_TYPE);
+	common->pid = read_common_field(tep, data, COMMON_PID);
+	common->preempt_count = read_common_field(tep, data, COMMON_PREEMPT_COUNT);
+	common->flags = read_common_field(tep, data, COMMON_FLAGS);
+	common->lock_depth = read_common_field(tep, data, COMMON_LOCK_DEPTH);
+	common->migrate_disable = read_common_field(tep, data,
+						    COMMON_MIGRATE_DISABLE);
+	return 0;
+}
+
 /**
  * tep_data_comm_from_pid - return the command line from PID
  * @tep: a handle to the trace event parser context
@@ -7029,6 +9158,8 @@ static void print_event_info(struct trace_seq *s, char *format, bool raw,
 {
 	int print_pretty = 1;
 
+	event_print_fmt(event);
+
 	if (raw || (event->flags & TEP_EVENT_FL_PRINTRAW))
 		print_selected_fields(s, record->data, record->size, event, 0, true);
 	else {
@@ -7078,30 +9209,17 @@ static void print_event_time(struct tep_handle *tep, struct trace_seq *s,
 				 char *format, struct tep_event *event,
 				 struct tep_record *record)
 {
-	unsigned long long time;
 	char *divstr;
-	int prec = 0, pr;
+	int prec = 0;
 	int div = 0;
-	int p10 = 1;
 
 	if (isdigit(*(format + 1)))
 		prec = atoi(format + 1);
 	divstr = strchr(format, '.');
 	if (divstr && isdigit(*(divstr + 1)))
 		div = atoi(divstr + 1);
-	time = record->ts;
-	if (div) {
-		time += div / 2;
-		time /= div;
-	}
-	pr = prec;
-	while (pr--)
-		p10 *= 10;
 
-	if (p10 > 1)
-		trace_seq_printf(s, "%5llu.%0*llu", time / p10, prec, time % p10);
-	else
-		trace_seq_printf(s, "%12llu", time);
+	trace_seq_put_timestamp(s, record->ts, div, prec);
 }
 
 struct print_event_type {
@@ -7156,7 +9274,8 @@ static void print_int(struct tep_handle *tep, struct trace_seq *s,
 	default:
 		return;
 	}
-	trace_seq_printf(s, type->format, param);
+	if (!print_int_fast(s, type->format, 0, param))
+		trace_seq_printf(s, type->format, param);
 }
 
 static int tep_print_event_param_type(char *format,
@@ -7167,53 +9286,32 @@ static int tep_print_event_param_type(char *format,
 
 	type->type = EVENT_TYPE_UNKNOWN;
 	while (*str) {
-		switch (*str) {
-		case 'd':
-		case 'u':
-		case 'i':
-		case 'x':
-		case 'X':
-		case 'o':
-			type->type = EVENT_TYPE_INT;
-			break;
-		case 's':
-			type->type = EVENT_TYPE_STRING;
-			break;
-		}
-		str++;
-		i++;
-		if (type->type != EVENT_TYPE_UNKNOWN)
-			break;
-	}
-	memset(type->format, 0, 32);
-	memcpy(type->format, format, i < 32 ? i : 31);
-	return i;
-}
-
-/**
- * tep_print_event - Write various event information
- * @tep: a handle to the trace event parser context
- * @s: the trace_seq to write to
- * @record: The record to get the event from
- * @format: a printf format string. Supported event fileds:
- *	TEP_PRINT_PID, "%d" - event PID
- *	TEP_PRINT_CPU, "%d" - event CPU
- *	TEP_PRINT_COMM, "%s" - event command string
- *	TEP_PRINT_NAME, "%s" - event name
- *	TEP_PRINT_LATENCY, "%s" - event latency
- *	TEP_PRINT_TIME, %d - event time stamp. A divisor and precision
- *			can be specified as part of this format string:
- *			"%precision.divisord". Example:
- *			"%3.1000d" - divide the time by 1000 and print the first
- *			3 digits before the dot. Thus, the time stamp
- *			"123456000" will be printed as "123.456"
- *	TEP_PRINT_INFO, "%s" - event information. If any width is specified in
- *			the format string, the event information will be printed
- *			in raw format.
- * Writes the specified event information into @s.
- */
-void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
-		     struct tep_record *record, const char *fmt, ...)
+		switch (*str) {
+		case 'd':
+		case 'u':
+		case 'i':
+		case 'x':
+		case 'X':
+		case 'o':
+			type->type = EVENT_TYPE_INT;
+			break;
+		case 's':
+			type->type = EVENT_TYPE_STRING;
+			break;
+		}
+		str++;
+		i++;
+		if (type->type != EVENT_TYPE_UNKNOWN)
+			break;
+	}
+	memset(type->format, 0, 32);
+	memcpy(type->format, format, i < 32 ? i : 31);
+	return i;
+}
+
+static void print_event_args(struct tep_handle *tep, struct trace_seq *s,
+			     struct tep_record *record, const char *fmt,
+			     va_list args)
 {
 	struct print_event_type type;
 	struct tep_event *event;
@@ -7221,7 +9319,6 @@ void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
 	char *format;
 	char *str;
 	int offset;
-	va_list args;
 
 	event = tep_find_event_by_record(tep, record);
 	if (!event) {
@@ -7233,7 +9330,6 @@ void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
 	if (!format)
 		return;
 
-	va_start(args, fmt);
 	while (*current) {
 		current = strchr(str, '%');
 		if (!current) {
@@ -7262,10 +9358,52 @@ void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
 		str = current;
 
 	}
-	va_end(args);
 	free(format);
 }
 
+/**
+ * tep_print_event - Write various event information
+ * @tep: a handle to the trace event parser context
+ * @s: the trace_seq to write to
+ * @record: The record to get the event from
+ * @format: a printf format string. Supported event fileds:
+ *	TEP_PRINT_PID, "%d" - event PID
+ *	TEP_PRINT_CPU, "%d" - event CPU
+ *	TEP_PRINT_COMM, "%s" - event command string
+ *	TEP_PRINT_NAME, "%s" - event name
+ *	TEP_PRINT_LATENCY, "%s" - event latency
+ *	TEP_PRINT_TIME, %d - event time stamp. A divisor and precision
+ *			can be specified as part of this format string:
+ *			"%precision.divisord". Example:
+ *			"%3.1000d" - divide the time by 1000 and print the first
+ *			3 digits before the dot. Thus, the time stamp
+ *			"123456000" will be printed as "123.456"
+ *	TEP_PRINT_INFO, "%s" - event information. If any width is specified in
+ *			the format string, the event information will be printed
+ *			in raw format.
+ * Writes the specified event information into @s.
+ */
+void tep_print_event(struct tep_handle *tep, struct trace_seq *s,
+		     struct tep_record *record, const char *fmt, ...)
+{
+#ifdef TEP_STATS
+	unsigned long long expansions = trace_seq_expansions;
+#endif
+	va_list args;
+
+	trace_seq_print_begin(s);
+
+	va_start(args, fmt);
+	print_event_args(tep, s, record, fmt, args);
+	va_end(args);
+
+	trace_seq_print_end(s);
+
+	/* Only the trace_seqs grown by this thread, while printing for @tep */
+	tep_stat_add(tep->stats.seq_expansions,
+		     trace_seq_expansions - expansions);
+}
+
 static int events_id_cmp(const void *a, const void *b)
 {
 	struct tep_event * const * ea = a;
@@ -7596,8 +9734,8 @@ static void parse_header_field(struct tep_handle *tep, const char *field,
 	char *token;
 	int type;
 
-	save_input_buf_ptr = tep->input_buf_ptr;
-	save_input_buf_siz = tep->input_buf_siz;
+	save_input_buf_ptr = parser.input_buf_ptr;
+	save_input_buf_siz = parser.input_buf_siz;
 
 	if (read_expected(tep, TEP_EVENT_ITEM, "field") < 0)
 		return;
@@ -7674,8 +9812,8 @@ static void parse_header_field(struct tep_handle *tep, const char *field,
 	return;
 
  discard:
-	tep->input_buf_ptr = save_input_buf_ptr;
-	tep->input_buf_siz = save_input_buf_siz;
+	parser.input_buf_ptr = save_input_buf_ptr;
+	parser.input_buf_siz = save_input_buf_siz;
 	*offset = 0;
 	*size = 0;
 	free_token(token);
@@ -7698,6 +9836,8 @@ int tep_parse_header_page(struct tep_handle *tep, char *buf, unsigned long size,
 {
 	int ignore;
 
+	digest_input(tep, TEP_CACHE_HEADER_PAGE, buf, size);
+
 	if (!size) {
 		/*
 		 * Old kernels did not have header page info.
@@ -7747,7 +9887,7 @@ static void free_handler(struct event_handler *handle)
 	free(handle);
 }
 
-static int find_event_handle(struct tep_handle *tep, struct tep_event *event)
+__hidden int find_event_handle(struct tep_handle *tep, struct tep_event *event)
 {
 	struct event_handler *handle, **next;
 
@@ -7788,11 +9928,158 @@ static int find_event_handle(struct tep_handle *tep, struct tep_event *event)
  *
  * /sys/kernel/debug/tracing/events/.../.../format
  */
+/*
+ * Keep the parsed format in the schema of @event. If the schema can be
+ * shared, also keep the format text it was parsed from, to be compared
+ * with the formats of the events parsed after it.
+ */
+static int save_schema(struct tep_event *event, const char *text,
+		       unsigned long len)
+{
+	struct event_schema *schema = to_event_alloc(event)->layout->schema;
+	struct tep_format_field *field;
+
+	schema->format = event->format;
+	schema->print_fmt = event->print_fmt;
+	schema->flags = event->flags & TEP_EVENT_FL_FAILED;
+
+	if (!event->tep || (event->flags & TEP_EVENT_FL_ISFTRACE))
+		return 0;
+
+	schema->text = arena_alloc(&schema->arena, len);
+	if (schema->text)
+		memcpy(schema->text, text, len);
+
+	if (!parser.shared)
+		return 0;
+
+	if (event_copy_fields(event->tep, event) < 0) {
+		event->format = schema->format;
+		return -1;
+	}
+
+	/* The fields of the schema must not refer to this handle */
+	for (field = schema->format.common_fields; field; field = field->next)
+		field->event = NULL;
+	for (field = schema->format.fields; field; field = field->next)
+		field->event = NULL;
+
+	/* Whether a print format not parsed yet calls functions is unknown */
+	if (schema->text && !schema->flags && !parser.func_args &&
+	    !schema->print_text)
+		add_schema(schema);
+	return 0;
+}
+
+/*
+ * Keep the rest of the format, the print format, to be parsed when the
+ * event is first printed. Returns false if it has to be parsed now.
+ */
+static bool save_print_text(struct tep_event *event)
+{
+	struct event_schema *schema = to_event_alloc(event)->layout->schema;
+	unsigned long len = parser.input_buf_siz - parser.input_buf_ptr;
+
+	schema->print_text = arena_alloc(&schema->arena, len);
+	if (!schema->print_text)
+		return false;
+	memcpy(schema->print_text, parser.input_buf + parser.input_buf_ptr, len);
+	schema->print_len = len;
+	return true;
+}
+
+/* The flags of a field that parsing the print format sets */
+#define FIELD_PRINT_FLAGS	(TEP_FIELD_IS_FLAG | TEP_FIELD_IS_SYMBOLIC)
+
+static void copy_print_flags(struct tep_format_field *dst,
+			     struct tep_format_field *src)
+{
+	for (; dst && src; dst = dst->next, src = src->next)
+		dst->flags |= src->flags & FIELD_PRINT_FLAGS;
+}
+
+/*
+ * Parsing the print format marks the fields it prints with flags or
+ * symbols, but on the fields of the schema. Pass that on to the copies
+ * of the fields that @event uses, if it has its own.
+ */
+static void event_copy_print_flags(struct tep_event *event)
+{
+	struct tep_format *format = &to_event_alloc(event)->layout->schema->format;
+
+	if (event->format.fields != format->fields)
+		copy_print_flags(event->format.fields, format->fields);
+	if (event->format.common_fields != format->common_fields)
+		copy_print_flags(event->format.common_fields,
+				 format->common_fields);
+}
+
+/*
+ * Parse the print format of @event that was kept as text when the event
+ * was parsed. The events of a layout share it, so it is only parsed by
+ * the first of them that is printed.
+ */
+static void parse_pending_print(struct tep_event *event)
+{
+	struct event_schema *schema = to_event_alloc(event)->layout->schema;
+	struct tep_parser saved = parser;
+	struct tep_event tmp;
+	int flags;
+
+	pthread_mutex_lock(&event->tep->print_fmt_lock);
+	flags = event->flags;
+	if (!(flags & TEP_EVENT_FL_PRINT_PENDING))
+		goto out;
+
+	if (!schema->print_parsed) {
+		/* The arguments refer to the fields of the schema */
+		tmp = *event;
+		tmp.format = schema->format;
+		memset(&tmp.print_fmt, 0, sizeof(tmp.print_fmt));
+
+		init_input_buf(event->tep, schema->print_text, schema->print_len);
+		parser.arena = &schema->arena;
+		parser.shared = false;
+		/* An event with its own handler may not use the format */
+		parser.quiet = event->handler != NULL;
+
+		if (event_read_print(&tmp) < 0) {
+			do_warning_event(event, "%s: failed to parse print format",
+					 __func__);
+			schema->flags |= TEP_EVENT_FL_FAILED;
+		} else {
+			tmp.print_fmt.print_cache = parse_args(&tmp,
+							       tmp.print_fmt.format,
+							       tmp.print_fmt.args);
+		}
+
+		schema->print_fmt = tmp.print_fmt;
+		schema->print_parsed = true;
+	}
+
+	event_copy_print_flags(event);
+	event->print_fmt = schema->print_fmt;
+	flags = (flags | schema->flags) & ~TEP_EVENT_FL_PRINT_PENDING;
+	__atomic_store_n(&event->flags, flags, __ATOMIC_RELEASE);
+ out:
+	pthread_mutex_unlock(&event->tep->print_fmt_lock);
+	parser = saved;
+}
+
+__hidden void parse_event_print(struct tep_event *event)
+{
+	event_print_fmt(event);
+}
+
 static enum tep_errno parse_format(struct tep_event **eventp,
 				   struct tep_handle *tep, const char *buf,
 				   unsigned long size, const char *sys)
 {
+	struct event_layout *layout = NULL;
 	struct tep_event *event;
+	unsigned long len;
+	const char *text;
+	unsigned int hash;
 	int ret;
 
 	init_input_buf(tep, buf, size);
@@ -7801,6 +10088,8 @@ static enum tep_errno parse_format(struct tep_event **eventp,
 	if (!event)
 		return TEP_ERRNO__MEM_ALLOC_FAILED;
 
+	parser.arena = &to_event_alloc(event)->arena;
+
 	event->name = event_read_name(tep);
 	if (!event->name) {
 		/* Bad event? */
@@ -7825,7 +10114,13 @@ static enum tep_errno parse_format(struct tep_event **eventp,
 		goto event_alloc_failed;
 	}
 
-	event->system = strdup(sys);
+	if (tep) {
+		pthread_mutex_lock(&tep->lock);
+		event->system = (char *)strtab_intern(&tep->strings, sys);
+		pthread_mutex_unlock(&tep->lock);
+	} else {
+		event->system = parse_strdup(sys);
+	}
 	if (!event->system) {
 		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
 		goto event_alloc_failed;
@@ -7834,21 +10129,100 @@ static enum tep_errno parse_format(struct tep_event **eventp,
 	/* Add tep to event so that it can be referenced */
 	event->tep = tep;
 
+	/* Everything after the ID is the same for the events of a class */
+	text = buf + parser.input_buf_ptr;
+	len = size - parser.input_buf_ptr;
+	hash = layout_hash(text, len);
+
+	if (tep && !(event->flags & TEP_EVENT_FL_ISFTRACE)) {
+		pthread_mutex_lock(&tep->lock);
+		layout = find_layout(tep, hash, text, len);
+		if (layout)
+			__atomic_add_fetch(&layout->ref, 1, __ATOMIC_ACQ_REL);
+		pthread_mutex_unlock(&tep->lock);
+	}
+
+	if (layout) {
+		to_event_alloc(event)->layout = layout;
+		parser.arena = NULL;
+		if (event_copy_fields(tep, event) < 0) {
+			ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+			goto event_alloc_failed;
+		}
+		if (layout->schema->print_text) {
+			event->flags |= TEP_EVENT_FL_PRINT_PENDING;
+		} else {
+			event->print_fmt = layout->schema->print_fmt;
+			event->flags |= layout->schema->flags;
+		}
+		return 0;
+	}
+
+	layout = calloc(1, sizeof(*layout));
+	if (!layout) {
+		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+		goto event_alloc_failed;
+	}
+	layout->ref = 1;
+	to_event_alloc(event)->layout = layout;
+
+	parser.shared = tep && !(event->flags & TEP_EVENT_FL_ISFTRACE) &&
+			(tep->flags & TEP_SHARE_FORMATS);
+	parser.func_args = false;
+
+	if (parser.shared) {
+		layout->schema = find_schema(hash, text, len, tep->long_size);
+		if (layout->schema) {
+			parser.arena = NULL;
+			parser.shared = false;
+			if (event_copy_fields(tep, event) < 0) {
+				ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+				goto event_alloc_failed;
+			}
+			event->print_fmt = layout->schema->print_fmt;
+			event->flags |= layout->schema->flags;
+			return 0;
+		}
+	}
+
+	layout->schema = calloc(1, sizeof(*layout->schema));
+	if (!layout->schema) {
+		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+		goto event_alloc_failed;
+	}
+	layout->schema->ref = 1;
+	layout->schema->hash = hash;
+	layout->schema->len = len;
+	layout->schema->long_size = tep ? tep->long_size : 0;
+
+	/* The fields and print format belong to the schema */
+	parser.arena = &layout->schema->arena;
+
 	ret = event_read_format(event);
 	if (ret < 0) {
 		ret = TEP_ERRNO__READ_FORMAT_FAILED;
 		goto event_parse_failed;
 	}
 
+	if (tep && (tep->flags & TEP_LAZY_PRINT_FMT) &&
+	    !(event->flags & TEP_EVENT_FL_ISFTRACE) && save_print_text(event)) {
+		event->flags |= TEP_EVENT_FL_PRINT_PENDING;
+		goto out;
+	}
+
 	/*
 	 * If the event has an override, don't print warnings if the event
 	 * print format fails to parse.
 	 */
-	if (tep && find_event_handle(tep, event))
-		show_warning = 0;
+	if (tep) {
+		pthread_mutex_lock(&tep->lock);
+		if (find_event_handle(tep, event))
+			parser.quiet = true;
+		pthread_mutex_unlock(&tep->lock);
+	}
 
 	ret = event_read_print(event);
-	show_warning = 1;
+	parser.quiet = false;
 
 	if (ret < 0) {
 		ret = TEP_ERRNO__READ_PRINT_FAILED;
@@ -7864,15 +10238,15 @@ static enum tep_errno parse_format(struct tep_event **eventp,
 		for (field = event->format.fields; field; field = field->next) {
 			arg = alloc_arg();
 			if (!arg) {
-				event->flags |= TEP_EVENT_FL_FAILED;
-				return TEP_ERRNO__OLD_FTRACE_ARG_FAILED;
+				ret = TEP_ERRNO__OLD_FTRACE_ARG_FAILED;
+				goto event_parse_failed;
 			}
 			arg->type = TEP_PRINT_FIELD;
-			arg->field.name = strdup(field->name);
+			arg->field.name = parse_strdup(field->name);
 			if (!arg->field.name) {
-				event->flags |= TEP_EVENT_FL_FAILED;
 				free_arg(arg);
-				return TEP_ERRNO__OLD_FTRACE_ARG_FAILED;
+				ret = TEP_ERRNO__OLD_FTRACE_ARG_FAILED;
+				goto event_parse_failed;
 			}
 			arg->field.field = field;
 			*list = arg;
@@ -7885,16 +10259,28 @@ static enum tep_errno parse_format(struct tep_event **eventp,
 							  event->print_fmt.format,
 							  event->print_fmt.args);
 
+ out:
+	parser.arena = NULL;
+	ret = save_schema(event, text, len);
+	parser.shared = false;
+	if (ret < 0) {
+		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+		goto event_alloc_failed;
+	}
 	return 0;
 
  event_parse_failed:
 	event->flags |= TEP_EVENT_FL_FAILED;
+	parser.arena = NULL;
+	if (save_schema(event, text, len) < 0)
+		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+	parser.shared = false;
 	return ret;
 
  event_alloc_failed:
-	free(event->system);
-	free(event->name);
-	free(event);
+	parser.arena = NULL;
+	parser.shared = false;
+	free_tep_event(event);
 	*eventp = NULL;
 	return ret;
 }
@@ -7905,15 +10291,38 @@ __parse_event(struct tep_handle *tep,
 	      const char *buf, unsigned long size,
 	      const char *sys)
 {
-	int ret = parse_format(eventp, tep, buf, size, sys);
-	struct tep_event *event = *eventp;
+	struct tep_event *event;
+	int ret;
+
+	if (tep && tep->frozen_id)
+		return TEP_ERRNO__HANDLE_FROZEN;
+	if (tep && __atomic_load_n(&tep->nr_pipelines, __ATOMIC_ACQUIRE))
+		return TEP_ERRNO__HANDLE_BUSY;
 
+	ret = parse_format(eventp, tep, buf, size, sys);
+	event = *eventp;
 	if (event == NULL)
 		return ret;
 
-	if (tep && add_event(tep, event)) {
-		ret = TEP_ERRNO__MEM_ALLOC_FAILED;
-		goto event_add_failed;
+	if (tep) {
+		/* Only adding the event needs to be serialized */
+		struct event_layout *layout = to_event_alloc(event)->layout;
+		unsigned long long digest;
+
+		digest = tep_digest_input(0, TEP_CACHE_FORMAT, buf, size);
+
+		pthread_mutex_lock(&tep->lock);
+		ret = add_event(tep, event);
+		/* Let the events parsed after this one share its layout */
+		if (!ret && layout->schema->text && !layout->hashed)
+			add_layout(tep, layout);
+		if (!ret)
+			tep->input_digest += digest;
+		pthread_mutex_unlock(&tep->lock);
+		if (ret) {
+			ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+			goto event_add_failed;
+		}
 	}
 
 #define PRINT_ARGS 0
@@ -8042,6 +10451,42 @@ void *tep_get_field_raw(struct trace_seq *s, struct tep_event *event,
 	return data + offset;
 }
 
+/**
+ * tep_get_field_view - return where the data of a field is in a record
+ * @field: the field to find
+ * @record: the record to find it in
+ * @view: where to store the location and length of the data
+ *
+ * Fills @view with a pointer into @record->data of the data of @field,
+ * and its length, without copying it. For a __data_loc or __rel_loc
+ * field, that is the array it points to. For a string, the length does
+ * not include the terminating nul, which the view may not have.
+ *
+ * Returns 0 on success, or -1 if the data is not all within the
+ * @record->size bytes of the record, in which case @view is empty.
+ */
+int tep_get_field_view(struct tep_format_field *field,
+		       struct tep_record *record, struct tep_field_view *view)
+{
+	void *ptr;
+	unsigned int len;
+
+	view->data = NULL;
+	view->len = 0;
+
+	if (!field || !record ||
+	    !field_data(field->event->tep, field, record->data, record->size,
+			&ptr, &len))
+		return -1;
+
+	if (field->flags & TEP_FIELD_IS_STRING)
+		len = strnlen(ptr, len);
+
+	view->data = ptr;
+	view->len = len;
+	return 0;
+}
+
 /**
  * tep_get_field_val - find a field and return its value
  * @s: The seq to print to on error
@@ -8169,7 +10614,7 @@ int tep_print_func_field(struct trace_seq *s, const char *fmt,
 	struct tep_format_field *field = tep_find_field(event, name);
 	struct tep_handle *tep = event->tep;
 	unsigned long long val;
-	struct func_map *func;
+	struct func_map func;
 	char tmp[128];
 
 	if (!field)
@@ -8178,10 +10623,8 @@ int tep_print_func_field(struct trace_seq *s, const char *fmt,
 	if (tep_read_number_field(field, record->data, &val))
 		goto failed;
 
-	func = find_func(tep, val);
-
-	if (func)
-		snprintf(tmp, 128, "%s/0x%llx", func->func, func->addr - val);
+	if (find_func(tep, val, &func, NULL))
+		snprintf(tmp, 128, "%s/0x%llx", func.func, func.addr - val);
 	else
 		sprintf(tmp, "0x%08llx", val);
 
@@ -8196,8 +10639,16 @@ int tep_print_func_field(struct trace_seq *s, const char *fmt,
 static void free_func_handle(struct tep_function_handler *func)
 {
 	struct func_params *params;
+	int i;
 
 	free(func->name);
+	free(func->args);
+
+	for (i = 0; func->str_args && i < func->nr_str_args; i++) {
+		if (func->str_args[i].buffer)
+			trace_seq_destroy(&func->str_args[i]);
+	}
+	free(func->str_args);
 
 	while (func->params) {
 		params = func->params;
@@ -8235,6 +10686,9 @@ int tep_register_print_function(struct tep_handle *tep,
 	va_list ap;
 	int ret;
 
+	if (handle_in_pipeline(tep))
+		return TEP_ERRNO__HANDLE_BUSY;
+
 	func_handle = find_func_handler(tep, name);
 	if (func_handle) {
 		/*
@@ -8287,15 +10741,38 @@ int tep_register_print_function(struct tep_handle *tep,
 		next_param = &(param->next);
 
 		func_handle->nr_args++;
+		if (type == TEP_FUNC_ARG_STRING)
+			func_handle->nr_str_args++;
 	}
 	va_end(ap);
 
+	if (func_handle->nr_args) {
+		func_handle->args = calloc(func_handle->nr_args,
+					   sizeof(*func_handle->args));
+		if (!func_handle->args) {
+			do_warning("Failed to allocate function args");
+			ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+			goto out_free_func;
+		}
+	}
+
+	if (func_handle->nr_str_args) {
+		func_handle->str_args = calloc(func_handle->nr_str_args,
+					       sizeof(*func_handle->str_args));
+		if (!func_handle->str_args) {
+			do_warning("Failed to allocate function string args");
+			ret = TEP_ERRNO__MEM_ALLOC_FAILED;
+			goto out_free_func;
+		}
+	}
+
 	func_handle->next = tep->func_handlers;
 	tep->func_handlers = func_handle;
 
 	return 0;
  out_free:
 	va_end(ap);
+ out_free_func:
 	free_func_handle(func_handle);
 	return ret;
 }
@@ -8315,6 +10792,9 @@ int tep_unregister_print_function(struct tep_handle *tep,
 {
 	struct tep_function_handler *func_handle;
 
+	if (handle_in_pipeline(tep))
+		return -1;
+
 	func_handle = find_func_handler(tep, name);
 	if (func_handle && func_handle->func == func) {
 		remove_func_handler(tep, name);
@@ -8331,7 +10811,8 @@ static struct tep_event *search_event(struct tep_handle *tep, int id,
 
 	if (id >= 0) {
 		/* search by id */
-		event = tep_find_event(tep, id);
+		/* A handler may replace the print format, do not parse it */
+		event = find_event(tep, id);
 		if (!event)
 			return NULL;
 		if (event_name && (strcmp(event_name, event->name) != 0))
@@ -8339,7 +10820,7 @@ static struct tep_event *search_event(struct tep_handle *tep, int id,
 		if (sys_name && (strcmp(sys_name, event->system) != 0))
 			return NULL;
 	} else {
-		event = tep_find_event_by_name(tep, sys_name, event_name);
+		event = find_event_by_name(tep, sys_name, event_name);
 		if (!event)
 			return NULL;
 	}
@@ -8376,6 +10857,9 @@ int tep_register_event_handler(struct tep_handle *tep, int id,
 	struct tep_event *event;
 	struct event_handler *handle;
 
+	if (handle_in_pipeline(tep))
+		return TEP_ERRNO__HANDLE_BUSY;
+
 	event = search_event(tep, id, sys_name, event_name);
 	if (event == NULL)
 		goto not_found;
@@ -8461,6 +10945,9 @@ int tep_unregister_event_handler(struct tep_handle *tep, int id,
 	struct event_handler *handle;
 	struct event_handler **next;
 
+	if (handle_in_pipeline(tep))
+		return -1;
+
 	event = search_event(tep, id, sys_name, event_name);
 	if (event == NULL)
 		goto not_found;
@@ -8501,59 +10988,113 @@ struct tep_handle *tep_alloc(void)
 	if (tep) {
 		tep->ref_count = 1;
 		tep->host_bigendian = tep_is_bigendian();
+		pthread_mutex_init(&tep->lock, NULL);
+		pthread_mutex_init(&tep->print_fmt_lock, NULL);
 	}
 
 	return tep;
 }
 
-void tep_ref(struct tep_handle *tep)
+/*
+ * Build the sorted comm, function and printk tables from everything
+ * that was registered so far.
+ */
+__hidden int init_lookup_tables(struct tep_handle *tep)
 {
-	tep->ref_count++;
-}
+	if (!tep->cmdlines && cmdline_init(tep))
+		return -1;
+	if (func_table_dirty(tep) && func_map_init(tep, NULL))
+		return -1;
+	if ((!tep->printk_map || tep->printklist) && printk_map_init(tep, NULL))
+		return -1;
 
-int tep_get_ref(struct tep_handle *tep)
-{
-	if (tep)
-		return tep->ref_count;
 	return 0;
 }
 
-__hidden void free_tep_format_field(struct tep_format_field *field)
+/**
+ * tep_freeze - make a tep handle read only
+ * @tep: a handle to the trace event parser context
+ *
+ * Builds the comm, function and printk tables and resolves the fields
+ * that the lookup and print functions would otherwise look up on first
+ * use, and moves the caches of those functions to per thread storage.
+ * Afterward the handle may be used by any number of threads at once
+ * without locking. The functions that modify the handle fail with
+ * EBUSY, or with TEP_ERRNO__HANDLE_FROZEN for the event parsing ones.
+ *
+ * A handle can not be frozen while a print pipeline uses it.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int tep_freeze(struct tep_handle *tep)
 {
-	free(field->type);
-	if (field->alias != field->name)
-		free(field->alias);
-	free(field->name);
-	free(field);
-}
+	static unsigned int frozen_ids;
+	struct tep_event *event;
+	unsigned int id;
 
-static void free_format_fields(struct tep_format_field *field)
-{
-	struct tep_format_field *next;
+	if (!tep) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tep->frozen_id)
+		return 0;
+
+	if (__atomic_load_n(&tep->nr_pipelines, __ATOMIC_ACQUIRE)) {
+		errno = EBUSY;
+		return -1;
+	}
 
-	while (field) {
-		next = field->next;
-		free_tep_format_field(field);
-		field = next;
+	if (init_lookup_tables(tep))
+		return -1;
+
+	if (tep->nr_events)
+		resolve_common_fields(tep);
+
+	event = tep_find_event_by_name(tep, "ftrace", "bprint");
+	if (event && !tep->bprint_buf_field) {
+		tep->bprint_ip_field = tep_find_field(event, "ip");
+		if (tep->bprint_ip_field)
+			tep->bprint_buf_field = tep_find_field(event, "buf");
 	}
+	if (event && !tep->bprint_fmt_field)
+		tep->bprint_fmt_field = tep_find_field(event, "fmt");
+
+	do {
+		id = __atomic_add_fetch(&frozen_ids, 1, __ATOMIC_RELAXED);
+	} while (!id);
+	tep->frozen_id = id;
+
+	return 0;
+}
+
+void tep_ref(struct tep_handle *tep)
+{
+	tep->ref_count++;
 }
 
-static void free_formats(struct tep_format *format)
+int tep_get_ref(struct tep_handle *tep)
 {
-	free_format_fields(format->common_fields);
-	free_format_fields(format->fields);
+	if (tep)
+		return tep->ref_count;
+	return 0;
 }
 
+/*
+ * The fields, print arguments and strings of an event all live in the
+ * arenas of the event and of its schema, there is no need to walk them.
+ * Events loaded with tep_load_cache() go away with the cache mapping.
+ */
 __hidden void free_tep_event(struct tep_event *event)
 {
-	free(event->name);
-	free(event->system);
+	struct tep_handle *tep = event->tep;
 
-	free_formats(&event->format);
+	if (tep && tep->cache_map && (char *)event >= (char *)tep->cache_map &&
+	    (char *)event < (char *)tep->cache_map + tep->cache_size)
+		return;
 
-	free(event->print_fmt.format);
-	free_args(event->print_fmt.args);
-	free_parse_args(event->print_fmt.print_cache);
+	put_layout(to_event_alloc(event)->layout);
+	arena_free(&to_event_alloc(event)->arena);
 	free(event);
 }
 
@@ -8594,13 +11135,8 @@ void tep_free(struct tep_handle *tep)
 		cmdlist = cmdnext;
 	}
 
-	if (tep->func_map) {
-		for (i = 0; i < (int)tep->func_count; i++) {
-			free(tep->func_map[i].func);
-			free(tep->func_map[i].mod);
-		}
-		free(tep->func_map);
-	}
+	free_func_table(tep->func_table);
+	free_func_retired(tep);
 
 	while (funclist) {
 		funcnext = funclist->next;
@@ -8616,11 +11152,8 @@ void tep_free(struct tep_handle *tep)
 		free_func_handle(func_handler);
 	}
 
-	if (tep->printk_map) {
-		for (i = 0; i < (int)tep->printk_count; i++)
-			free(tep->printk_map[i].printk);
-		free(tep->printk_map);
-	}
+	free(tep->printk_map);
+	free(tep->printk_strs);
 
 	while (printklist) {
 		printknext = printklist->next;
@@ -8638,10 +11171,18 @@ void tep_free(struct tep_handle *tep)
 		free_handler(handle);
 	}
 
+	if (tep->cache_map)
+		munmap(tep->cache_map, tep->cache_size);
+
 	free(tep->events);
 	free(tep->sort_events);
+	free(tep->layouts);
 	free(tep->func_resolver);
+	free(tep->func_cache);
 	free_tep_plugin_paths(tep);
+	strtab_free(&tep->strings);
+	pthread_mutex_destroy(&tep->print_fmt_lock);
+	pthread_mutex_destroy(&tep->lock);
 
 	free(tep);
 }
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Format records on worker threads and write them out in order.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "event-parse.h"
+#include "event-parse-local.h"
+#include "trace-seq.h"
+
+/* Records that may be in flight per worker thread */
+#define PIPELINE_SLOTS_PER_THREAD	16
+/* Most slots written out by a single writev() */
+#define PIPELINE_IOV_MAX		64
+
+/*
+ * Event handlers, like the ones of the plugins, may keep their state in
+ * static variables. The records of events that have one are formatted
+ * one at a time in the whole process.
+ */
+static pthread_mutex_t handler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pipeline_slot {
+	struct trace_seq	s;
+	struct tep_record	*record;
+	int			done;
+};
+
+struct tep_print_pipeline {
+	struct tep_handle		*tep;
+	tep_pipeline_print_func		print;
+	tep_pipeline_release_func	release;
+	void				*context;
+	int				fd;
+	int				error;
+
+	pthread_mutex_t			lock;
+	pthread_cond_t			work;
+	pthread_cond_t			done;
+	pthread_t			*threads;
+	int				nr_threads;
+	bool				stop;
+
+	struct pipeline_slot		*slots;
+	unsigned long			mask;
+	unsigned long			head;	/* next slot to fill */
+	unsigned long			next;	/* next slot to format */
+	unsigned long			tail;	/* next slot to write */
+};
+
+static void pipeline_default_print(struct tep_handle *tep, struct trace_seq *s,
+				   struct tep_record *record, void *context)
+{
+	tep_print_event(tep, s, record, "%16s-%-5d [%03d] %d %s: %s\n",
+			TEP_PRINT_COMM, TEP_PRINT_PID, TEP_PRINT_CPU,
+			TEP_PRINT_TIME, TEP_PRINT_NAME, TEP_PRINT_INFO);
+}
+
+static void *pipeline_worker(void *data)
+{
+	struct tep_print_pipeline *pipe = data;
+	struct pipeline_slot *slot;
+	struct tep_event *event;
+	unsigned long seq;
+	bool serialize;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while (pipe->next == pipe->head && !pipe->stop)
+			pthread_cond_wait(&pipe->work, &pipe->lock);
+		if (pipe->next == pipe->head)
+			break;
+
+		seq = pipe->next++;
+		slot = &pipe->slots[seq & pipe->mask];
+		pthread_mutex_unlock(&pipe->lock);
+
+		event = tep_find_event_by_record(pipe->tep, slot->record);
+		serialize = event && event->handler;
+
+		trace_seq_reset(&slot->s);
+		if (serialize)
+			pthread_mutex_lock(&handler_lock);
+		pipe->print(pipe->tep, &slot->s, slot->record, pipe->context);
+		if (serialize)
+			pthread_mutex_unlock(&handler_lock);
+
+		pthread_mutex_lock(&pipe->lock);
+		slot->done = 1;
+		/* Only the oldest record can unblock the writer */
+		if (seq == pipe->tail)
+			pthread_cond_signal(&pipe->done);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t r;
+
+	while (cnt) {
+		r = writev(fd, iov, cnt);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the formatted records at the tail of the ring. Called with
+ * the pipeline lock held. If @wait is set, wait until the ring holds no
+ * more than @wait - 1 records, otherwise only write what is done.
+ */
+static void pipeline_drain(struct tep_print_pipeline *pipe, unsigned long wait)
+{
+	struct iovec iov[PIPELINE_IOV_MAX];
+	struct pipeline_slot *slot;
+	unsigned long tail;
+	int cnt;
+	int i;
+
+	for (;;) {
+		tail = pipe->tail;
+		for (cnt = 0; cnt < PIPELINE_IOV_MAX && tail + cnt != pipe->head; cnt++) {
+			slot = &pipe->slots[(tail + cnt) & pipe->mask];
+			if (!slot->done)
+				break;
+		}
+
+		if (!cnt) {
+			if (!wait || pipe->head - pipe->tail < wait)
+				return;
+			pthread_cond_wait(&pipe->done, &pipe->lock);
+			continue;
+		}
+
+		/* Workers never touch finished slots, write them unlocked */
+		pthread_mutex_unlock(&pipe->lock);
+		for (i = 0; i < cnt; i++) {
+			slot = &pipe->slots[(tail + i) & pipe->mask];
+			iov[i].iov_base = slot->s.buffer;
+			iov[i].iov_len = slot->s.len;
+		}
+		if (!__atomic_load_n(&pipe->error, __ATOMIC_RELAXED) &&
+		    write_iov(pipe->fd, iov, cnt) < 0)
+			__atomic_store_n(&pipe->error, errno, __ATOMIC_RELAXED);
+		for (i = 0; i < cnt; i++) {
+			slot = &pipe->slots[(tail + i) & pipe->mask];
+			if (pipe->release)
+				pipe->release(slot->record, pipe->context);
+			slot->record = NULL;
+			slot->done = 0;
+		}
+		pthread_mutex_lock(&pipe->lock);
+		pipe->tail = tail + cnt;
+	}
+}
+
+/* The drain may write unlocked, so @error is read and set atomically */
+static int pipeline_status(struct tep_print_pipeline *pipe)
+{
+	int error = __atomic_load_n(&pipe->error, __ATOMIC_RELAXED);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * tep_print_pipeline_alloc - start threads to format records
+ * @tep: a handle to the trace event parser context
+ * @nr_threads: number of worker threads, or 0 for one per online CPU
+ * @fd: the file descriptor to write the formatted records to
+ * @print: formats a record into a trace_seq, or NULL for the default
+ * @release: called once a record has been written, may be NULL
+ * @context: passed to @print and @release
+ *
+ * Records added with tep_print_pipeline_add() are formatted by @print on
+ * the worker threads, each with its own trace_seq, and are written to
+ * @fd in the order they were added. If @print is NULL, the record is
+ * printed with the comm, pid, cpu, timestamp, event name and info.
+ *
+ * While a pipeline exists, the comm, function and printk lookups of
+ * @tep are serialized. Comms may still be registered, but the calls
+ * that add functions, printk formats, events or handlers, or that
+ * override comms, fail with EBUSY until the pipeline is freed. The
+ * records of events with a handler are formatted one at a time.
+ *
+ * Returns the pipeline, or NULL on error.
+ */
+struct tep_print_pipeline *
+tep_print_pipeline_alloc(struct tep_handle *tep, int nr_threads, int fd,
+			 tep_pipeline_print_func print,
+			 tep_pipeline_release_func release, void *context)
+{
+	struct tep_print_pipeline *pipe;
+	unsigned long nr_slots;
+	unsigned long i;
+
+	if (!tep || fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (nr_threads <= 0) {
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_threads <= 0)
+			nr_threads = 1;
+	}
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (!pipe)
+		return NULL;
+
+	for (nr_slots = 1; nr_slots < (unsigned long)nr_threads * PIPELINE_SLOTS_PER_THREAD; )
+		nr_slots <<= 1;
+
+	pipe->slots = calloc(nr_slots, sizeof(*pipe->slots));
+	pipe->threads = calloc(nr_threads, sizeof(*pipe->threads));
+	if (!pipe->slots || !pipe->threads) {
+		free(pipe->slots);
+		free(pipe->threads);
+		free(pipe);
+		return NULL;
+	}
+
+	for (i = 0; i < nr_slots; i++)
+		trace_seq_init(&pipe->slots[i].s);
+
+	pipe->tep = tep;
+	pipe->print = print ? print : pipeline_default_print;
+	pipe->release = release;
+	pipe->context = context;
+	pipe->fd = fd;
+	pipe->mask = nr_slots - 1;
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->work, NULL);
+	pthread_cond_init(&pipe->done, NULL);
+
+	__atomic_add_fetch(&tep->nr_pipelines, 1, __ATOMIC_ACQ_REL);
+
+	for (; pipe->nr_threads < nr_threads; pipe->nr_threads++) {
+		if (pthread_create(&pipe->threads[pipe->nr_threads], NULL,
+				   pipeline_worker, pipe))
+			break;
+	}
+
+	if (!pipe->nr_threads) {
+		tep_print_pipeline_free(pipe);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return pipe;
+}
+
+/**
+ * tep_print_pipeline_add - queue a record to be formatted
+ * @pipe: the pipeline returned by tep_print_pipeline_alloc()
+ * @record: the record to format
+ *
+ * The record must stay valid until the release callback of the
+ * pipeline is called for it, or until the pipeline is flushed. Records
+ * that are done are written out from here, and if all the slots are in
+ * use this waits for the oldest record to be formatted.
+ *
+ * Returns 0 on success, or -1 if writing to the file descriptor failed.
+ */
+int tep_print_pipeline_add(struct tep_print_pipeline *pipe,
+			   struct tep_record *record)
+{
+	struct pipeline_slot *slot;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipeline_drain(pipe, pipe->mask + 1);
+
+	slot = &pipe->slots[pipe->head & pipe->mask];
+	slot->record = record;
+	slot->done = 0;
+	pipe->head++;
+	pthread_cond_signal(&pipe->work);
+	pthread_mutex_unlock(&pipe->lock);
+
+	return pipeline_status(pipe);
+}
+
+/**
+ * tep_print_pipeline_flush - wait for all queued records to be written
+ * @pipe: the pipeline returned by tep_print_pipeline_alloc()
+ *
+ * Returns 0 on success, or -1 if writing to the file descriptor failed.
+ */
+int tep_print_pipeline_flush(struct tep_print_pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipeline_drain(pipe, 1);
+	pthread_mutex_unlock(&pipe->lock);
+
+	return pipeline_status(pipe);
+}
+
+/**
+ * tep_print_pipeline_free - flush and free a print pipeline
+ * @pipe: the pipeline returned by tep_print_pipeline_alloc()
+ *
+ * Writes out all the queued records and stops the worker threads.
+ */
+void tep_print_pipeline_free(struct tep_print_pipeline *pipe)
+{
+	unsigned long i;
+	int t;
+
+	if (!pipe)
+		return;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->nr_threads)
+		pipeline_drain(pipe, 1);
+	pipe->stop = true;
+	pthread_cond_broadcast(&pipe->work);
+	pthread_mutex_unlock(&pipe->lock);
+
+	for (t = 0; t < pipe->nr_threads; t++)
+		pthread_join(pipe->threads[t], NULL);
+
+	__atomic_sub_fetch(&pipe->tep->nr_pipelines, 1, __ATOMIC_ACQ_REL);
+
+	for (i = 0; i <= pipe->mask; i++)
+		trace_seq_destroy(&pipe->slots[i].s);
+
+	pthread_cond_destroy(&pipe->done);
+	pthread_cond_destroy(&pipe->work);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe->threads);
+	free(pipe->slots);
+	free(pipe);
+}
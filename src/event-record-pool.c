@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: LGPL-2.1
+/*
+ * Recycle struct tep_record allocations between threads.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "event-parse.h"
+#include "event-parse-local.h"
+
+/* Records allocated at once when the pool runs out */
+#define POOL_SLAB_RECORDS	256
+/* Free records a thread keeps before giving some back to the pool */
+#define POOL_CACHE_MAX		512
+/* Free records moved between a thread and the pool at once */
+#define POOL_CACHE_BATCH	128
+
+struct pool_record {
+	struct tep_record	record;
+	struct tep_record_pool	*pool;
+	struct pool_record	*next;
+	/* followed by data_size bytes of data */
+};
+
+struct pool_slab {
+	struct pool_slab	*next;
+	unsigned long long	records[];
+};
+
+/* The records of a pool that one thread uses without taking the lock */
+struct pool_cache {
+	struct tep_record_pool	*pool;
+	struct pool_cache	*next;
+	struct pool_cache	**pprev;
+	struct pool_record	*free;
+	unsigned int		nr_free;
+	struct pool_record	**ring;
+	unsigned int		ring_pos;
+};
+
+struct tep_record_pool {
+	unsigned int		data_size;
+	unsigned int		ring_size;
+	size_t			stride;
+	pthread_key_t		key;
+
+	pthread_mutex_t		lock;
+	struct pool_record	*free;
+	unsigned int		nr_free;
+	struct pool_slab	*slabs;
+	struct pool_cache	*caches;
+};
+
+static inline struct pool_record *to_pool_record(struct tep_record *record)
+{
+	return (struct pool_record *)record;
+}
+
+static void init_record(struct pool_record *pr)
+{
+	memset(&pr->record, 0, sizeof(pr->record));
+	if (pr->pool->data_size)
+		pr->record.data = pr + 1;
+	pr->record.ref_count = 1;
+}
+
+/* Must be called with pool->lock held */
+static struct pool_record *alloc_slab(struct tep_record_pool *pool,
+				      unsigned int nr, unsigned int *count)
+{
+	struct pool_record *list = NULL;
+	struct pool_record *pr;
+	struct pool_slab *slab;
+	unsigned int i;
+
+	if (nr < POOL_SLAB_RECORDS)
+		nr = POOL_SLAB_RECORDS;
+
+	slab = malloc(sizeof(*slab) + pool->stride * nr);
+	if (!slab)
+		return NULL;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	for (i = nr; i > 0; i--) {
+		pr = (void *)slab->records + pool->stride * (i - 1);
+		pr->pool = pool;
+		pr->next = list;
+		list = pr;
+	}
+	*count = nr;
+	return list;
+}
+
+/* Gives all but @keep of the free records of @cache back to the pool */
+static void cache_flush(struct pool_cache *cache, unsigned int keep)
+{
+	struct tep_record_pool *pool = cache->pool;
+	struct pool_record *first = cache->free;
+	struct pool_record *last;
+	unsigned int nr;
+
+	if (cache->nr_free <= keep)
+		return;
+
+	nr = cache->nr_free - keep;
+	for (last = first; --nr; last = last->next)
+		;
+
+	cache->free = last->next;
+	nr = cache->nr_free - keep;
+	cache->nr_free = keep;
+
+	pthread_mutex_lock(&pool->lock);
+	last->next = pool->free;
+	pool->free = first;
+	pool->nr_free += nr;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Takes at least @nr free records from the pool into @cache */
+static int cache_refill(struct pool_cache *cache, unsigned int nr)
+{
+	struct tep_record_pool *pool = cache->pool;
+	struct pool_record *first;
+	struct pool_record *last;
+	unsigned int count;
+
+	if (nr < POOL_CACHE_BATCH)
+		nr = POOL_CACHE_BATCH;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nr_free < nr) {
+		first = alloc_slab(pool, nr, &count);
+		if (!first) {
+			pthread_mutex_unlock(&pool->lock);
+			return -1;
+		}
+	} else {
+		first = pool->free;
+		for (last = first, count = 1; count < nr; count++)
+			last = last->next;
+		pool->free = last->next;
+		pool->nr_free -= count;
+		last->next = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (last = first; last->next; last = last->next)
+		;
+	last->next = cache->free;
+	cache->free = first;
+	cache->nr_free += count;
+	return 0;
+}
+
+static void release_record(struct pool_cache *cache, struct pool_record *pr)
+{
+	pr->next = cache->free;
+	cache->free = pr;
+	if (++cache->nr_free > POOL_CACHE_MAX)
+		cache_flush(cache, POOL_CACHE_MAX - POOL_CACHE_BATCH);
+}
+
+static int put_record(struct pool_cache *cache, struct pool_record *pr)
+{
+	if (__atomic_sub_fetch(&pr->record.ref_count, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	if (pr->record.locked)
+		return 0;
+	release_record(cache, pr);
+	return 1;
+}
+
+/* Called when a thread that used the pool exits */
+static void cache_destroy(void *data)
+{
+	struct pool_cache *cache = data;
+	struct tep_record_pool *pool = cache->pool;
+	unsigned int i;
+
+	for (i = 0; cache->ring && i < pool->ring_size; i++) {
+		if (cache->ring[i])
+			put_record(cache, cache->ring[i]);
+	}
+
+	cache_flush(cache, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	*cache->pprev = cache->next;
+	if (cache->next)
+		cache->next->pprev = cache->pprev;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(cache->ring);
+	free(cache);
+}
+
+static struct pool_cache *get_cache(struct tep_record_pool *pool)
+{
+	struct pool_cache *cache;
+
+	cache = pthread_getspecific(pool->key);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->pool = pool;
+
+	if (pool->ring_size) {
+		cache->ring = calloc(pool->ring_size, sizeof(*cache->ring));
+		if (!cache->ring)
+			goto fail;
+	}
+
+	if (pthread_setspecific(pool->key, cache))
+		goto fail;
+
+	pthread_mutex_lock(&pool->lock);
+	cache->next = pool->caches;
+	if (cache->next)
+		cache->next->pprev = &cache->next;
+	cache->pprev = &pool->caches;
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->lock);
+
+	return cache;
+ fail:
+	free(cache->ring);
+	free(cache);
+	return NULL;
+}
+
+static struct pool_record *cache_get(struct pool_cache *cache)
+{
+	struct pool_record *pr;
+
+	if (!cache->free && cache_refill(cache, 1) < 0)
+		return NULL;
+
+	pr = cache->free;
+	cache->free = pr->next;
+	cache->nr_free--;
+
+	init_record(pr);
+	return pr;
+}
+
+/**
+ * tep_record_pool_alloc - create a pool of records
+ * @data_size: the number of bytes of data each record comes with
+ * @ring_size: the number of records of each thread for tep_record_pool_next()
+ *
+ * Creates a pool of records that are recycled instead of being freed.
+ * If @data_size is not zero, the data of each record that is taken from
+ * the pool points to a buffer of that many bytes that belongs to it.
+ * @ring_size is only needed when tep_record_pool_next() is used.
+ *
+ * Returns the pool, to be freed with tep_record_pool_free(), or NULL
+ * on error.
+ */
+struct tep_record_pool *tep_record_pool_alloc(unsigned int data_size,
+					      unsigned int ring_size)
+{
+	struct tep_record_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->data_size = data_size;
+	pool->ring_size = ring_size;
+	pool->stride = (sizeof(struct pool_record) + data_size + 7) & ~7UL;
+
+	if (pthread_key_create(&pool->key, cache_destroy)) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+/**
+ * tep_record_pool_free - free a pool of records
+ * @pool: the pool to free
+ *
+ * Frees @pool and all of its records. None of them may still be in use,
+ * and no other thread may be using @pool.
+ */
+void tep_record_pool_free(struct tep_record_pool *pool)
+{
+	struct pool_cache *cache;
+	struct pool_slab *slab;
+
+	if (!pool)
+		return;
+
+	pthread_key_delete(pool->key);
+
+	while ((cache = pool->caches)) {
+		pool->caches = cache->next;
+		free(cache->ring);
+		free(cache);
+	}
+
+	while ((slab = pool->slabs)) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/**
+ * tep_record_pool_get - take a record from a pool
+ * @pool: the pool to take the record from
+ *
+ * Returns a cleared record with a ref_count of one, or NULL on error.
+ * It goes back to @pool when its last reference is put with
+ * tep_record_pool_put().
+ */
+struct tep_record *tep_record_pool_get(struct tep_record_pool *pool)
+{
+	struct pool_cache *cache;
+	struct pool_record *pr;
+
+	cache = get_cache(pool);
+	if (!cache)
+		return NULL;
+
+	pr = cache_get(cache);
+	return pr ? &pr->record : NULL;
+}
+
+/**
+ * tep_record_pool_get_bulk - take many records from a pool
+ * @pool: the pool to take the records from
+ * @records: where to store the records
+ * @nr: the number of records to take
+ *
+ * Does the same as tep_record_pool_get() for @nr records, taking the lock
+ * of @pool at most once.
+ *
+ * Returns @nr, or -1 on error, in which case no record is taken.
+ */
+int tep_record_pool_get_bulk(struct tep_record_pool *pool,
+			     struct tep_record **records, unsigned int nr)
+{
+	struct pool_cache *cache;
+	unsigned int i;
+
+	cache = get_cache(pool);
+	if (!cache)
+		return -1;
+
+	if (cache->nr_free < nr &&
+	    cache_refill(cache, nr - cache->nr_free) < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++)
+		records[i] = &cache_get(cache)->record;
+
+	return nr;
+}
+
+/**
+ * tep_record_pool_ref - take another reference of a record of a pool
+ * @record: the record taken from a pool
+ *
+ * The reference is put with tep_record_pool_put(), possibly by another
+ * thread.
+ */
+void tep_record_pool_ref(struct tep_record *record)
+{
+	__atomic_add_fetch(&record->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * tep_record_pool_put - put a reference of a record of a pool
+ * @record: the record taken from a pool
+ *
+ * When this was the last reference of @record, and it is not locked, it
+ * goes back to the pool it was taken from, to be given out again.
+ */
+void tep_record_pool_put(struct tep_record *record)
+{
+	struct pool_record *pr;
+	struct pool_cache *cache;
+
+	if (!record)
+		return;
+
+	pr = to_pool_record(record);
+
+	cache = get_cache(pr->pool);
+	if (cache) {
+		put_record(cache, pr);
+		return;
+	}
+
+	/* Without a cache of its own, the thread gives it to the pool */
+	if (__atomic_sub_fetch(&record->ref_count, 1, __ATOMIC_ACQ_REL) ||
+	    record->locked)
+		return;
+
+	pthread_mutex_lock(&pr->pool->lock);
+	pr->next = pr->pool->free;
+	pr->pool->free = pr;
+	pr->pool->nr_free++;
+	pthread_mutex_unlock(&pr->pool->lock);
+}
+
+/**
+ * tep_record_pool_next - take the next record of the ring of a thread
+ * @pool: the pool, created with a ring size
+ *
+ * For records that are processed and dropped, each thread that calls
+ * this has a ring of the ring size of @pool records, that it cycles
+ * through. The record returned is cleared, and stays valid until the
+ * thread called this function that many more times. It must not be put
+ * with tep_record_pool_put(), unless it was referenced again with
+ * tep_record_pool_ref() to keep it for longer, in which case the ring
+ * moves on to another record.
+ *
+ * Returns the record, or NULL on error.
+ */
+struct tep_record *tep_record_pool_next(struct tep_record_pool *pool)
+{
+	struct pool_cache *cache;
+	struct pool_record *pr;
+
+	if (!pool->ring_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = get_cache(pool);
+	if (!cache)
+		return NULL;
+
+	pr = cache->ring[cache->ring_pos];
+	if (pr && !pr->record.locked &&
+	    __atomic_load_n(&pr->record.ref_count, __ATOMIC_ACQUIRE) == 1) {
+		init_record(pr);
+	} else {
+		/* Still in use, the last one to put it will free it */
+		if (pr)
+			put_record(cache, pr);
+		pr = cache_get(cache);
+		cache->ring[cache->ring_pos] = pr;
+		if (!pr)
+			return NULL;
+	}
+
+	if (++cache->ring_pos == pool->ring_size)
+		cache->ring_pos = 0;
+
+	return &pr->record;
+}
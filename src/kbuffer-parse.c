@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #include <sys/utsname.h>
 
@@ -46,6 +47,8 @@ enum {
  * @read_4		- Function to read 4 raw bytes (may swap)
  * @read_8		- Function to read 8 raw bytes (may swap)
  * @read_long		- Function to read a long word (4 or 8 bytes with needed swap)
+ *
+ * @stats		- counters for kbuffer_get_stats()
  */
 struct kbuffer {
 	unsigned long long 	timestamp;
@@ -64,8 +67,21 @@ struct kbuffer {
 	unsigned long long (*read_8)(void *ptr);
 	unsigned long long (*read_long)(struct kbuffer *kbuf, void *ptr);
 	int (*next_event)(struct kbuffer *kbuf);
+
+	struct kbuffer_stats	stats;
 };
 
+/* Counts an event in the totals and in those of the current sub-buffer */
+#ifdef TEP_STATS
+#define kbuffer_stat(kbuf, counter)				\
+	do {							\
+		(kbuf)->stats.counter++;			\
+		(kbuf)->stats.subbuf_##counter++;		\
+	} while (0)
+#else
+#define kbuffer_stat(kbuf, counter)	do { } while (0)
+#endif
+
 static void *zmalloc(size_t size)
 {
 	return calloc(1, size);
@@ -438,12 +454,17 @@ static int __old_next_event(struct kbuffer *kbuf)
 {
 	int type;
 
-	do {
+	for (;;) {
 		kbuf->curr = kbuf->next;
 		if (kbuf->next >= kbuf->size)
 			return -1;
 		type = old_update_pointers(kbuf);
-	} while (type == OLD_RINGBUF_TYPE_TIME_EXTEND || type == OLD_RINGBUF_TYPE_PADDING);
+		if (type != OLD_RINGBUF_TYPE_TIME_EXTEND &&
+		    type != OLD_RINGBUF_TYPE_PADDING)
+			break;
+		kbuffer_stat(kbuf, skipped);
+	}
+	kbuffer_stat(kbuf, events);
 
 	return 0;
 }
@@ -559,14 +580,18 @@ static int __next_event(struct kbuffer *kbuf)
 {
 	int type;
 
-	do {
+	for (;;) {
 		kbuf->curr = kbuf->next;
 		if (kbuf->next >= kbuf->size)
 			return -1;
 		type = update_pointers(kbuf);
-	} while (type == KBUFFER_TYPE_TIME_EXTEND ||
-		 type == KBUFFER_TYPE_TIME_STAMP ||
-		 type == KBUFFER_TYPE_PADDING);
+		if (type != KBUFFER_TYPE_TIME_EXTEND &&
+		    type != KBUFFER_TYPE_TIME_STAMP &&
+		    type != KBUFFER_TYPE_PADDING)
+			break;
+		kbuffer_stat(kbuf, skipped);
+	}
+	kbuffer_stat(kbuf, events);
 
 	return 0;
 }
@@ -653,6 +678,11 @@ int kbuffer_load_subbuffer(struct kbuffer *kbuf, void *subbuffer)
 	kbuf->index = 0;
 	kbuf->next = 0;
 
+#ifdef TEP_STATS
+	kbuf->stats.subbuffers++;
+	kbuf->stats.subbuf_events = 0;
+	kbuf->stats.subbuf_skipped = 0;
+#endif
 	next_event(kbuf);
 
 	/* save the first record from the page */
@@ -1017,3 +1047,40 @@ int kbuffer_read_buffer(struct kbuffer *kbuf, void *buffer, int len)
 
 	return last_next;
 }
+
+/**
+ * kbuffer_get_stats - get the counters of what a kbuffer decoded
+ * @kbuf:	The kbuffer to read the counters of
+ * @stats:	Where to store the counters
+ *
+ * Takes a snapshot of the counts of sub-buffers loaded, events decoded
+ * and padding and time stamps skipped by @kbuf since it was allocated or
+ * kbuffer_reset_stats() was called, and of the events decoded and skipped
+ * in the current sub-buffer. They are only counted when the library is
+ * built with TEP_STATS, otherwise @stats is zeroed.
+ *
+ * Returns 0 on success, or -1 with errno set to ENOTSUP if the library
+ * does not count.
+ */
+int kbuffer_get_stats(struct kbuffer *kbuf, struct kbuffer_stats *stats)
+{
+#ifdef TEP_STATS
+	*stats = kbuf->stats;
+	return 0;
+#else
+	memset(stats, 0, sizeof(*stats));
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * kbuffer_reset_stats - reset the counters of a kbuffer
+ * @kbuf:	The kbuffer to reset the counters of
+ *
+ * Sets all the counters returned by kbuffer_get_stats() back to zero.
+ */
+void kbuffer_reset_stats(struct kbuffer *kbuf)
+{
+	memset(&kbuf->stats, 0, sizeof(kbuf->stats));
+}
@@ -102,6 +102,85 @@ static int filter_cmp(const void *a, const void *b)
 	return 0;
 }
 
+#ifdef TEP_STATS
+/*
+ * The counters of tep_filter_get_stats(). They are kept in an array
+ * parallel to filter->event_filters, and not in struct tep_filter_type,
+ * as that array is part of the ABI.
+ */
+struct filter_stat {
+	unsigned long long	tests;
+	unsigned long long	matches;
+};
+
+struct filter_with_stats {
+	struct tep_event_filter	filter;
+	struct filter_stat	*stats;
+};
+
+#define FILTER_ALLOC_SIZE	sizeof(struct filter_with_stats)
+
+static struct filter_stat **filter_stats(struct tep_event_filter *filter)
+{
+	return &((struct filter_with_stats *)filter)->stats;
+}
+
+/* Makes room for the counters of a new filter_type at @i */
+static int filter_stats_insert(struct tep_event_filter *filter, int i)
+{
+	struct filter_stat *stats;
+
+	stats = realloc(*filter_stats(filter),
+			sizeof(*stats) * (filter->filters + 1));
+	if (!stats)
+		return -1;
+
+	memmove(&stats[i + 1], &stats[i],
+		sizeof(*stats) * (filter->filters - i));
+	memset(&stats[i], 0, sizeof(*stats));
+	*filter_stats(filter) = stats;
+
+	return 0;
+}
+
+static void filter_stats_remove(struct tep_event_filter *filter, int i)
+{
+	struct filter_stat *stats = *filter_stats(filter);
+
+	memmove(&stats[i], &stats[i + 1],
+		sizeof(*stats) * (filter->filters - i - 1));
+}
+
+static void filter_stats_free(struct tep_event_filter *filter)
+{
+	free(*filter_stats(filter));
+	*filter_stats(filter) = NULL;
+}
+
+static void filter_stats_count(struct tep_event_filter *filter,
+			       struct tep_filter_type *filter_type, bool match)
+{
+	struct filter_stat *stat;
+
+	stat = &(*filter_stats(filter))[filter_type - filter->event_filters];
+	tep_stat_inc(stat->tests);
+	if (match)
+		tep_stat_inc(stat->matches);
+}
+#else
+#define FILTER_ALLOC_SIZE	sizeof(struct tep_event_filter)
+
+static inline int filter_stats_insert(struct tep_event_filter *filter, int i)
+{
+	return 0;
+}
+static inline void filter_stats_remove(struct tep_event_filter *filter, int i) { }
+static inline void filter_stats_free(struct tep_event_filter *filter) { }
+static inline void filter_stats_count(struct tep_event_filter *filter,
+				      struct tep_filter_type *filter_type,
+				      bool match) { }
+#endif
+
 static struct tep_filter_type *
 find_filter_type(struct tep_event_filter *filter, int id)
 {
@@ -141,6 +220,9 @@ add_filter_type(struct tep_event_filter *filter, int id)
 			break;
 	}
 
+	if (filter_stats_insert(filter, i) < 0)
+		return NULL;
+
 	if (i < filter->filters)
 		memmove(&filter->event_filters[i+1],
 			&filter->event_filters[i],
@@ -165,11 +247,11 @@ struct tep_event_filter *tep_filter_alloc(struct tep_handle *tep)
 {
 	struct tep_event_filter *filter;
 
-	filter = malloc(sizeof(*filter));
+	filter = malloc(FILTER_ALLOC_SIZE);
 	if (filter == NULL)
 		return NULL;
 
-	memset(filter, 0, sizeof(*filter));
+	memset(filter, 0, FILTER_ALLOC_SIZE);
 	filter->tep = tep;
 	tep_ref(tep);
 
@@ -553,17 +635,6 @@ add_right(struct tep_handle *tep, struct tep_filter_arg *op,
 				show_error(tep, error_str, "Failed to allocate string filter");
 				return TEP_ERRNO__MEM_ALLOC_FAILED;
 			}
-			/*
-			 * Need a buffer to copy data for tests
-			 */
-			op->str.buffer = malloc(op->str.field->size + 1);
-			if (!op->str.buffer) {
-				show_error(tep, error_str, "Failed to allocate string filter");
-				return TEP_ERRNO__MEM_ALLOC_FAILED;
-			}
-			/* Null terminate this buffer */
-			op->str.buffer[op->str.field->size] = 0;
-
 			/* We no longer have left or right args */
 			free_arg(arg);
 			free_arg(left);
@@ -1405,6 +1476,7 @@ int tep_filter_remove_event(struct tep_event_filter *filter,
 		return 0;
 
 	free_filter_type(filter_type);
+	filter_stats_remove(filter, filter_type - filter->event_filters);
 
 	/* The filter_type points into the event_filters array */
 	len = (unsigned long)(filter->event_filters + filter->filters) -
@@ -1433,6 +1505,7 @@ void tep_filter_reset(struct tep_event_filter *filter)
 		free_filter_type(&filter->event_filters[i]);
 
 	free(filter->event_filters);
+	filter_stats_free(filter);
 	filter->filters = 0;
 	filter->event_filters = NULL;
 }
@@ -1698,82 +1771,90 @@ static int test_num(struct tep_event *event, struct tep_filter_arg *arg,
 	}
 }
 
-static const char *get_field_str(struct tep_filter_arg *arg, struct tep_record *record)
+/* A field that is not a string is compared as a symbol or a number */
+static const char *get_field_str(struct tep_filter_arg *arg, struct tep_record *record,
+				 char *hex, int size)
 {
 	struct tep_event *event;
 	struct tep_handle *tep;
 	unsigned long long addr;
 	const char *val = NULL;
-	static char hex[64];
-	unsigned int size;
-
-	/* If the field is not a string convert it */
-	if (arg->str.field->flags & TEP_FIELD_IS_STRING) {
-		val = record->data + arg->str.field->offset;
-		size = arg->str.field->size;
-
-		if (arg->str.field->flags & TEP_FIELD_IS_DYNAMIC) {
-			addr = *(unsigned int *)val;
-			size = addr >> 16;
-			addr &= 0xffff;
-			if (arg->str.field->flags & TEP_FIELD_IS_RELATIVE)
-				addr += arg->str.field->offset + arg->str.field->size;
-			val = record->data + addr;
-		}
 
-		/*
-		 * We need to copy the data since we can't be sure the field
-		 * is null terminated.
-		 */
-		if (*(val + size - 1)) {
-			/* copy it */
-			memcpy(arg->str.buffer, val, arg->str.field->size);
-			/* the buffer is already NULL terminated */
-			val = arg->str.buffer;
-		}
+	event = arg->str.field->event;
+	tep = event->tep;
+	addr = get_value(event, arg->str.field, record);
 
-	} else {
-		event = arg->str.field->event;
-		tep = event->tep;
-		addr = get_value(event, arg->str.field, record);
-
-		if (arg->str.field->flags & (TEP_FIELD_IS_POINTER | TEP_FIELD_IS_LONG))
-			/* convert to a kernel symbol */
-			val = tep_find_function(tep, addr);
-
-		if (val == NULL) {
-			/* just use the hex of the string name */
-			snprintf(hex, 64, "0x%llx", addr);
-			val = hex;
-		}
+	if (arg->str.field->flags & (TEP_FIELD_IS_POINTER | TEP_FIELD_IS_LONG))
+		/* convert to a kernel symbol */
+		val = tep_find_function(tep, addr);
+
+	if (val == NULL) {
+		/* just use the hex of the string name */
+		snprintf(hex, size, "0x%llx", addr);
+		val = hex;
 	}
 
 	return val;
 }
 
+/* Returns zero on match, like regexec() */
+static int test_regex(regex_t *reg, const char *val, unsigned int len)
+{
+#ifdef REG_STARTEND
+	regmatch_t match = { .rm_so = 0, .rm_eo = len };
+
+	/* The string does not need to be nul terminated */
+	return regexec(reg, val, 1, &match, REG_STARTEND);
+#else
+	char *str;
+	int ret;
+
+	str = strndup(val, len);
+	if (!str)
+		return REG_ESPACE;
+	ret = regexec(reg, str, 0, NULL, 0);
+	free(str);
+	return ret;
+#endif
+}
+
 static int test_str(struct tep_event *event, struct tep_filter_arg *arg,
 		    struct tep_record *record, enum tep_errno *err)
 {
+	struct tep_field_view view;
+	char hex[64];
 	const char *val;
+	unsigned int len;
+	size_t str_len;
 
-	if (arg->str.field == &comm)
+	if (arg->str.field == &comm) {
 		val = get_comm(event, record);
-	else
-		val = get_field_str(arg, record);
+		len = strlen(val);
+	} else if (arg->str.field->flags & TEP_FIELD_IS_STRING) {
+		/* Compared where it is in the record, without a copy */
+		if (tep_get_field_view(arg->str.field, record, &view) < 0)
+			view.data = "";
+		val = view.data;
+		len = view.len;
+	} else {
+		val = get_field_str(arg, record, hex, sizeof(hex));
+		len = strlen(val);
+	}
+
+	str_len = strlen(arg->str.val);
 
 	switch (arg->str.type) {
 	case TEP_FILTER_CMP_MATCH:
-		return strcmp(val, arg->str.val) == 0;
+		return len == str_len && memcmp(val, arg->str.val, len) == 0;
 
 	case TEP_FILTER_CMP_NOT_MATCH:
-		return strcmp(val, arg->str.val) != 0;
+		return len != str_len || memcmp(val, arg->str.val, len) != 0;
 
 	case TEP_FILTER_CMP_REGEX:
-		/* Returns zero on match */
-		return !regexec(&arg->str.reg, val, 0, NULL, 0);
+		return !test_regex(&arg->str.reg, val, len);
 
 	case TEP_FILTER_CMP_NOT_REGEX:
-		return regexec(&arg->str.reg, val, 0, NULL, 0);
+		return test_regex(&arg->str.reg, val, len) != 0;
 
 	default:
 		if (!*err)
@@ -1897,6 +1978,7 @@ enum tep_errno tep_filter_match(struct tep_event_filter *filter,
 		return TEP_ERRNO__FILTER_NOT_FOUND;
 
 	ret = test_filter(filter_type->event, filter_type->filter, record, &err);
+	filter_stats_count(filter, filter_type, ret && !err);
 	if (err)
 		return err;
 
@@ -2281,3 +2363,62 @@ int tep_filter_compare(struct tep_event_filter *filter1, struct tep_event_filter
 	return 1;
 }
 
+/**
+ * tep_filter_get_stats - get how often the filter of an event was tested
+ * @filter: the filter to read the counters of
+ * @event_id: the id of the event with a filter in @filter
+ * @tests: returns the number of records tested by tep_filter_match()
+ * @matches: returns the number of those that matched
+ *
+ * The counters are only counted when the library is built with
+ * TEP_STATS. Either @tests or @matches may be NULL.
+ *
+ * Returns 0 on success, or -1 if @filter has no filter for @event_id,
+ * or with errno set to ENOTSUP if the library does not count.
+ */
+int tep_filter_get_stats(struct tep_event_filter *filter, int event_id,
+			 unsigned long long *tests, unsigned long long *matches)
+{
+#ifdef TEP_STATS
+	struct tep_filter_type *filter_type;
+	struct filter_stat *stat;
+
+	filter_type = find_filter_type(filter, event_id);
+	if (filter_type) {
+		stat = &(*filter_stats(filter))[filter_type - filter->event_filters];
+		if (tests)
+			*tests = __atomic_load_n(&stat->tests, __ATOMIC_RELAXED);
+		if (matches)
+			*matches = __atomic_load_n(&stat->matches,
+						   __ATOMIC_RELAXED);
+		return 0;
+	}
+#else
+	errno = ENOTSUP;
+#endif
+	if (tests)
+		*tests = 0;
+	if (matches)
+		*matches = 0;
+	return -1;
+}
+
+/**
+ * tep_filter_reset_stats - reset the counters of a filter
+ * @filter: the filter to reset the counters of
+ *
+ * Sets the counters returned by tep_filter_get_stats() for all the
+ * events of @filter back to zero.
+ */
+void tep_filter_reset_stats(struct tep_event_filter *filter)
+{
+#ifdef TEP_STATS
+	struct filter_stat *stats = *filter_stats(filter);
+	int i;
+
+	for (i = 0; i < filter->filters; i++) {
+		__atomic_store_n(&stats[i].tests, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats[i].matches, 0, __ATOMIC_RELAXED);
+	}
+#endif
+}
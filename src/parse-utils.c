@@ -11,6 +11,7 @@
 
 #include "event-utils.h"
 #include "event-parse.h"
+#include "event-parse-local.h"
 #include "kbuffer.h"
 
 #define __weak __attribute__((weak))
@@ -154,3 +155,319 @@ struct kbuffer *tep_kbuffer(struct tep_handle *tep)
 
 	return kbuffer_alloc(long_size, endian);
 }
+
+/* Chunks start small, as most events are small, and double up to the max */
+#define ARENA_CHUNK_MIN		512
+#define ARENA_CHUNK_MAX		8192
+#define ARENA_ALIGN(size)	(((size) + 7) & ~(size_t)7)
+
+struct tep_arena_chunk {
+	struct tep_arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	unsigned long long	data[];
+};
+
+/* Every block starts with its size, so that it can be grown */
+struct arena_block {
+	size_t			size;
+	unsigned long long	data[];
+};
+
+static struct arena_block *arena_block(void *ptr)
+{
+	return (struct arena_block *)((char *)ptr - sizeof(struct arena_block));
+}
+
+static bool arena_block_last(struct tep_arena_chunk *chunk,
+			     struct arena_block *block)
+{
+	return (char *)block + sizeof(*block) + ARENA_ALIGN(block->size) ==
+		(char *)chunk->data + chunk->used;
+}
+
+/**
+ * arena_alloc - allocate zeroed memory from an arena
+ * @arena: the arena to allocate from
+ * @size: the number of bytes to allocate
+ *
+ * The memory stays valid until arena_free() is called on @arena.
+ *
+ * Returns the memory, or NULL on allocation failure.
+ */
+__hidden void *arena_alloc(struct tep_arena *arena, size_t size)
+{
+	struct tep_arena_chunk *chunk = arena->chunks;
+	struct arena_block *block;
+	size_t need;
+
+	need = sizeof(*block) + ARENA_ALIGN(size);
+
+	if (!chunk || chunk->size - chunk->used < need) {
+		size_t csize = ARENA_CHUNK_MIN;
+
+		if (chunk)
+			csize = chunk->size < ARENA_CHUNK_MAX ?
+				chunk->size * 2 : ARENA_CHUNK_MAX;
+		if (csize < need)
+			csize = need;
+
+		chunk = malloc(sizeof(*chunk) + csize);
+		if (!chunk)
+			return NULL;
+		chunk->size = csize;
+		chunk->used = 0;
+
+		/* Keep filling the current chunk after a large allocation */
+		if (arena->chunks && need > ARENA_CHUNK_MAX / 4) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	block = (struct arena_block *)((char *)chunk->data + chunk->used);
+	chunk->used += need;
+	block->size = size;
+	memset(block->data, 0, ARENA_ALIGN(size));
+
+	return block->data;
+}
+
+/**
+ * arena_realloc - grow memory allocated from an arena
+ * @arena: the arena @ptr was allocated from
+ * @ptr: the memory to grow, or NULL
+ * @size: the new size in bytes
+ *
+ * The last block allocated is grown in place when there is room,
+ * otherwise it is copied into a new block.
+ *
+ * Returns the memory, or NULL on allocation failure.
+ */
+__hidden void *arena_realloc(struct tep_arena *arena, void *ptr, size_t size)
+{
+	struct tep_arena_chunk *chunk = arena->chunks;
+	struct arena_block *block;
+	void *new;
+
+	if (!ptr)
+		return arena_alloc(arena, size);
+
+	block = arena_block(ptr);
+	if (size <= block->size)
+		return ptr;
+
+	if (chunk && arena_block_last(chunk, block) &&
+	    (char *)block->data + ARENA_ALIGN(size) <=
+	    (char *)chunk->data + chunk->size) {
+		chunk->used += ARENA_ALIGN(size) - ARENA_ALIGN(block->size);
+		memset((char *)ptr + block->size, 0, size - block->size);
+		block->size = size;
+		return ptr;
+	}
+
+	new = arena_alloc(arena, size);
+	if (!new)
+		return NULL;
+	memcpy(new, ptr, block->size);
+
+	return new;
+}
+
+static struct tep_arena_chunk *arena_chunk(struct tep_arena *arena,
+					   const void *ptr)
+{
+	struct tep_arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next) {
+		if ((char *)ptr > (char *)chunk->data &&
+		    (char *)ptr < (char *)chunk->data + chunk->used)
+			return chunk;
+	}
+	return NULL;
+}
+
+/**
+ * arena_owns - test if memory was allocated from an arena
+ * @arena: the arena to check
+ * @ptr: the memory to test
+ *
+ * Returns true if @ptr belongs to @arena.
+ */
+__hidden bool arena_owns(struct tep_arena *arena, const void *ptr)
+{
+	return ptr && arena_chunk(arena, ptr);
+}
+
+/**
+ * arena_release - give back memory allocated from an arena
+ * @arena: the arena to check
+ * @ptr: the memory to release
+ *
+ * The memory is only reused if it was the last block allocated, as
+ * with the temporary tokens of a parser. Otherwise it is kept until
+ * the arena is freed.
+ *
+ * Returns true if @ptr belongs to @arena, false if it does not and
+ * must be freed with free().
+ */
+__hidden bool arena_release(struct tep_arena *arena, void *ptr)
+{
+	struct tep_arena_chunk *chunk;
+	struct arena_block *block;
+
+	if (!ptr)
+		return false;
+
+	chunk = arena_chunk(arena, ptr);
+	if (!chunk)
+		return false;
+
+	block = arena_block(ptr);
+	if (chunk == arena->chunks && arena_block_last(chunk, block))
+		chunk->used = (char *)block - (char *)chunk->data;
+	return true;
+}
+
+/**
+ * arena_free - free all the memory of an arena
+ * @arena: the arena to free
+ */
+__hidden void arena_free(struct tep_arena *arena)
+{
+	struct tep_arena_chunk *chunk;
+
+	while (arena->chunks) {
+		chunk = arena->chunks;
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+#define STRTAB_INIT_SIZE	256
+
+struct strtab_entry {
+	struct strtab_entry	*next;
+	unsigned int		hash;
+	char			str[];
+};
+
+/* FNV-1a */
+static unsigned int strtab_hash(const char *str)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *str; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	return hash;
+}
+
+static struct strtab_entry *strtab_find(struct tep_strtab *tab,
+					const char *str, unsigned int hash)
+{
+	struct strtab_entry *entry;
+
+	if (!tab->buckets)
+		return NULL;
+
+	for (entry = tab->buckets[hash & (tab->size - 1)]; entry;
+	     entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->str, str) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static int strtab_grow(struct tep_strtab *tab)
+{
+	struct strtab_entry **buckets;
+	struct strtab_entry *entry;
+	unsigned int size;
+	unsigned int i;
+
+	size = tab->size ? tab->size * 2 : STRTAB_INIT_SIZE;
+	buckets = calloc(size, sizeof(*buckets));
+	if (!buckets)
+		return -1;
+
+	for (i = 0; i < tab->size; i++) {
+		while ((entry = tab->buckets[i])) {
+			tab->buckets[i] = entry->next;
+			entry->next = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+		}
+	}
+
+	free(tab->buckets);
+	tab->buckets = buckets;
+	tab->size = size;
+
+	return 0;
+}
+
+/**
+ * strtab_intern - return the one copy of a string kept in a table
+ * @tab: the table to look in
+ * @str: the string to intern
+ *
+ * If @str is not in @tab yet, a copy of it is added. The returned
+ * string stays valid until strtab_free() is called on @tab.
+ *
+ * Returns the copy of @str in @tab, or NULL on allocation failure.
+ */
+__hidden const char *strtab_intern(struct tep_strtab *tab, const char *str)
+{
+	struct strtab_entry *entry;
+	unsigned int hash;
+	size_t len;
+
+	hash = strtab_hash(str);
+	entry = strtab_find(tab, str, hash);
+	if (entry)
+		return entry->str;
+
+	if (tab->count >= tab->size && strtab_grow(tab) < 0)
+		return NULL;
+
+	len = strlen(str);
+	entry = arena_alloc(&tab->arena, sizeof(*entry) + len + 1);
+	if (!entry)
+		return NULL;
+	entry->hash = hash;
+	memcpy(entry->str, str, len + 1);
+
+	entry->next = tab->buckets[hash & (tab->size - 1)];
+	tab->buckets[hash & (tab->size - 1)] = entry;
+	tab->count++;
+
+	return entry->str;
+}
+
+/**
+ * strtab_lookup - find a string in a table
+ * @tab: the table to look in
+ * @str: the string to find
+ *
+ * Returns the copy of @str in @tab, or NULL if it is not there.
+ */
+__hidden const char *strtab_lookup(struct tep_strtab *tab, const char *str)
+{
+	struct strtab_entry *entry;
+
+	entry = strtab_find(tab, str, strtab_hash(str));
+	return entry ? entry->str : NULL;
+}
+
+/**
+ * strtab_free - free a string table and all its strings
+ * @tab: the table to free
+ */
+__hidden void strtab_free(struct tep_strtab *tab)
+{
+	free(tab->buckets);
+	arena_free(&tab->arena);
+	memset(tab, 0, sizeof(*tab));
+}
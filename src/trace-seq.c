@@ -9,21 +9,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <asm/bug.h>
 #include "event-parse.h"
 #include "event-utils.h"
+#include "event-parse-local.h"
 
 /*
  * The TRACE_SEQ_POISON is to catch the use of using
- * a trace_seq structure after it was destroyed.
+ * a trace_seq structure after it was destroyed, and the
+ * TRACE_SEQ_MAGIC in front of the buffer the use of a buffer
+ * that was not set up by trace_seq_init*().
  */
 #define TRACE_SEQ_POISON	((void *)0xdeadbeef)
+#define TRACE_SEQ_MAGIC		0x5e9b0f3eU
 #define TRACE_SEQ_CHECK(s)						\
 do {									\
 	if (WARN_ONCE((s)->buffer == TRACE_SEQ_POISON,			\
 		      "Usage of trace_seq after it was destroyed"))	\
 		(s)->state = TRACE_SEQ__BUFFER_POISONED;		\
+	else if (WARN_ONCE((s)->buffer &&				\
+			   seq_hdr(s)->magic != TRACE_SEQ_MAGIC,	\
+			   "trace_seq buffer not set up by trace_seq_init()")) \
+		(s)->state = TRACE_SEQ__BUFFER_POISONED;		\
 } while (0)
 
 #define TRACE_SEQ_CHECK_RET_N(s, n)		\
@@ -36,22 +48,220 @@ do {						\
 #define TRACE_SEQ_CHECK_RET(s)   TRACE_SEQ_CHECK_RET_N(s, )
 #define TRACE_SEQ_CHECK_RET0(s)  TRACE_SEQ_CHECK_RET_N(s, 0)
 
-/**
- * trace_seq_init - initialize the trace_seq structure
- * @s: a pointer to the trace_seq structure to initialize
+/* The buffer belongs to the caller of trace_seq_init_buf() */
+#define TRACE_SEQ_FL_EXTERNAL	(1 << 0)
+/* The content is written to hdr->fd, see trace_seq_init_fd() */
+#define TRACE_SEQ_FL_FD		(1 << 1)
+
+#define TRACE_SEQ_FD_BUF_SIZE	(1 << 16)
+
+/*
+ * struct trace_seq is part of the ABI, as applications embed it in their
+ * own structures. What does not fit in it is kept in this header, right
+ * in front of s->buffer. Every buffer set up by trace_seq_init*() has one,
+ * including the ones given by the callers of trace_seq_init_buf(), which
+ * it is carved out of. This means that s->buffer is not the start of an
+ * allocation, and must not be freed or replaced by the callers.
  */
-void trace_seq_init(struct trace_seq *s)
+struct trace_seq_hdr {
+	unsigned int		flags;
+	int			fd;
+	unsigned int		high_water;
+	/* Nesting of tep_print_event(), see trace_seq_print_begin() */
+	unsigned int		printing;
+	unsigned int		magic;
+};
+
+static inline struct trace_seq_hdr *seq_hdr(struct trace_seq *s)
+{
+	return (struct trace_seq_hdr *)s->buffer - 1;
+}
+
+/* Allocates a buffer of @size characters, with its header in front */
+static char *alloc_buffer(unsigned int size, unsigned int flags)
+{
+	struct trace_seq_hdr *hdr;
+
+	hdr = malloc(sizeof(*hdr) + size);
+	if (!hdr)
+		return NULL;
+
+	hdr->flags = flags;
+	hdr->fd = -1;
+	hdr->high_water = 0;
+	hdr->printing = 0;
+	hdr->magic = TRACE_SEQ_MAGIC;
+
+	return (char *)(hdr + 1);
+}
+
+/* Sets up @s after its buffer was allocated */
+static void init_seq(struct trace_seq *s, char *buffer, unsigned int size)
 {
 	s->len = 0;
 	s->readpos = 0;
-	s->buffer_size = TRACE_SEQ_BUF_SIZE;
-	s->buffer = malloc(s->buffer_size);
+	s->buffer_size = size;
+	s->buffer = buffer;
 	if (s->buffer != NULL)
 		s->state = TRACE_SEQ__GOOD;
 	else
 		s->state = TRACE_SEQ__MEM_ALLOC_FAILED;
 }
 
+/**
+ * trace_seq_init - initialize the trace_seq structure
+ * @s: a pointer to the trace_seq structure to initialize
+ */
+void trace_seq_init(struct trace_seq *s)
+{
+	init_seq(s, alloc_buffer(TRACE_SEQ_BUF_SIZE, 0), TRACE_SEQ_BUF_SIZE);
+}
+
+/**
+ * trace_seq_init_buf - initialize the trace_seq structure with a buffer
+ * @s: a pointer to the trace_seq structure to initialize
+ * @buf: the buffer to use, for example one on the stack
+ * @size: the size of @buf
+ *
+ * Initializes @s without allocating any memory. The content is written
+ * into @buf, and only if it does not fit, it is moved to an allocated
+ * buffer. The first few bytes of @buf are used by @s to keep its state,
+ * so s->buffer points past them. The @buf must stay valid until
+ * trace_seq_destroy() is called, which must still be done to free a
+ * buffer that may have been allocated.
+ */
+void trace_seq_init_buf(struct trace_seq *s, char *buf, unsigned int size)
+{
+	const unsigned long align = __alignof__(struct trace_seq_hdr);
+	struct trace_seq_hdr *hdr;
+	unsigned long skip;
+
+	skip = -(unsigned long)buf & (align - 1);
+	skip += sizeof(*hdr);
+	if (!buf || size < skip + 2) {
+		trace_seq_init(s);
+		return;
+	}
+
+	hdr = (struct trace_seq_hdr *)(buf + skip) - 1;
+	hdr->flags = TRACE_SEQ_FL_EXTERNAL;
+	hdr->fd = -1;
+	hdr->high_water = 0;
+	hdr->printing = 0;
+	hdr->magic = TRACE_SEQ_MAGIC;
+
+	init_seq(s, (char *)(hdr + 1), size - skip);
+}
+
+/**
+ * trace_seq_init_fd - initialize a trace_seq that writes to a file
+ * @s: a pointer to the trace_seq structure to initialize
+ * @fd: the file descriptor to write the content to
+ * @size: the high-water mark of the buffer, or zero for the default
+ *
+ * Initializes @s to collect the content of many records in one big
+ * buffer. The content is written to @fd once it passes @size bytes,
+ * which is checked at the start of every tep_print_event(), and after
+ * every write to @s that is not done by tep_print_event() or the print
+ * handlers it calls. It is also written by trace_seq_flush() and
+ * trace_seq_destroy().
+ */
+void trace_seq_init_fd(struct trace_seq *s, int fd, unsigned int size)
+{
+	unsigned int buffer_size;
+
+	if (!size)
+		size = TRACE_SEQ_FD_BUF_SIZE;
+	if (size > UINT_MAX / 2)
+		size = UINT_MAX / 2;
+	/* Leave room for the record that crosses the high-water mark */
+	buffer_size = size + TRACE_SEQ_BUF_SIZE;
+
+	init_seq(s, alloc_buffer(buffer_size, TRACE_SEQ_FL_FD), buffer_size);
+	if (s->buffer) {
+		seq_hdr(s)->fd = fd;
+		seq_hdr(s)->high_water = size;
+	}
+}
+
+/**
+ * trace_seq_flush - write out the content of a file trace_seq
+ * @s: a pointer to the trace_seq initialized by trace_seq_init_fd()
+ *
+ * Writes the content of @s to its file descriptor and empties it.
+ * It does nothing for a trace_seq that is not bound to a file.
+ *
+ * Returns 0 on success, and -1 on error.
+ */
+int trace_seq_flush(struct trace_seq *s)
+{
+	struct trace_seq_hdr *hdr;
+	unsigned int pos = 0;
+	ssize_t r;
+
+	TRACE_SEQ_CHECK_RET_N(s, -1);
+
+	hdr = seq_hdr(s);
+	if (!(hdr->flags & TRACE_SEQ_FL_FD))
+		return 0;
+
+	while (pos < s->len) {
+		r = write(hdr->fd, s->buffer + pos, s->len - pos);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			s->state = TRACE_SEQ__WRITE_FAILED;
+			return -1;
+		}
+		pos += r;
+	}
+
+	s->len = 0;
+	s->readpos = 0;
+
+	return 0;
+}
+
+static void flush_high_water(struct trace_seq *s)
+{
+	struct trace_seq_hdr *hdr = seq_hdr(s);
+
+	if ((hdr->flags & TRACE_SEQ_FL_FD) && s->len >= hdr->high_water)
+		trace_seq_flush(s);
+}
+
+/*
+ * While a record is printed, its print handlers may refer to what they
+ * wrote, so the content is only written out in between the records.
+ */
+__hidden void trace_seq_print_begin(struct trace_seq *s)
+{
+	if (s->state != TRACE_SEQ__GOOD || s->buffer == TRACE_SEQ_POISON ||
+	    !s->buffer)
+		return;
+
+	if (!seq_hdr(s)->printing)
+		flush_high_water(s);
+	seq_hdr(s)->printing++;
+}
+
+__hidden void trace_seq_print_end(struct trace_seq *s)
+{
+	/* The buffer may have moved, but not lost its header */
+	if (s->state != TRACE_SEQ__GOOD || s->buffer == TRACE_SEQ_POISON ||
+	    !s->buffer || !seq_hdr(s)->printing)
+		return;
+
+	seq_hdr(s)->printing--;
+}
+
+/* Called at the end of the functions that write to @s */
+static void seq_written(struct trace_seq *s)
+{
+	if (!seq_hdr(s)->printing)
+		flush_high_water(s);
+}
+
 /**
  * trace_seq_reset - re-initialize the trace_seq structure
  * @s: a pointer to the trace_seq structure to reset
@@ -75,23 +285,67 @@ void trace_seq_destroy(struct trace_seq *s)
 {
 	if (!s)
 		return;
-	TRACE_SEQ_CHECK_RET(s);
-	free(s->buffer);
+	TRACE_SEQ_CHECK(s);
+	if (s->state == TRACE_SEQ__BUFFER_POISONED)
+		return;
+	if (s->state == TRACE_SEQ__GOOD)
+		trace_seq_flush(s);
+	if (s->buffer && !(seq_hdr(s)->flags & TRACE_SEQ_FL_EXTERNAL))
+		free(seq_hdr(s));
 	s->buffer = TRACE_SEQ_POISON;
 }
 
-static void expand_buffer(struct trace_seq *s)
+#ifdef TEP_STATS
+__hidden __thread unsigned long long trace_seq_expansions;
+#endif
+
+/*
+ * Make room for @len more characters (plus the terminating one). The
+ * buffer at least doubles in size, so that building a long string
+ * does not copy it over and over.
+ */
+static void expand_buffer(struct trace_seq *s, unsigned int len)
 {
-	char *buf;
+	unsigned long long need = (unsigned long long)s->len + len + 1;
+	unsigned long long size = s->buffer_size;
+	struct trace_seq_hdr *hdr = seq_hdr(s);
+	struct trace_seq_hdr *new;
+
+	if (need <= size)
+		return;
 
-	buf = realloc(s->buffer, s->buffer_size + TRACE_SEQ_BUF_SIZE);
-	if (WARN_ONCE(!buf, "Can't allocate trace_seq buffer memory")) {
+	if (size < TRACE_SEQ_BUF_SIZE)
+		size = TRACE_SEQ_BUF_SIZE;
+	while (size < need)
+		size *= 2;
+	if (size > UINT_MAX - sizeof(*hdr))
+		size = UINT_MAX - sizeof(*hdr);
+
+	if (WARN_ONCE(need > size, "Can't allocate trace_seq buffer memory")) {
+		s->state = TRACE_SEQ__MEM_ALLOC_FAILED;
+		return;
+	}
+
+	if (hdr->flags & TRACE_SEQ_FL_EXTERNAL) {
+		new = malloc(sizeof(*new) + size);
+		if (new) {
+			*new = *hdr;
+			memcpy(new + 1, s->buffer, s->len);
+		}
+	} else {
+		new = realloc(hdr, sizeof(*new) + size);
+	}
+	if (WARN_ONCE(!new, "Can't allocate trace_seq buffer memory")) {
 		s->state = TRACE_SEQ__MEM_ALLOC_FAILED;
 		return;
 	}
 
-	s->buffer = buf;
-	s->buffer_size += TRACE_SEQ_BUF_SIZE;
+	new->flags &= ~TRACE_SEQ_FL_EXTERNAL;
+	s->buffer = (char *)(new + 1);
+	s->buffer_size = size;
+#ifdef TEP_STATS
+	trace_seq_expansions++;
+#endif
 }
 
 /**
@@ -113,26 +367,12 @@ int
 trace_seq_printf(struct trace_seq *s, const char *fmt, ...)
 {
 	va_list ap;
-	int len;
 	int ret;
 
- try_again:
-	TRACE_SEQ_CHECK_RET0(s);
-
-	len = (s->buffer_size - 1) - s->len;
-
 	va_start(ap, fmt);
-	ret = vsnprintf(s->buffer + s->len, len, fmt, ap);
+	ret = trace_seq_vprintf(s, fmt, ap);
 	va_end(ap);
 
-	if (ret >= len) {
-		expand_buffer(s);
-		goto try_again;
-	}
-
-	if (ret > 0)
-		s->len += ret;
-
 	return ret;
 }
 
@@ -154,23 +394,32 @@ trace_seq_printf(struct trace_seq *s, const char *fmt, ...)
 int
 trace_seq_vprintf(struct trace_seq *s, const char *fmt, va_list args)
 {
+	va_list ap;
 	int len;
 	int ret;
 
- try_again:
 	TRACE_SEQ_CHECK_RET0(s);
 
 	len = (s->buffer_size - 1) - s->len;
 
-	ret = vsnprintf(s->buffer + s->len, len, fmt, args);
+	va_copy(ap, args);
+	ret = vsnprintf(s->buffer + s->len, len + 1, fmt, ap);
+	va_end(ap);
+
+	/* vsnprintf() told us the size, one more try is enough */
+	if (ret > len) {
+		expand_buffer(s, ret);
+		TRACE_SEQ_CHECK_RET0(s);
 
-	if (ret >= len) {
-		expand_buffer(s);
-		goto try_again;
+		len = (s->buffer_size - 1) - s->len;
+		va_copy(ap, args);
+		ret = vsnprintf(s->buffer + s->len, len + 1, fmt, ap);
+		va_end(ap);
 	}
 
 	if (ret > 0)
 		s->len += ret;
+	seq_written(s);
 
 	return ret;
 }
@@ -193,13 +442,14 @@ int trace_seq_puts(struct trace_seq *s, const char *str)
 
 	len = strlen(str);
 
-	while (len > ((s->buffer_size - 1) - s->len))
-		expand_buffer(s);
+	if (len > ((s->buffer_size - 1) - s->len))
+		expand_buffer(s, len);
 
 	TRACE_SEQ_CHECK_RET0(s);
 
 	memcpy(s->buffer + s->len, str, len);
 	s->len += len;
+	seq_written(s);
 
 	return len;
 }
@@ -208,16 +458,251 @@ int trace_seq_putc(struct trace_seq *s, unsigned char c)
 {
 	TRACE_SEQ_CHECK_RET0(s);
 
-	while (s->len >= (s->buffer_size - 1))
-		expand_buffer(s);
+	if (s->len >= (s->buffer_size - 1))
+		expand_buffer(s, 1);
 
 	TRACE_SEQ_CHECK_RET0(s);
 
 	s->buffer[s->len++] = c;
+	seq_written(s);
 
 	return 1;
 }
 
+/* Returns where @len characters can be written, or NULL on error */
+static char *trace_seq_reserve(struct trace_seq *s, unsigned int len)
+{
+	if (len > ((s->buffer_size - 1) - s->len))
+		expand_buffer(s, len);
+
+	if (s->state != TRACE_SEQ__GOOD)
+		return NULL;
+
+	return s->buffer + s->len;
+}
+
+static const char trace_seq_digits2[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/**
+ * trace_seq_put_num - print a number without a format string
+ * @s: trace sequence descriptor
+ * @val: the number to print
+ * @width: the minimum number of characters to print
+ * @flags: a mask of enum trace_seq_num_flags
+ *
+ * Prints @val like the printf() conversions "%llu", "%lld" (with
+ * TRACE_SEQ_NUM_SIGNED), "%llx" (with TRACE_SEQ_NUM_HEX) and "%llX"
+ * (with TRACE_SEQ_NUM_HEX and TRACE_SEQ_NUM_UPPER). The number is padded
+ * to @width with spaces on the left, with zeros if TRACE_SEQ_NUM_ZERO is
+ * set, or with spaces on the right if TRACE_SEQ_NUM_LEFT is set.
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_num(struct trace_seq *s, unsigned long long val,
+		      int width, unsigned int flags)
+{
+	const char *hex = flags & TRACE_SEQ_NUM_UPPER ?
+		"0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned int len, total;
+	unsigned int pad = 0;
+	bool neg = false;
+	char *buf;
+
+	TRACE_SEQ_CHECK_RET0(s);
+
+	if ((flags & TRACE_SEQ_NUM_SIGNED) && (long long)val < 0) {
+		neg = true;
+		val = -val;
+	}
+
+	if (flags & TRACE_SEQ_NUM_HEX) {
+		do {
+			*--p = hex[val & 0xf];
+			val >>= 4;
+		} while (val);
+	} else {
+		while (val >= 100) {
+			unsigned int i = (val % 100) * 2;
+
+			val /= 100;
+			*--p = trace_seq_digits2[i + 1];
+			*--p = trace_seq_digits2[i];
+		}
+		if (val >= 10) {
+			*--p = trace_seq_digits2[val * 2 + 1];
+			*--p = trace_seq_digits2[val * 2];
+		} else {
+			*--p = '0' + val;
+		}
+	}
+
+	len = tmp + sizeof(tmp) - p;
+	total = len + neg;
+	if (width > 0 && (unsigned int)width > total)
+		pad = width - total;
+
+	buf = trace_seq_reserve(s, total + pad);
+	if (!buf)
+		return 0;
+
+	if (pad && !(flags & (TRACE_SEQ_NUM_LEFT | TRACE_SEQ_NUM_ZERO))) {
+		memset(buf, ' ', pad);
+		buf += pad;
+	}
+	if (neg)
+		*buf++ = '-';
+	if (pad && (flags & TRACE_SEQ_NUM_ZERO) && !(flags & TRACE_SEQ_NUM_LEFT)) {
+		memset(buf, '0', pad);
+		buf += pad;
+	}
+	memcpy(buf, p, len);
+	buf += len;
+	if (pad && (flags & TRACE_SEQ_NUM_LEFT))
+		memset(buf, ' ', pad);
+
+	s->len += total + pad;
+	seq_written(s);
+
+	return total + pad;
+}
+
+/**
+ * trace_seq_put_u64 - print an unsigned number in decimal
+ * @s: trace sequence descriptor
+ * @val: the number to print
+ *
+ * Same as trace_seq_printf(s, "%llu", val).
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_u64(struct trace_seq *s, unsigned long long val)
+{
+	return trace_seq_put_num(s, val, 0, 0);
+}
+
+/**
+ * trace_seq_put_s64 - print a signed number in decimal
+ * @s: trace sequence descriptor
+ * @val: the number to print
+ *
+ * Same as trace_seq_printf(s, "%lld", val).
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_s64(struct trace_seq *s, long long val)
+{
+	return trace_seq_put_num(s, val, 0, TRACE_SEQ_NUM_SIGNED);
+}
+
+/**
+ * trace_seq_put_hex - print an unsigned number in hexadecimal
+ * @s: trace sequence descriptor
+ * @val: the number to print
+ *
+ * Same as trace_seq_printf(s, "%llx", val).
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_hex(struct trace_seq *s, unsigned long long val)
+{
+	return trace_seq_put_num(s, val, 0, TRACE_SEQ_NUM_HEX);
+}
+
+/**
+ * trace_seq_put_timestamp - print a time stamp
+ * @s: trace sequence descriptor
+ * @ts: the time stamp
+ * @div: divide @ts by this first (rounded), or zero to not divide
+ * @prec: the number of digits to put after the dot
+ *
+ * Prints the time stamp as "%5llu.%0*llu" (the last @prec digits after
+ * the dot), or as "%12llu" if @prec is zero. This is the format of the
+ * TEP_PRINT_TIME field of tep_print_event().
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_timestamp(struct trace_seq *s, unsigned long long ts,
+			    unsigned int div, unsigned int prec)
+{
+	unsigned long long p10 = 1;
+	unsigned int i;
+	int ret;
+
+	if (div) {
+		ts += div / 2;
+		ts /= div;
+	}
+
+	if (!prec)
+		return trace_seq_put_num(s, ts, 12, 0);
+
+	if (prec > 19)
+		prec = 19;
+	for (i = 0; i < prec; i++)
+		p10 *= 10;
+
+	ret = trace_seq_put_num(s, ts / p10, 5, 0);
+	ret += trace_seq_putc(s, '.');
+	ret += trace_seq_put_num(s, ts % p10, prec, TRACE_SEQ_NUM_ZERO);
+
+	return ret;
+}
+
+/**
+ * trace_seq_put_str_pad - print a string padded to a width
+ * @s: trace sequence descriptor
+ * @str: the string to print
+ * @width: the minimum number of characters to print
+ *
+ * Same as trace_seq_printf(s, "%*s", width, str). A negative @width
+ * pads the string on the right, like "%-*s".
+ *
+ * Returns the number of characters printed, or 0 on error.
+ */
+int trace_seq_put_str_pad(struct trace_seq *s, const char *str, int width)
+{
+	unsigned int len = strlen(str);
+	unsigned int pad = 0;
+	bool left = width < 0;
+	char *buf;
+
+	TRACE_SEQ_CHECK_RET0(s);
+
+	if (left)
+		width = -width;
+	if ((unsigned int)width > len)
+		pad = width - len;
+
+	buf = trace_seq_reserve(s, len + pad);
+	if (!buf)
+		return 0;
+
+	if (!left) {
+		memset(buf, ' ', pad);
+		buf += pad;
+	}
+	memcpy(buf, str, len);
+	if (left)
+		memset(buf + len, ' ', pad);
+
+	s->len += len + pad;
+	seq_written(s);
+
+	return len + pad;
+}
+
 void trace_seq_terminate(struct trace_seq *s)
 {
 	TRACE_SEQ_CHECK_RET(s);
@@ -239,6 +724,9 @@ int trace_seq_do_fprintf(struct trace_seq *s, FILE *fp)
 	case TRACE_SEQ__MEM_ALLOC_FAILED:
 		fprintf(fp, "%s\n", "Can't allocate trace_seq buffer memory");
 		break;
+	case TRACE_SEQ__WRITE_FAILED:
+		fprintf(fp, "%s\n", "Can't write trace_seq buffer to its file");
+		break;
 	}
 	return -1;
 }
@@ -8,18 +8,22 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
 #include <dirent.h>
 #include <ftw.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 
 #include "event-parse.h"
 #include "trace-seq.h"
+#include "kbuffer.h"
 
 #define TRACEEVENT_SUITE	"traceevent library"
 
@@ -220,6 +224,22 @@ DECL_CPUMASK_EVENT_DATA(bytepn, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01);
 #define CPUMASK_BYTEPN_FMT "cpumask=0,63"
 #endif
 
+#define FUNC_EVENT_SYSTEM	"func"
+#define FUNC_STRLEN_FMT		"name=hello len=5"
+static const char func_strlen_event[] =
+	"name: func_strlen\n"
+	"ID: 4\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:int irq;\toffset:8;\tsize:4;\tsigned:1;\n"
+	"\tfield:__data_loc char[] name;\toffset:12;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"name=%s len=%d\", __get_str(name), test_strlen(__get_str(name))\n";
+
 static struct tep_handle *test_tep;
 static struct trace_seq *test_seq;
 static struct trace_seq seq_storage;
@@ -378,6 +398,1993 @@ static void test_parse_sizeof_undef(void)
 	test_parse_sizeof(0, 5, "sizeof_undef", SIZEOF_LONG0_FMT);
 }
 
+static unsigned long long test_strlen(struct trace_seq *s,
+				      unsigned long long *args)
+{
+	return strlen((char *)(unsigned long)args[0]);
+}
+
+static void test_parse_print_func(void)
+{
+	struct tep_event *event;
+	struct tep_record record;
+	char *data;
+	int i;
+
+	data = malloc(sizeof(dyn_str_data));
+	CU_TEST(data != NULL);
+	memcpy(data, dyn_str_data, sizeof(dyn_str_data));
+	/* Handles endianess */
+	*(unsigned short *)data = 4;
+
+	record.data = data;
+	record.size = sizeof(dyn_str_data);
+
+	CU_TEST(tep_register_print_function(test_tep, test_strlen,
+					    TEP_FUNC_ARG_INT, "test_strlen",
+					    TEP_FUNC_ARG_STRING,
+					    TEP_FUNC_ARG_VOID) == 0);
+
+	CU_TEST(tep_parse_format(test_tep, &event, func_strlen_event,
+				 strlen(func_strlen_event),
+				 FUNC_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+
+	/* The helper reuses its string buffers on every call */
+	for (i = 0; i < 2; i++) {
+		trace_seq_reset(test_seq);
+		tep_print_event(test_tep, test_seq, &record, "%s", TEP_PRINT_INFO);
+		trace_seq_terminate(test_seq);
+		CU_TEST(strcmp(test_seq->buffer, FUNC_STRLEN_FMT) == 0);
+	}
+
+	free(data);
+}
+
+static void test_find_function_cache(void)
+{
+	unsigned long long start;
+	unsigned long size;
+	const char *name;
+
+	CU_TEST(tep_register_function(test_tep, "func_a", 0x1000, NULL) == 0);
+	CU_TEST(tep_register_function(test_tep, "func_b", 0x1100, "mod") == 0);
+	CU_TEST(tep_register_function(test_tep, "func_c", 0x1200, NULL) == 0);
+
+	CU_TEST(tep_find_function_info(test_tep, 0x1010, &name, &start, &size) == 1);
+	CU_TEST(strcmp(name, "func_a") == 0);
+	CU_TEST(start == 0x1000 && size == 0x100);
+
+	/* The same address again must come from the cache */
+	CU_TEST(tep_find_function_info(test_tep, 0x1010, &name, &start, &size) == 1);
+	CU_TEST(strcmp(name, "func_a") == 0);
+	CU_TEST(start == 0x1000 && size == 0x100);
+
+	CU_TEST(tep_find_function(test_tep, 0x1180) != NULL);
+	CU_TEST(tep_find_function_address(test_tep, 0x1180) == 0x1100);
+	CU_TEST(tep_find_function(test_tep, 0x10) == NULL);
+	CU_TEST(tep_find_function(test_tep, 0x10) == NULL);
+}
+
+#define TEST_NR_FUNCS	1000
+
+static void test_find_function_table(void)
+{
+	struct tep_handle *tep;
+	unsigned long long start;
+	unsigned long size;
+	const char *name;
+	char buf[32];
+	int i, j;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	/* Register out of order, every function is 0x40 bytes */
+	for (i = 0; i < TEST_NR_FUNCS; i++) {
+		j = (i * 7) % TEST_NR_FUNCS;
+		snprintf(buf, sizeof(buf), "func_%d", j);
+		CU_TEST(tep_register_function(tep, buf, 0x10000 + j * 0x40,
+					      j & 1 ? "mod" : NULL) == 0);
+	}
+
+	CU_TEST(tep_find_function(tep, 0xffff) == NULL);
+
+	for (i = 0; i < TEST_NR_FUNCS - 1; i++) {
+		snprintf(buf, sizeof(buf), "func_%d", i);
+		CU_TEST(tep_find_function_info(tep, 0x10000 + i * 0x40 + 0x3f,
+					       &name, &start, &size) == 1);
+		CU_TEST(strcmp(name, buf) == 0);
+		CU_TEST(start == 0x10000 + i * 0x40);
+		CU_TEST(size == 0x40);
+	}
+
+	/* The last function only matches its exact address */
+	start = 0x10000 + (TEST_NR_FUNCS - 1) * 0x40;
+	CU_TEST(tep_find_function_info(tep, start, &name, NULL, &size) == 1);
+	CU_TEST(size == 0);
+	CU_TEST(tep_find_function(tep, start + 1) == NULL);
+
+	CU_TEST(tep_find_function_info(tep, 0x10010, &name, &start, &size) == 1);
+
+	/* Functions registered after the first lookup must be found too */
+	CU_TEST(tep_register_function(tep, "late_func", 0x8000, NULL) == 0);
+	CU_TEST(tep_find_function_address(tep, 0x8010) == 0x8000);
+	CU_TEST(tep_find_function_address(tep, 0x10010) == 0x10000);
+
+	/* Names found before the table is rebuilt stay valid */
+	CU_TEST(strcmp(name, "func_0") == 0);
+
+	tep_free(tep);
+}
+
+static void test_register_after_lookup(void)
+{
+	struct tep_handle *tep;
+	unsigned long long start;
+	unsigned long size;
+	const char *mod_name;
+	const char *name;
+	char buf[32];
+	int i;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	CU_TEST(tep_register_function(tep, "core_a", 0x1000, NULL) == 0);
+	CU_TEST(tep_register_function(tep, "core_b", 0x4000, NULL) == 0);
+	CU_TEST(tep_find_function_address(tep, 0x3000) == 0x1000);
+
+	/* A module is loaded in between */
+	CU_TEST(tep_register_function(tep, "mod_a", 0x2000, "mod") == 0);
+	CU_TEST(tep_register_function(tep, "mod_b", 0x2100, "mod") == 0);
+	CU_TEST(tep_get_function_count(tep) == 4);
+
+	CU_TEST(tep_find_function_info(tep, 0x2010, &mod_name, &start, &size) == 1);
+	CU_TEST(strcmp(mod_name, "mod_a") == 0);
+	CU_TEST(start == 0x2000 && size == 0x100);
+	CU_TEST(tep_find_function_info(tep, 0x1010, &name, &start, &size) == 1);
+	CU_TEST(strcmp(name, "core_a") == 0 && size == 0x1000);
+
+	/* Unload the module and a function of the table */
+	CU_TEST(tep_unregister_functions(tep, 0x2000, 0x3000) == 0);
+	CU_TEST(tep_unregister_functions(tep, 0x4000, 0x4001) == 0);
+	CU_TEST(tep_get_function_count(tep) == 1);
+	/* core_a is the last function now, which only matches exactly */
+	CU_TEST(tep_find_function(tep, 0x2010) == NULL);
+	CU_TEST(tep_find_function(tep, 0x4000) == NULL);
+	CU_TEST(tep_find_function_info(tep, 0x1000, &name, &start, &size) == 1);
+	CU_TEST(strcmp(name, "core_a") == 0 && size == 0);
+	/* Names found before the functions were removed stay valid */
+	CU_TEST(strcmp(mod_name, "mod_a") == 0);
+
+	/* And load it again */
+	CU_TEST(tep_register_function(tep, "core_b", 0x4000, NULL) == 0);
+	CU_TEST(tep_find_function_address(tep, 0x3000) == 0x1000);
+	CU_TEST(tep_find_function_address(tep, 0x4000) == 0x4000);
+	CU_TEST(tep_get_function_count(tep) == 2);
+
+	/* Registering many functions merges them into a new table */
+	name = tep_find_function(tep, 0x4000);
+	for (i = 0; i < 2048; i++) {
+		snprintf(buf, sizeof(buf), "bpf_%d", i);
+		CU_TEST(tep_register_function(tep, buf, 0x100000 + i * 0x10,
+					      NULL) == 0);
+	}
+	CU_TEST(tep_get_function_count(tep) == 2 + 2048);
+	CU_TEST(strcmp(tep_find_function(tep, 0x100015), "bpf_1") == 0);
+	CU_TEST(name && strcmp(name, "core_b") == 0);
+
+	tep_free(tep);
+}
+
+static void test_parse_kallsyms_buf(void)
+{
+	/* Not nul terminated, out of order, with modules and skipped symbols */
+	static const char kallsyms[] =
+		"ffffffff81000100 T func_b\n"
+		"ffffffff81000000 T func_a\n"
+		"ffffffff81000080 a absolute\n"
+		"ffffffffc0001000 t mod_func_a\t[test_mod]\n"
+		"ffffffffc0001100 t mod_func_b\t[test_mod]\n"
+		"ffffffff81000200 T func_c";
+	static const char printk_formats[] =
+		"0xffffffff82000010 : \"second\\n\"\n"
+		"0xffffffff82000000 : \"first: string\"\n";
+	struct tep_handle *tep;
+	unsigned long long start;
+	unsigned long size;
+	const char *name;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	CU_TEST(tep_parse_kallsyms_buf(tep, kallsyms, sizeof(kallsyms) - 1) == 0);
+
+	CU_TEST(tep_find_function_info(tep, 0xffffffff81000090, &name, &start, &size) == 1);
+	CU_TEST(strcmp(name, "func_a") == 0);
+	CU_TEST(start == 0xffffffff81000000 && size == 0x100);
+	CU_TEST(tep_find_function_address(tep, 0xffffffff81000200) == 0xffffffff81000200);
+	CU_TEST(tep_find_function(tep, 0xffffffffc0001010) != NULL);
+	CU_TEST(strcmp(tep_find_function(tep, 0xffffffffc0001010), "mod_func_a") == 0);
+
+	/* Names found before the table is rebuilt stay valid */
+	CU_TEST(tep_parse_kallsyms_buf(tep, kallsyms, sizeof(kallsyms) - 1) == 0);
+	CU_TEST(strcmp(name, "func_a") == 0);
+	CU_TEST(tep_find_function_address(tep, 0xffffffff81000090) == 0xffffffff81000000);
+
+	CU_TEST(tep_parse_printk_formats_buf(tep, printk_formats,
+					     sizeof(printk_formats) - 1) == 0);
+	CU_TEST(tep_register_print_string(tep, "\"third\"", 0xffffffff82000020) == 0);
+
+	tep_free(tep);
+}
+
+static void test_trace_seq_init_buf(void)
+{
+	struct trace_seq s;
+	char buf[32];
+	int i;
+
+	trace_seq_init_buf(&s, buf, sizeof(buf));
+	CU_TEST(trace_seq_printf(&s, "%d-%s", 42, "abc") == 6);
+	/* The content goes in buf, after the state of the seq */
+	CU_TEST(s.buffer > buf && s.buffer < buf + sizeof(buf));
+	CU_TEST(strncmp(s.buffer, "42-abc", 6) == 0);
+
+	/* Spill over into an allocated buffer */
+	for (i = 0; i < 1000; i++)
+		trace_seq_printf(&s, "%08x", i);
+	trace_seq_terminate(&s);
+	CU_TEST(s.buffer < buf || s.buffer >= buf + sizeof(buf));
+	CU_TEST(s.state == TRACE_SEQ__GOOD);
+	CU_TEST(s.len == 6 + 8000);
+	CU_TEST(strncmp(s.buffer, "42-abc00000000", 14) == 0);
+	CU_TEST(strcmp(s.buffer + s.len - 8, "000003e7") == 0);
+	trace_seq_destroy(&s);
+
+	/* A single print bigger than the buffer */
+	trace_seq_init_buf(&s, buf, sizeof(buf));
+	trace_seq_puts(&s, "x");
+	CU_TEST(trace_seq_printf(&s, "%*s", 10000, "y") == 10000);
+	trace_seq_terminate(&s);
+	CU_TEST(s.len == 10001 && s.buffer[10000] == 'y');
+	trace_seq_destroy(&s);
+
+	/* A buffer set by the caller is refused, and not freed */
+	memset(buf, 0, sizeof(buf));
+	trace_seq_init(&s);
+	trace_seq_destroy(&s);
+	s.buffer = buf + 16;
+	s.buffer_size = 16;
+	s.len = 0;
+	s.state = TRACE_SEQ__GOOD;
+	CU_TEST(trace_seq_puts(&s, "x") == 0);
+	CU_TEST(s.state == TRACE_SEQ__BUFFER_POISONED);
+	trace_seq_destroy(&s);
+}
+
+static void test_trace_seq_init_fd(void)
+{
+	struct trace_seq s;
+	char buf[64];
+	FILE *fp;
+	int i;
+
+	fp = tmpfile();
+	CU_TEST(fp != NULL);
+	if (!fp)
+		return;
+
+	trace_seq_init_fd(&s, fileno(fp), 16);
+	for (i = 0; i < 2; i++)
+		trace_seq_printf(&s, "line %d\n", i);
+	/* Nothing is written below the size */
+	CU_TEST(lseek(fileno(fp), 0, SEEK_END) == 0);
+	trace_seq_printf(&s, "line %d\n", i++);
+	/* Direct writes past the size are written out */
+	CU_TEST(lseek(fileno(fp), 0, SEEK_END) == 21);
+	CU_TEST(s.len == 0);
+	trace_seq_printf(&s, "line %d\n", i);
+	CU_TEST(trace_seq_flush(&s) == 0);
+	CU_TEST(s.len == 0);
+	trace_seq_puts(&s, "last\n");
+	trace_seq_destroy(&s);
+
+	rewind(fp);
+	i = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[i] = '\0';
+	CU_TEST(strcmp(buf, "line 0\nline 1\nline 2\nline 3\nlast\n") == 0);
+	fclose(fp);
+}
+
+static void test_trace_seq_put_num(void)
+{
+	static const long long vals[] = {
+		0, 1, -1, 9, 10, 99, 100, 12345, -12345, 0xdeadbeef,
+		LLONG_MAX, LLONG_MIN,
+	};
+	struct trace_seq s;
+	char buf[256];
+	unsigned int i;
+
+	trace_seq_init(&s);
+	for (i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+		trace_seq_reset(&s);
+		trace_seq_put_u64(&s, vals[i]);
+		trace_seq_putc(&s, ' ');
+		trace_seq_put_s64(&s, vals[i]);
+		trace_seq_putc(&s, ' ');
+		trace_seq_put_hex(&s, vals[i]);
+		trace_seq_putc(&s, ' ');
+		trace_seq_put_num(&s, vals[i], 8, TRACE_SEQ_NUM_SIGNED | TRACE_SEQ_NUM_ZERO);
+		trace_seq_putc(&s, ' ');
+		trace_seq_put_num(&s, vals[i], -1, TRACE_SEQ_NUM_HEX | TRACE_SEQ_NUM_UPPER);
+		trace_seq_putc(&s, ' ');
+		trace_seq_put_num(&s, vals[i], 7, TRACE_SEQ_NUM_SIGNED | TRACE_SEQ_NUM_LEFT);
+		trace_seq_putc(&s, '|');
+		trace_seq_put_num(&s, vals[i], 7, 0);
+		trace_seq_terminate(&s);
+
+		snprintf(buf, sizeof(buf), "%llu %lld %llx %08lld %llX %-7lld|%7llu",
+			 vals[i], vals[i], vals[i], vals[i], vals[i], vals[i], vals[i]);
+		CU_TEST(strcmp(s.buffer, buf) == 0);
+	}
+
+	trace_seq_reset(&s);
+	trace_seq_put_timestamp(&s, 123456789, 1000, 3);
+	trace_seq_putc(&s, ' ');
+	trace_seq_put_timestamp(&s, 1005, 0, 3);
+	trace_seq_putc(&s, ' ');
+	trace_seq_put_timestamp(&s, 42, 0, 0);
+	trace_seq_putc(&s, ' ');
+	trace_seq_put_str_pad(&s, "ab", 4);
+	trace_seq_put_str_pad(&s, "cd", -4);
+	trace_seq_put_str_pad(&s, "toolong", 2);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, "  123.457     1.005           42   abcd  toolong") == 0);
+	trace_seq_destroy(&s);
+}
+
+#define PIPE_EVENT_SYSTEM	"test"
+#define PIPE_NR_RECORDS		2000
+
+static const char pipe_event[] =
+	"name: pipe_event\n"
+	"ID: 7\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:unsigned long long ip;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\tfield:int val;\toffset:16;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"%pS val=%d\", (void *)REC->ip, REC->val\n";
+
+struct pipe_test_data {
+	unsigned short		common_type;
+	unsigned char		common_flags;
+	unsigned char		common_preempt_count;
+	int			common_pid;
+	unsigned long long	ip;
+	int			val;
+	int			pad;
+};
+
+static void pipe_test_fill(struct tep_handle *tep, struct pipe_test_data *data,
+			   struct tep_record *records)
+{
+	char name[32];
+	int i;
+
+	tep_set_long_size(tep, 8);
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+	CU_TEST(tep_parse_event(tep, pipe_event, strlen(pipe_event),
+				PIPE_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+
+	/* The comm and function tables are built on first use */
+	for (i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "func_%d", i);
+		tep_register_function(tep, name, 0x1000 + i * 0x100, NULL);
+		snprintf(name, sizeof(name), "task_%d", i);
+		tep_register_comm(tep, name, 1000 + i);
+	}
+
+	for (i = 0; i < PIPE_NR_RECORDS; i++) {
+		data[i].common_type = 7;
+		data[i].common_pid = 1000 + i % 120;
+		data[i].ip = 0x1000 + (i % 110) * 0x100 + i % 0x100;
+		data[i].val = i;
+		records[i].data = &data[i];
+		records[i].size = sizeof(data[i]);
+		records[i].ts = i * 1000ULL;
+		records[i].cpu = i % 4;
+	}
+}
+
+static void pipe_test_print(struct tep_handle *tep, struct trace_seq *s,
+			    struct tep_record *records)
+{
+	int i;
+
+	for (i = 0; i < PIPE_NR_RECORDS; i++)
+		tep_print_event(tep, s, &records[i], "%16s-%-5d [%03d] %d %s: %s\n",
+				TEP_PRINT_COMM, TEP_PRINT_PID, TEP_PRINT_CPU,
+				TEP_PRINT_TIME, TEP_PRINT_NAME, TEP_PRINT_INFO);
+	trace_seq_terminate(s);
+}
+
+static void pipe_release(struct tep_record *record, void *context)
+{
+	int *released = context;
+
+	/* Records must be released in the order they were added */
+	CU_TEST(record->ts == *released * 1000ULL);
+	(*released)++;
+}
+
+static int pipe_handler_running;
+static int pipe_handler_overlap;
+
+static int pipe_handler(struct trace_seq *s, struct tep_record *record,
+			struct tep_event *event, void *context)
+{
+	unsigned long long val;
+
+	/* Like the handlers of the plugins, this one is not reentrant */
+	if (__atomic_exchange_n(&pipe_handler_running, 1, __ATOMIC_ACQUIRE))
+		__atomic_store_n(&pipe_handler_overlap, 1, __ATOMIC_RELAXED);
+	tep_get_field_val(s, event, "val", record, &val, 0);
+	/* Give the other workers a chance to run into this one */
+	if (!(val % 64))
+		usleep(100);
+	trace_seq_printf(s, "handled val=%llu", val);
+	__atomic_store_n(&pipe_handler_running, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void test_print_pipeline(void)
+{
+	struct tep_print_pipeline *pipe;
+	struct pipe_test_data *data;
+	struct tep_record *records;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	char *buf;
+	FILE *fp;
+	int released = 0;
+	size_t r;
+	int i;
+
+	tep = tep_alloc();
+	data = calloc(PIPE_NR_RECORDS, sizeof(*data));
+	records = calloc(PIPE_NR_RECORDS, sizeof(*records));
+	fp = tmpfile();
+	CU_TEST(tep && data && records && fp);
+	if (!tep || !data || !records || !fp)
+		goto out;
+
+	pipe_test_fill(tep, data, records);
+	CU_TEST(tep_register_event_handler(tep, 7, NULL, NULL,
+					   pipe_handler, NULL) >= 0);
+
+	pipe = tep_print_pipeline_alloc(tep, 4, fileno(fp), NULL,
+					pipe_release, &released);
+	CU_TEST(pipe != NULL);
+	if (!pipe)
+		goto out;
+
+	/* Only comms can be added while the workers use the handle */
+	CU_TEST(tep_register_function(tep, "late", 0x100000, NULL) == -1 &&
+		errno == EBUSY);
+	CU_TEST(tep_register_print_string(tep, "late", 0x100000) == -1);
+	CU_TEST(tep_override_comm(tep, "late", 1000) == -1);
+	CU_TEST(tep_parse_event(tep, pipe_event, strlen(pipe_event),
+				PIPE_EVENT_SYSTEM) == TEP_ERRNO__HANDLE_BUSY);
+	CU_TEST(tep_unregister_event_handler(tep, 7, NULL, NULL,
+					     pipe_handler, NULL) == -1);
+	CU_TEST(tep_register_comm(tep, "late", 5000) == 0);
+
+	for (i = 0; i < PIPE_NR_RECORDS; i++)
+		CU_TEST(tep_print_pipeline_add(pipe, &records[i]) == 0);
+	CU_TEST(tep_print_pipeline_flush(pipe) == 0);
+	CU_TEST(released == PIPE_NR_RECORDS);
+	tep_print_pipeline_free(pipe);
+	CU_TEST(!pipe_handler_overlap);
+
+	/* The output must match printing the records one by one */
+	trace_seq_init(&s);
+	pipe_test_print(tep, &s, records);
+
+	buf = malloc(s.len + 1);
+	CU_TEST(buf != NULL);
+	if (buf) {
+		rewind(fp);
+		r = fread(buf, 1, s.len + 1, fp);
+		CU_TEST(r == s.len);
+		CU_TEST(memcmp(buf, s.buffer, s.len) == 0);
+		free(buf);
+	}
+	trace_seq_destroy(&s);
+ out:
+	if (fp)
+		fclose(fp);
+	free(records);
+	free(data);
+	tep_free(tep);
+}
+
+#define FROZEN_NR_THREADS	4
+
+struct frozen_test {
+	struct tep_handle	*tep;
+	struct tep_record	*records;
+	const char		*expect;
+	bool			match;
+};
+
+static void *frozen_reader(void *data)
+{
+	struct frozen_test *ft = data;
+	struct trace_seq s;
+
+	trace_seq_init(&s);
+	pipe_test_print(ft->tep, &s, ft->records);
+	ft->match = strcmp(s.buffer, ft->expect) == 0 &&
+		tep_find_event(ft->tep, 7) != NULL &&
+		tep_is_pid_registered(ft->tep, 1001);
+	trace_seq_destroy(&s);
+
+	return NULL;
+}
+
+static void test_frozen_handle(void)
+{
+	struct frozen_test ft[FROZEN_NR_THREADS];
+	pthread_t threads[FROZEN_NR_THREADS];
+	struct pipe_test_data *data;
+	struct tep_record *records;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	int i;
+
+	tep = tep_alloc();
+	data = calloc(PIPE_NR_RECORDS, sizeof(*data));
+	records = calloc(PIPE_NR_RECORDS, sizeof(*records));
+	CU_TEST(tep && data && records);
+	if (!tep || !data || !records)
+		goto out;
+
+	pipe_test_fill(tep, data, records);
+	CU_TEST(!tep_is_frozen(tep));
+	CU_TEST(tep_freeze(tep) == 0);
+	CU_TEST(tep_is_frozen(tep));
+
+	/* Nothing can be added once frozen */
+	CU_TEST(tep_register_comm(tep, "late", 5000) == -1 && errno == EBUSY);
+	CU_TEST(tep_register_function(tep, "late", 0x100000, NULL) == -1);
+	CU_TEST(tep_register_print_string(tep, "late", 0x100000) == -1);
+	CU_TEST(tep_parse_event(tep, pipe_event, strlen(pipe_event),
+				PIPE_EVENT_SYSTEM) == TEP_ERRNO__HANDLE_FROZEN);
+
+	trace_seq_init(&s);
+	pipe_test_print(tep, &s, records);
+
+	for (i = 0; i < FROZEN_NR_THREADS; i++) {
+		ft[i].tep = tep;
+		ft[i].records = records;
+		ft[i].expect = s.buffer;
+		ft[i].match = false;
+		CU_TEST(pthread_create(&threads[i], NULL, frozen_reader, &ft[i]) == 0);
+	}
+	for (i = 0; i < FROZEN_NR_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		CU_TEST(ft[i].match);
+	}
+	trace_seq_destroy(&s);
+ out:
+	free(records);
+	free(data);
+	tep_free(tep);
+}
+
+#define PARALLEL_NR_THREADS	4
+#define PARALLEL_NR_EVENTS	100
+
+static const char parallel_event_fmt[] =
+	"name: parallel_%d\n"
+	"ID: %d\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:unsigned long long flags;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"flags=%%s\", __print_flags(REC->flags, \"|\", { 1, \"A\" }, { 2, \"B\" })\n";
+
+struct parallel_test {
+	struct tep_handle	*tep;
+	int			first;
+	int			failed;
+};
+
+static void *parallel_parser(void *data)
+{
+	struct parallel_test *pt = data;
+	char buf[1024];
+	int len;
+	int i;
+
+	for (i = pt->first; i < pt->first + PARALLEL_NR_EVENTS; i++) {
+		len = snprintf(buf, sizeof(buf), parallel_event_fmt, i, i);
+		if (tep_parse_event(pt->tep, buf, len, PIPE_EVENT_SYSTEM))
+			pt->failed++;
+	}
+
+	return NULL;
+}
+
+static void test_parse_events_parallel(void)
+{
+	struct parallel_test pt[PARALLEL_NR_THREADS];
+	pthread_t threads[PARALLEL_NR_THREADS];
+	struct tep_format_field *field;
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct tep_event *event;
+	struct trace_seq s;
+	unsigned char data[16] = { 0 };
+	int nr = PARALLEL_NR_THREADS * PARALLEL_NR_EVENTS;
+	int i;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_long_size(tep, 8);
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+
+	for (i = 0; i < PARALLEL_NR_THREADS; i++) {
+		pt[i].tep = tep;
+		pt[i].first = 1 + i * PARALLEL_NR_EVENTS;
+		pt[i].failed = 0;
+		CU_TEST(pthread_create(&threads[i], NULL, parallel_parser, &pt[i]) == 0);
+	}
+	for (i = 0; i < PARALLEL_NR_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		CU_TEST(pt[i].failed == 0);
+	}
+
+	CU_TEST(tep_get_events_count(tep) == nr);
+
+	/* The flags field of every event must have been marked as such */
+	trace_seq_init(&s);
+	*(unsigned long long *)(data + 8) = 3;
+	record.data = data;
+	record.size = sizeof(data);
+	for (i = 1; i <= nr; i++) {
+		event = tep_find_event(tep, i);
+		CU_TEST(event != NULL);
+		if (!event)
+			continue;
+		field = tep_find_field(event, "flags");
+		CU_TEST(field && (field->flags & TEP_FIELD_IS_FLAG));
+
+		*(unsigned short *)data = i;
+		trace_seq_reset(&s);
+		tep_print_event(tep, &s, &record, "%s", TEP_PRINT_INFO);
+		trace_seq_terminate(&s);
+		CU_TEST(strcmp(s.buffer, "flags=A|B") == 0);
+	}
+	trace_seq_destroy(&s);
+	tep_free(tep);
+}
+
+static const char concat_event_fmt[] =
+	"name: concat\n"
+	"ID: 7\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:int val;\toffset:8;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"%s\" \"val=%%d\"  \"!\", REC->val\n";
+
+static void test_parse_concat_strings(void)
+{
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	unsigned char data[12] = { 0 };
+	char *long_str;
+	char *buf;
+	int len;
+
+	/* A literal longer than the old fixed token buffer */
+	long_str = malloc(3 * BUFSIZ + 1);
+	buf = malloc(4 * BUFSIZ);
+	CU_TEST(long_str != NULL && buf != NULL);
+	if (!long_str || !buf)
+		goto out_free;
+	memset(long_str, 'x', 3 * BUFSIZ);
+	long_str[3 * BUFSIZ] = '\0';
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		goto out_free;
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+
+	len = snprintf(buf, 4 * BUFSIZ, concat_event_fmt, long_str);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+
+	*(unsigned short *)data = 7;
+	*(int *)(data + 8) = 42;
+	record.data = data;
+	record.size = sizeof(data);
+
+	trace_seq_init(&s);
+	tep_print_event(tep, &s, &record, "%s", TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(s.len == 3 * BUFSIZ + 7);
+	CU_TEST(strncmp(s.buffer, long_str, 3 * BUFSIZ) == 0);
+	CU_TEST(strcmp(s.buffer + 3 * BUFSIZ, "val=42!") == 0);
+	trace_seq_destroy(&s);
+	tep_free(tep);
+
+ out_free:
+	free(long_str);
+	free(buf);
+}
+
+static const char bad_print_event[] =
+	"name: bad_print\n"
+	"ID: 8\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\n"
+	"\tfield:unsigned long flags;\toffset:8;\tsize:8;\tsigned:0;\n"
+	"\n"
+	"print fmt: \"flags=%s\", __print_flags(REC->flags, \"|\", { 1, \"A\" }, { 2\n";
+
+static const char bad_field_event[] =
+	"name: bad_field\n"
+	"ID: 9\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\n"
+	"\tfield:char name[16;\toffset:8;\n";
+
+static void test_parse_bad_formats(void)
+{
+	struct tep_handle *tep;
+	struct tep_event *event;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	/* The events are kept, but marked as failed */
+	tep_parse_event(tep, bad_print_event, strlen(bad_print_event), "test");
+	event = tep_find_event(tep, 8);
+	CU_TEST(event && (event->flags & TEP_EVENT_FL_FAILED));
+	CU_TEST(event && tep_find_field(event, "flags") != NULL);
+
+	tep_parse_event(tep, bad_field_event, strlen(bad_field_event), "test");
+	event = tep_find_event(tep, 9);
+	CU_TEST(event && (event->flags & TEP_EVENT_FL_FAILED));
+
+	tep_free(tep);
+}
+
+static void test_interned_strings(void)
+{
+	struct tep_format_field *f1, *f2;
+	struct tep_event *e1, *e2;
+	struct tep_handle *tep;
+	const char *name;
+	char buf[1024];
+	int len;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 1, 1);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+
+	e1 = tep_find_event(tep, 1);
+	e2 = tep_find_event(tep, 2);
+	CU_TEST(e1 != NULL && e2 != NULL);
+	if (!e1 || !e2)
+		goto out;
+	CU_TEST(e1->system == e2->system);
+
+	f1 = tep_find_field(e1, "flags");
+	f2 = tep_find_field(e2, "flags");
+	CU_TEST(f1 != NULL && f2 != NULL);
+	if (!f1 || !f2)
+		goto out;
+	CU_TEST(f1->name == f2->name);
+	CU_TEST(f1->type == f2->type);
+	CU_TEST(strcmp(f1->type, "unsigned long long") == 0);
+
+	name = tep_find_interned_string(tep, "flags");
+	CU_TEST(name == f1->name);
+	CU_TEST(tep_find_field(e2, name) == f2);
+	CU_TEST(tep_find_interned_string(tep, "common_pid") ==
+		tep_find_common_field(e1, "common_pid")->name);
+	CU_TEST(tep_find_interned_string(tep, "test") == e1->system);
+	CU_TEST(tep_find_interned_string(tep, "no_such_field") == NULL);
+
+ out:
+	tep_free(tep);
+}
+
+static void test_shared_layouts(void)
+{
+	struct tep_event *e1, *e2, *e3;
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	unsigned char data[16] = { 0 };
+	char buf[1024];
+	int len;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_long_size(tep, 8);
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+
+	/* Same class, only the name and ID differ */
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 1, 1);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	/* Same fields, but its own print format */
+	len = snprintf(buf, sizeof(buf), concat_event_fmt, "");
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+
+	e1 = tep_find_event(tep, 1);
+	e2 = tep_find_event(tep, 2);
+	e3 = tep_find_event(tep, 7);
+	CU_TEST(e1 != NULL && e2 != NULL && e3 != NULL);
+	if (!e1 || !e2 || !e3)
+		goto out;
+
+	CU_TEST(strcmp(e2->name, "parallel_2") == 0);
+	CU_TEST(e2->id == 2);
+	CU_TEST(e1->format.nr_fields == e2->format.nr_fields);
+	CU_TEST(e1->print_fmt.args == e2->print_fmt.args);
+	/* Each event has its own fields, that refer to it */
+	CU_TEST(e1->format.fields != e2->format.fields);
+	CU_TEST(e1->format.fields->name == e2->format.fields->name);
+	CU_TEST(e1->format.fields->event == e1);
+	CU_TEST(e2->format.fields->event == e2);
+	CU_TEST(tep_find_common_field(e2, "common_pid")->event == e2);
+	CU_TEST(e1->format.common_fields != e3->format.common_fields);
+
+	trace_seq_init(&s);
+	*(unsigned short *)data = 2;
+	*(unsigned long long *)(data + 8) = 2;
+	record.data = data;
+	record.size = sizeof(data);
+	tep_print_event(tep, &s, &record, "%s:%s", TEP_PRINT_NAME, TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, "parallel_2:flags=B") == 0);
+	trace_seq_destroy(&s);
+
+ out:
+	tep_free(tep);
+}
+
+static struct tep_handle *cache_test_handle(void)
+{
+	struct tep_handle *tep;
+
+	tep = tep_alloc();
+	if (!tep)
+		return NULL;
+	tep_set_long_size(tep, 8);
+	tep_set_page_size(tep, 4096);
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+	tep_register_print_function(tep, test_strlen, TEP_FUNC_ARG_INT,
+				    "test_strlen", TEP_FUNC_ARG_STRING,
+				    TEP_FUNC_ARG_VOID);
+	return tep;
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	buf = NULL;
+	if (!fstat(fd, &st) && (buf = malloc(st.st_size)) &&
+	    read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		buf = NULL;
+	}
+	close(fd);
+	*size = st.st_size;
+	return buf;
+}
+
+static struct tep_handle *shared_test_handle(int flags)
+{
+	struct tep_handle *tep;
+
+	tep = cache_test_handle();
+	if (tep)
+		tep_set_flag(tep, flags);
+	return tep;
+}
+
+static bool shared_test_print(struct tep_handle *tep, void *data, int size,
+			      const char *expect)
+{
+	struct tep_record record;
+	struct trace_seq s;
+	bool ret;
+
+	memset(&record, 0, sizeof(record));
+	record.data = data;
+	record.size = size;
+	trace_seq_init(&s);
+	tep_print_event(tep, &s, &record, "%s", TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	ret = strcmp(s.buffer, expect) == 0;
+	trace_seq_destroy(&s);
+	return ret;
+}
+
+static void test_shared_schemas(void)
+{
+	struct tep_handle *tep1, *tep2, *tep3;
+	struct tep_format_field *field;
+	struct tep_event *e1, *e2, *e3;
+
+	tep1 = shared_test_handle(TEP_SHARE_FORMATS);
+	tep2 = shared_test_handle(TEP_SHARE_FORMATS);
+	tep3 = shared_test_handle(0);
+	CU_TEST(tep1 != NULL && tep2 != NULL && tep3 != NULL);
+	if (!tep1 || !tep2 || !tep3)
+		goto out;
+
+	CU_TEST(tep_parse_event(tep1, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep2, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep3, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	e1 = tep_find_event(tep1, 1);
+	e2 = tep_find_event(tep2, 1);
+	e3 = tep_find_event(tep3, 1);
+	CU_TEST(e1 != NULL && e2 != NULL && e3 != NULL);
+	if (!e1 || !e2 || !e3)
+		goto out;
+
+	/* The print format is shared, the fields belong to each handle */
+	CU_TEST(e1->print_fmt.args == e2->print_fmt.args);
+	CU_TEST(e1->print_fmt.args != e3->print_fmt.args);
+	CU_TEST(e1->format.fields != e2->format.fields);
+	CU_TEST(e1->format.nr_fields == e2->format.nr_fields);
+	for (field = e1->format.fields; field; field = field->next)
+		CU_TEST(field->event == e1);
+	for (field = e2->format.common_fields; field; field = field->next)
+		CU_TEST(field->event == e2);
+
+	CU_TEST(shared_test_print(tep1, dyn_str_data, sizeof(dyn_str_data),
+				  DYN_STRING_FMT));
+	CU_TEST(shared_test_print(tep2, dyn_str_data, sizeof(dyn_str_data),
+				  DYN_STRING_FMT));
+
+	/* The format outlives the handle that parsed it first */
+	tep_free(tep1);
+	tep1 = NULL;
+	CU_TEST(shared_test_print(tep2, dyn_str_data, sizeof(dyn_str_data),
+				  DYN_STRING_FMT));
+
+	/* Print functions are registered per handle */
+	tep1 = shared_test_handle(TEP_SHARE_FORMATS);
+	CU_TEST(tep1 != NULL);
+	if (!tep1)
+		goto out;
+	CU_TEST(tep_parse_event(tep1, func_strlen_event, strlen(func_strlen_event),
+				"test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep2, func_strlen_event, strlen(func_strlen_event),
+				"test") == TEP_ERRNO__SUCCESS);
+	e1 = tep_find_event(tep1, 4);
+	e2 = tep_find_event(tep2, 4);
+	CU_TEST(e1 != NULL && e2 != NULL);
+	if (e1 && e2)
+		CU_TEST(e1->print_fmt.args != e2->print_fmt.args);
+
+ out:
+	tep_free(tep1);
+	tep_free(tep2);
+	tep_free(tep3);
+}
+
+static const char lock_depth_event[] =
+	"name: lock_depth\n"
+	"ID: 10\n"
+	"format:\n"
+	"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+	"\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+	"\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+	"\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+	"\tfield:int common_lock_depth;\toffset:8;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"\tfield:int value;\toffset:12;\tsize:4;\tsigned:1;\n"
+	"\n"
+	"print fmt: \"value=%d\", REC->value\n";
+
+static void test_data_common(void)
+{
+	struct tep_common_fields common;
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	unsigned char data[16] = { 0 };
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+
+	memset(&record, 0, sizeof(record));
+	record.data = data;
+	record.size = sizeof(data);
+
+	/* Nothing to find the common fields with */
+	CU_TEST(tep_data_common(tep, &record, &common) == -1);
+	CU_TEST(common.type == -1 && common.pid == -1);
+
+	CU_TEST(tep_parse_event(tep, lock_depth_event, strlen(lock_depth_event),
+				"test") == TEP_ERRNO__SUCCESS);
+
+	*(unsigned short *)data = 10;
+	data[2] = TRACE_FLAG_IRQS_OFF | TRACE_FLAG_HARDIRQ;
+	data[3] = 0x21;
+	*(int *)(data + 4) = 1234;
+	*(int *)(data + 8) = 3;
+	*(int *)(data + 12) = 7;
+
+	CU_TEST(tep_data_common(tep, &record, &common) == 0);
+	CU_TEST(common.type == 10);
+	CU_TEST(common.pid == 1234);
+	CU_TEST(common.preempt_count == 0x21);
+	CU_TEST(common.flags == (TRACE_FLAG_IRQS_OFF | TRACE_FLAG_HARDIRQ));
+	CU_TEST(common.lock_depth == 3);
+	CU_TEST(common.migrate_disable == -1);
+
+	/* The same as reading them one by one */
+	CU_TEST(common.type == tep_data_type(tep, &record));
+	CU_TEST(common.pid == tep_data_pid(tep, &record));
+	CU_TEST(common.preempt_count == tep_data_preempt_count(tep, &record));
+	CU_TEST(common.flags == tep_data_flags(tep, &record));
+
+	trace_seq_init(&s);
+	tep_print_event(tep, &s, &record, "%s %s", TEP_PRINT_LATENCY,
+			TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, "d.h123 value=7") == 0);
+	trace_seq_destroy(&s);
+
+	tep_free(tep);
+}
+
+static void test_read_columns(void)
+{
+	struct tep_record records[300], *recs[300];
+	unsigned char data[300][16];
+	struct tep_column columns[4];
+	unsigned long long ts[300];
+	unsigned char nulls[300 / 8 + 1];
+	unsigned short flags[300];
+	long long values[300];
+	int pids[300];
+	struct tep_event *event;
+	struct tep_handle *tep;
+	bool ok;
+	int swap;
+	int i;
+
+	for (swap = 0; swap < 2; swap++) {
+		tep = tep_alloc();
+		CU_TEST(tep != NULL);
+		if (!tep)
+			return;
+		/* Read the records of the other endianness the second time */
+		tep_set_file_bigendian(tep, tep_is_bigendian() == !swap ?
+				       TEP_BIG_ENDIAN : TEP_LITTLE_ENDIAN);
+		CU_TEST(tep_parse_event(tep, lock_depth_event,
+					strlen(lock_depth_event),
+					"test") == TEP_ERRNO__SUCCESS);
+		event = tep_find_event(tep, 10);
+		CU_TEST(event != NULL);
+		if (!event)
+			goto out;
+
+		memset(data, 0, sizeof(data));
+		for (i = 0; i < 300; i++) {
+			unsigned short type = 10;
+			int pid = 1000 + i;
+			int value = -i;
+
+			if (swap) {
+				type = __builtin_bswap16(type);
+				pid = __builtin_bswap32(pid);
+				value = __builtin_bswap32(value);
+			}
+			memcpy(data[i], &type, 2);
+			data[i][2] = i & 0x1f;
+			memcpy(data[i] + 4, &pid, 4);
+			memcpy(data[i] + 12, &value, 4);
+
+			memset(&records[i], 0, sizeof(records[i]));
+			records[i].ts = 5000 + i;
+			records[i].data = data[i];
+			records[i].size = sizeof(data[i]);
+			recs[i] = &records[i];
+		}
+		/* Too short for the value, and another event */
+		records[7].size = 12;
+		data[260][swap ? 1 : 0] = 11;
+
+		columns[0] = (struct tep_column){ tep_find_any_field(event, "common_pid"),
+						  TEP_COLUMN_S32, pids, NULL };
+		columns[1] = (struct tep_column){ tep_find_field(event, "value"),
+						  TEP_COLUMN_S64, values, nulls };
+		columns[2] = (struct tep_column){ NULL, TEP_COLUMN_U64, ts, NULL };
+		columns[3] = (struct tep_column){ tep_find_any_field(event, "common_flags"),
+						  TEP_COLUMN_U16, flags, NULL };
+		memset(nulls, 0xff, sizeof(nulls));
+		CU_TEST(tep_read_columns(event, recs, 300, columns, 4) == 0);
+
+		ok = true;
+		for (i = 0; i < 300; i++) {
+			bool null = i == 7 || i == 260;
+
+			if (!!(nulls[i / 8] & (1 << (i % 8))) != null ||
+			    ts[i] != 5000 + i ||
+			    pids[i] != (i == 260 ? 0 : 1000 + i) ||
+			    values[i] != (null ? 0 : -i) ||
+			    flags[i] != (i == 260 ? 0 : (i & 0x1f)))
+				ok = false;
+		}
+		CU_TEST(ok);
+
+		/* Not a type of column */
+		columns[0].type = 42;
+		CU_TEST(tep_read_columns(event, recs, 300, columns, 1) == -1);
+ out:
+		tep_free(tep);
+	}
+}
+
+static void swap_bytes(unsigned char *data, int offset, int size)
+{
+	unsigned char c;
+	int i;
+
+	for (i = 0; i < size / 2; i++) {
+		c = data[offset + i];
+		data[offset + i] = data[offset + size - 1 - i];
+		data[offset + size - 1 - i] = c;
+	}
+}
+
+static void test_swap_records(void)
+{
+	unsigned char str[sizeof(dyn_str_data)];
+	unsigned char data[3][16] = { { 0 } };
+	struct tep_record records[4], *recs[4];
+	struct tep_handle *tep;
+	unsigned long long val;
+	struct trace_seq s;
+	int i;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_LITTLE_ENDIAN :
+						       TEP_BIG_ENDIAN);
+	CU_TEST(tep_parse_event(tep, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep, lock_depth_event, strlen(lock_depth_event),
+				"test") == TEP_ERRNO__SUCCESS);
+
+	/* The records as a machine of the other byte order wrote them */
+	memcpy(str, dyn_str_data, sizeof(str));
+	swap_bytes(str, 0, 2);
+	swap_bytes(str, 4, 4);
+	swap_bytes(str, 8, 4);
+	swap_bytes(str, 12, 4);
+
+	for (i = 0; i < 3; i++) {
+		*(unsigned short *)data[i] = 10;
+		*(int *)(data[i] + 4) = 100 + i;
+		*(int *)(data[i] + 8) = i;
+		*(int *)(data[i] + 12) = -1000 - i;
+		swap_bytes(data[i], 0, 2);
+		swap_bytes(data[i], 4, 4);
+		swap_bytes(data[i], 8, 4);
+		swap_bytes(data[i], 12, 4);
+	}
+	/* An unknown event */
+	data[2][0] = data[2][1] = 0x7f;
+
+	for (i = 0; i < 4; i++) {
+		memset(&records[i], 0, sizeof(records[i]));
+		records[i].data = i ? data[i - 1] : str;
+		records[i].size = i ? sizeof(data[i - 1]) : sizeof(str);
+		recs[i] = &records[i];
+	}
+	/* Too short for the last field */
+	records[2].size = 12;
+
+	CU_TEST(tep_swap_records(tep, recs, 4) == 3);
+	CU_TEST(memcmp(str, dyn_str_data, sizeof(str)) == 0);
+	CU_TEST(*(int *)(data[1] + 12) != -1001);
+	CU_TEST(*(unsigned short *)data[2] == 0x7f7f);
+
+	/* Read them as records of the host */
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+	CU_TEST(tep_data_pid(tep, &records[1]) == 100);
+	CU_TEST(tep_data_pid(tep, &records[2]) == 101);
+	CU_TEST(tep_read_number_field(tep_find_field(tep_find_event(tep, 10),
+						     "value"),
+				      data[0], &val) == 0);
+	CU_TEST((int)val == -1000);
+
+	trace_seq_init(&s);
+	tep_print_event(tep, &s, &records[0], "%s", TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, DYN_STRING_FMT) == 0);
+	trace_seq_destroy(&s);
+
+	/* Nothing to do for records of the host */
+	CU_TEST(tep_swap_records(tep, recs, 4) == 4);
+	CU_TEST(memcmp(str, dyn_str_data, sizeof(str)) == 0);
+
+	tep_free(tep);
+}
+
+static void test_field_view(void)
+{
+	unsigned char data[sizeof(dyn_str_data)];
+	struct tep_format_field *field;
+	struct tep_event_filter *filter;
+	struct tep_field_view view;
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct tep_event *event;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+	CU_TEST(tep_parse_event(tep, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	event = tep_find_event(tep, 1);
+	field = event ? tep_find_field(event, DYN_STR_FIELD) : NULL;
+	CU_TEST(field != NULL);
+	if (!field)
+		goto out;
+
+	memcpy(data, dyn_str_data, sizeof(data));
+	memset(&record, 0, sizeof(record));
+	record.data = data;
+	record.size = sizeof(data);
+
+	CU_TEST(tep_get_field_view(field, &record, &view) == 0);
+	CU_TEST(view.data == data + 16);
+	CU_TEST(view.len == strlen(DYN_STRING));
+
+	filter = tep_filter_alloc(tep);
+	CU_TEST(filter != NULL);
+	if (!filter)
+		goto out;
+	CU_TEST(tep_filter_add_filter_str(filter,
+		"irq_handler_entry:name == \"hello\" && name =~ \"^hel\"") == 0);
+	CU_TEST(tep_filter_match(filter, &record) == TEP_ERRNO__FILTER_MATCH);
+
+	/* A string that fills its array has no nul */
+	data[16 + 5] = 'x';
+	CU_TEST(tep_get_field_view(field, &record, &view) == 0);
+	CU_TEST(view.len == 6 && memcmp(view.data, "hellox", 6) == 0);
+	CU_TEST(tep_filter_match(filter, &record) == TEP_ERRNO__FILTER_MISS);
+	data[16 + 5] = '\0';
+
+	/* The string is not all in the record */
+	record.size = 20;
+	CU_TEST(tep_get_field_view(field, &record, &view) == -1);
+	CU_TEST(view.data == NULL && view.len == 0);
+	CU_TEST(tep_filter_match(filter, &record) == TEP_ERRNO__FILTER_MISS);
+
+	/* Nor is its location */
+	record.size = 14;
+	CU_TEST(tep_get_field_view(field, &record, &view) == -1);
+
+	tep_filter_free(filter);
+ out:
+	tep_free(tep);
+}
+
+#define POOL_NR_THREADS		4
+#define POOL_NR_RECORDS		1000
+
+struct record_pool_test {
+	struct tep_record_pool	*pool;
+	struct tep_record	*records[POOL_NR_RECORDS];
+	bool			ok;
+};
+
+static void *pool_worker(void *data)
+{
+	struct record_pool_test *pt = data;
+	struct tep_record *record;
+	int i;
+
+	pt->ok = tep_record_pool_get_bulk(pt->pool, pt->records,
+					  POOL_NR_RECORDS) == POOL_NR_RECORDS;
+	for (i = 0; pt->ok && i < POOL_NR_RECORDS; i++) {
+		*(int *)pt->records[i]->data = i;
+		record = tep_record_pool_next(pt->pool);
+		if (!record || record->ref_count != 1)
+			pt->ok = false;
+	}
+	return NULL;
+}
+
+static void test_record_pool(void)
+{
+	struct record_pool_test pt[POOL_NR_THREADS];
+	pthread_t threads[POOL_NR_THREADS];
+	struct tep_record_pool *pool;
+	struct tep_record *ring[4];
+	struct tep_record *record;
+	struct tep_record *kept;
+	int i, j;
+
+	pool = tep_record_pool_alloc(sizeof(int), 4);
+	CU_TEST(pool != NULL);
+	if (!pool)
+		return;
+
+	record = tep_record_pool_get(pool);
+	CU_TEST(record != NULL && record->data != NULL &&
+		record->ref_count == 1 && record->size == 0);
+	record->size = 4;
+	record->cpu = 3;
+
+	/* A record is only given out again after its last reference */
+	tep_record_pool_ref(record);
+	tep_record_pool_put(record);
+	kept = tep_record_pool_get(pool);
+	CU_TEST(kept != record);
+	tep_record_pool_put(kept);
+	tep_record_pool_put(record);
+	kept = tep_record_pool_get(pool);
+	CU_TEST(kept == record && kept->size == 0 && kept->cpu == 0);
+	tep_record_pool_put(kept);
+
+	/* Locked records do not go back to the pool */
+	record = tep_record_pool_get(pool);
+	record->locked = 1;
+	tep_record_pool_put(record);
+	kept = tep_record_pool_get(pool);
+	CU_TEST(kept != record);
+	tep_record_pool_put(kept);
+
+	/* The ring cycles through the same records */
+	for (i = 0; i < 4; i++)
+		ring[i] = tep_record_pool_next(pool);
+	CU_TEST(ring[0] != ring[1] && ring[1] != ring[2] && ring[2] != ring[3]);
+	ring[1]->ts = 100;
+	for (i = 0; i < 4; i++) {
+		record = tep_record_pool_next(pool);
+		CU_TEST(record == ring[i] && record->ts == 0);
+		if (i == 1)
+			record->ts = 200;
+	}
+
+	/* A record kept from the ring is replaced in it */
+	tep_record_pool_ref(ring[1]);
+	tep_record_pool_next(pool);
+	record = tep_record_pool_next(pool);
+	CU_TEST(record != ring[1]);
+	CU_TEST(ring[1]->ts == 200 && ring[1]->ref_count == 1);
+	tep_record_pool_put(ring[1]);
+
+	/* Records taken by threads are put by this one */
+	for (i = 0; i < POOL_NR_THREADS; i++) {
+		pt[i].pool = pool;
+		pt[i].ok = false;
+		CU_TEST(pthread_create(&threads[i], NULL, pool_worker, &pt[i]) == 0);
+	}
+	for (i = 0; i < POOL_NR_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < POOL_NR_THREADS; i++) {
+		CU_TEST(pt[i].ok);
+		for (j = 0; pt[i].ok && j < POOL_NR_RECORDS; j++) {
+			if (*(int *)pt[i].records[j]->data != j)
+				break;
+			tep_record_pool_put(pt[i].records[j]);
+		}
+		CU_TEST(j == POOL_NR_RECORDS);
+	}
+
+	CU_TEST(tep_record_pool_get_bulk(pool, pt[0].records,
+					 POOL_NR_RECORDS) == POOL_NR_RECORDS);
+	for (i = 0; i < POOL_NR_RECORDS; i++)
+		tep_record_pool_put(pt[0].records[i]);
+
+	tep_record_pool_free(pool);
+
+	pool = tep_record_pool_alloc(0, 0);
+	CU_TEST(pool != NULL);
+	if (!pool)
+		return;
+	record = tep_record_pool_get(pool);
+	CU_TEST(record != NULL && record->data == NULL);
+	tep_record_pool_put(record);
+	CU_TEST(tep_record_pool_next(pool) == NULL && errno == EINVAL);
+	tep_record_pool_free(pool);
+}
+
+static void test_stats(void)
+{
+	/* An 8 byte event, a time extend and a 4 byte event */
+	unsigned char subbuf[48] = {
+		[8] = 28,
+		[16] = 2 | (1 << 5),
+		[28] = KBUFFER_TYPE_TIME_EXTEND, [32] = 1,
+		[36] = 1 | (1 << 5),
+	};
+	static const char low_event[] =
+		"name: low\n"
+		"ID: 5\n"
+		"format:\n"
+		"\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+		"\n"
+		"\tfield:int value;\toffset:12;\tsize:4;\tsigned:1;\n"
+		"\n"
+		"print fmt: \"value=%d\", REC->value\n";
+	unsigned char data[16] = { 0 };
+	unsigned long long tests, matches;
+	char buf[24];
+	struct tep_event_filter *filter;
+	struct kbuffer_stats kstats;
+	struct tep_record record;
+	struct tep_stats stats;
+	struct kbuffer *kbuf;
+	struct tep_handle *tep;
+	struct trace_seq s;
+	const char *func;
+	void *ptr;
+	int i;
+
+	tep = tep_alloc();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	tep_set_file_bigendian(tep, tep_is_bigendian() ? TEP_BIG_ENDIAN :
+						       TEP_LITTLE_ENDIAN);
+	CU_TEST(tep_parse_event(tep, lock_depth_event, strlen(lock_depth_event),
+				"test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_register_comm(tep, "hello", 1234) == 0);
+	CU_TEST(tep_register_function(tep, "func", 0x1000, NULL) == 0);
+	CU_TEST(tep_register_function(tep, "next", 0x2000, NULL) == 0);
+
+	filter = tep_filter_alloc(tep);
+	kbuf = kbuffer_alloc(KBUFFER_LSIZE_8, KBUFFER_ENDIAN_LITTLE);
+	CU_TEST(filter != NULL && kbuf != NULL);
+	if (!filter || !kbuf)
+		goto out;
+	CU_TEST(tep_filter_add_filter_str(filter, "lock_depth:value == 3") == 0);
+
+	tep_reset_stats(tep);
+	tep_filter_reset_stats(filter);
+	kbuffer_reset_stats(kbuf);
+
+	CU_TEST(tep_find_event(tep, 10) != NULL);
+	CU_TEST(tep_find_event(tep, 10) != NULL);
+	CU_TEST(strcmp(tep_data_comm_from_pid(tep, 1234), "hello") == 0);
+	func = tep_find_function(tep, 0x1010);
+	CU_TEST(func && strcmp(func, "func") == 0);
+	func = tep_find_function(tep, 0x1010);
+	CU_TEST(func && strcmp(func, "func") == 0);
+
+	memset(&record, 0, sizeof(record));
+	record.data = data;
+	record.size = sizeof(data);
+	*(unsigned short *)data = 10;
+	*(int *)(data + 12) = 3;
+	CU_TEST(tep_filter_match(filter, &record) == TEP_ERRNO__FILTER_MATCH);
+	*(int *)(data + 12) = 4;
+	CU_TEST(tep_filter_match(filter, &record) == TEP_ERRNO__FILTER_MISS);
+
+	/* Grown while printing for tep */
+	trace_seq_init_buf(&s, buf, sizeof(buf));
+	tep_print_event(tep, &s, &record, "%s: %s %d", TEP_PRINT_NAME,
+			TEP_PRINT_INFO, TEP_PRINT_PID);
+	trace_seq_destroy(&s);
+
+	CU_TEST(kbuffer_load_subbuffer(kbuf, subbuf) == 0);
+	for (i = 0, ptr = kbuffer_read_event(kbuf, NULL); ptr;
+	     ptr = kbuffer_next_event(kbuf, NULL))
+		i++;
+	CU_TEST(i == 2);
+
+	if (tep_get_stats(tep, &stats) < 0) {
+		/* Not built with TEP_STATS */
+		CU_TEST(errno == ENOTSUP && stats.last_event_hits == 0);
+		CU_TEST(tep_filter_get_stats(filter, 10, &tests, &matches) == -1);
+		CU_TEST(tests == 0 && matches == 0);
+		CU_TEST(kbuffer_get_stats(kbuf, &kstats) == -1);
+		CU_TEST(kstats.events == 0);
+		goto out;
+	}
+
+	/* Two lookups above, and one by tep_print_event() */
+	CU_TEST(stats.last_event_hits >= 1 &&
+		stats.last_event_hits + stats.last_event_misses == 3);
+	CU_TEST(stats.cmdline_searches == 1 && stats.cmdline_probes >= 1);
+	/* The second lookup of the function comes from the cache */
+	CU_TEST(stats.func_cache_hits == 1 && stats.func_cache_misses == 1);
+	CU_TEST(stats.func_searches == 1);
+	CU_TEST(stats.seq_expansions >= 1);
+
+	CU_TEST(tep_filter_get_stats(filter, 10, &tests, &matches) == 0);
+	CU_TEST(tests == 2 && matches == 1);
+	CU_TEST(tep_filter_get_stats(filter, 11, &tests, NULL) == -1);
+
+	/* The counters stay with their event when others come and go */
+	CU_TEST(tep_parse_event(tep, low_event, strlen(low_event),
+				"test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_filter_add_filter_str(filter, "low:value == 1") == 0);
+	CU_TEST(tep_filter_get_stats(filter, 5, &tests, &matches) == 0);
+	CU_TEST(tests == 0 && matches == 0);
+	CU_TEST(tep_filter_get_stats(filter, 10, &tests, &matches) == 0);
+	CU_TEST(tests == 2 && matches == 1);
+	CU_TEST(tep_filter_remove_event(filter, 5) == 1);
+	CU_TEST(tep_filter_get_stats(filter, 10, &tests, &matches) == 0);
+	CU_TEST(tests == 2 && matches == 1);
+
+	CU_TEST(kbuffer_get_stats(kbuf, &kstats) == 0);
+	CU_TEST(kstats.subbuffers == 1 && kstats.events == 2 &&
+		kstats.skipped == 1);
+	CU_TEST(kstats.subbuf_events == 2 && kstats.subbuf_skipped == 1);
+
+	tep_reset_stats(tep);
+	tep_filter_reset_stats(filter);
+	kbuffer_reset_stats(kbuf);
+
+	/* Grown outside of the print paths of tep */
+	trace_seq_init(&s);
+	for (i = 0; i < 10000; i++)
+		trace_seq_putc(&s, 'x');
+	trace_seq_destroy(&s);
+
+	CU_TEST(tep_get_stats(tep, &stats) == 0);
+	CU_TEST(stats.last_event_hits == 0 && stats.cmdline_searches == 0 &&
+		stats.seq_expansions == 0);
+	CU_TEST(tep_filter_get_stats(filter, 10, &tests, &matches) == 0);
+	CU_TEST(tests == 0 && matches == 0);
+	CU_TEST(kbuffer_get_stats(kbuf, &kstats) == 0 && kstats.events == 0);
+ out:
+	kbuffer_free(kbuf);
+	tep_filter_free(filter);
+	tep_free(tep);
+}
+
+struct lazy_print_test {
+	struct tep_handle	*tep;
+	bool			ok;
+};
+
+static void *lazy_printer(void *data)
+{
+	struct lazy_print_test *lt = data;
+
+	lt->ok = shared_test_print(lt->tep, dyn_str_data, sizeof(dyn_str_data),
+				   DYN_STRING_FMT);
+	return NULL;
+}
+
+static void test_lazy_print_fmt(void)
+{
+	struct lazy_print_test lt[4];
+	pthread_t threads[4];
+	struct tep_event *e1, *e2, *event;
+	struct tep_handle *tep;
+	unsigned char data[16] = { 0 };
+	char buf[1024];
+	int len;
+	int i;
+
+	tep = shared_test_handle(TEP_LAZY_PRINT_FMT);
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+
+	/* The fields are there, the print format is parsed when printed */
+	CU_TEST(tep_parse_event(tep, dyn_str_event, strlen(dyn_str_event),
+				DYN_STR_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	event = tep_get_event(tep, 0);
+	CU_TEST(event != NULL);
+	if (!event)
+		goto out;
+	CU_TEST(tep_find_field(event, DYN_STR_FIELD) != NULL);
+	CU_TEST(event->print_fmt.args == NULL);
+
+	for (i = 0; i < 4; i++) {
+		lt[i].tep = tep;
+		lt[i].ok = false;
+		CU_TEST(pthread_create(&threads[i], NULL, lazy_printer, &lt[i]) == 0);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		CU_TEST(lt[i].ok);
+	}
+	CU_TEST(event->print_fmt.args != NULL);
+
+	/* Events of the same class parse it once */
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 3, 3);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	e1 = tep_get_event(tep, 1);
+	e2 = tep_get_event(tep, 2);
+	CU_TEST(e1 != NULL && e2 != NULL);
+	if (!e1 || !e2)
+		goto out;
+	*(unsigned short *)data = 3;
+	*(unsigned long long *)(data + 8) = 3;
+	CU_TEST(shared_test_print(tep, data, sizeof(data), "flags=A|B"));
+	CU_TEST(e1->print_fmt.args == NULL);
+	/* Looking an event up resolves its print format too */
+	CU_TEST(tep_find_event(tep, 2) == e1);
+	CU_TEST(e1->print_fmt.args == e2->print_fmt.args);
+	CU_TEST(tep_find_field(e1, "flags")->flags & TEP_FIELD_IS_FLAG);
+	*(unsigned short *)data = 2;
+	CU_TEST(shared_test_print(tep, data, sizeof(data), "flags=A|B"));
+
+	/* A broken print format is only found when printed */
+	CU_TEST(tep_parse_event(tep, bad_print_event, strlen(bad_print_event),
+				"test") == TEP_ERRNO__SUCCESS);
+	event = tep_get_event(tep, 3);
+	CU_TEST(event != NULL && event->id == 8);
+	if (!event)
+		goto out;
+	CU_TEST(!(event->flags & TEP_EVENT_FL_FAILED));
+	*(unsigned short *)data = 8;
+	CU_TEST(shared_test_print(tep, data, sizeof(data),
+				  "[FAILED TO PARSE] flags=0x3"));
+	CU_TEST(event->flags & TEP_EVENT_FL_FAILED);
+
+	/* The fields of an event with formats shared get the print flags too */
+	tep_free(tep);
+	tep = shared_test_handle(TEP_SHARE_FORMATS | TEP_LAZY_PRINT_FMT);
+	CU_TEST(tep != NULL);
+	if (!tep)
+		return;
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	e1 = tep_get_event(tep, 0);
+	CU_TEST(e1 != NULL);
+	if (!e1)
+		goto out;
+	CU_TEST(!(tep_find_field(e1, "flags")->flags & TEP_FIELD_IS_FLAG));
+	*(unsigned short *)data = 2;
+	CU_TEST(shared_test_print(tep, data, sizeof(data), "flags=A|B"));
+	CU_TEST(tep_find_field(e1, "flags")->flags & TEP_FIELD_IS_FLAG);
+
+ out:
+	tep_free(tep);
+}
+
+static void test_schema_cache(void)
+{
+	char path[] = "/tmp/tep-cache-XXXXXX";
+	char path2[] = "/tmp/tep-cache-XXXXXX";
+	struct tep_event *e1, *e2;
+	struct tep_record record;
+	struct tep_handle *tep;
+	struct tep_handle *tep2;
+	struct trace_seq s;
+	unsigned char data[16] = { 0 };
+	char *file1, *file2;
+	size_t size1, size2;
+	char buf[1024];
+	int len;
+	int fd;
+
+	fd = mkstemp(path);
+	CU_TEST(fd >= 0);
+	if (fd < 0)
+		return;
+	close(fd);
+	fd = mkstemp(path2);
+	CU_TEST(fd >= 0);
+	if (fd < 0)
+		goto out_path;
+	close(fd);
+
+	tep = cache_test_handle();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		goto out_path;
+
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 1, 1);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep, func_strlen_event, strlen(func_strlen_event),
+				FUNC_EVENT_SYSTEM) == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_register_function(tep, "cache_func", 0x1000, "mod") == 0);
+	CU_TEST(tep_register_print_string(tep, "\"cached\"", 0x2000) == 0);
+	CU_TEST(tep_register_comm(tep, "cached", 42) == 0);
+	CU_TEST(tep_save_cache(tep, path) == 0);
+	tep_free(tep);
+
+	/* The print function the event calls must be registered first */
+	tep = tep_alloc();
+	CU_TEST(tep_load_cache(tep, path) == -1 && errno == ENOENT);
+	tep_free(tep);
+
+	tep = cache_test_handle();
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 3, 3);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_load_cache(tep, path) == -1 && errno == EEXIST);
+	tep_free(tep);
+
+	tep = cache_test_handle();
+	CU_TEST(tep_load_cache(tep, path) == 0);
+	CU_TEST(tep_get_long_size(tep) == 8);
+	CU_TEST(tep_get_page_size(tep) == 4096);
+	CU_TEST(tep_get_events_count(tep) == 3);
+
+	e1 = tep_find_event(tep, 1);
+	e2 = tep_find_event_by_name(tep, "test", "parallel_2");
+	CU_TEST(e1 != NULL && e2 != NULL);
+	if (!e1 || !e2)
+		goto out;
+	CU_TEST(e2->id == 2);
+	CU_TEST(e2->format.fields->event == e2);
+	CU_TEST(e1->print_fmt.args == e2->print_fmt.args);
+	CU_TEST(tep_find_interned_string(tep, "flags") == e2->format.fields->name);
+
+	CU_TEST(strcmp(tep_find_function(tep, 0x1000), "cache_func") == 0);
+	CU_TEST(strcmp(tep_data_comm_from_pid(tep, 42), "cached") == 0);
+
+	trace_seq_init(&s);
+	*(unsigned short *)data = 2;
+	*(unsigned long long *)(data + 8) = 3;
+	record.data = data;
+	record.size = sizeof(data);
+	tep_print_event(tep, &s, &record, "%s:%s", TEP_PRINT_NAME, TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, "parallel_2:flags=A|B") == 0);
+
+	trace_seq_reset(&s);
+	memcpy(buf, dyn_str_data, sizeof(dyn_str_data));
+	*(unsigned short *)buf = 4;
+	record.data = buf;
+	record.size = sizeof(dyn_str_data);
+	tep_print_event(tep, &s, &record, "%s", TEP_PRINT_INFO);
+	trace_seq_terminate(&s);
+	CU_TEST(strcmp(s.buffer, FUNC_STRLEN_FMT) == 0);
+	trace_seq_destroy(&s);
+
+	/* Events parsed later are added to the mapped ones */
+	len = snprintf(buf, sizeof(buf), parallel_event_fmt, 3, 3);
+	CU_TEST(tep_parse_event(tep, buf, len, "test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_find_event(tep, 3) != NULL);
+
+	/* Saving the loaded handle writes the same file */
+	tep_free(tep);
+	tep = cache_test_handle();
+	CU_TEST(tep_load_cache(tep, path) == 0);
+	CU_TEST(tep_save_cache(tep, path2) == 0);
+	file1 = read_file(path, &size1);
+	file2 = read_file(path2, &size2);
+	CU_TEST(file1 != NULL && file2 != NULL);
+	CU_TEST(file1 && file2 && size1 == size2 && !memcmp(file1, file2, size1));
+	free(file1);
+	free(file2);
+
+	/* Not a cache file */
+	tep2 = cache_test_handle();
+	CU_TEST(tep_load_cache(tep2, "/proc/self/cmdline") == -1);
+	fd = open(path2, O_WRONLY | O_TRUNC);
+	CU_TEST(write(fd, "TEPCACHE", 8) == 8);
+	close(fd);
+	CU_TEST(tep_load_cache(tep2, path2) == -1 && errno == EINVAL);
+	tep_free(tep2);
+ out:
+	tep_free(tep);
+ out_path:
+	unlink(path);
+	unlink(path2);
+}
+
+static bool write_file(const char *path, const char *buf, size_t size)
+{
+	bool ret;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return false;
+	ret = write(fd, buf, size) == (ssize_t)size;
+	close(fd);
+	return ret;
+}
+
+static void test_cache_checks(void)
+{
+	static const char header_page[] =
+		"\tfield: u64 timestamp;\toffset:0;\tsize:8;\tsigned:0;\n"
+		"\tfield: local_t commit;\toffset:8;\tsize:8;\tsigned:1;\n"
+		"\tfield: int overwrite;\toffset:8;\tsize:1;\tsigned:1;\n"
+		"\tfield: char data;\toffset:16;\tsize:4080;\tsigned:1;\n";
+	static const char kallsyms[] = "123456789abc0 T unique_func\n";
+	static const char printk_formats[] = "0x2000 : \"cached\"\n";
+	const unsigned long long func_addr = 0x123456789abc0ULL;
+	char path[] = "/tmp/tep-cache-XXXXXX";
+	unsigned long long digest, cached;
+	struct tep_handle *tep;
+	char fmt1[1024], fmt2[1024];
+	int len1, len2;
+	unsigned int name_off, bad_off;
+	char tail[8];
+	char *file;
+	size_t size;
+	size_t i;
+	int fd;
+
+	fd = mkstemp(path);
+	CU_TEST(fd >= 0);
+	if (fd < 0)
+		return;
+	close(fd);
+
+	tep = cache_test_handle();
+	CU_TEST(tep != NULL);
+	if (!tep)
+		goto out_path;
+
+	len1 = snprintf(fmt1, sizeof(fmt1), parallel_event_fmt, 1, 1);
+	len2 = snprintf(fmt2, sizeof(fmt2), parallel_event_fmt, 2, 2);
+	CU_TEST(tep_parse_header_page(tep, (char *)header_page,
+				      sizeof(header_page) - 1, 8) == 0);
+	CU_TEST(tep_parse_event(tep, fmt1, len1, "test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_event(tep, fmt2, len2, "test") == TEP_ERRNO__SUCCESS);
+	CU_TEST(tep_parse_kallsyms_buf(tep, kallsyms, sizeof(kallsyms) - 1) == 0);
+	CU_TEST(tep_parse_printk_formats_buf(tep, printk_formats,
+					     sizeof(printk_formats) - 1) == 0);
+
+	/* The digest does not depend on the order of the inputs */
+	digest = tep_digest_input(0, TEP_CACHE_PRINTK, printk_formats,
+				  sizeof(printk_formats) - 1);
+	digest = tep_digest_input(digest, TEP_CACHE_FORMAT, fmt2, len2);
+	digest = tep_digest_input(digest, TEP_CACHE_KALLSYMS, kallsyms,
+				  sizeof(kallsyms) - 1);
+	digest = tep_digest_input(digest, TEP_CACHE_FORMAT, fmt1, len1);
+	digest = tep_digest_input(digest, TEP_CACHE_HEADER_PAGE, header_page,
+				  sizeof(header_page) - 1);
+	CU_TEST(tep_get_input_digest(tep) == digest);
+
+	/* Another kernel has other addresses */
+	CU_TEST(tep_digest_input(0, TEP_CACHE_KALLSYMS, kallsyms,
+				 sizeof(kallsyms) - 1) !=
+		tep_digest_input(0, TEP_CACHE_KALLSYMS, printk_formats,
+				 sizeof(printk_formats) - 1));
+
+	CU_TEST(tep_save_cache(tep, path) == 0);
+	tep_free(tep);
+
+	CU_TEST(tep_get_cache_digest(path, &cached) == 0 && cached == digest);
+	CU_TEST(tep_get_cache_digest("/proc/self/cmdline", &cached) == -1 &&
+		errno == EINVAL);
+
+	/* A loaded handle has the digest of the file */
+	tep = cache_test_handle();
+	CU_TEST(tep_load_cache(tep, path) == 0);
+	CU_TEST(tep_get_input_digest(tep) == digest);
+	tep_free(tep);
+
+	file = read_file(path, &size);
+	CU_TEST(file != NULL);
+	if (!file)
+		goto out_path;
+
+	/*
+	 * The offsets of the function names follow the function addresses.
+	 * A name outside of the file must fail the load.
+	 */
+	for (i = 0; i + 12 <= size; i += 8) {
+		if (!memcmp(file + i, &func_addr, sizeof(func_addr)))
+			break;
+	}
+	CU_TEST(i + 12 <= size);
+	if (i + 12 <= size) {
+		memcpy(&name_off, file + i + 8, sizeof(name_off));
+		bad_off = size;
+		memcpy(file + i + 8, &bad_off, sizeof(bad_off));
+		CU_TEST(write_file(path, file, size));
+		tep = cache_test_handle();
+		CU_TEST(tep_load_cache(tep, path) == -1 && errno == EINVAL);
+		tep_free(tep);
+		memcpy(file + i + 8, &name_off, sizeof(name_off));
+	}
+
+	/* The file ends with the sizes of what the pointers point to */
+	memcpy(tail, file + size - 8, sizeof(tail));
+	memset(file + size - 8, 0xff, 8);
+	CU_TEST(write_file(path, file, size));
+	tep = cache_test_handle();
+	CU_TEST(tep_load_cache(tep, path) == -1 && errno == EINVAL);
+	tep_free(tep);
+
+	/* Damage that leaves all the pointers valid is caught too */
+	memcpy(file + size - 8, tail, sizeof(tail));
+	for (i = 0; i + 11 <= size; i++) {
+		if (!memcmp(file + i, "unique_func", 11))
+			break;
+	}
+	CU_TEST(i + 11 <= size);
+	if (i + 11 <= size) {
+		file[i] = 'U';
+		CU_TEST(write_file(path, file, size));
+		tep = cache_test_handle();
+		CU_TEST(tep_load_cache(tep, path) == -1 && errno == EINVAL);
+		tep_free(tep);
+	}
+	free(file);
+ out_path:
+	unlink(path);
+}
+
 static int test_suite_destroy(void)
 {
 	tep_free(test_tep);
@@ -429,4 +2436,54 @@ void test_traceevent_lib(void)
 		    test_parse_sizeof4);
 	CU_add_test(suite, "parse sizeof() no long size defined",
 		    test_parse_sizeof_undef);
+	CU_add_test(suite, "parse registered print function",
+		    test_parse_print_func);
+	CU_add_test(suite, "find function with cache",
+		    test_find_function_cache);
+	CU_add_test(suite, "find function in a large table",
+		    test_find_function_table);
+	CU_add_test(suite, "register functions after a lookup",
+		    test_register_after_lookup);
+	CU_add_test(suite, "parse kallsyms and printk formats buffers",
+		    test_parse_kallsyms_buf);
+	CU_add_test(suite, "trace_seq with a caller buffer",
+		    test_trace_seq_init_buf);
+	CU_add_test(suite, "trace_seq bound to a file",
+		    test_trace_seq_init_fd);
+	CU_add_test(suite, "trace_seq number printing",
+		    test_trace_seq_put_num);
+	CU_add_test(suite, "print records on worker threads",
+		    test_print_pipeline);
+	CU_add_test(suite, "frozen handle shared by threads",
+		    test_frozen_handle);
+	CU_add_test(suite, "parse event formats in parallel",
+		    test_parse_events_parallel);
+	CU_add_test(suite, "parse concatenated and long strings",
+		    test_parse_concat_strings);
+	CU_add_test(suite, "parse and free broken formats",
+		    test_parse_bad_formats);
+	CU_add_test(suite, "share field and system names between events",
+		    test_interned_strings);
+	CU_add_test(suite, "share the layout of events of one class",
+		    test_shared_layouts);
+	CU_add_test(suite, "save and load parsed events from a file",
+		    test_schema_cache);
+	CU_add_test(suite, "check cache files before loading them",
+		    test_cache_checks);
+	CU_add_test(suite, "share parsed formats between handles",
+		    test_shared_schemas);
+	CU_add_test(suite, "parse print formats when first printed",
+		    test_lazy_print_fmt);
+	CU_add_test(suite, "read all common fields of a record",
+		    test_data_common);
+	CU_add_test(suite, "read fields of many records into columns",
+		    test_read_columns);
+	CU_add_test(suite, "convert records to the byte order of the host",
+		    test_swap_records);
+	CU_add_test(suite, "view dynamic strings in records",
+		    test_field_view);
+	CU_add_test(suite, "recycle records in a pool",
+		    test_record_pool);
+	CU_add_test(suite, "count lookups and parses",
+		    test_stats);
 }